@@ -260,6 +260,17 @@ char const *AMQP_CALL amqp_version(void);
  */
 #define AMQP_DEFAULT_VHOST "/"
 
+/**
+ * \def AMQP_DEFAULT_MAX_DECODED_BODY_SIZE
+ *
+ * Default limit on the size of a body decoded by a body codec (64MiB)
+ *
+ * \sa amqp_set_max_decoded_body_size()
+ *
+ * \since v0.14.0
+ */
+#define AMQP_DEFAULT_MAX_DECODED_BODY_SIZE 67108864
+
 /**
  * boolean type 0 = false, true otherwise
  *
@@ -512,7 +523,9 @@ typedef struct amqp_frame_t_ {
     struct {
       uint16_t class_id;        /**< the class for the properties */
       uint64_t body_size;       /**< size of the body in bytes */
-      void *decoded;            /**< the decoded properties */
+      void *decoded;            /**< the decoded properties, NULL if not
+                                     decoded yet, see
+                                     amqp_set_lazy_properties() */
       amqp_bytes_t raw;         /**< amqp-encoded properties structure */
     } properties;               /**< message header, a.k.a., properties,
                                       use if frame_type == AMQP_FRAME_HEADER */
@@ -651,7 +664,16 @@ typedef enum amqp_status_enum_ {
                                                           SASL mechanism */
   AMQP_STATUS_UNSUPPORTED = -0x0014, /**< Parameter is unsupported
                                        in this version */
-  _AMQP_STATUS_NEXT_VALUE = -0x0015, /**< Internal value */
+  AMQP_STATUS_WOULD_BLOCK = -0x0015, /**< Data was queued but the socket
+                                       is not ready to write all of it,
+                                       see amqp_send_pending() */
+  AMQP_STATUS_CODEC_ERROR = -0x0016, /**< A message body could not be
+                                       decoded by the body codec */
+  AMQP_STATUS_CONNECTION_BLOCKED = -0x0017, /**< Publishing is blocked
+                                              by the broker */
+  AMQP_STATUS_NO_FREE_CHANNEL = -0x0018,    /**< Every channel number up to
+                                              channel_max is in use */
+  _AMQP_STATUS_NEXT_VALUE = -0x0019,        /**< Internal value */
 
   AMQP_STATUS_TCP_ERROR = -0x0100,                /**< A generic TCP error
                                                        occurred */
@@ -806,11 +828,38 @@ void AMQP_CALL recycle_amqp_pool(amqp_pool_t *pool);
 AMQP_EXPORT
 void AMQP_CALL empty_amqp_pool(amqp_pool_t *pool);
 
+/**
+ * Enables the process-wide cache of memory pool pages
+ *
+ * Without the cache every page an amqp_pool_t needs, and the array listing
+ * them, is allocated with malloc() and freed again by empty_amqp_pool() and,
+ * for allocations larger than a page, recycle_amqp_pool(). With it, blocks of
+ * up to 1 MiB are allocated in power of two sizes, and kept for reuse by any
+ * pool when freed, as long as the cache holds less than max_bytes. The pool
+ * of a message read with amqp_read_message() or amqp_consume_message() then
+ * needs no malloc() or free(), nor do the channel buffers of each new
+ * connection.
+ *
+ * The cache is shared by all threads and guarded by a mutex, which is taken
+ * when a pool allocates or frees a block, not for each allocation from a
+ * block.
+ *
+ * This must not be called while other threads are using the library.
+ *
+ * \param [in] max_bytes the most memory to keep cached. 0, the default,
+ *              disables the cache, freeing whatever it holds. A lower limit
+ *              frees what is over it.
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+void AMQP_CALL amqp_set_page_cache(size_t max_bytes);
+
 /**
  * Allocates a block of memory from an amqp_pool_t memory pool
  *
  * Memory will be aligned on a 8-byte boundary. If a 0-length allocation is
- * requested, a NULL pointer will be returned.
+ * requested, a NULL pointer will be returned. The memory is not initialized.
  *
  * \param [in] pool the allocation pool to allocate the memory from
  * \param [in] amount the size of the allocation in bytes.
@@ -1800,6 +1849,9 @@ struct amqp_basic_properties_t_;
  *         - AMQP_STATUS_SSL_ERROR: a SSL error occurred.
  *         - AMQP_STATUS_TCP_ERROR: a TCP error occurred. errno or
  *           WSAGetLastError() may provide more information
+ *         - AMQP_STATUS_WOULD_BLOCK: in non-blocking send mode, the message
+ *           was sent but part of it is queued on the connection, see
+ *           amqp_set_send_nonblocking().
  *
  * Note: this function does heartbeat processing as of v0.4.0
  *
@@ -1812,9 +1864,441 @@ int AMQP_CALL amqp_basic_publish(
     amqp_boolean_t immediate, struct amqp_basic_properties_t_ const *properties,
     amqp_bytes_t body);
 
+/**
+ * A message to publish with amqp_basic_publish_batch()
+ *
+ * The fields have the same meaning as the parameters of
+ * amqp_basic_publish().
+ *
+ * \since v0.14.0
+ */
+typedef struct amqp_publish_item_t_ {
+  amqp_bytes_t exchange;    /**< exchange to publish to */
+  amqp_bytes_t routing_key; /**< routing key to publish with */
+  amqp_boolean_t mandatory; /**< message must be routed to a queue */
+  amqp_boolean_t immediate; /**< message must be delivered immediately */
+  struct amqp_basic_properties_t_ const *properties; /**< may be NULL */
+  amqp_bytes_t body;                                 /**< message body */
+} amqp_publish_item_t;
+
+/**
+ * Publish several messages to the broker
+ *
+ * Publishes each message in items on the channel, as if by calling
+ * amqp_basic_publish() on each of them in order. The frames of all messages
+ * are encoded into a connection-owned buffer and written to the socket
+ * together, so a burst of small messages costs a handful of system calls
+ * rather than at least one per message. Large bodies are not copied, they are
+ * written directly from the caller's buffers.
+ *
+ * Bodies are encoded with the body codec set with amqp_set_body_codec(), as
+ * by amqp_basic_publish(). A message whose body, method or header frame
+ * cannot be encoded (for example AMQP_STATUS_TABLE_TOO_BIG) is skipped, and
+ * the rest of the batch is still sent. A socket error stops the batch: the
+ * message being written and all messages after it report the error, and some
+ * of their frames may already have been transmitted.
+ *
+ * \param [in] state the connection object
+ * \param [in] channel the channel identifier
+ * \param [in] items the messages to publish
+ * \param [in] count the number of messages in items
+ * \param [out] statuses an array of count elements which receives the
+ *              amqp_status_enum result of each message. May be NULL.
+ * \return AMQP_STATUS_OK if every message was sent, otherwise the status of
+ *         the first message that was not. See amqp_basic_publish() for the
+ *         possible error values.
+ *
+ * Note: this function does heartbeat processing
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+int AMQP_CALL amqp_basic_publish_batch(amqp_connection_state_t state,
+                                       amqp_channel_t channel,
+                                       amqp_publish_item_t const *items,
+                                       size_t count, int *statuses);
+
+/**
+ * A pre-encoded basic.publish for messages sharing an exchange, routing key
+ * and properties
+ *
+ * Created with amqp_publish_template_new(), used with
+ * amqp_basic_publish_template(), freed with amqp_publish_template_free(). A
+ * template does not belong to a connection and may be used with several.
+ *
+ * \since v0.14.0
+ */
+typedef struct amqp_publish_template_t_ amqp_publish_template_t;
+
+/**
+ * Create a publish template
+ *
+ * Encodes the basic.publish method and content header once, so publishing
+ * with the template only has to fill in the channel and body size, and
+ * encode any per-message overrides.
+ *
+ * Properties named in overrides may be given per message by
+ * amqp_basic_publish_template(). They are always sent; those not set in
+ * properties default to empty or 0. Only properties following the headers
+ * table on the wire may be overridden: delivery_mode, priority,
+ * correlation_id, reply_to, expiration, message_id, timestamp, type, user_id,
+ * app_id and cluster_id. Each message re-encodes the properties from the
+ * first overridable one onwards, so it is cheapest to only override the last
+ * ones, such as message_id and timestamp.
+ *
+ * The template keeps copies of everything it needs, the arguments need not
+ * outlive the call.
+ *
+ * \param [in] exchange the exchange on the broker to publish to
+ * \param [in] routing_key the routing key to use when publishing the message
+ * \param [in] mandatory see amqp_basic_publish()
+ * \param [in] immediate see amqp_basic_publish()
+ * \param [in] properties the properties associated with every message, may
+ *              be NULL
+ * \param [in] overrides AMQP_BASIC_*_FLAG values of the properties that may
+ *              be given per message, or 0
+ * \param [out] tmpl the new template, NULL on failure
+ * \return AMQP_STATUS_OK on success. AMQP_STATUS_INVALID_PARAMETER if
+ *         overrides names a property that cannot be overridden,
+ *         AMQP_STATUS_BAD_AMQP_DATA or AMQP_STATUS_TABLE_TOO_BIG if the method
+ *         or properties cannot be encoded, AMQP_STATUS_NO_MEMORY.
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+int AMQP_CALL amqp_publish_template_new(
+    amqp_bytes_t exchange, amqp_bytes_t routing_key, amqp_boolean_t mandatory,
+    amqp_boolean_t immediate, struct amqp_basic_properties_t_ const *properties,
+    amqp_flags_t overrides, amqp_publish_template_t **tmpl);
+
+/**
+ * Free a publish template
+ *
+ * \param [in] tmpl the template, may be NULL
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+void AMQP_CALL amqp_publish_template_free(amqp_publish_template_t *tmpl);
+
+/**
+ * Publish a message using a template
+ *
+ * Equivalent to amqp_basic_publish() with the template's exchange, routing
+ * key, flags and properties, the latter updated with the overrides. The body
+ * codec set with amqp_set_body_codec() is not applied, as the template's
+ * content header, content_encoding included, is encoded once for all
+ * messages.
+ *
+ * \param [in] state the connection object
+ * \param [in] channel the channel identifier
+ * \param [in] tmpl the template
+ * \param [in] overrides per-message values of the properties the template
+ *              allows overriding. Only properties both allowed by the template
+ *              and set in overrides->_flags are used, the others keep the
+ *              template's value. May be NULL.
+ * \param [in] body the message body
+ * \return AMQP_STATUS_OK on success, amqp_status_enum value on failure, see
+ *         amqp_basic_publish(). AMQP_STATUS_TABLE_TOO_BIG if the frames do not
+ *         fit the connection's frame_max.
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+int AMQP_CALL amqp_basic_publish_template(
+    amqp_connection_state_t state, amqp_channel_t channel,
+    amqp_publish_template_t const *tmpl,
+    struct amqp_basic_properties_t_ const *overrides, amqp_bytes_t body);
+
+/**
+ * Publish a message whose body is read from a file descriptor
+ *
+ * Like amqp_basic_publish(), but the body is len bytes of fd starting at
+ * offset, and is never held in memory as a whole. On plain TCP sockets on
+ * platforms with sendfile(2) the file is sent by the kernel between the body
+ * frames' headers and footers. Otherwise, such as over SSL, it is read with
+ * pread(2) and sent one frame at a time through a buffer of frame_max bytes,
+ * so fd must support pread(2).
+ *
+ * fd's file offset is not used or changed. The call always blocks until the
+ * whole message is written, also in non-blocking send mode, after writing
+ * out anything already queued. The body codec set with amqp_set_body_codec()
+ * is not applied, as the body is sent as it is read.
+ *
+ * \param [in] state the connection object
+ * \param [in] channel the channel identifier
+ * \param [in] exchange the exchange on the broker to publish to
+ * \param [in] routing_key the routing key to use when publishing the message
+ * \param [in] mandatory indicate to the broker that the message MUST be
+ *              routed to a queue
+ * \param [in] immediate indicate to the broker that the message MUST be
+ *              delivered to a consumer immediately
+ * \param [in] properties the properties associated with the message
+ * \param [in] fd the file descriptor to read the body from
+ * \param [in] offset the position in fd the body starts at
+ * \param [in] len the size of the body in bytes
+ * \return AMQP_STATUS_OK on success. AMQP_STATUS_INVALID_PARAMETER if fd
+ *         can't be read from or, for a regular file, is shorter than
+ *         offset + len; the message was not sent.
+ *         AMQP_STATUS_CONNECTION_CLOSED if fd could not be read after part of
+ *         the message was sent: the connection is closed as the message
+ *         can't be completed. AMQP_STATUS_UNSUPPORTED on Windows. Otherwise
+ *         the error values of amqp_basic_publish().
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+int AMQP_CALL amqp_basic_publish_fd(
+    amqp_connection_state_t state, amqp_channel_t channel,
+    amqp_bytes_t exchange, amqp_bytes_t routing_key, amqp_boolean_t mandatory,
+    amqp_boolean_t immediate, struct amqp_basic_properties_t_ const *properties,
+    int fd, uint64_t offset, uint64_t len);
+
+/**
+ * Start publishing a message whose body is written in pieces
+ *
+ * For bodies produced on the fly, such as compressor output or a database
+ * dump, that should not be held in memory as a whole. Sends the basic.publish
+ * method and content header for a body of body_size bytes. The body is then
+ * given to amqp_basic_publish_write() in chunks of any size, and the message
+ * finished with amqp_basic_publish_end().
+ *
+ * Body frames are sent as soon as a frame's worth of body has been written,
+ * so at most a frame of it is kept by the library. Chunks of at least a frame
+ * are sent without being copied. Only one message per connection can be
+ * published like this at a time. Other channels may be used between the
+ * calls, but nothing else may be published on channel until the message is
+ * finished.
+ *
+ * Flow control, publisher confirms and the heartbeat are handled as by
+ * amqp_basic_publish(). The body codec set with amqp_set_body_codec() is not
+ * applied, as the size of the encoded body would have to be known upfront.
+ *
+ * \param [in] state the connection object
+ * \param [in] channel the channel identifier
+ * \param [in] exchange the exchange on the broker to publish to
+ * \param [in] routing_key the routing key to use when publishing the message
+ * \param [in] mandatory indicate to the broker that the message MUST be
+ *              routed to a queue
+ * \param [in] immediate indicate to the broker that the message MUST be
+ *              delivered to a consumer immediately
+ * \param [in] properties the properties associated with the message
+ * \param [in] body_size the size of the body in bytes
+ * \return AMQP_STATUS_OK on success. AMQP_STATUS_INVALID_PARAMETER if a
+ *         message is already being published this way. Otherwise the values
+ *         returned by amqp_basic_publish(), including
+ *         AMQP_STATUS_WOULD_BLOCK in non-blocking send mode, in which case
+ *         the message has been started.
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+int AMQP_CALL amqp_basic_publish_begin(
+    amqp_connection_state_t state, amqp_channel_t channel,
+    amqp_bytes_t exchange, amqp_bytes_t routing_key, amqp_boolean_t mandatory,
+    amqp_boolean_t immediate, struct amqp_basic_properties_t_ const *properties,
+    uint64_t body_size);
+
+/**
+ * Write the next part of the body of a message started with
+ * amqp_basic_publish_begin()
+ *
+ * \param [in] state the connection object
+ * \param [in] chunk the next bytes of the body, need not outlive the call
+ * \return AMQP_STATUS_OK on success. AMQP_STATUS_INVALID_PARAMETER if no
+ *         message has been started or chunk is longer than what is left of
+ *         the body; nothing is sent. AMQP_STATUS_WOULD_BLOCK in non-blocking
+ *         send mode if some of it was queued, see amqp_set_send_nonblocking().
+ *         On any other error the message is abandoned and the connection
+ *         should not be used any more.
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+int AMQP_CALL amqp_basic_publish_write(amqp_connection_state_t state,
+                                       amqp_bytes_t chunk);
+
+/**
+ * Finish a message started with amqp_basic_publish_begin()
+ *
+ * The last body frame has already been sent by amqp_basic_publish_write().
+ *
+ * \param [in] state the connection object
+ * \return AMQP_STATUS_OK on success. AMQP_STATUS_INVALID_PARAMETER if no
+ *         message has been started. AMQP_STATUS_CONNECTION_CLOSED if less
+ *         than the body size given to amqp_basic_publish_begin() was written:
+ *         the connection is closed as the message can't be completed.
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+int AMQP_CALL amqp_basic_publish_end(amqp_connection_state_t state);
+
+/**
+ * A publisher confirm received from the broker
+ *
+ * \since v0.14.0
+ */
+typedef struct amqp_confirm_t_ {
+  amqp_channel_t channel;  /**< channel the message was published on */
+  uint64_t delivery_tag;   /**< sequence number of the confirmed message */
+  amqp_boolean_t multiple; /**< also confirms every earlier message */
+  amqp_boolean_t nack;     /**< basic.nack rather than basic.ack */
+} amqp_confirm_t;
+
+/**
+ * Function called for each publisher confirm received on a channel
+ *
+ * The callback runs from inside whichever library call read the confirm from
+ * the socket, it must not call back into the library with the same
+ * connection.
+ *
+ * \since v0.14.0
+ */
+typedef void(AMQP_CALL *amqp_confirm_callback_t)(amqp_connection_state_t state,
+                                                 const amqp_confirm_t *confirm,
+                                                 void *user_data);
+
+/**
+ * Put a channel in confirm mode and track publisher confirms on it
+ *
+ * Sends confirm.select on the channel. From then on each message published on
+ * the channel with amqp_basic_publish() or amqp_basic_publish_batch() is
+ * given a sequence number, starting at 1, which the broker acknowledges with
+ * a basic.ack or basic.nack carrying that number as its delivery tag. These
+ * are consumed by the library as they are read, they are not returned by
+ * amqp_simple_wait_frame() or amqp_consume_message(). Instead each is passed
+ * to the callback set with amqp_confirm_set_callback(), or, if there is none,
+ * queued for amqp_confirm_poll().
+ *
+ * At most max_in_flight messages may be unconfirmed, counting confirms
+ * queued but not yet polled. Publishing on a channel with a full window
+ * blocks, reading from the socket until a confirm makes room or the RPC
+ * timeout set with amqp_set_rpc_timeout() passes, in which case publishing
+ * fails with AMQP_STATUS_TIMEOUT. Frames read in the meantime are kept for
+ * amqp_simple_wait_frame().
+ *
+ * Tracking stops when the channel is closed with amqp_channel_close().
+ *
+ * \param [in] state the connection object
+ * \param [in] channel the channel identifier
+ * \param [in] max_in_flight the maximum number of unconfirmed messages, must
+ *              be greater than 0
+ * \return amqp_rpc_reply_t indicating the result of the confirm.select RPC.
+ *         r.library_error is AMQP_STATUS_INVALID_PARAMETER if max_in_flight
+ *         is 0 or the channel is already in confirm mode.
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+amqp_rpc_reply_t AMQP_CALL amqp_confirm_enable(amqp_connection_state_t state,
+                                               amqp_channel_t channel,
+                                               size_t max_in_flight);
+
+/**
+ * Set the function called for publisher confirms on a channel
+ *
+ * Confirms already queued for amqp_confirm_poll() stay queued.
+ *
+ * \param [in] state the connection object
+ * \param [in] channel a channel put in confirm mode by amqp_confirm_enable()
+ * \param [in] callback the function to call, or NULL to queue confirms for
+ *              amqp_confirm_poll()
+ * \param [in] user_data passed to callback
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_INVALID_PARAMETER if the
+ *         channel is not in confirm mode
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+int AMQP_CALL amqp_confirm_set_callback(amqp_connection_state_t state,
+                                        amqp_channel_t channel,
+                                        amqp_confirm_callback_t callback,
+                                        void *user_data);
+
+/**
+ * Get the next publisher confirm received on a channel
+ *
+ * Returns the oldest queued confirm, reading from the socket if there is none
+ * yet. Frames other than confirms read in the meantime are kept for
+ * amqp_simple_wait_frame().
+ *
+ * \param [in] state the connection object
+ * \param [in] channel a channel put in confirm mode by amqp_confirm_enable()
+ * \param [out] confirm the confirm
+ * \param [in] timeout how long to wait for a confirm. NULL waits
+ *              indefinitely, a zero timeval only returns an already received
+ *              confirm
+ * \return AMQP_STATUS_OK on success. AMQP_STATUS_TIMEOUT if no confirm was
+ *         received in time, returned immediately if no message is awaiting a
+ *         confirm. AMQP_STATUS_INVALID_PARAMETER if the channel is not in
+ *         confirm mode, otherwise an amqp_status_enum value from reading the
+ *         socket.
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+int AMQP_CALL amqp_confirm_poll(amqp_connection_state_t state,
+                                amqp_channel_t channel,
+                                amqp_confirm_t *confirm,
+                                const struct timeval *timeout);
+
+/**
+ * Get the sequence number the next message published on a channel will have
+ *
+ * \param [in] state the connection object
+ * \param [in] channel the channel identifier
+ * \return the sequence number, or 0 if the channel is not in confirm mode
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+uint64_t AMQP_CALL amqp_confirm_next_seqno(amqp_connection_state_t state,
+                                           amqp_channel_t channel);
+
+/**
+ * Reserve the lowest channel number not in use
+ *
+ * A channel is in use from when it is returned by this function or opened
+ * until channel.close-ok is sent or received on it, as amqp_channel_close()
+ * does. Reusing the lowest numbers keeps the memory used to track channels
+ * proportional to the number open at once, however many have been opened
+ * over the life of the connection.
+ *
+ * \param [in] state the connection object
+ * \param [out] channel the channel number, to be opened with
+ *              amqp_channel_open()
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_NO_FREE_CHANNEL if every
+ *         channel number up to the negotiated channel_max is in use,
+ *         AMQP_STATUS_NO_MEMORY
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+int AMQP_CALL amqp_allocate_channel(amqp_connection_state_t state,
+                                    amqp_channel_t *channel);
+
+/**
+ * Return a channel number reserved with amqp_allocate_channel() unopened
+ *
+ * Channels that were opened are returned when they are closed.
+ *
+ * \param [in] state the connection object
+ * \param [in] channel the channel number
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+void AMQP_CALL amqp_release_channel(amqp_connection_state_t state,
+                                    amqp_channel_t channel);
+
 /**
  * Closes an channel
  *
+ * Once closed, the memory the connection holds for the channel is freed the
+ * next time its buffers are released, see
+ * amqp_maybe_release_buffers_on_channel().
+ *
  * \param [in] state the connection object
  * \param [in] channel the channel identifier
  * \param [in] code the reason for closing the channel, AMQP_REPLY_SUCCESS is a
@@ -1937,7 +2421,8 @@ int AMQP_CALL amqp_basic_nack(amqp_connection_state_t state,
  *
  * Can be used to see if there is data still in the buffer, if so
  * calling amqp_simple_wait_frame will not immediately enter a
- * blocking read.
+ * blocking read. The start of a frame that has not been received in full
+ * does not count.
  *
  * \param [in] state the connection object
  * \return true if there is data in the recieve buffer, false otherwise
@@ -2083,6 +2568,155 @@ amqp_rpc_reply_t AMQP_CALL amqp_read_message(amqp_connection_state_t state,
                                              amqp_message_t *message,
                                              int flags);
 
+/**
+ * Called by amqp_read_message_stream() with the properties of a message
+ *
+ * \param [in] user_data the user_data passed to amqp_read_message_stream()
+ * \param [in] channel the channel the message is read from
+ * \param [in] properties the message properties, valid until the callback
+ *              returns
+ * \param [in] body_size the size of the body as sent, which for a body
+ *              decoded by the connection's body codec is its encoded size
+ * \return AMQP_STATUS_OK to go on, anything else to fail the read
+ *
+ * \since v0.14.0
+ */
+typedef int(AMQP_CALL *amqp_message_header_callback_t)(
+    void *user_data, amqp_channel_t channel,
+    const amqp_basic_properties_t *properties, uint64_t body_size);
+
+/**
+ * Called by amqp_read_message_stream() with each part of a message body
+ *
+ * \param [in] user_data the user_data passed to amqp_read_message_stream()
+ * \param [in] channel the channel the message is read from
+ * \param [in] fragment the next part of the body, valid until the callback
+ *              returns. Never empty.
+ * \return AMQP_STATUS_OK to go on, anything else to fail the read
+ *
+ * \since v0.14.0
+ */
+typedef int(AMQP_CALL *amqp_body_fragment_callback_t)(void *user_data,
+                                                      amqp_channel_t channel,
+                                                      amqp_bytes_t fragment);
+
+/**
+ * Reads the next message on a channel, a body frame at a time
+ *
+ * Behaves like amqp_read_message(), but rather than putting the body
+ * together in memory, passes each body frame to on_fragment as it is read,
+ * so reading a message takes a few frames' worth of memory whatever its
+ * size. A body encoded with the connection's body codec is decoded as it
+ * is read, and on_fragment gets the decoded output.
+ *
+ * The buffers of channel are released as the message is read, as
+ * amqp_maybe_release_buffers_on_channel() does.
+ *
+ * If a callback fails, or the body does not decode, the rest of the message
+ * is still read, so the channel stays usable, without calling the callbacks
+ * again. The read then fails with the callback's status, or
+ * AMQP_STATUS_CODEC_ERROR, as library_error.
+ *
+ * \param [in,out] state the connection object
+ * \param [in] channel the channel on which to read the message from
+ * \param [in] on_header called with the properties before the body, may be
+ *              NULL
+ * \param [in] on_fragment called with each part of the body
+ * \param [in] user_data passed to the callbacks
+ * \returns a amqp_rpc_reply_t object, see amqp_read_message().
+ *          AMQP_STATUS_INVALID_PARAMETER is returned if on_fragment is NULL.
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+amqp_rpc_reply_t AMQP_CALL amqp_read_message_stream(
+    amqp_connection_state_t state, amqp_channel_t channel,
+    amqp_message_header_callback_t on_header,
+    amqp_body_fragment_callback_t on_fragment, void *user_data);
+
+/**
+ * Reads the next message on a channel into a buffer supplied by the caller
+ *
+ * Behaves like amqp_read_message(), but each body frame is copied straight
+ * from the connection's buffers into buffer, so no memory is allocated for
+ * the body. A body encoded with the connection's body codec is decoded into
+ * buffer.
+ *
+ * If the body is larger than buffer the message is left unread, and can be
+ * read with a larger buffer or with amqp_read_message(). This is only known
+ * for a decoded body once it has been read: it is then read to the end and
+ * dropped.
+ *
+ * \param [in,out] state the connection object
+ * \param [in] channel the channel on which to read the message from
+ * \param [out] properties the message properties, may be NULL. The
+ *              properties are copied into memory held by the connection, so
+ *              stay valid until the next call to amqp_read_message_into() or
+ *              until the connection is destroyed. The channel's buffers are
+ *              released as the message is read either way, as
+ *              amqp_read_message_stream() does.
+ * \param [in] buffer the memory to read the body into
+ * \param [out] body_len the size of the body read into buffer, may be NULL
+ * \returns a amqp_rpc_reply_t object, see amqp_read_message().
+ *          AMQP_STATUS_INVALID_PARAMETER is returned if the body does not fit
+ *          in buffer.
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+amqp_rpc_reply_t AMQP_CALL amqp_read_message_into(
+    amqp_connection_state_t state, amqp_channel_t channel,
+    amqp_basic_properties_t *properties, amqp_bytes_t buffer,
+    size_t *body_len);
+
+/**
+ * Called by amqp_read_message_provided() for the memory to read a message
+ * body into
+ *
+ * \param [in] user_data the user_data passed to amqp_read_message_provided()
+ * \param [in] channel the channel the message is read from
+ * \param [in] properties the message properties, valid until the callback
+ *              returns
+ * \param [in] body_size the size of the body as sent, which for a body
+ *              decoded by the connection's body codec is its encoded size
+ * \param [out] buffer the memory to read the body into. Unless the body is
+ *              decoded, it must hold at least body_size bytes.
+ * \return AMQP_STATUS_OK to go on, anything else to leave the message unread
+ *
+ * \since v0.14.0
+ */
+typedef int(AMQP_CALL *amqp_body_buffer_provider_t)(
+    void *user_data, amqp_channel_t channel,
+    const amqp_basic_properties_t *properties, uint64_t body_size,
+    amqp_bytes_t *buffer);
+
+/**
+ * Reads the next message on a channel into memory chosen once its size is
+ * known
+ *
+ * Behaves like amqp_read_message_into(), but the buffer is asked of provider
+ * once the content header has been read, for instance to take a slot of the
+ * right size from the application's own memory. The buffers of channel are
+ * released as the message is read.
+ *
+ * If provider fails, or gives a buffer too small for the body, the message
+ * is left unread and the provider's status is returned as library_error.
+ *
+ * \param [in,out] state the connection object
+ * \param [in] channel the channel on which to read the message from
+ * \param [in] provider called for the memory to read the body into
+ * \param [in] user_data passed to provider
+ * \param [out] body_len the size of the body read, may be NULL
+ * \returns a amqp_rpc_reply_t object, see amqp_read_message_into().
+ *          AMQP_STATUS_INVALID_PARAMETER is returned if provider is NULL.
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+amqp_rpc_reply_t AMQP_CALL amqp_read_message_provided(
+    amqp_connection_state_t state, amqp_channel_t channel,
+    amqp_body_buffer_provider_t provider, void *user_data, size_t *body_len);
+
 /**
  * Frees memory associated with a amqp_message_t allocated in amqp_read_message
  *
@@ -2158,6 +2792,204 @@ amqp_rpc_reply_t AMQP_CALL amqp_consume_message(amqp_connection_state_t state,
 AMQP_EXPORT
 void AMQP_CALL amqp_destroy_envelope(amqp_envelope_t *envelope);
 
+/**
+ * Wait for and consume a batch of messages
+ *
+ * Waits for a message like amqp_consume_message(), then goes on to consume
+ * every further delivery that has already been read in full from the
+ * socket, up to max messages in all. Only the first message is waited for,
+ * the rest are decoded from the connection's buffers without reading from
+ * the socket.
+ *
+ * The batch ends early at anything other than a complete basic.deliver, which
+ * is left for the next call or for amqp_simple_wait_frame().
+ *
+ * \param [in,out] state the connection object
+ * \param [out] envelopes an array of at least max envelopes. The first
+ *              *count are filled in, and the caller should call
+ *              #amqp_destroy_envelope() on each of them.
+ * \param [in] max the size of the envelopes array, at least 1
+ * \param [out] count the number of envelopes filled in. This is set whatever
+ *              the outcome, as messages consumed before an error are still
+ *              returned.
+ * \param [in] timeout a timeout to wait for the first message. Passing in
+ *             NULL will result in blocking behavior.
+ * \param [in] flags pass in 0. Currently unused.
+ * \returns a amqp_rpc_reply_t object. ret.reply_type == AMQP_RESPONSE_NORMAL
+ *          on success, otherwise it describes the error that ended the batch,
+ *          see amqp_consume_message(). AMQP_STATUS_INVALID_PARAMETER is
+ *          returned if max is 0.
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+amqp_rpc_reply_t AMQP_CALL amqp_consume_messages(
+    amqp_connection_state_t state, amqp_envelope_t *envelopes, size_t max,
+    size_t *count, const struct timeval *timeout, int flags);
+
+/**
+ * Message view object
+ *
+ * A delivered message that refers to the library's frame buffers instead of
+ * owning copies of its fields, see amqp_consume_message_view().
+ *
+ * \since v0.14.0
+ */
+typedef struct amqp_message_view_t_ {
+  amqp_channel_t channel;     /**< channel message was delivered on */
+  amqp_bytes_t consumer_tag;  /**< the consumer tag the message was delivered to
+                               */
+  uint64_t delivery_tag;      /**< the messages delivery tag */
+  amqp_boolean_t redelivered; /**< flag indicating whether this message is being
+                                 redelivered */
+  amqp_bytes_t exchange;      /**< exchange this message was published to */
+  amqp_bytes_t routing_key; /**< the routing key this message was published with
+                             */
+  amqp_basic_properties_t properties; /**< message properties */
+  amqp_bytes_t body;                  /**< message body */
+  amqp_bytes_t raw_properties;        /**< the encoded properties, see
+                                         amqp_message_view_headers() */
+} amqp_message_view_t;
+
+/**
+ * Wait for and consume a message without copying it
+ *
+ * Behaves like amqp_consume_message(), but the fields of the view point into
+ * the frames the message was read from rather than into fresh allocations.
+ * A body that arrived in a single body frame is returned in place; only a
+ * body split over several frames, or one decoded by the connection's body
+ * codec, is put together in a buffer the connection reuses between messages.
+ *
+ * The view stays valid until amqp_release_message_view() is called for it,
+ * the next call to amqp_consume_message_view() on the connection, or the
+ * buffers of its channel are released, for example by
+ * amqp_maybe_release_buffers(). Only one view per connection is valid at a
+ * time.
+ *
+ * If the connection decodes properties lazily, see
+ * amqp_set_lazy_properties(), the headers table of view->properties is left
+ * empty; amqp_message_view_headers() decodes it.
+ *
+ * \param [in,out] state the connection object
+ * \param [out] view the message, valid as described above on success
+ * \param [in] timeout a timeout to wait for a message delivery. Passing in
+ *             NULL will result in blocking behavior.
+ * \param [in] flags pass in 0. Currently unused.
+ * \returns a amqp_rpc_reply_t object, see amqp_consume_message().
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+amqp_rpc_reply_t AMQP_CALL
+amqp_consume_message_view(amqp_connection_state_t state,
+                          amqp_message_view_t *view,
+                          const struct timeval *timeout, int flags);
+
+/**
+ * Releases a view returned by amqp_consume_message_view()
+ *
+ * Releases the buffers of the view's channel, as
+ * amqp_maybe_release_buffers_on_channel() does, so anything else read on that
+ * channel is released too. The view must not be used afterwards.
+ *
+ * \param [in] state the connection object
+ * \param [in,out] view the view to release
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+void AMQP_CALL amqp_release_message_view(amqp_connection_state_t state,
+                                         amqp_message_view_t *view);
+
+/**
+ * Get the headers table of a message view
+ *
+ * Decodes the headers of view->properties, if that has not been done, into
+ * the buffers of the view's channel. The table stays valid as long as the
+ * view.
+ *
+ * \param [in] state the connection object
+ * \param [in,out] view the view returned by amqp_consume_message_view()
+ * \param [out] headers set to &view->properties.headers, an empty table if
+ *              the message has no headers
+ * \return AMQP_STATUS_OK on success, an amqp_status_enum value otherwise
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+int AMQP_CALL amqp_message_view_headers(amqp_connection_state_t state,
+                                        amqp_message_view_t *view,
+                                        amqp_table_t **headers);
+
+/**
+ * Handles the messages delivered to a consumer, see amqp_register_consumer()
+ *
+ * \param [in] user_data the user_data passed to amqp_register_consumer()
+ * \param [in] state the connection object
+ * \param [in] message the message, valid until the handler returns
+ * \return AMQP_STATUS_OK, anything else makes the call that dispatched the
+ *         message fail with it as library_error
+ *
+ * \since v0.14.0
+ */
+typedef int(AMQP_CALL *amqp_consumer_handler_t)(
+    void *user_data, amqp_connection_state_t state,
+    amqp_message_view_t *message);
+
+/**
+ * Register a handler for the messages delivered to a consumer
+ *
+ * Messages delivered to consumer_tag on channel are passed to handler as
+ * they are read by amqp_consume_message(), amqp_consume_messages() or
+ * amqp_consume_message_view(), which go on to wait for a message for a
+ * consumer without a handler. The handler gets the message as a view, as
+ * amqp_consume_message_view() would return it, so nothing is copied;
+ * dispatching releases any view amqp_consume_message_view() returned
+ * before. The handler may send, for example to acknowledge the message, but
+ * must not consume messages itself.
+ *
+ * Consumers are looked up in a hash table, so the number registered does not
+ * slow down dispatching. Registering a consumer again replaces its handler.
+ * Registrations end with amqp_unregister_consumer(), amqp_channel_close()
+ * on their channel, or amqp_destroy_connection().
+ *
+ * \param [in] state the connection object
+ * \param [in] channel the channel the consumer was started on
+ * \param [in] consumer_tag the consumer tag, from basic.consume-ok. It is
+ *              copied.
+ * \param [in] handler the handler
+ * \param [in] user_data passed to handler
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_INVALID_PARAMETER if
+ *         handler is NULL, AMQP_STATUS_NO_MEMORY
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+int AMQP_CALL amqp_register_consumer(amqp_connection_state_t state,
+                                     amqp_channel_t channel,
+                                     amqp_bytes_t consumer_tag,
+                                     amqp_consumer_handler_t handler,
+                                     void *user_data);
+
+/**
+ * Remove a handler registered with amqp_register_consumer()
+ *
+ * Messages delivered to the consumer afterwards are returned by the consume
+ * functions as usual.
+ *
+ * \param [in] state the connection object
+ * \param [in] channel the channel the consumer was registered on
+ * \param [in] consumer_tag the consumer tag
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_INVALID_PARAMETER if no
+ *         such consumer was registered
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+int AMQP_CALL amqp_unregister_consumer(amqp_connection_state_t state,
+                                       amqp_channel_t channel,
+                                       amqp_bytes_t consumer_tag);
+
 /**
  * Parameters used to connect to the RabbitMQ broker
  *
@@ -2432,6 +3264,423 @@ AMQP_EXPORT
 int AMQP_CALL amqp_set_rpc_timeout(amqp_connection_state_t state,
                                    const struct timeval *timeout);
 
+/**
+ * Enable or disable write coalescing
+ *
+ * By default every frame is written to the socket as soon as it is sent. With
+ * write coalescing enabled, small frames (such as the basic.ack of
+ * amqp_basic_ack(), or small publishes) are appended to a per-connection
+ * buffer instead, and written together when:
+ * - the buffer holds flush_threshold bytes or more,
+ * - amqp_flush() is called,
+ * - the library is about to block reading from the socket, for example in
+ *   amqp_simple_wait_frame(), amqp_consume_message() or an RPC,
+ * - a frame is sent more than max_delay after the oldest buffered one.
+ *
+ * Frames that do not fit in the buffer are written immediately, along with
+ * anything already buffered, without being copied.
+ *
+ * Since buffered frames are written later, an error writing them is
+ * reported by whichever call does so. An application that waits for the
+ * socket outside the library, or stops sending for a while, must call
+ * amqp_flush() first: max_delay is only checked when a frame is sent.
+ *
+ * \param [in] state the connection object
+ * \param [in] flush_threshold the buffer size in bytes, 0 disables write
+ *              coalescing
+ * \param [in] max_delay the longest a frame may stay buffered, checked when
+ *              further frames are sent. NULL for no limit. The value is
+ *              copied.
+ * \return AMQP_STATUS_OK on success. AMQP_STATUS_INVALID_PARAMETER if
+ *         max_delay is negative, AMQP_STATUS_NO_MEMORY, or an error writing
+ *         the frames already buffered, which is done first.
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+int AMQP_CALL amqp_set_write_coalescing(amqp_connection_state_t state,
+                                        size_t flush_threshold,
+                                        const struct timeval *max_delay);
+
+/**
+ * Write out any frames held back by write coalescing
+ *
+ * Also writes out whatever a non-blocking send left queued, see
+ * amqp_set_send_nonblocking().
+ *
+ * \param [in] state the connection object
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_WOULD_BLOCK in non-blocking
+ *         send mode if not everything could be written, or an
+ *         amqp_status_enum value from writing to the socket.
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+int AMQP_CALL amqp_flush(amqp_connection_state_t state);
+
+/**
+ * Enable or disable non-blocking send mode
+ *
+ * By default calls that send frames wait until the socket has accepted all of
+ * them. In non-blocking send mode they write what the socket accepts without
+ * waiting, queue the rest on the connection and return
+ * AMQP_STATUS_WOULD_BLOCK. The frames are not lost: the call has succeeded,
+ * and the queued data is written, in order, before anything sent later. Call
+ * amqp_send_pending() when the socket becomes writable to continue writing
+ * it. This lets one thread drive many connections from its own poll loop.
+ *
+ * The mode applies to calls that only send, such as amqp_basic_publish(),
+ * amqp_basic_ack(), amqp_send_method() and amqp_flush(). Calls that wait for
+ * a reply or a frame, such as RPCs, amqp_simple_wait_frame() or waiting for
+ * room in a publisher confirm window, block until everything queued has been
+ * written, as they would have to block for the reply anyway.
+ *
+ * With SSL sockets continuing a write may need the socket to be readable
+ * rather than writable; polling for both is safe.
+ *
+ * Disabling the mode does not write the queued data immediately, it is
+ * written by the next send, blocking.
+ *
+ * \param [in] state the connection object
+ * \param [in] nonblocking non-zero to enable non-blocking send mode
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+void AMQP_CALL amqp_set_send_nonblocking(amqp_connection_state_t state,
+                                         amqp_boolean_t nonblocking);
+
+/**
+ * Continue writing data queued by a non-blocking send
+ *
+ * Writes as much of the queued data as the socket accepts without waiting,
+ * including frames held back by write coalescing.
+ *
+ * \param [in] state the connection object
+ * \return AMQP_STATUS_OK once nothing is left queued,
+ *         AMQP_STATUS_WOULD_BLOCK if the socket would not accept all of it,
+ *         call again when it is writable, or an amqp_status_enum value from
+ *         writing to the socket.
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+int AMQP_CALL amqp_send_pending(amqp_connection_state_t state);
+
+/**
+ * Called by amqp_process_input() for each frame read
+ *
+ * The frame is valid as one returned by amqp_simple_wait_frame() is.
+ *
+ * \param [in] user_data the user_data passed to amqp_process_input()
+ * \param [in] state the connection object
+ * \param [in] frame the frame
+ * \return AMQP_STATUS_OK to go on, anything else to stop processing input,
+ *         which amqp_process_input() then returns
+ *
+ * \since v0.14.0
+ */
+typedef int(AMQP_CALL *amqp_frame_callback_t)(void *user_data,
+                                              amqp_connection_state_t state,
+                                              amqp_frame_t *frame);
+
+/**
+ * What a connection waits for, as reported by amqp_process_input()
+ *
+ * \since v0.14.0
+ */
+typedef struct amqp_io_interest_t_ {
+  amqp_boolean_t want_read;  /**< poll the socket for reading */
+  amqp_boolean_t want_write; /**< poll the socket for writing, and call
+                                amqp_send_pending() once it is writable */
+  int timeout_ms; /**< milliseconds until amqp_process_input() must be called
+                     again to handle heartbeats even if the socket is not
+                     ready, 0 to call it again straight away, -1 for no
+                     limit */
+} amqp_io_interest_t;
+
+/**
+ * Process input without blocking, for use from an event loop
+ *
+ * Passes the frames already read, including those queued by other calls, to
+ * on_frame, reads from the socket once without waiting, and passes on every
+ * complete frame that read brought in. Heartbeats, publisher confirms and
+ * flow control are handled as amqp_simple_wait_frame() does. A heartbeat due
+ * to be sent is sent. The socket is never polled: call this when the socket
+ * of amqp_get_sockfd() is ready as *interest says, or when its timeout_ms
+ * has passed.
+ *
+ * Sends are best made in non-blocking send mode, see
+ * amqp_set_send_nonblocking(), so that neither on_frame nor a heartbeat
+ * blocks the event loop. Frames handed to on_frame stay in the connection's
+ * buffers until they are released, for example with
+ * amqp_maybe_release_buffers().
+ *
+ * \param [in] state the connection object
+ * \param [in] on_frame called for each frame
+ * \param [in] user_data passed to on_frame
+ * \param [out] interest what to wait for before calling again, set on
+ *              success
+ * \return AMQP_STATUS_OK on success, including when nothing could be read,
+ *         the status returned by on_frame if it stopped, or another
+ *         amqp_status_enum value, such as AMQP_STATUS_CONNECTION_CLOSED or
+ *         AMQP_STATUS_HEARTBEAT_TIMEOUT
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+int AMQP_CALL amqp_process_input(amqp_connection_state_t state,
+                                 amqp_frame_callback_t on_frame,
+                                 void *user_data, amqp_io_interest_t *interest);
+
+/**
+ * A body codec, such as a compression algorithm
+ *
+ * Bodies are encoded in one go, since the encoded size must be sent before
+ * the body, and decoded a body frame at a time as they arrive, so the encoded
+ * body is never held in memory as a whole on receipt.
+ *
+ * All functions return an amqp_status_enum value, AMQP_STATUS_OK on success.
+ *
+ * \since v0.14.0
+ */
+typedef struct amqp_body_codec_t_ {
+  /** The content_encoding property of encoded messages */
+  const char *content_encoding;
+
+  /**
+   * Encode body into *encoded, allocated with malloc(). May fail with
+   * AMQP_STATUS_UNSUPPORTED to send body unencoded.
+   */
+  int(AMQP_CALL *encode)(void *user_data, amqp_bytes_t body,
+                         amqp_bytes_t *encoded);
+
+  /**
+   * Start decoding a body of encoded_size bytes. Sets *decoder to a context
+   * for decode(), decoder_finish() and decoder_free(). decode() must fail
+   * with AMQP_STATUS_CODEC_ERROR rather than decode more than max_size bytes.
+   */
+  int(AMQP_CALL *decoder_new)(void *user_data, uint64_t encoded_size,
+                              uint64_t max_size, void **decoder);
+
+  /**
+   * Decode the next part of the body, appending the output to body. body
+   * was allocated with malloc() and has room for *capacity bytes, it may be
+   * grown with realloc().
+   */
+  int(AMQP_CALL *decode)(void *decoder, amqp_bytes_t fragment,
+                         amqp_bytes_t *body, size_t *capacity);
+
+  /** Check the whole body has been decoded */
+  int(AMQP_CALL *decoder_finish)(void *decoder);
+
+  /** Free the decoder */
+  void(AMQP_CALL *decoder_free)(void *decoder);
+} amqp_body_codec_t;
+
+/**
+ * Set the body codec of a connection
+ *
+ * amqp_basic_publish() and amqp_basic_publish_batch() encode bodies of at
+ * least min_size bytes with codec and set their content_encoding property,
+ * unless the properties already have a content_encoding or the encoded body
+ * would not be smaller. amqp_basic_publish_template(), amqp_basic_publish_fd()
+ * and amqp_basic_publish_begin() send bodies as they are.
+ * amqp_read_message() and amqp_consume_message() decode bodies whose
+ * content_encoding is codec->content_encoding, and clear the property, so
+ * the caller sees the message as it was published.
+ *
+ * A body that fails to decode is still read in full, and the read fails with
+ * AMQP_STATUS_CODEC_ERROR.
+ *
+ * \param [in] state the connection object
+ * \param [in] codec the codec, NULL for none. It must stay valid as long as
+ *              it is set.
+ * \param [in] user_data passed to codec->encode() and codec->decoder_new()
+ * \param [in] min_size the smallest body to encode
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+void AMQP_CALL amqp_set_body_codec(amqp_connection_state_t state,
+                                   const amqp_body_codec_t *codec,
+                                   void *user_data, size_t min_size);
+
+/**
+ * Set the largest body a body codec may decode
+ *
+ * Decoding a body that would grow larger fails with AMQP_STATUS_CODEC_ERROR
+ * once the limit is reached, so a small encoded body cannot make the
+ * connection allocate an unbounded amount of memory. The body is still read
+ * in full, as for any body that fails to decode.
+ *
+ * \param [in] state the connection object
+ * \param [in] max_size the limit in bytes, AMQP_DEFAULT_MAX_DECODED_BODY_SIZE
+ *              by default
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+void AMQP_CALL amqp_set_max_decoded_body_size(amqp_connection_state_t state,
+                                              uint64_t max_size);
+
+/**
+ * Decode message properties lazily
+ *
+ * By default the properties of every content header frame read are decoded
+ * as the frame is read, headers table included. In lazy mode the basic
+ * properties of header frames are left encoded, with
+ * frame->payload.properties.decoded set to NULL, and only decoded when asked
+ * for with amqp_frame_properties(), or amqp_frame_headers() for the headers
+ * table. A consumer that never looks at the headers never pays for decoding
+ * them.
+ *
+ * amqp_read_message() and amqp_consume_message() still return fully decoded
+ * properties. amqp_consume_message_view() leaves the headers to
+ * amqp_message_view_headers().
+ *
+ * \param [in] state the connection object
+ * \param [in] lazy true to decode properties lazily, false to decode them as
+ *             frames are read
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+void AMQP_CALL amqp_set_lazy_properties(amqp_connection_state_t state,
+                                        amqp_boolean_t lazy);
+
+/**
+ * Get the properties of a content header frame
+ *
+ * Decodes the properties if that has not been done, and stores them in
+ * frame->payload.properties.decoded. Apart from the headers table, which is
+ * left empty until amqp_frame_headers() is called, the result points into
+ * the frame, and stays valid as long as the frame.
+ *
+ * \param [in] state the connection object
+ * \param [in,out] frame a content header frame of the basic class
+ * \param [out] properties the decoded properties
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_INVALID_PARAMETER if frame
+ *         is not a basic content header frame, an amqp_status_enum value
+ *         otherwise
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+int AMQP_CALL amqp_frame_properties(amqp_connection_state_t state,
+                                    amqp_frame_t *frame,
+                                    amqp_basic_properties_t **properties);
+
+/**
+ * Get the headers table of a content header frame
+ *
+ * Decodes the properties of the frame as amqp_frame_properties() does, and
+ * then their headers table, if that has not been done. The table is
+ * allocated from the buffers of the frame's channel.
+ *
+ * \param [in] state the connection object
+ * \param [in,out] frame a content header frame of the basic class
+ * \param [out] headers the headers of the decoded properties, an empty table
+ *              if the message has no headers
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_INVALID_PARAMETER if frame
+ *         is not a basic content header frame, an amqp_status_enum value
+ *         otherwise
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+int AMQP_CALL amqp_frame_headers(amqp_connection_state_t state,
+                                 amqp_frame_t *frame, amqp_table_t **headers);
+
+/**
+ * Check whether the broker has blocked the connection
+ *
+ * The library asks the broker to send connection.blocked when it stops
+ * accepting publishes, for example on a memory or disk alarm, and
+ * connection.unblocked when it resumes. These frames are consumed by the
+ * library as they are read, they are not returned by amqp_simple_wait_frame()
+ * or amqp_consume_message().
+ *
+ * Publishing functions read whatever the broker has sent every so often, so
+ * a connection that only publishes still notices it has been blocked.
+ *
+ * \param [in] state the connection object
+ * \return true if the connection is blocked, false otherwise
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+amqp_boolean_t AMQP_CALL
+amqp_connection_is_blocked(amqp_connection_state_t state);
+
+/**
+ * Check whether the broker allows publishing on a channel
+ *
+ * The broker may pause a channel with channel.flow. The library replies with
+ * channel.flow-ok itself, and consumes the frame as it does for
+ * connection.blocked.
+ *
+ * \param [in] state the connection object
+ * \param [in] channel the channel identifier
+ * \return true unless the broker has paused the channel, false otherwise
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+amqp_boolean_t AMQP_CALL amqp_channel_flow_active(
+    amqp_connection_state_t state, amqp_channel_t channel);
+
+/**
+ * Set how long a publish waits while publishing is blocked
+ *
+ * Publishing while the connection is blocked (see
+ * amqp_connection_is_blocked()) or the channel is paused (see
+ * amqp_channel_flow_active()) waits for the broker to lift the block. The wait
+ * reads from the socket, sleeping until the broker sends something, and keeps
+ * the frames read for amqp_simple_wait_frame(). If the block is not lifted
+ * within the timeout the publish fails with AMQP_STATUS_CONNECTION_BLOCKED
+ * without sending anything. A zero timeout fails at once, which lets a
+ * publisher shed load rather than wait.
+ *
+ * The default value is NULL, or an infinite timeout.
+ *
+ * \param [in] state the connection object
+ * \param [in] timeout the longest time to wait, NULL to wait as long as it
+ *              takes. The value is copied.
+ * \return AMQP_STATUS_OK on success.
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+int AMQP_CALL amqp_set_publish_blocked_timeout(amqp_connection_state_t state,
+                                               const struct timeval *timeout);
+
+/**
+ * Set the size limits of the socket receive buffer
+ *
+ * Data is read from the socket into a ring buffer, which keeps a frame that
+ * has only partly arrived in place while the rest is read. The buffer starts
+ * at 128 KB, doubles, up to max_size, whenever a read fills it, and halves,
+ * down to min_size, after a run of reads each using under a quarter of it.
+ * Busy connections so make fewer, larger reads, while idle ones hold on to
+ * little memory.
+ *
+ * The defaults are 4 KB and 1 MB. New limits apply from the next read.
+ *
+ * \param [in] state the connection object
+ * \param [in] min_size the smallest the buffer shrinks to, at least
+ *              AMQP_FRAME_MIN_SIZE
+ * \param [in] max_size the largest the buffer grows to, at least min_size
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_INVALID_PARAMETER if the
+ *         limits are out of range.
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+int AMQP_CALL amqp_set_inbound_buffer_limits(amqp_connection_state_t state,
+                                             size_t min_size,
+                                             size_t max_size);
+
 AMQP_END_DECLS
 
 #endif /* RABBITMQ_C_RABBITMQ_C_H */
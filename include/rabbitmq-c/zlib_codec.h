@@ -0,0 +1,52 @@
+// Copyright 2007 - 2021, Alan Antonuk and the rabbitmq-c contributors.
+// SPDX-License-Identifier: mit
+
+/** \file */
+
+/**
+ * A zlib body codec, for message bodies with the "deflate" content encoding.
+ */
+
+#ifndef RABBITMQ_C_ZLIB_CODEC_H
+#define RABBITMQ_C_ZLIB_CODEC_H
+
+#include <stddef.h>
+
+#include <rabbitmq-c/amqp.h>
+#include <rabbitmq-c/export.h>
+
+AMQP_BEGIN_DECLS
+
+/**
+ * The zlib body codec
+ *
+ * Encodes bodies in the zlib format with content_encoding "deflate". The
+ * user_data of amqp_set_body_codec() is the compression level as an intptr_t,
+ * see amqp_set_deflate_codec().
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+extern const amqp_body_codec_t amqp_deflate_codec;
+
+/**
+ * Compress message bodies of a connection with zlib
+ *
+ * Equivalent to amqp_set_body_codec() with amqp_deflate_codec.
+ *
+ * \param [in] state the connection object
+ * \param [in] level the zlib compression level, 0 to 9, or -1 for zlib's
+ *              default
+ * \param [in] min_size the smallest body to compress
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_INVALID_PARAMETER if level
+ *         is out of range.
+ *
+ * \since v0.14.0
+ */
+AMQP_EXPORT
+int AMQP_CALL amqp_set_deflate_codec(amqp_connection_state_t state, int level,
+                                     size_t min_size);
+
+AMQP_END_DECLS
+
+#endif /* RABBITMQ_C_ZLIB_CODEC_H */
@@ -14,11 +14,16 @@
 
 #include "amqp_private.h"
 #include "amqp_time.h"
+#include <errno.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #define ERROR_MASK (0x00FF)
 #define ERROR_CATEGORY_MASK (0xFF00)
@@ -67,7 +72,15 @@ static const char *base_error_strings[] = {
     /* AMQP_STATUS_BROKER_UNSUPPORTED_SASL_METHOD -0x00013 */
     "unsupported sasl method requested",
     /* AMQP_STATUS_UNSUPPORTED                -0x0014 */
-    "parameter value is unsupported"};
+    "parameter value is unsupported",
+    /* AMQP_STATUS_WOULD_BLOCK                -0x0015 */
+    "operation would block",
+    /* AMQP_STATUS_CODEC_ERROR                -0x0016 */
+    "message body could not be decoded",
+    /* AMQP_STATUS_CONNECTION_BLOCKED         -0x0017 */
+    "publishing blocked by the broker",
+    /* AMQP_STATUS_NO_FREE_CHANNEL            -0x0018 */
+    "no free channel"};
 
 static const char *tcp_error_strings[] = {
     /* AMQP_STATUS_TCP_ERROR                  -0x0100 */
@@ -155,30 +168,20 @@ const amqp_bytes_t amqp_empty_bytes = {0, NULL};
 const amqp_table_t amqp_empty_table = {0, NULL};
 const amqp_array_t amqp_empty_array = {0, NULL};
 
-int amqp_basic_publish(amqp_connection_state_t state, amqp_channel_t channel,
-                       amqp_bytes_t exchange, amqp_bytes_t routing_key,
-                       amqp_boolean_t mandatory, amqp_boolean_t immediate,
-                       amqp_basic_properties_t const *properties,
-                       amqp_bytes_t body) {
-  amqp_frame_t f;
-  size_t body_offset;
-  size_t usable_body_payload_size =
-      state->frame_max - (HEADER_SIZE + FOOTER_SIZE);
-  int res;
-  int flagz;
-
-  amqp_basic_publish_t m;
-  amqp_basic_properties_t default_properties;
+/* Largest possible basic.publish method frame: method id, ticket, exchange
+ * and routing key shortstrs, and the mandatory/immediate bits */
+#define AMQP_BASIC_PUBLISH_FRAME_MAX \
+  (HEADER_SIZE + 4 + 2 + 2 * (1 + UINT8_MAX) + 1 + FOOTER_SIZE)
 
-  m.exchange = exchange;
-  m.routing_key = routing_key;
-  m.mandatory = mandatory;
-  m.immediate = immediate;
-  m.ticket = 0;
+/* Fails with AMQP_STATUS_HEARTBEAT_TIMEOUT if the broker has not been heard
+ * from in time. */
+static int amqp_publish_check_heartbeat(amqp_connection_state_t state) {
+  int res;
 
   /* TODO(alanxz): this heartbeat check is happening in the wrong place, it
    * should really be done in amqp_try_send/writev */
-  res = amqp_time_has_past(state->next_recv_heartbeat);
+  res = amqp_time_has_past_cached(state->next_recv_heartbeat,
+                                  &state->heartbeat_clock);
   if (AMQP_STATUS_TIMER_FAILURE == res) {
     return res;
   } else if (AMQP_STATUS_TIMEOUT == res) {
@@ -189,63 +192,1269 @@ int amqp_basic_publish(amqp_connection_state_t state, amqp_channel_t channel,
       return res;
     }
   }
+  return AMQP_STATUS_OK;
+}
 
-  res = amqp_send_method_inner(state, channel, AMQP_BASIC_PUBLISH_METHOD, &m,
-                               AMQP_SF_MORE, amqp_time_infinite());
-  if (res < 0) {
+/* Checks the connection is fit to publish on, and waits for room in the
+ * channel's confirm window if it is in confirm mode. */
+static int amqp_publish_prepare(amqp_connection_state_t state,
+                                amqp_channel_t channel,
+                                amqp_confirm_tracker_t **tracker) {
+  int res = amqp_publish_check_heartbeat(state);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  res = amqp_flow_wait_for_publish(state, channel);
+  if (AMQP_STATUS_OK != res) {
     return res;
   }
 
+  *tracker = amqp_confirm_get_tracker(state, channel);
+  if (*tracker != NULL) {
+    return amqp_confirm_wait_for_room(state, *tracker);
+  }
+  return AMQP_STATUS_OK;
+}
+
+/* Writes an encoded method and content header frame followed by the body
+ * frames for body. The body is not copied: each body frame is written as a
+ * frame header, a slice of the caller's buffer and a footer, in as few writev
+ * calls as possible. */
+static int amqp_publish_frames(amqp_connection_state_t state,
+                               amqp_channel_t channel,
+                               amqp_confirm_tracker_t *tracker,
+                               amqp_bytes_t method, amqp_bytes_t header,
+                               amqp_bytes_t body) {
+  size_t body_offset;
+  size_t usable_body_payload_size =
+      state->frame_max - (HEADER_SIZE + FOOTER_SIZE);
+  int res;
+  int would_block = 0;
+
+  uint8_t body_headers[AMQP_SOCKET_MAX_IOV / 3][HEADER_SIZE];
+  static const uint8_t body_footer = AMQP_FRAME_END;
+  struct iovec iov[AMQP_SOCKET_MAX_IOV];
+  int iovcnt;
+  int num_body_frames;
+
+  iov[0].iov_base = method.bytes;
+  iov[0].iov_len = method.len;
+  iov[1].iov_base = header.bytes;
+  iov[1].iov_len = header.len;
+  iovcnt = 2;
+
+  if (tracker != NULL) {
+    amqp_confirm_published(tracker);
+  }
+
+  num_body_frames = 0;
+  body_offset = 0;
+  while (body_offset < body.len) {
+    size_t remaining = body.len - body_offset;
+    uint8_t *frame_header = body_headers[num_body_frames++];
+
+    if (remaining > usable_body_payload_size) {
+      remaining = usable_body_payload_size;
+    }
+
+    amqp_e8(AMQP_FRAME_BODY, amqp_offset(frame_header, 0));
+    amqp_e16(channel, amqp_offset(frame_header, 1));
+    amqp_e32((uint32_t)remaining, amqp_offset(frame_header, 3));
+
+    iov[iovcnt].iov_base = frame_header;
+    iov[iovcnt].iov_len = HEADER_SIZE;
+    iov[iovcnt + 1].iov_base = amqp_offset(body.bytes, body_offset);
+    iov[iovcnt + 1].iov_len = remaining;
+    iov[iovcnt + 2].iov_base = (void *)&body_footer;
+    iov[iovcnt + 2].iov_len = FOOTER_SIZE;
+    iovcnt += 3;
+
+    body_offset += remaining;
+
+    if (body_offset < body.len && iovcnt + 3 > AMQP_SOCKET_MAX_IOV) {
+      res = amqp_send_iov_inner(state, iov, iovcnt, AMQP_SF_MORE,
+                                amqp_time_infinite());
+      /* Once queued, the rest of the message must be queued after it */
+      if (res < 0 && AMQP_STATUS_WOULD_BLOCK != res) {
+        return res;
+      }
+      would_block = would_block || AMQP_STATUS_WOULD_BLOCK == res;
+      iovcnt = 0;
+      num_body_frames = 0;
+    }
+  }
+
+  res = amqp_send_iov_inner(state, iov, iovcnt, AMQP_SF_NONE,
+                            amqp_time_infinite());
+  if (AMQP_STATUS_OK == res && would_block) {
+    return AMQP_STATUS_WOULD_BLOCK;
+  }
+  return res;
+}
+
+/* Encodes the basic.publish method frame into method_buffer and the content
+ * header frame into the connection's outbound buffer. Both are encoded before
+ * anything is written, so a message with unencodable properties is never
+ * half-sent. */
+static int amqp_publish_encode(amqp_connection_state_t state,
+                               amqp_channel_t channel, amqp_bytes_t exchange,
+                               amqp_bytes_t routing_key,
+                               amqp_boolean_t mandatory,
+                               amqp_boolean_t immediate,
+                               amqp_basic_properties_t const *properties,
+                               uint64_t body_size, amqp_bytes_t method_buffer,
+                               amqp_bytes_t *method_encoded,
+                               amqp_bytes_t *header_encoded) {
+  amqp_frame_t f;
+  int res;
+
+  amqp_basic_publish_t m;
+  amqp_basic_properties_t default_properties;
+
+  m.exchange = exchange;
+  m.routing_key = routing_key;
+  m.mandatory = mandatory;
+  m.immediate = immediate;
+  m.ticket = 0;
+
   if (properties == NULL) {
     memset(&default_properties, 0, sizeof(default_properties));
     properties = &default_properties;
   }
 
-  f.frame_type = AMQP_FRAME_HEADER;
+  f.frame_type = AMQP_FRAME_METHOD;
   f.channel = channel;
+  f.payload.method.id = AMQP_BASIC_PUBLISH_METHOD;
+  f.payload.method.decoded = &m;
+
+  if ((size_t)state->frame_max < method_buffer.len) {
+    method_buffer.len = state->frame_max;
+  }
+  res = amqp_frame_to_bytes(&f, method_buffer, method_encoded);
+  if (res < 0) {
+    return res;
+  }
+
+  f.frame_type = AMQP_FRAME_HEADER;
   f.payload.properties.class_id = AMQP_BASIC_CLASS;
-  f.payload.properties.body_size = body.len;
+  f.payload.properties.body_size = body_size;
   f.payload.properties.decoded = (void *)properties;
 
-  if (body.len > 0) {
-    flagz = AMQP_SF_MORE;
+  return amqp_frame_to_bytes(&f, state->outbound_buffer, header_encoded);
+}
+
+/* Encodes *body with the connection's body codec, if one applies to it. When
+ * it does *properties and *body are pointed at the encoded message, and
+ * *encoded must be freed once it has been sent. */
+static int amqp_publish_apply_codec(
+    amqp_connection_state_t state, amqp_basic_properties_t const **properties,
+    amqp_basic_properties_t *encoded_properties, amqp_bytes_t *body,
+    amqp_bytes_t *encoded) {
+  const amqp_body_codec_t *codec = state->body_codec;
+  int res;
+
+  *encoded = amqp_empty_bytes;
+  if (NULL == codec || body->len < state->body_codec_min_size ||
+      (NULL != *properties &&
+       (*properties)->_flags & AMQP_BASIC_CONTENT_ENCODING_FLAG)) {
+    return AMQP_STATUS_OK;
+  }
+
+  res = codec->encode(state->body_codec_user_data, *body, encoded);
+  if (AMQP_STATUS_UNSUPPORTED == res) {
+    *encoded = amqp_empty_bytes;
+    return AMQP_STATUS_OK;
+  }
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+  if (encoded->len >= body->len) {
+    amqp_bytes_free(*encoded);
+    *encoded = amqp_empty_bytes;
+    return AMQP_STATUS_OK;
+  }
+
+  if (NULL == *properties) {
+    memset(encoded_properties, 0, sizeof(*encoded_properties));
   } else {
-    flagz = AMQP_SF_NONE;
+    *encoded_properties = **properties;
+  }
+  encoded_properties->_flags |= AMQP_BASIC_CONTENT_ENCODING_FLAG;
+  encoded_properties->content_encoding =
+      amqp_cstring_bytes(codec->content_encoding);
+  *properties = encoded_properties;
+  *body = *encoded;
+  return AMQP_STATUS_OK;
+}
+
+int amqp_basic_publish(amqp_connection_state_t state, amqp_channel_t channel,
+                       amqp_bytes_t exchange, amqp_bytes_t routing_key,
+                       amqp_boolean_t mandatory, amqp_boolean_t immediate,
+                       amqp_basic_properties_t const *properties,
+                       amqp_bytes_t body) {
+  int res;
+
+  uint8_t method_frame[AMQP_BASIC_PUBLISH_FRAME_MAX];
+  amqp_bytes_t buffer;
+  amqp_bytes_t method_encoded;
+  amqp_bytes_t header_encoded;
+  amqp_bytes_t body_encoded;
+  amqp_basic_properties_t encoded_properties;
+  amqp_confirm_tracker_t *tracker;
+
+  res = amqp_publish_prepare(state, channel, &tracker);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  res = amqp_publish_apply_codec(state, &properties, &encoded_properties,
+                                 &body, &body_encoded);
+  if (AMQP_STATUS_OK != res) {
+    return res;
   }
-  res = amqp_send_frame_inner(state, &f, flagz, amqp_time_infinite());
+
+  buffer.bytes = method_frame;
+  buffer.len = sizeof(method_frame);
+  res = amqp_publish_encode(state, channel, exchange, routing_key, mandatory,
+                            immediate, properties, body.len, buffer,
+                            &method_encoded, &header_encoded);
+  if (res >= 0) {
+    res = amqp_publish_frames(state, channel, tracker, method_encoded,
+                              header_encoded, body);
+  }
+
+  amqp_bytes_free(body_encoded);
+  return res;
+}
+
+#ifndef _WIN32
+/* Reads exactly len bytes of fd from offset into buf. */
+static int publish_fd_read(int fd, uint64_t offset, void *buf, size_t len) {
+  while (len > 0) {
+    ssize_t res = pread(fd, buf, len, (off_t)offset);
+    if (res < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      return AMQP_STATUS_INVALID_PARAMETER;
+    }
+    if (0 == res) {
+      return AMQP_PRIVATE_STATUS_FILE_ENDED;
+    }
+    buf = amqp_offset(buf, res);
+    offset += res;
+    len -= res;
+  }
+  return AMQP_STATUS_OK;
+}
+
+/* Called before the first write of a message: from then on it counts as
+ * published. */
+static void publish_fd_start(amqp_confirm_tracker_t *tracker, int *started) {
+  if (!*started && tracker != NULL) {
+    amqp_confirm_published(tracker);
+  }
+  *started = 1;
+}
+#endif
+
+int amqp_basic_publish_fd(amqp_connection_state_t state,
+                          amqp_channel_t channel, amqp_bytes_t exchange,
+                          amqp_bytes_t routing_key, amqp_boolean_t mandatory,
+                          amqp_boolean_t immediate,
+                          amqp_basic_properties_t const *properties, int fd,
+                          uint64_t offset, uint64_t len) {
+#ifdef _WIN32
+  (void)state;
+  (void)channel;
+  (void)exchange;
+  (void)routing_key;
+  (void)mandatory;
+  (void)immediate;
+  (void)properties;
+  (void)fd;
+  (void)offset;
+  (void)len;
+  return AMQP_STATUS_UNSUPPORTED;
+#else
+  size_t usable_body_payload_size =
+      state->frame_max - (HEADER_SIZE + FOOTER_SIZE);
+  uint8_t method_frame[AMQP_BASIC_PUBLISH_FRAME_MAX];
+  uint8_t frame_header[HEADER_SIZE];
+  static const uint8_t body_footer = AMQP_FRAME_END;
+  amqp_bytes_t buffer;
+  amqp_bytes_t method_encoded;
+  amqp_bytes_t header_encoded;
+  struct iovec iov[4];
+  int iovcnt;
+  uint64_t body_offset;
+  int use_sendfile;
+  int started = 0;
+  amqp_confirm_tracker_t *tracker;
+  struct stat st;
+  int res;
+
+  if (0 > fd || offset + len < offset || 0 != fstat(fd, &st)) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  if (S_ISREG(st.st_mode) && offset + len > (uint64_t)st.st_size) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  res = amqp_publish_prepare(state, channel, &tracker);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  buffer.bytes = method_frame;
+  buffer.len = sizeof(method_frame);
+  res = amqp_publish_encode(state, channel, exchange, routing_key, mandatory,
+                            immediate, properties, len, buffer,
+                            &method_encoded, &header_encoded);
   if (res < 0) {
     return res;
   }
 
+  /* The file is written blocking, after anything coalesced or queued. This
+   * also leaves the send buffer free to read the file into when it can't be
+   * sent directly. */
+  res = amqp_flush_blocking(state, amqp_time_infinite());
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  use_sendfile =
+      NULL != state->socket && NULL != state->socket->klass->sendfile;
+
+  iov[0].iov_base = method_encoded.bytes;
+  iov[0].iov_len = method_encoded.len;
+  iov[1].iov_base = header_encoded.bytes;
+  iov[1].iov_len = header_encoded.len;
+  iovcnt = 2;
+
+  /* Each body frame's header goes out with the previous frame's footer */
   body_offset = 0;
-  while (body_offset < body.len) {
-    size_t remaining = body.len - body_offset;
+  while (body_offset < len) {
+    size_t remaining = usable_body_payload_size;
+    if (len - body_offset < remaining) {
+      remaining = (size_t)(len - body_offset);
+    }
 
-    if (remaining == 0) {
-      break;
+    amqp_e8(AMQP_FRAME_BODY, amqp_offset(frame_header, 0));
+    amqp_e16(channel, amqp_offset(frame_header, 1));
+    amqp_e32((uint32_t)remaining, amqp_offset(frame_header, 3));
+
+    iov[iovcnt].iov_base = frame_header;
+    iov[iovcnt].iov_len = HEADER_SIZE;
+    iovcnt++;
+
+    if (use_sendfile) {
+      publish_fd_start(tracker, &started);
+      res = amqp_send_iov_blocking(state, iov, iovcnt, AMQP_SF_MORE,
+                                   amqp_time_infinite());
+      if (AMQP_STATUS_OK != res) {
+        return res;
+      }
+      iovcnt = 0;
+
+      res = amqp_send_file_inner(state, fd, offset + body_offset, remaining,
+                                 AMQP_SF_MORE, amqp_time_infinite());
+      if (AMQP_STATUS_UNSUPPORTED == res) {
+        /* Not a file sendfile() can read, such as a pipe */
+        use_sendfile = 0;
+      } else if (AMQP_PRIVATE_STATUS_FILE_ENDED == res) {
+        goto file_error;
+      } else if (AMQP_STATUS_OK != res) {
+        return res;
+      }
     }
 
-    f.frame_type = AMQP_FRAME_BODY;
-    f.channel = channel;
-    f.payload.body_fragment.bytes = amqp_offset(body.bytes, body_offset);
-    if (remaining >= usable_body_payload_size) {
-      f.payload.body_fragment.len = usable_body_payload_size;
-      flagz = AMQP_SF_MORE;
+    if (!use_sendfile) {
+      /* Read the frame into the send buffer, so at most a frame of the file
+       * is held in memory */
+      if (state->send_buffer.len < usable_body_payload_size) {
+        void *newbuf =
+            realloc(state->send_buffer.bytes, usable_body_payload_size);
+        if (NULL == newbuf) {
+          res = AMQP_STATUS_NO_MEMORY;
+          goto file_error;
+        }
+        state->send_buffer.bytes = newbuf;
+        state->send_buffer.len = usable_body_payload_size;
+      }
+      res = publish_fd_read(fd, offset + body_offset,
+                            state->send_buffer.bytes, remaining);
+      if (AMQP_STATUS_OK != res) {
+        goto file_error;
+      }
+      iov[iovcnt].iov_base = state->send_buffer.bytes;
+      iov[iovcnt].iov_len = remaining;
+      iovcnt++;
+
+      publish_fd_start(tracker, &started);
+      res = amqp_send_iov_blocking(state, iov, iovcnt, AMQP_SF_MORE,
+                                   amqp_time_infinite());
+      if (AMQP_STATUS_OK != res) {
+        return res;
+      }
+    }
+
+    iov[0].iov_base = (void *)&body_footer;
+    iov[0].iov_len = FOOTER_SIZE;
+    iovcnt = 1;
+    body_offset += remaining;
+  }
+
+  publish_fd_start(tracker, &started);
+  return amqp_send_iov_blocking(state, iov, iovcnt, AMQP_SF_NONE,
+                                amqp_time_infinite());
+
+file_error:
+  if (!started) {
+    return AMQP_STATUS_NO_MEMORY == res ? res : AMQP_STATUS_INVALID_PARAMETER;
+  }
+  /* The broker has been promised more of the body than there is to send, the
+   * connection can't be used any more */
+  amqp_socket_close(state->socket, AMQP_SC_FORCE);
+  return AMQP_STATUS_CONNECTION_CLOSED;
+#endif
+}
+
+int amqp_basic_publish_begin(amqp_connection_state_t state,
+                             amqp_channel_t channel, amqp_bytes_t exchange,
+                             amqp_bytes_t routing_key,
+                             amqp_boolean_t mandatory,
+                             amqp_boolean_t immediate,
+                             amqp_basic_properties_t const *properties,
+                             uint64_t body_size) {
+  uint8_t method_frame[AMQP_BASIC_PUBLISH_FRAME_MAX];
+  amqp_bytes_t buffer;
+  amqp_bytes_t method_encoded;
+  amqp_bytes_t header_encoded;
+  amqp_confirm_tracker_t *tracker;
+  struct iovec iov[2];
+  int res;
+
+  if (state->publish_active) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  if (state->publish_frame.len < (size_t)state->frame_max) {
+    void *newbuf = realloc(state->publish_frame.bytes, state->frame_max);
+    if (NULL == newbuf) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+    state->publish_frame.bytes = newbuf;
+    state->publish_frame.len = state->frame_max;
+  }
+
+  res = amqp_publish_prepare(state, channel, &tracker);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  buffer.bytes = method_frame;
+  buffer.len = sizeof(method_frame);
+  res = amqp_publish_encode(state, channel, exchange, routing_key, mandatory,
+                            immediate, properties, body_size, buffer,
+                            &method_encoded, &header_encoded);
+  if (res < 0) {
+    return res;
+  }
+
+  if (tracker != NULL) {
+    amqp_confirm_published(tracker);
+  }
+
+  iov[0].iov_base = method_encoded.bytes;
+  iov[0].iov_len = method_encoded.len;
+  iov[1].iov_base = header_encoded.bytes;
+  iov[1].iov_len = header_encoded.len;
+  res = amqp_send_iov_inner(state, iov, 2,
+                            0 == body_size ? AMQP_SF_NONE : AMQP_SF_MORE,
+                            amqp_time_infinite());
+  if (res < 0 && AMQP_STATUS_WOULD_BLOCK != res) {
+    return res;
+  }
+
+  state->publish_active = 1;
+  state->publish_channel = channel;
+  state->publish_remaining = body_size;
+  state->publish_frame_fill = 0;
+  return res;
+}
+
+/* Sends what has been collected in publish_frame as a body frame. */
+static int publish_stream_flush(amqp_connection_state_t state, int flags) {
+  size_t len = state->publish_frame_fill;
+  struct iovec iov;
+
+  amqp_e8(AMQP_FRAME_BODY, amqp_offset(state->publish_frame.bytes, 0));
+  amqp_e16(state->publish_channel, amqp_offset(state->publish_frame.bytes, 1));
+  amqp_e32((uint32_t)len, amqp_offset(state->publish_frame.bytes, 3));
+  amqp_e8(AMQP_FRAME_END,
+          amqp_offset(state->publish_frame.bytes, HEADER_SIZE + len));
+
+  iov.iov_base = state->publish_frame.bytes;
+  iov.iov_len = HEADER_SIZE + len + FOOTER_SIZE;
+  state->publish_frame_fill = 0;
+  return amqp_send_iov_inner(state, &iov, 1, flags, amqp_time_infinite());
+}
+
+int amqp_basic_publish_write(amqp_connection_state_t state,
+                             amqp_bytes_t chunk) {
+  size_t usable_body_payload_size =
+      state->frame_max - (HEADER_SIZE + FOOTER_SIZE);
+  size_t offset = 0;
+  int would_block = 0;
+  int res;
+
+  if (!state->publish_active || chunk.len > state->publish_remaining) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  while (offset < chunk.len) {
+    size_t len = chunk.len - offset;
+    int flags;
+
+    if (0 == state->publish_frame_fill && len >= usable_body_payload_size) {
+      /* A whole frame is sent straight from chunk */
+      uint8_t frame_header[HEADER_SIZE];
+      static const uint8_t body_footer = AMQP_FRAME_END;
+      struct iovec iov[3];
+
+      len = usable_body_payload_size;
+      state->publish_remaining -= len;
+      flags = 0 == state->publish_remaining ? AMQP_SF_NONE : AMQP_SF_MORE;
+
+      amqp_e8(AMQP_FRAME_BODY, amqp_offset(frame_header, 0));
+      amqp_e16(state->publish_channel, amqp_offset(frame_header, 1));
+      amqp_e32((uint32_t)len, amqp_offset(frame_header, 3));
+
+      iov[0].iov_base = frame_header;
+      iov[0].iov_len = HEADER_SIZE;
+      iov[1].iov_base = amqp_offset(chunk.bytes, offset);
+      iov[1].iov_len = len;
+      iov[2].iov_base = (void *)&body_footer;
+      iov[2].iov_len = FOOTER_SIZE;
+      res = amqp_send_iov_inner(state, iov, 3, flags, amqp_time_infinite());
     } else {
-      f.payload.body_fragment.len = remaining;
-      flagz = AMQP_SF_NONE;
+      if (len > usable_body_payload_size - state->publish_frame_fill) {
+        len = usable_body_payload_size - state->publish_frame_fill;
+      }
+      memcpy(amqp_offset(state->publish_frame.bytes,
+                         HEADER_SIZE + state->publish_frame_fill),
+             amqp_offset(chunk.bytes, offset), len);
+      state->publish_frame_fill += len;
+      state->publish_remaining -= len;
+      flags = 0 == state->publish_remaining ? AMQP_SF_NONE : AMQP_SF_MORE;
+
+      res = AMQP_STATUS_OK;
+      if (state->publish_frame_fill == usable_body_payload_size ||
+          0 == state->publish_remaining) {
+        res = publish_stream_flush(state, flags);
+      }
+    }
+
+    /* Once queued, the rest of the message must be queued after it */
+    if (res < 0 && AMQP_STATUS_WOULD_BLOCK != res) {
+      state->publish_active = 0;
+      return res;
     }
+    would_block = would_block || AMQP_STATUS_WOULD_BLOCK == res;
+    offset += len;
+  }
 
-    body_offset += f.payload.body_fragment.len;
-    res = amqp_send_frame_inner(state, &f, flagz, amqp_time_infinite());
+  return would_block ? AMQP_STATUS_WOULD_BLOCK : AMQP_STATUS_OK;
+}
+
+int amqp_basic_publish_end(amqp_connection_state_t state) {
+  if (!state->publish_active) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  state->publish_active = 0;
+
+  if (0 != state->publish_remaining) {
+    /* As with amqp_basic_publish_fd(), the broker has been promised more of
+     * the body than there is to send */
+    amqp_socket_close(state->socket, AMQP_SC_FORCE);
+    return AMQP_STATUS_CONNECTION_CLOSED;
+  }
+  return AMQP_STATUS_OK;
+}
+
+/* Properties that may be given per message when publishing with a template.
+ * They all come after the headers table on the wire and are cheap to
+ * encode. */
+#define AMQP_PUBLISH_TEMPLATE_OVERRIDABLE                              \
+  (AMQP_BASIC_DELIVERY_MODE_FLAG | AMQP_BASIC_PRIORITY_FLAG |          \
+   AMQP_BASIC_CORRELATION_ID_FLAG | AMQP_BASIC_REPLY_TO_FLAG |         \
+   AMQP_BASIC_EXPIRATION_FLAG | AMQP_BASIC_MESSAGE_ID_FLAG |           \
+   AMQP_BASIC_TIMESTAMP_FLAG | AMQP_BASIC_TYPE_FLAG |                  \
+   AMQP_BASIC_USER_ID_FLAG | AMQP_BASIC_APP_ID_FLAG |                  \
+   AMQP_BASIC_CLUSTER_ID_FLAG)
+
+/*
+ * A template holds the basic.publish method frame and the start of the
+ * content header frame, encoded for channel 0 and a body size of 0.
+ *
+ * Properties are encoded in flag order, so the header is split at the first
+ * overridable property: the prefix before it is copied as is, and the tail
+ * from it onwards is encoded for each message from tail_properties with the
+ * message's overrides applied. The flags word in the prefix already includes
+ * every tail property.
+ */
+struct amqp_publish_template_t_ {
+  amqp_bytes_t method_frame;
+  amqp_bytes_t header_prefix;
+  amqp_flags_t overrides;
+  amqp_flags_t tail_flags;
+  amqp_basic_properties_t tail_properties;
+  amqp_pool_t pool;
+};
+
+/* Offset of the property flags in a content header frame: class id, weight
+ * and body size come first */
+#define AMQP_HEADER_FRAME_FLAGS_OFFSET (HEADER_SIZE + 12)
+
+static int amqp_publish_template_copy_bytes(amqp_pool_t *pool,
+                                            amqp_bytes_t *bytes) {
+  amqp_bytes_t copy;
+  if (0 == bytes->len) {
+    *bytes = amqp_empty_bytes;
+    return AMQP_STATUS_OK;
+  }
+  amqp_pool_alloc_bytes(pool, bytes->len, &copy);
+  if (NULL == copy.bytes) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  memcpy(copy.bytes, bytes->bytes, bytes->len);
+  *bytes = copy;
+  return AMQP_STATUS_OK;
+}
+
+/* Copies the properties listed in flags from src to dest. */
+static void amqp_publish_template_copy_tail(amqp_basic_properties_t *dest,
+                                            amqp_basic_properties_t const *src,
+                                            amqp_flags_t flags) {
+  if (flags & AMQP_BASIC_DELIVERY_MODE_FLAG) {
+    dest->delivery_mode = src->delivery_mode;
+  }
+  if (flags & AMQP_BASIC_PRIORITY_FLAG) {
+    dest->priority = src->priority;
+  }
+  if (flags & AMQP_BASIC_CORRELATION_ID_FLAG) {
+    dest->correlation_id = src->correlation_id;
+  }
+  if (flags & AMQP_BASIC_REPLY_TO_FLAG) {
+    dest->reply_to = src->reply_to;
+  }
+  if (flags & AMQP_BASIC_EXPIRATION_FLAG) {
+    dest->expiration = src->expiration;
+  }
+  if (flags & AMQP_BASIC_MESSAGE_ID_FLAG) {
+    dest->message_id = src->message_id;
+  }
+  if (flags & AMQP_BASIC_TIMESTAMP_FLAG) {
+    dest->timestamp = src->timestamp;
+  }
+  if (flags & AMQP_BASIC_TYPE_FLAG) {
+    dest->type = src->type;
+  }
+  if (flags & AMQP_BASIC_USER_ID_FLAG) {
+    dest->user_id = src->user_id;
+  }
+  if (flags & AMQP_BASIC_APP_ID_FLAG) {
+    dest->app_id = src->app_id;
+  }
+  if (flags & AMQP_BASIC_CLUSTER_ID_FLAG) {
+    dest->cluster_id = src->cluster_id;
+  }
+}
+
+int amqp_publish_template_new(amqp_bytes_t exchange, amqp_bytes_t routing_key,
+                              amqp_boolean_t mandatory,
+                              amqp_boolean_t immediate,
+                              amqp_basic_properties_t const *properties,
+                              amqp_flags_t overrides,
+                              amqp_publish_template_t **tmpl) {
+  amqp_publish_template_t *t;
+  amqp_basic_publish_t m;
+  amqp_basic_properties_t prefix_properties;
+  amqp_flags_t flags;
+  amqp_frame_t f;
+  amqp_bytes_t buffer;
+  amqp_bytes_t encoded;
+  size_t buffer_size;
+  int res;
+
+  *tmpl = NULL;
+  if (0 != (overrides & ~AMQP_PUBLISH_TEMPLATE_OVERRIDABLE)) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  t = calloc(1, sizeof(amqp_publish_template_t));
+  if (NULL == t) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  init_amqp_pool(&t->pool, 4096);
+
+  memset(&prefix_properties, 0, sizeof(prefix_properties));
+  if (properties != NULL) {
+    prefix_properties = *properties;
+  }
+
+  /* Properties are encoded from the highest flag bit down. Every property
+   * from the first overridable one on goes in the tail. */
+  flags = prefix_properties._flags | overrides;
+  t->overrides = overrides;
+  if (overrides != 0) {
+    amqp_flags_t first_override = AMQP_BASIC_CONTENT_TYPE_FLAG;
+    while (!(first_override & overrides)) {
+      first_override >>= 1;
+    }
+    t->tail_flags = flags & ((first_override << 1) - 1);
+  }
+  t->tail_properties._flags = t->tail_flags;
+  amqp_publish_template_copy_tail(&t->tail_properties, &prefix_properties,
+                                  t->tail_flags & prefix_properties._flags);
+  prefix_properties._flags = flags & ~t->tail_flags;
+
+  res = amqp_publish_template_copy_bytes(&t->pool,
+                                         &t->tail_properties.correlation_id);
+  if (AMQP_STATUS_OK == res) {
+    res = amqp_publish_template_copy_bytes(&t->pool,
+                                           &t->tail_properties.reply_to);
+  }
+  if (AMQP_STATUS_OK == res) {
+    res = amqp_publish_template_copy_bytes(&t->pool,
+                                           &t->tail_properties.expiration);
+  }
+  if (AMQP_STATUS_OK == res) {
+    res = amqp_publish_template_copy_bytes(&t->pool,
+                                           &t->tail_properties.message_id);
+  }
+  if (AMQP_STATUS_OK == res) {
+    res = amqp_publish_template_copy_bytes(&t->pool, &t->tail_properties.type);
+  }
+  if (AMQP_STATUS_OK == res) {
+    res = amqp_publish_template_copy_bytes(&t->pool,
+                                           &t->tail_properties.user_id);
+  }
+  if (AMQP_STATUS_OK == res) {
+    res =
+        amqp_publish_template_copy_bytes(&t->pool, &t->tail_properties.app_id);
+  }
+  if (AMQP_STATUS_OK == res) {
+    res = amqp_publish_template_copy_bytes(&t->pool,
+                                           &t->tail_properties.cluster_id);
+  }
+  if (AMQP_STATUS_OK != res) {
+    goto error;
+  }
+
+  m.exchange = exchange;
+  m.routing_key = routing_key;
+  m.mandatory = mandatory;
+  m.immediate = immediate;
+  m.ticket = 0;
+
+  f.frame_type = AMQP_FRAME_METHOD;
+  f.channel = 0;
+  f.payload.method.id = AMQP_BASIC_PUBLISH_METHOD;
+  f.payload.method.decoded = &m;
+
+  amqp_pool_alloc_bytes(&t->pool, AMQP_BASIC_PUBLISH_FRAME_MAX, &buffer);
+  if (NULL == buffer.bytes) {
+    res = AMQP_STATUS_NO_MEMORY;
+    goto error;
+  }
+  res = amqp_frame_to_bytes(&f, buffer, &t->method_frame);
+  if (AMQP_STATUS_OK != res) {
+    goto error;
+  }
+
+  f.frame_type = AMQP_FRAME_HEADER;
+  f.payload.properties.class_id = AMQP_BASIC_CLASS;
+  f.payload.properties.body_size = 0;
+  f.payload.properties.decoded = &prefix_properties;
+
+  /* The headers table may be arbitrarily large */
+  buffer_size = AMQP_DEFAULT_FRAME_SIZE;
+  for (;;) {
+    buffer.bytes = malloc(buffer_size);
+    buffer.len = buffer_size;
+    if (NULL == buffer.bytes) {
+      res = AMQP_STATUS_NO_MEMORY;
+      goto error;
+    }
+    res = amqp_frame_to_bytes(&f, buffer, &encoded);
+    if (AMQP_STATUS_TABLE_TOO_BIG != res || buffer_size > INT32_MAX / 2) {
+      break;
+    }
+    free(buffer.bytes);
+    buffer_size *= 2;
+  }
+  if (AMQP_STATUS_OK == res) {
+    /* Drop the footer, the tail follows the prefix */
+    encoded.len -= FOOTER_SIZE;
+    amqp_e16((uint16_t)flags,
+             amqp_offset(encoded.bytes, AMQP_HEADER_FRAME_FLAGS_OFFSET));
+    res = amqp_publish_template_copy_bytes(&t->pool, &encoded);
+    t->header_prefix = encoded;
+  }
+  free(buffer.bytes);
+  if (AMQP_STATUS_OK != res) {
+    goto error;
+  }
+
+  *tmpl = t;
+  return AMQP_STATUS_OK;
+
+error:
+  amqp_publish_template_free(t);
+  return res;
+}
+
+void amqp_publish_template_free(amqp_publish_template_t *tmpl) {
+  if (tmpl != NULL) {
+    empty_amqp_pool(&tmpl->pool);
+    free(tmpl);
+  }
+}
+
+int amqp_basic_publish_template(amqp_connection_state_t state,
+                                amqp_channel_t channel,
+                                amqp_publish_template_t const *tmpl,
+                                amqp_basic_properties_t const *overrides,
+                                amqp_bytes_t body) {
+  uint8_t method_frame[AMQP_BASIC_PUBLISH_FRAME_MAX];
+  amqp_bytes_t method_encoded;
+  amqp_bytes_t header_encoded;
+  amqp_confirm_tracker_t *tracker;
+  size_t payload_len;
+  int res;
+
+  if ((size_t)state->frame_max < tmpl->method_frame.len ||
+      (size_t)state->frame_max < tmpl->header_prefix.len + FOOTER_SIZE) {
+    return AMQP_STATUS_TABLE_TOO_BIG;
+  }
+
+  res = amqp_publish_prepare(state, channel, &tracker);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  memcpy(method_frame, tmpl->method_frame.bytes, tmpl->method_frame.len);
+  amqp_e16(channel, amqp_offset(method_frame, 1));
+  method_encoded.bytes = method_frame;
+  method_encoded.len = tmpl->method_frame.len;
+
+  header_encoded.bytes = state->outbound_buffer.bytes;
+  memcpy(header_encoded.bytes, tmpl->header_prefix.bytes,
+         tmpl->header_prefix.len);
+  amqp_e16(channel, amqp_offset(header_encoded.bytes, 1));
+  amqp_e64(body.len, amqp_offset(header_encoded.bytes, HEADER_SIZE + 4));
+  payload_len = tmpl->header_prefix.len - HEADER_SIZE;
+
+  if (tmpl->tail_flags != 0) {
+    amqp_basic_properties_t tail = tmpl->tail_properties;
+    amqp_bytes_t tail_encoded;
+    uint8_t saved[2];
+
+    if (overrides != NULL) {
+      amqp_publish_template_copy_tail(&tail, overrides,
+                                      tmpl->overrides & overrides->_flags);
+    }
+
+    /* amqp_encode_properties() writes the tail's own flags word first: let it
+     * overwrite the last two bytes of the prefix, then put them back */
+    tail_encoded.bytes =
+        amqp_offset(header_encoded.bytes, tmpl->header_prefix.len - 2);
+    tail_encoded.len = state->frame_max - tmpl->header_prefix.len + 2 -
+                       FOOTER_SIZE;
+    memcpy(saved, tail_encoded.bytes, sizeof(saved));
+    res = amqp_encode_properties(AMQP_BASIC_CLASS, &tail, tail_encoded);
     if (res < 0) {
       return res;
     }
+    memcpy(tail_encoded.bytes, saved, sizeof(saved));
+    payload_len += res - 2;
+  }
+
+  amqp_e32((uint32_t)payload_len, amqp_offset(header_encoded.bytes, 3));
+  amqp_e8(AMQP_FRAME_END,
+          amqp_offset(header_encoded.bytes, HEADER_SIZE + payload_len));
+  header_encoded.len = HEADER_SIZE + payload_len + FOOTER_SIZE;
+
+  return amqp_publish_frames(state, channel, tracker, method_encoded,
+                             header_encoded, body);
+}
+
+/* Minimum size of the send buffer used by amqp_basic_publish_batch(). Frames
+ * are written out whenever the buffer fills up. */
+#define AMQP_PUBLISH_BATCH_BUFFER_SIZE 65536
+
+/* Body frames with payloads up to this size are copied into the send buffer,
+ * larger ones are written from the caller's buffer. */
+#define AMQP_PUBLISH_BATCH_COPY_MAX 2048
+
+struct amqp_publish_batch_t {
+  amqp_connection_state_t state;
+  /* Bytes used in state->send_buffer */
+  size_t len;
+  /* Start of the bytes in state->send_buffer not yet added to iov */
+  size_t segment;
+  struct iovec iov[AMQP_SOCKET_MAX_IOV];
+  int iovcnt;
+  /* Index of the message being encoded, and of the first message that has not
+   * been completely written */
+  size_t item;
+  size_t unsent_item;
+  /* Set once part of the batch has been queued by a non-blocking send */
+  int would_block;
+  /* Bodies encoded with the body codec that iov may still point into, freed
+   * once written */
+  amqp_bytes_t *encoded;
+  size_t encoded_count;
+  size_t encoded_capacity;
+};
+
+static void publish_batch_free_encoded(struct amqp_publish_batch_t *batch) {
+  while (batch->encoded_count > 0) {
+    amqp_bytes_free(batch->encoded[--batch->encoded_count]);
+  }
+}
+
+/* Makes room to keep one more encoded body until it has been written. */
+static int publish_batch_reserve_encoded(struct amqp_publish_batch_t *batch) {
+  size_t capacity;
+  amqp_bytes_t *encoded;
+
+  if (batch->encoded_count < batch->encoded_capacity) {
+    return AMQP_STATUS_OK;
+  }
+  capacity = 0 == batch->encoded_capacity ? 16 : batch->encoded_capacity * 2;
+  encoded = realloc(batch->encoded, capacity * sizeof(amqp_bytes_t));
+  if (NULL == encoded) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  batch->encoded = encoded;
+  batch->encoded_capacity = capacity;
+  return AMQP_STATUS_OK;
+}
+
+static void publish_batch_close_segment(struct amqp_publish_batch_t *batch) {
+  if (batch->len > batch->segment) {
+    batch->iov[batch->iovcnt].iov_base =
+        amqp_offset(batch->state->send_buffer.bytes, batch->segment);
+    batch->iov[batch->iovcnt].iov_len = batch->len - batch->segment;
+    batch->iovcnt++;
+    batch->segment = batch->len;
+  }
+}
+
+static int publish_batch_flush(struct amqp_publish_batch_t *batch, int flags) {
+  int res;
+
+  publish_batch_close_segment(batch);
+  if (0 == batch->iovcnt) {
+    publish_batch_free_encoded(batch);
+    return AMQP_STATUS_OK;
+  }
+
+  res = amqp_send_iov_unbuffered(batch->state, batch->iov, batch->iovcnt,
+                                 flags, amqp_time_infinite());
+  /* Written or queued, either way the encoded bodies are no longer needed */
+  publish_batch_free_encoded(batch);
+  if (AMQP_STATUS_WOULD_BLOCK == res) {
+    /* Queued, which is as good as written */
+    batch->would_block = 1;
+  } else if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  batch->len = 0;
+  batch->segment = 0;
+  batch->iovcnt = 0;
+  batch->unsent_item = batch->item;
+  return AMQP_STATUS_OK;
+}
+
+/* Makes room for len more bytes in the send buffer, writing out what has been
+ * encoded so far if needed. */
+static int publish_batch_reserve(struct amqp_publish_batch_t *batch,
+                                 size_t len) {
+  if (batch->len + len > batch->state->send_buffer.len) {
+    return publish_batch_flush(batch, AMQP_SF_MORE);
+  }
+  return AMQP_STATUS_OK;
+}
+
+/* Adds bytes owned by the caller to the output without copying them. */
+static int publish_batch_add_ref(struct amqp_publish_batch_t *batch,
+                                 amqp_bytes_t bytes) {
+  /* Keep a slot free for the segment that follows */
+  if (batch->iovcnt + 3 > AMQP_SOCKET_MAX_IOV) {
+    int res = publish_batch_flush(batch, AMQP_SF_MORE);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
   }
+  publish_batch_close_segment(batch);
+  batch->iov[batch->iovcnt].iov_base = bytes.bytes;
+  batch->iov[batch->iovcnt].iov_len = bytes.len;
+  batch->iovcnt++;
+  return AMQP_STATUS_OK;
+}
+
+/* Encodes frame at the end of the send buffer. The caller must have reserved
+ * enough room for it. */
+static int publish_batch_add_frame(struct amqp_publish_batch_t *batch,
+                                   const amqp_frame_t *frame) {
+  amqp_bytes_t buffer;
+  amqp_bytes_t encoded;
+  int res;
 
+  buffer.bytes = amqp_offset(batch->state->send_buffer.bytes, batch->len);
+  buffer.len = batch->state->send_buffer.len - batch->len;
+  if (buffer.len > (size_t)batch->state->frame_max) {
+    buffer.len = batch->state->frame_max;
+  }
+
+  res = amqp_frame_to_bytes(frame, buffer, &encoded);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+  batch->len += encoded.len;
   return AMQP_STATUS_OK;
 }
 
+static int publish_batch_add_body(struct amqp_publish_batch_t *batch,
+                                  amqp_channel_t channel, amqp_bytes_t body) {
+  size_t usable_body_payload_size =
+      batch->state->frame_max - (HEADER_SIZE + FOOTER_SIZE);
+  size_t body_offset = 0;
+  int res;
+
+  while (body_offset < body.len) {
+    amqp_bytes_t fragment;
+    void *frame;
+
+    fragment.bytes = amqp_offset(body.bytes, body_offset);
+    fragment.len = body.len - body_offset;
+    if (fragment.len > usable_body_payload_size) {
+      fragment.len = usable_body_payload_size;
+    }
+    body_offset += fragment.len;
+
+    if (fragment.len <= AMQP_PUBLISH_BATCH_COPY_MAX) {
+      res = publish_batch_reserve(batch,
+                                  HEADER_SIZE + fragment.len + FOOTER_SIZE);
+    } else {
+      res = publish_batch_reserve(batch, HEADER_SIZE);
+    }
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+
+    frame = amqp_offset(batch->state->send_buffer.bytes, batch->len);
+    amqp_e8(AMQP_FRAME_BODY, amqp_offset(frame, 0));
+    amqp_e16(channel, amqp_offset(frame, 1));
+    amqp_e32((uint32_t)fragment.len, amqp_offset(frame, 3));
+    batch->len += HEADER_SIZE;
+
+    if (fragment.len <= AMQP_PUBLISH_BATCH_COPY_MAX) {
+      memcpy(amqp_offset(frame, HEADER_SIZE), fragment.bytes, fragment.len);
+      batch->len += fragment.len;
+    } else {
+      res = publish_batch_add_ref(batch, fragment);
+      if (AMQP_STATUS_OK != res) {
+        return res;
+      }
+      res = publish_batch_reserve(batch, FOOTER_SIZE);
+      if (AMQP_STATUS_OK != res) {
+        return res;
+      }
+    }
+
+    amqp_e8(AMQP_FRAME_END,
+            amqp_offset(batch->state->send_buffer.bytes, batch->len));
+    batch->len += FOOTER_SIZE;
+  }
+  return AMQP_STATUS_OK;
+}
+
+int amqp_basic_publish_batch(amqp_connection_state_t state,
+                             amqp_channel_t channel,
+                             amqp_publish_item_t const *items, size_t count,
+                             int *statuses) {
+  struct amqp_publish_batch_t batch;
+  amqp_confirm_tracker_t *tracker;
+  size_t buffer_size;
+  amqp_basic_properties_t default_properties;
+  int first_error = AMQP_STATUS_OK;
+  size_t first_error_item = 0;
+  int res;
+
+  memset(&batch, 0, sizeof(batch));
+  batch.state = state;
+
+  res = amqp_publish_check_heartbeat(state);
+  if (AMQP_STATUS_OK != res) {
+    goto error;
+  }
+
+  res = amqp_flow_wait_for_publish(state, channel);
+  if (AMQP_STATUS_OK != res) {
+    goto error;
+  }
+
+  /* The batch is encoded into the same buffer write coalescing uses */
+  res = amqp_flush(state);
+  if (AMQP_STATUS_WOULD_BLOCK == res) {
+    batch.would_block = 1;
+  } else if (AMQP_STATUS_OK != res) {
+    goto error;
+  }
+
+  /* The buffer must always fit a message's method and header frames */
+  buffer_size = state->frame_max + AMQP_BASIC_PUBLISH_FRAME_MAX;
+  if (buffer_size < AMQP_PUBLISH_BATCH_BUFFER_SIZE) {
+    buffer_size = AMQP_PUBLISH_BATCH_BUFFER_SIZE;
+  }
+  if (state->send_buffer.len < buffer_size) {
+    void *newbuf = realloc(state->send_buffer.bytes, buffer_size);
+    if (NULL == newbuf) {
+      res = AMQP_STATUS_NO_MEMORY;
+      goto error;
+    }
+    state->send_buffer.bytes = newbuf;
+    state->send_buffer.len = buffer_size;
+  }
+
+  memset(&default_properties, 0, sizeof(default_properties));
+  tracker = amqp_confirm_get_tracker(state, channel);
+
+  for (; batch.item < count; batch.item++) {
+    const amqp_publish_item_t *item = &items[batch.item];
+    amqp_basic_properties_t const *properties = item->properties;
+    amqp_basic_properties_t encoded_properties;
+    amqp_bytes_t body = item->body;
+    amqp_bytes_t body_encoded = amqp_empty_bytes;
+    amqp_basic_publish_t m;
+    amqp_frame_t f;
+    size_t item_start;
+
+    if (tracker != NULL && !amqp_confirm_has_room(tracker)) {
+      /* Let the broker see what has been encoded so far, it may be what the
+       * missing confirms are waiting on */
+      res = publish_batch_flush(&batch, AMQP_SF_NONE);
+      if (AMQP_STATUS_OK != res) {
+        goto error;
+      }
+      res = amqp_confirm_wait_for_room(state, tracker);
+      if (AMQP_STATUS_OK != res) {
+        goto error;
+      }
+    }
+
+    res = publish_batch_reserve(
+        &batch, AMQP_BASIC_PUBLISH_FRAME_MAX + state->frame_max);
+    if (AMQP_STATUS_OK != res) {
+      goto error;
+    }
+    item_start = batch.len;
+
+    m.exchange = item->exchange;
+    m.routing_key = item->routing_key;
+    m.mandatory = item->mandatory;
+    m.immediate = item->immediate;
+    m.ticket = 0;
+
+    f.frame_type = AMQP_FRAME_METHOD;
+    f.channel = channel;
+    f.payload.method.id = AMQP_BASIC_PUBLISH_METHOD;
+    f.payload.method.decoded = &m;
+
+    res = amqp_publish_apply_codec(state, &properties, &encoded_properties,
+                                   &body, &body_encoded);
+    if (AMQP_STATUS_OK == res && body_encoded.bytes != NULL) {
+      res = publish_batch_reserve_encoded(&batch);
+    }
+    if (AMQP_STATUS_OK == res) {
+      res = publish_batch_add_frame(&batch, &f);
+    }
+    if (AMQP_STATUS_OK == res) {
+      f.frame_type = AMQP_FRAME_HEADER;
+      f.payload.properties.class_id = AMQP_BASIC_CLASS;
+      f.payload.properties.body_size = body.len;
+      f.payload.properties.decoded =
+          (void *)(properties != NULL ? properties : &default_properties);
+
+      res = publish_batch_add_frame(&batch, &f);
+    }
+    if (AMQP_STATUS_OK != res) {
+      /* Nothing has been written since item_start: drop the message */
+      amqp_bytes_free(body_encoded);
+      batch.len = item_start;
+      if (statuses != NULL) {
+        statuses[batch.item] = res;
+      }
+      if (AMQP_STATUS_OK == first_error) {
+        first_error = res;
+        first_error_item = batch.item;
+      }
+      continue;
+    }
+
+    if (tracker != NULL) {
+      amqp_confirm_published(tracker);
+    }
+
+    /* Only kept once added, a flush while adding the body must not free it */
+    res = publish_batch_add_body(&batch, channel, body);
+    if (body_encoded.bytes != NULL) {
+      batch.encoded[batch.encoded_count++] = body_encoded;
+    }
+    if (AMQP_STATUS_OK != res) {
+      goto error;
+    }
+    if (statuses != NULL) {
+      statuses[batch.item] = AMQP_STATUS_OK;
+    }
+  }
+
+  res = publish_batch_flush(&batch, AMQP_SF_NONE);
+  if (AMQP_STATUS_OK != res) {
+    goto error;
+  }
+  free(batch.encoded);
+  if (AMQP_STATUS_OK == first_error && batch.would_block) {
+    return AMQP_STATUS_WOULD_BLOCK;
+  }
+  return first_error;
+
+error:
+  publish_batch_free_encoded(&batch);
+  free(batch.encoded);
+  /* Everything from the first message that was not completely written fails,
+   * except messages that already failed to encode */
+  if (statuses != NULL) {
+    size_t i;
+    for (i = batch.unsent_item; i < count; ++i) {
+      if (i >= batch.item || AMQP_STATUS_OK == statuses[i]) {
+        statuses[i] = res;
+      }
+    }
+  }
+  if (AMQP_STATUS_OK != first_error && first_error_item < batch.unsent_item) {
+    return first_error;
+  }
+  return res;
+}
+
 amqp_rpc_reply_t amqp_channel_close(amqp_connection_state_t state,
                                     amqp_channel_t channel, int code) {
   char codestr[13];
@@ -0,0 +1,140 @@
+// Copyright 2007 - 2021, Alan Antonuk and the rabbitmq-c contributors.
+// SPDX-License-Identifier: mit
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+#include "rabbitmq-c/amqp.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Channel lifetime.
+ *
+ * A channel is in use from when amqp_allocate_channel() returns it or
+ * channel.open is sent on it until channel.close-ok is sent or received on
+ * it. The channels in use are a bitmap, grown to cover the highest channel
+ * number used. amqp_allocate_channel() returns the lowest channel not in use,
+ * so a connection opening and closing short lived channels keeps reusing the
+ * same few numbers, and their pools the same blocks of the pool table.
+ * channel_id_hint is the lowest word that may have a clear bit, so allocating
+ * does not rescan the full words in front of it.
+ *
+ * Once closed, the channel's pool is freed along with its pool table entry
+ * the next time its buffers are released, as anything read on the channel
+ * stays valid until then. Its confirm tracker, flow state and consumers are
+ * dropped at once, whichever side closed it, so a reopened channel starts
+ * afresh.
+ */
+
+#define CHANNEL_ID_WORD_BITS 64
+
+/* The channel bits of word i, with channel 0 always taken */
+static uint64_t channel_id_word(amqp_connection_state_t state, size_t i) {
+  return state->channel_ids[i] | (0 == i ? 1 : 0);
+}
+
+static int channel_ids_grow(amqp_connection_state_t state,
+                            amqp_channel_t channel) {
+  size_t words = (size_t)channel / CHANNEL_ID_WORD_BITS + 1;
+  uint64_t *ids;
+
+  if (words <= state->channel_id_words) {
+    return AMQP_STATUS_OK;
+  }
+  ids = realloc(state->channel_ids, words * sizeof(uint64_t));
+  if (NULL == ids) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  memset(ids + state->channel_id_words, 0,
+         (words - state->channel_id_words) * sizeof(uint64_t));
+  state->channel_ids = ids;
+  state->channel_id_words = words;
+  return AMQP_STATUS_OK;
+}
+
+static int channel_id_take(amqp_connection_state_t state,
+                           amqp_channel_t channel) {
+  int res = channel_ids_grow(state, channel);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+  state->channel_ids[channel / CHANNEL_ID_WORD_BITS] |=
+      (uint64_t)1 << (channel % CHANNEL_ID_WORD_BITS);
+  return AMQP_STATUS_OK;
+}
+
+int amqp_allocate_channel(amqp_connection_state_t state,
+                          amqp_channel_t *channel) {
+  int channel_max = 0 == state->channel_max ? UINT16_MAX : state->channel_max;
+  size_t i = state->channel_id_hint;
+  uint64_t free_bits;
+  size_t next;
+  int res;
+
+  while (i < state->channel_id_words &&
+         UINT64_MAX == channel_id_word(state, i)) {
+    ++i;
+  }
+  state->channel_id_hint = i;
+
+  if (i < state->channel_id_words) {
+    free_bits = ~channel_id_word(state, i);
+  } else {
+    free_bits = 0 == i ? ~(uint64_t)1 : ~(uint64_t)0;
+  }
+  next = i * CHANNEL_ID_WORD_BITS;
+  while (0 == (free_bits & 1)) {
+    free_bits >>= 1;
+    ++next;
+  }
+
+  if (next > (size_t)channel_max) {
+    return AMQP_STATUS_NO_FREE_CHANNEL;
+  }
+  res = channel_id_take(state, (amqp_channel_t)next);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+  *channel = (amqp_channel_t)next;
+  return AMQP_STATUS_OK;
+}
+
+void amqp_release_channel(amqp_connection_state_t state,
+                          amqp_channel_t channel) {
+  size_t i = channel / CHANNEL_ID_WORD_BITS;
+  uint64_t bit = (uint64_t)1 << (channel % CHANNEL_ID_WORD_BITS);
+
+  if (i < state->channel_id_words) {
+    state->channel_ids[i] &= ~bit;
+    if (i < state->channel_id_hint) {
+      state->channel_id_hint = i;
+    }
+  }
+}
+
+int amqp_channel_opened(amqp_connection_state_t state,
+                        amqp_channel_t channel) {
+  amqp_pool_table_entry_t *entry = amqp_get_channel_pool_entry(state, channel);
+
+  if (NULL != entry) {
+    entry->closed = 0;
+  }
+  return channel_id_take(state, channel);
+}
+
+void amqp_channel_closed(amqp_connection_state_t state,
+                         amqp_channel_t channel) {
+  amqp_pool_table_entry_t *entry = amqp_get_channel_pool_entry(state, channel);
+
+  if (NULL != entry) {
+    entry->closed = 1;
+  }
+  amqp_release_channel(state, channel);
+  amqp_confirm_release(state, channel);
+  amqp_flow_release(state, channel);
+  amqp_dispatch_release(state, channel);
+}
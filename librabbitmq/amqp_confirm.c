@@ -0,0 +1,294 @@
+// Copyright 2007 - 2021, Alan Antonuk and the rabbitmq-c contributors.
+// SPDX-License-Identifier: mit
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+#include "amqp_time.h"
+#include "rabbitmq-c/amqp.h"
+#include "rabbitmq-c/framing.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Publisher confirm tracking.
+ *
+ * Messages in flight on a channel are those with sequence numbers in
+ * [first_unconfirmed, next_seqno). A basic.ack/basic.nack with multiple set
+ * moves first_unconfirmed past its delivery tag in one step. One without it
+ * either advances first_unconfirmed, or marks the tag in the confirmed bitmap
+ * so first_unconfirmed can skip over it later. A tag's bit is cleared when
+ * the tag is assigned, so bits left behind by a multiple confirm never need
+ * clearing.
+ *
+ * The window counts confirms waiting to be polled as well as messages in
+ * flight, which bounds the number of queued confirms by max_in_flight.
+ */
+
+static int confirm_bit_is_set(amqp_confirm_tracker_t *tracker,
+                              uint64_t seqno) {
+  uint64_t index = seqno & tracker->window_mask;
+  return (tracker->confirmed[index / 64] >> (index % 64)) & 1;
+}
+
+static void confirm_bit_set(amqp_confirm_tracker_t *tracker, uint64_t seqno) {
+  uint64_t index = seqno & tracker->window_mask;
+  tracker->confirmed[index / 64] |= (uint64_t)1 << (index % 64);
+}
+
+static void confirm_bit_clear(amqp_confirm_tracker_t *tracker,
+                              uint64_t seqno) {
+  uint64_t index = seqno & tracker->window_mask;
+  tracker->confirmed[index / 64] &= ~((uint64_t)1 << (index % 64));
+}
+
+static void confirm_tracker_free(amqp_confirm_tracker_t *tracker) {
+  if (tracker != NULL) {
+    free(tracker->confirmed);
+    free(tracker->events);
+    free(tracker);
+  }
+}
+
+static amqp_confirm_tracker_t *confirm_tracker_new(amqp_channel_t channel,
+                                                   size_t max_in_flight) {
+  amqp_confirm_tracker_t *tracker;
+  uint64_t window = 64;
+
+  while (window < max_in_flight) {
+    window *= 2;
+  }
+
+  tracker = calloc(1, sizeof(amqp_confirm_tracker_t));
+  if (NULL == tracker) {
+    return NULL;
+  }
+  tracker->channel = channel;
+  tracker->next_seqno = 1;
+  tracker->first_unconfirmed = 1;
+  tracker->max_in_flight = max_in_flight;
+  tracker->window_mask = window - 1;
+  tracker->confirmed = calloc((size_t)(window / 64), sizeof(uint64_t));
+  tracker->events = calloc(max_in_flight, sizeof(amqp_confirm_t));
+  if (NULL == tracker->confirmed || NULL == tracker->events) {
+    confirm_tracker_free(tracker);
+    return NULL;
+  }
+  return tracker;
+}
+
+int amqp_confirm_has_room(amqp_confirm_tracker_t *tracker) {
+  return tracker->next_seqno - tracker->first_unconfirmed +
+             tracker->events_count <
+         tracker->max_in_flight;
+}
+
+amqp_confirm_tracker_t *amqp_confirm_get_tracker(amqp_connection_state_t state,
+                                                 amqp_channel_t channel) {
+  amqp_confirm_tracker_t *tracker;
+  for (tracker = state->confirm_trackers; tracker != NULL;
+       tracker = tracker->next) {
+    if (tracker->channel == channel) {
+      return tracker;
+    }
+  }
+  return NULL;
+}
+
+int amqp_confirm_handle_frame(amqp_connection_state_t state,
+                              const amqp_frame_t *frame) {
+  amqp_confirm_tracker_t *tracker;
+  amqp_confirm_t confirm;
+
+  if (AMQP_FRAME_METHOD != frame->frame_type ||
+      (AMQP_BASIC_ACK_METHOD != frame->payload.method.id &&
+       AMQP_BASIC_NACK_METHOD != frame->payload.method.id)) {
+    return 0;
+  }
+  tracker = amqp_confirm_get_tracker(state, frame->channel);
+  if (NULL == tracker) {
+    return 0;
+  }
+
+  confirm.channel = frame->channel;
+  if (AMQP_BASIC_ACK_METHOD == frame->payload.method.id) {
+    amqp_basic_ack_t *m = frame->payload.method.decoded;
+    confirm.delivery_tag = m->delivery_tag;
+    confirm.multiple = m->multiple;
+    confirm.nack = 0;
+  } else {
+    amqp_basic_nack_t *m = frame->payload.method.decoded;
+    confirm.delivery_tag = m->delivery_tag;
+    confirm.multiple = m->multiple;
+    confirm.nack = 1;
+  }
+
+  /* Ignore confirms for messages that were never published or that have
+   * already been confirmed */
+  if (confirm.delivery_tag < tracker->first_unconfirmed ||
+      confirm.delivery_tag >= tracker->next_seqno ||
+      (!confirm.multiple &&
+       confirm_bit_is_set(tracker, confirm.delivery_tag))) {
+    return 1;
+  }
+
+  if (confirm.multiple) {
+    tracker->first_unconfirmed = confirm.delivery_tag + 1;
+  } else if (confirm.delivery_tag == tracker->first_unconfirmed) {
+    tracker->first_unconfirmed++;
+  } else {
+    confirm_bit_set(tracker, confirm.delivery_tag);
+  }
+  while (tracker->first_unconfirmed < tracker->next_seqno &&
+         confirm_bit_is_set(tracker, tracker->first_unconfirmed)) {
+    tracker->first_unconfirmed++;
+  }
+
+  if (tracker->callback != NULL) {
+    tracker->callback(state, &confirm, tracker->user_data);
+  } else {
+    size_t tail = (tracker->events_head + tracker->events_count) %
+                  tracker->max_in_flight;
+    tracker->events[tail] = confirm;
+    tracker->events_count++;
+  }
+  return 1;
+}
+
+int amqp_confirm_wait_for_room(amqp_connection_state_t state,
+                               amqp_confirm_tracker_t *tracker) {
+  amqp_time_t deadline;
+  int res;
+
+  if (amqp_confirm_has_room(tracker)) {
+    return AMQP_STATUS_OK;
+  }
+
+  res = amqp_time_from_now(&deadline, state->rpc_timeout);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  while (!amqp_confirm_has_room(tracker)) {
+    res = amqp_wait_control_frame(state, deadline);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+  return AMQP_STATUS_OK;
+}
+
+void amqp_confirm_published(amqp_confirm_tracker_t *tracker) {
+  confirm_bit_clear(tracker, tracker->next_seqno);
+  tracker->next_seqno++;
+}
+
+void amqp_confirm_release(amqp_connection_state_t state,
+                          amqp_channel_t channel) {
+  amqp_confirm_tracker_t **link = &state->confirm_trackers;
+
+  while (*link != NULL) {
+    if ((*link)->channel == channel) {
+      amqp_confirm_tracker_t *tracker = *link;
+      *link = tracker->next;
+      confirm_tracker_free(tracker);
+      return;
+    }
+    link = &(*link)->next;
+  }
+}
+
+void amqp_confirm_release_all(amqp_connection_state_t state) {
+  while (state->confirm_trackers != NULL) {
+    amqp_confirm_tracker_t *tracker = state->confirm_trackers;
+    state->confirm_trackers = tracker->next;
+    confirm_tracker_free(tracker);
+  }
+}
+
+amqp_rpc_reply_t amqp_confirm_enable(amqp_connection_state_t state,
+                                     amqp_channel_t channel,
+                                     size_t max_in_flight) {
+  amqp_confirm_tracker_t *tracker;
+
+  if (0 == max_in_flight || NULL != amqp_confirm_get_tracker(state, channel)) {
+    return amqp_rpc_reply_error(AMQP_STATUS_INVALID_PARAMETER);
+  }
+
+  tracker = confirm_tracker_new(channel, max_in_flight);
+  if (NULL == tracker) {
+    return amqp_rpc_reply_error(AMQP_STATUS_NO_MEMORY);
+  }
+
+  if (NULL == amqp_confirm_select(state, channel)) {
+    confirm_tracker_free(tracker);
+    return amqp_get_rpc_reply(state);
+  }
+
+  tracker->next = state->confirm_trackers;
+  state->confirm_trackers = tracker;
+
+  return amqp_get_rpc_reply(state);
+}
+
+int amqp_confirm_set_callback(amqp_connection_state_t state,
+                              amqp_channel_t channel,
+                              amqp_confirm_callback_t callback,
+                              void *user_data) {
+  amqp_confirm_tracker_t *tracker = amqp_confirm_get_tracker(state, channel);
+  if (NULL == tracker) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  tracker->callback = callback;
+  tracker->user_data = user_data;
+  return AMQP_STATUS_OK;
+}
+
+int amqp_confirm_poll(amqp_connection_state_t state, amqp_channel_t channel,
+                      amqp_confirm_t *confirm, const struct timeval *timeout) {
+  amqp_confirm_tracker_t *tracker;
+  amqp_time_t deadline;
+  int res;
+
+  tracker = amqp_confirm_get_tracker(state, channel);
+  if (NULL == tracker) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  res = amqp_time_from_now(&deadline, timeout);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  while (0 == tracker->events_count) {
+    if (tracker->first_unconfirmed == tracker->next_seqno) {
+      return AMQP_STATUS_TIMEOUT;
+    }
+    res = amqp_wait_control_frame(state, deadline);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+    /* A callback may have been installed or the channel closed meanwhile */
+    tracker = amqp_confirm_get_tracker(state, channel);
+    if (NULL == tracker) {
+      return AMQP_STATUS_INVALID_PARAMETER;
+    }
+  }
+
+  *confirm = tracker->events[tracker->events_head];
+  tracker->events_head = (tracker->events_head + 1) % tracker->max_in_flight;
+  tracker->events_count--;
+  return AMQP_STATUS_OK;
+}
+
+uint64_t amqp_confirm_next_seqno(amqp_connection_state_t state,
+                                 amqp_channel_t channel) {
+  amqp_confirm_tracker_t *tracker = amqp_confirm_get_tracker(state, channel);
+  if (NULL == tracker) {
+    return 0;
+  }
+  return tracker->next_seqno;
+}
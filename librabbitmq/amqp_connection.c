@@ -26,6 +26,22 @@
 #define AMQP_INITIAL_INBOUND_SOCK_BUFFER_SIZE 131072
 #endif
 
+#ifndef AMQP_DEFAULT_INBOUND_SOCK_BUFFER_MIN_SIZE
+#define AMQP_DEFAULT_INBOUND_SOCK_BUFFER_MIN_SIZE 4096
+#endif
+
+#ifndef AMQP_DEFAULT_INBOUND_SOCK_BUFFER_MAX_SIZE
+#define AMQP_DEFAULT_INBOUND_SOCK_BUFFER_MAX_SIZE 1048576
+#endif
+
+/* Reads in a row using under a quarter of the socket buffer before it is
+ * shrunk */
+#define AMQP_INBOUND_SHRINK_READS 8
+
+#ifndef AMQP_INITIAL_UNSENT_BUFFER_SIZE
+#define AMQP_INITIAL_UNSENT_BUFFER_SIZE 16384
+#endif
+
 #ifndef AMQP_DEFAULT_LOGIN_TIMEOUT_SEC
 #define AMQP_DEFAULT_LOGIN_TIMEOUT_SEC 12
 #endif
@@ -69,8 +85,16 @@ amqp_connection_state_t amqp_new_connection(void) {
   if (state->sock_inbound_buffer.bytes == NULL) {
     goto out_nomem;
   }
+  state->sock_inbound_min_size = AMQP_DEFAULT_INBOUND_SOCK_BUFFER_MIN_SIZE;
+  state->sock_inbound_max_size = AMQP_DEFAULT_INBOUND_SOCK_BUFFER_MAX_SIZE;
+  state->sock_inbound_generation = 1;
 
   init_amqp_pool(&state->properties_pool, 512);
+  init_amqp_pool(&state->read_into_pool, 512);
+
+  state->max_decoded_body_size = AMQP_DEFAULT_MAX_DECODED_BODY_SIZE;
+
+  state->send_buffer_deadline = amqp_time_infinite();
 
   /* Use address of the internal_handshake_timeout object by default. */
   state->internal_handshake_timeout.tv_sec = AMQP_DEFAULT_LOGIN_TIMEOUT_SEC;
@@ -158,20 +182,36 @@ int amqp_destroy_connection(amqp_connection_state_t state) {
   int status = AMQP_STATUS_OK;
   if (state) {
     int i;
+    while (NULL != state->pool_entries) {
+      amqp_pool_table_entry_t *todelete = state->pool_entries;
+      empty_amqp_pool(&todelete->pool);
+      state->pool_entries = todelete->next;
+      free(todelete);
+    }
     for (i = 0; i < POOL_TABLE_SIZE; ++i) {
-      amqp_pool_table_entry_t *entry = state->pool_table[i];
-      while (NULL != entry) {
-        amqp_pool_table_entry_t *todelete = entry;
-        empty_amqp_pool(&entry->pool);
-        entry = entry->next;
-        free(todelete);
-      }
+      free(state->pool_table[i]);
     }
+    free(state->channel_ids);
 
     free(state->outbound_buffer.bytes);
+    free(state->send_buffer.bytes);
+    free(state->unsent_buffer.bytes);
+    free(state->publish_frame.bytes);
+    free(state->view_body.bytes);
+    amqp_confirm_release_all(state);
+    amqp_flow_release_all(state);
+    amqp_dispatch_release_all(state);
     free(state->sock_inbound_buffer.bytes);
+    free(state->spare_inbound_buffer.bytes);
+    while (NULL != state->retired_inbound_buffers) {
+      amqp_retired_buffer_t *retired = state->retired_inbound_buffers;
+      state->retired_inbound_buffers = retired->next;
+      free(retired->bytes.bytes);
+      free(retired);
+    }
     amqp_socket_delete(state->socket);
     empty_amqp_pool(&state->properties_pool);
+    empty_amqp_pool(&state->read_into_pool);
     free(state);
   }
   return status;
@@ -202,10 +242,117 @@ static size_t consume_data(amqp_connection_state_t state,
   return bytes_consumed;
 }
 
-int amqp_handle_input(amqp_connection_state_t state, amqp_bytes_t received_data,
-                      amqp_frame_t *decoded_frame) {
+/* Decodes the complete frame of frame_size bytes, header and footer
+ * included, at raw_frame. The decoded frame may point into raw_frame. */
+static int decode_frame(amqp_connection_state_t state, void *raw_frame,
+                        size_t frame_size, amqp_frame_t *decoded_frame) {
+  amqp_bytes_t encoded;
+  int res;
+  amqp_pool_t *channel_pool;
+
+  /* Check frame end marker (footer) */
+  if (amqp_d8(amqp_offset(raw_frame, frame_size - 1)) != AMQP_FRAME_END) {
+    return AMQP_STATUS_BAD_AMQP_DATA;
+  }
+
+  decoded_frame->frame_type = amqp_d8(amqp_offset(raw_frame, 0));
+  decoded_frame->channel = amqp_d16(amqp_offset(raw_frame, 1));
+
+  channel_pool = amqp_get_or_create_channel_pool(state, decoded_frame->channel);
+  if (NULL == channel_pool) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  switch (decoded_frame->frame_type) {
+    case AMQP_FRAME_METHOD:
+      decoded_frame->payload.method.id =
+          amqp_d32(amqp_offset(raw_frame, HEADER_SIZE));
+      encoded.bytes = amqp_offset(raw_frame, HEADER_SIZE + 4);
+      encoded.len = frame_size - HEADER_SIZE - 4 - FOOTER_SIZE;
+
+      res = amqp_decode_method(decoded_frame->payload.method.id, channel_pool,
+                               encoded, &decoded_frame->payload.method.decoded);
+      if (res < 0) {
+        return res;
+      }
+      if (AMQP_CHANNEL_CLOSE_OK_METHOD == decoded_frame->payload.method.id) {
+        amqp_channel_closed(state, decoded_frame->channel);
+      }
+
+      break;
+
+    case AMQP_FRAME_HEADER:
+      decoded_frame->payload.properties.class_id =
+          amqp_d16(amqp_offset(raw_frame, HEADER_SIZE));
+      /* unused 2-byte weight field goes here */
+      decoded_frame->payload.properties.body_size =
+          amqp_d64(amqp_offset(raw_frame, HEADER_SIZE + 4));
+      encoded.bytes = amqp_offset(raw_frame, HEADER_SIZE + 12);
+      encoded.len = frame_size - HEADER_SIZE - 12 - FOOTER_SIZE;
+      decoded_frame->payload.properties.raw = encoded;
+
+      if (state->lazy_properties &&
+          AMQP_BASIC_CLASS == decoded_frame->payload.properties.class_id) {
+        /* Decoded on demand by amqp_frame_properties() */
+        decoded_frame->payload.properties.decoded = NULL;
+        break;
+      }
+
+      res = amqp_decode_properties(decoded_frame->payload.properties.class_id,
+                                   channel_pool, encoded,
+                                   &decoded_frame->payload.properties.decoded);
+      if (res < 0) {
+        return res;
+      }
+
+      break;
+
+    case AMQP_FRAME_BODY:
+      decoded_frame->payload.body_fragment.len =
+          frame_size - HEADER_SIZE - FOOTER_SIZE;
+      decoded_frame->payload.body_fragment.bytes =
+          amqp_offset(raw_frame, HEADER_SIZE);
+      break;
+
+    case AMQP_FRAME_HEARTBEAT:
+      break;
+
+    default:
+      /* Ignore the frame */
+      decoded_frame->frame_type = 0;
+      break;
+  }
+  return AMQP_STATUS_OK;
+}
+
+/* Reads the size of the frame whose header is at raw_frame, header and footer
+ * included. */
+static int frame_size_from_header(amqp_connection_state_t state,
+                                  void *raw_frame, size_t *frame_size) {
+  /* frame length is 3 bytes in */
+  uint32_t payload_size = amqp_d32(amqp_offset(raw_frame, 3));
+
+  /* To prevent the frame_size calculation below from overflowing, check that
+   * the stated payload size is smaller than a signed 32-bit. Given the
+   * library only allows configuring frame_max as an int32_t, and
+   * payload_size is uint32_t, the math below is safe from overflow. */
+  if (payload_size >= INT32_MAX) {
+    return AMQP_STATUS_BAD_AMQP_DATA;
+  }
+
+  *frame_size = payload_size + HEADER_SIZE + FOOTER_SIZE;
+  if ((size_t)state->frame_max < *frame_size) {
+    return AMQP_STATUS_BAD_AMQP_DATA;
+  }
+  return AMQP_STATUS_OK;
+}
+
+static int handle_input(amqp_connection_state_t state,
+                        amqp_bytes_t received_data,
+                        amqp_frame_t *decoded_frame, amqp_boolean_t *in_place) {
   size_t bytes_consumed;
   void *raw_frame;
+  int res;
 
   /* Returning frame_type of zero indicates either insufficient input,
      or a complete, ignored frame was read. */
@@ -215,6 +362,26 @@ int amqp_handle_input(amqp_connection_state_t state, amqp_bytes_t received_data,
     return AMQP_STATUS_OK;
   }
 
+  if (in_place != NULL && state->state == CONNECTION_STATE_IDLE &&
+      received_data.len >= HEADER_SIZE) {
+    size_t frame_size;
+
+    res = frame_size_from_header(state, received_data.bytes, &frame_size);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+    if (frame_size <= received_data.len) {
+      /* The whole frame is there, no need to copy it out */
+      res = decode_frame(state, received_data.bytes, frame_size,
+                         decoded_frame);
+      if (AMQP_STATUS_OK != res) {
+        return res;
+      }
+      *in_place = 1;
+      return (int)frame_size;
+    }
+  }
+
   if (state->state == CONNECTION_STATE_IDLE) {
     state->state = CONNECTION_STATE_HEADER;
   }
@@ -255,23 +422,12 @@ int amqp_handle_input(amqp_connection_state_t state, amqp_bytes_t received_data,
     case CONNECTION_STATE_HEADER: {
       amqp_channel_t channel;
       amqp_pool_t *channel_pool;
-      uint32_t frame_size;
 
       channel = amqp_d16(amqp_offset(raw_frame, 1));
 
-      /* frame length is 3 bytes in */
-      frame_size = amqp_d32(amqp_offset(raw_frame, 3));
-      /* To prevent the target_size calculation below from overflowing, check
-       * that the stated frame_size is smaller than a signed 32-bit. Given
-       * the library only allows configuring frame_max as an int32_t, and
-       * frame_size is uint32_t, the math below is safe from overflow. */
-      if (frame_size >= INT32_MAX) {
-        return AMQP_STATUS_BAD_AMQP_DATA;
-      }
-
-      state->target_size = frame_size + HEADER_SIZE + FOOTER_SIZE;
-      if ((size_t)state->frame_max < state->target_size) {
-        return AMQP_STATUS_BAD_AMQP_DATA;
+      res = frame_size_from_header(state, raw_frame, &state->target_size);
+      if (AMQP_STATUS_OK != res) {
+        return res;
       }
 
       channel_pool = amqp_get_or_create_channel_pool(state, channel);
@@ -284,7 +440,10 @@ int amqp_handle_input(amqp_connection_state_t state, amqp_bytes_t received_data,
       if (NULL == state->inbound_buffer.bytes) {
         return AMQP_STATUS_NO_MEMORY;
       }
-      memcpy(state->inbound_buffer.bytes, state->header_buffer, HEADER_SIZE);
+      /* In the initial state a byte more than the header was read, in case it
+       * was a protocol header */
+      memcpy(state->inbound_buffer.bytes, state->header_buffer,
+             state->inbound_offset);
       raw_frame = state->inbound_buffer.bytes;
 
       state->state = CONNECTION_STATE_BODY;
@@ -299,80 +458,14 @@ int amqp_handle_input(amqp_connection_state_t state, amqp_bytes_t received_data,
     }
       /* fall through to process body */
 
-    case CONNECTION_STATE_BODY: {
-      amqp_bytes_t encoded;
-      int res;
-      amqp_pool_t *channel_pool;
-
-      /* Check frame end marker (footer) */
-      if (amqp_d8(amqp_offset(raw_frame, state->target_size - 1)) !=
-          AMQP_FRAME_END) {
-        return AMQP_STATUS_BAD_AMQP_DATA;
-      }
-
-      decoded_frame->frame_type = amqp_d8(amqp_offset(raw_frame, 0));
-      decoded_frame->channel = amqp_d16(amqp_offset(raw_frame, 1));
-
-      channel_pool =
-          amqp_get_or_create_channel_pool(state, decoded_frame->channel);
-      if (NULL == channel_pool) {
-        return AMQP_STATUS_NO_MEMORY;
-      }
-
-      switch (decoded_frame->frame_type) {
-        case AMQP_FRAME_METHOD:
-          decoded_frame->payload.method.id =
-              amqp_d32(amqp_offset(raw_frame, HEADER_SIZE));
-          encoded.bytes = amqp_offset(raw_frame, HEADER_SIZE + 4);
-          encoded.len = state->target_size - HEADER_SIZE - 4 - FOOTER_SIZE;
-
-          res = amqp_decode_method(decoded_frame->payload.method.id,
-                                   channel_pool, encoded,
-                                   &decoded_frame->payload.method.decoded);
-          if (res < 0) {
-            return res;
-          }
-
-          break;
-
-        case AMQP_FRAME_HEADER:
-          decoded_frame->payload.properties.class_id =
-              amqp_d16(amqp_offset(raw_frame, HEADER_SIZE));
-          /* unused 2-byte weight field goes here */
-          decoded_frame->payload.properties.body_size =
-              amqp_d64(amqp_offset(raw_frame, HEADER_SIZE + 4));
-          encoded.bytes = amqp_offset(raw_frame, HEADER_SIZE + 12);
-          encoded.len = state->target_size - HEADER_SIZE - 12 - FOOTER_SIZE;
-          decoded_frame->payload.properties.raw = encoded;
-
-          res = amqp_decode_properties(
-              decoded_frame->payload.properties.class_id, channel_pool, encoded,
-              &decoded_frame->payload.properties.decoded);
-          if (res < 0) {
-            return res;
-          }
-
-          break;
-
-        case AMQP_FRAME_BODY:
-          decoded_frame->payload.body_fragment.len =
-              state->target_size - HEADER_SIZE - FOOTER_SIZE;
-          decoded_frame->payload.body_fragment.bytes =
-              amqp_offset(raw_frame, HEADER_SIZE);
-          break;
-
-        case AMQP_FRAME_HEARTBEAT:
-          break;
-
-        default:
-          /* Ignore the frame */
-          decoded_frame->frame_type = 0;
-          break;
+    case CONNECTION_STATE_BODY:
+      res = decode_frame(state, raw_frame, state->target_size, decoded_frame);
+      if (AMQP_STATUS_OK != res) {
+        return res;
       }
 
       return_to_idle(state);
       return (int)bytes_consumed;
-    }
 
     default:
       amqp_abort("Internal error: invalid amqp_connection_state_t->state %d",
@@ -380,21 +473,88 @@ int amqp_handle_input(amqp_connection_state_t state, amqp_bytes_t received_data,
   }
 }
 
+int amqp_handle_input(amqp_connection_state_t state, amqp_bytes_t received_data,
+                      amqp_frame_t *decoded_frame) {
+  return handle_input(state, received_data, decoded_frame, NULL);
+}
+
+int amqp_handle_input_in_place(amqp_connection_state_t state,
+                               amqp_bytes_t received_data,
+                               amqp_frame_t *decoded_frame,
+                               amqp_boolean_t *in_place) {
+  *in_place = 0;
+  return handle_input(state, received_data, decoded_frame, in_place);
+}
+
 amqp_boolean_t amqp_release_buffers_ok(amqp_connection_state_t state) {
   return (state->state == CONNECTION_STATE_IDLE);
 }
 
-void amqp_release_buffers(amqp_connection_state_t state) {
-  int i;
-  ENFORCE_STATE(state, CONNECTION_STATE_IDLE);
+/* Frees the retired socket buffers no channel pool references any more. */
+static void release_inbound_buffers(amqp_connection_state_t state) {
+  uint64_t oldest = state->sock_inbound_generation + 1;
+  amqp_pool_table_entry_t *entry;
+  amqp_retired_buffer_t **link;
 
-  for (i = 0; i < POOL_TABLE_SIZE; ++i) {
-    amqp_pool_table_entry_t *entry = state->pool_table[i];
+  if (!state->sock_inbound_referenced &&
+      NULL == state->retired_inbound_buffers) {
+    return;
+  }
+
+  for (entry = state->pool_entries; NULL != entry; entry = entry->next) {
+    if (entry->inbound_generation != 0 && entry->inbound_generation < oldest) {
+      oldest = entry->inbound_generation;
+    }
+  }
 
-    for (; NULL != entry; entry = entry->next) {
-      amqp_maybe_release_buffers_on_channel(state, entry->channel);
+  link = &state->retired_inbound_buffers;
+  while (NULL != *link) {
+    amqp_retired_buffer_t *retired = *link;
+    if (retired->generation < oldest) {
+      *link = retired->next;
+      if (NULL == state->spare_inbound_buffer.bytes &&
+          retired->bytes.len == state->sock_inbound_buffer.len) {
+        state->spare_inbound_buffer = retired->bytes;
+      } else {
+        free(retired->bytes.bytes);
+      }
+      free(retired);
+    } else {
+      link = &retired->next;
     }
   }
+
+  if (oldest > state->sock_inbound_generation) {
+    state->sock_inbound_referenced = 0;
+  }
+}
+
+/* Recycles the channel's pool unless frames for it are queued. The pool of a
+ * closed channel is freed instead, along with its entry. */
+static void release_channel_buffers(amqp_connection_state_t state,
+                                    amqp_pool_table_entry_t *entry) {
+  if (NULL != entry->first_queued_frame) {
+    return;
+  }
+
+  if (entry->closed) {
+    amqp_free_channel_pool_entry(state, entry);
+    return;
+  }
+  recycle_amqp_pool(&entry->pool);
+  entry->inbound_generation = 0;
+}
+
+void amqp_release_buffers(amqp_connection_state_t state) {
+  amqp_pool_table_entry_t *entry;
+  amqp_pool_table_entry_t *next;
+  ENFORCE_STATE(state, CONNECTION_STATE_IDLE);
+
+  for (entry = state->pool_entries; NULL != entry; entry = next) {
+    next = entry->next;
+    release_channel_buffers(state, entry);
+  }
+  release_inbound_buffers(state);
 }
 
 void amqp_maybe_release_buffers(amqp_connection_state_t state) {
@@ -405,32 +565,293 @@ void amqp_maybe_release_buffers(amqp_connection_state_t state) {
 
 void amqp_maybe_release_buffers_on_channel(amqp_connection_state_t state,
                                            amqp_channel_t channel) {
-  amqp_link_t *queued_link;
-  amqp_pool_t *pool;
+  amqp_pool_table_entry_t *entry;
   if (CONNECTION_STATE_IDLE != state->state) {
     return;
   }
 
-  queued_link = state->first_queued_frame;
+  entry = amqp_get_channel_pool_entry(state, channel);
+
+  if (entry != NULL) {
+    release_channel_buffers(state, entry);
+    release_inbound_buffers(state);
+  }
+}
+
+void amqp_inbound_buffer_referenced(amqp_connection_state_t state,
+                                    amqp_channel_t channel) {
+  amqp_pool_table_entry_t *entry = amqp_get_channel_pool_entry(state, channel);
+
+  if (!state->sock_inbound_referenced) {
+    /* The frame has not been consumed yet */
+    state->sock_inbound_referenced = 1;
+    state->sock_inbound_referenced_start = state->sock_inbound_offset;
+  }
+  /* Decoding the frame created the entry */
+  if (entry != NULL && 0 == entry->inbound_generation) {
+    entry->inbound_generation = state->sock_inbound_generation;
+  }
+}
+
+/* Copies len bytes starting skip bytes into the data in the socket buffer to
+ * out, if that much is buffered. */
+static amqp_boolean_t inbound_peek(amqp_connection_state_t state, size_t skip,
+                                   void *out, size_t len) {
+  size_t pos;
+  size_t first;
+
+  if (skip > state->sock_inbound_used ||
+      len > state->sock_inbound_used - skip) {
+    return 0;
+  }
+
+  pos = (state->sock_inbound_offset + skip) % state->sock_inbound_buffer.len;
+  first = state->sock_inbound_buffer.len - pos;
+  if (first > len) {
+    first = len;
+  }
+  memcpy(out, amqp_offset(state->sock_inbound_buffer.bytes, pos), first);
+  memcpy(amqp_offset(out, first), state->sock_inbound_buffer.bytes,
+         len - first);
+  return 1;
+}
 
-  while (NULL != queued_link) {
-    amqp_frame_t *frame = queued_link->data;
-    if (channel == frame->channel) {
-      return;
+/* The size the socket buffer should be for the next read. */
+static size_t inbound_target_size(amqp_connection_state_t state) {
+  size_t size = state->sock_inbound_buffer.len;
+
+  if (state->sock_inbound_grow) {
+    size = size <= state->sock_inbound_max_size / 2
+               ? 2 * size
+               : state->sock_inbound_max_size;
+  } else if (state->sock_inbound_small_reads >= AMQP_INBOUND_SHRINK_READS) {
+    /* Keep room for four times the largest recent read */
+    while (size / 2 >= state->sock_inbound_min_size &&
+           size / 8 >= state->sock_inbound_peak_read) {
+      size /= 2;
     }
+  }
 
-    queued_link = queued_link->next;
+  if (size < state->sock_inbound_min_size) {
+    size = state->sock_inbound_min_size;
+  } else if (size > state->sock_inbound_max_size) {
+    size = state->sock_inbound_max_size;
+  }
+  if (size < state->sock_inbound_used) {
+    size = state->sock_inbound_buffer.len;
   }
+  return size;
+}
 
-  pool = amqp_get_channel_pool(state, channel);
+/* The free space of the socket buffer that frames decoded in place do not
+ * point into. */
+static size_t inbound_unreferenced_space(amqp_connection_state_t state) {
+  size_t capacity = state->sock_inbound_buffer.len;
+  size_t referenced;
 
-  if (pool != NULL) {
-    recycle_amqp_pool(pool);
+  if (!state->sock_inbound_referenced) {
+    return capacity - state->sock_inbound_used;
   }
+  referenced = (state->sock_inbound_offset + capacity -
+                state->sock_inbound_referenced_start) %
+               capacity;
+  if (0 == referenced) {
+    /* Nothing but referenced frames all the way round */
+    return 0;
+  }
+  return capacity - state->sock_inbound_used - referenced;
 }
 
-static int amqp_frame_to_bytes(const amqp_frame_t *frame, amqp_bytes_t buffer,
-                               amqp_bytes_t *encoded) {
+int amqp_inbound_buffer_prepare(amqp_connection_state_t state) {
+  size_t size = inbound_target_size(state);
+  amqp_bytes_t old = state->sock_inbound_buffer;
+  amqp_bytes_t bytes;
+  amqp_retired_buffer_t *retired = NULL;
+
+  state->sock_inbound_grow = 0;
+  if (state->sock_inbound_small_reads >= AMQP_INBOUND_SHRINK_READS) {
+    state->sock_inbound_small_reads = 0;
+    state->sock_inbound_peak_read = 0;
+  }
+
+  if (size == old.len) {
+    if (!state->sock_inbound_referenced) {
+      if (0 == state->sock_inbound_used) {
+        /* Frames are less likely to wrap around if reads start at the
+         * beginning */
+        state->sock_inbound_offset = 0;
+      }
+      return AMQP_STATUS_OK;
+    }
+    if (inbound_unreferenced_space(state) >= old.len / 4) {
+      return AMQP_STATUS_OK;
+    }
+  }
+
+  if (state->sock_inbound_referenced) {
+    retired = malloc(sizeof(amqp_retired_buffer_t));
+    if (NULL == retired) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+  }
+  if (NULL != state->spare_inbound_buffer.bytes &&
+      size == state->spare_inbound_buffer.len) {
+    bytes = state->spare_inbound_buffer;
+  } else {
+    amqp_bytes_free(state->spare_inbound_buffer);
+    bytes = amqp_bytes_malloc(size);
+    if (NULL == bytes.bytes) {
+      state->spare_inbound_buffer = amqp_empty_bytes;
+      free(retired);
+      return AMQP_STATUS_NO_MEMORY;
+    }
+  }
+  state->spare_inbound_buffer = amqp_empty_bytes;
+
+  /* Carry over the start of a frame still being received */
+  inbound_peek(state, 0, bytes.bytes, state->sock_inbound_used);
+  state->sock_inbound_offset = 0;
+  state->sock_inbound_buffer = bytes;
+
+  if (NULL != retired) {
+    retired->bytes = old;
+    retired->generation = state->sock_inbound_generation;
+    retired->next = state->retired_inbound_buffers;
+    state->retired_inbound_buffers = retired;
+
+    state->sock_inbound_generation++;
+    state->sock_inbound_referenced = 0;
+  } else {
+    amqp_bytes_free(old);
+  }
+  return AMQP_STATUS_OK;
+}
+
+int amqp_inbound_buffer_free_space(amqp_connection_state_t state,
+                                   struct iovec *iov) {
+  size_t capacity = state->sock_inbound_buffer.len;
+  size_t tail = (state->sock_inbound_offset + state->sock_inbound_used) %
+                capacity;
+  size_t len = inbound_unreferenced_space(state);
+
+  iov[0].iov_base = amqp_offset(state->sock_inbound_buffer.bytes, tail);
+  if (len <= capacity - tail) {
+    iov[0].iov_len = len;
+    return 1;
+  }
+  iov[0].iov_len = capacity - tail;
+  iov[1].iov_base = state->sock_inbound_buffer.bytes;
+  iov[1].iov_len = len - iov[0].iov_len;
+  return 2;
+}
+
+void amqp_inbound_buffer_filled(amqp_connection_state_t state, size_t len,
+                                amqp_boolean_t full) {
+  state->sock_inbound_used += len;
+
+  if (full) {
+    state->sock_inbound_grow = 1;
+  } else if (len < state->sock_inbound_buffer.len / 4) {
+    state->sock_inbound_small_reads++;
+    if (len > state->sock_inbound_peak_read) {
+      state->sock_inbound_peak_read = len;
+    }
+    return;
+  }
+  state->sock_inbound_small_reads = 0;
+  state->sock_inbound_peak_read = 0;
+}
+
+amqp_boolean_t amqp_inbound_frame_ready(amqp_connection_state_t state) {
+  char header[HEADER_SIZE];
+  size_t frame_size;
+
+  if (0 == state->sock_inbound_used) {
+    return 0;
+  }
+  /* A frame is being copied out, any data continues it */
+  if (CONNECTION_STATE_IDLE != state->state) {
+    return 1;
+  }
+  if (!inbound_peek(state, 0, header, HEADER_SIZE)) {
+    return 0;
+  }
+  if (AMQP_STATUS_OK != frame_size_from_header(state, header, &frame_size)) {
+    /* Reported when it is decoded */
+    return 1;
+  }
+  /* One too big for the buffer is copied out as it arrives */
+  return frame_size <= state->sock_inbound_used ||
+         frame_size > state->sock_inbound_buffer.len;
+}
+
+amqp_boolean_t amqp_delivery_buffered(amqp_connection_state_t state) {
+  size_t skip = 0;
+  amqp_channel_t channel = 0;
+  amqp_boolean_t have_deliver = 0;
+  amqp_boolean_t have_header = 0;
+  uint64_t body_left = 0;
+
+  /* Queued frames, or one partly copied out, come before the buffer */
+  if (CONNECTION_STATE_IDLE != state->state ||
+      NULL != state->first_queued_frame) {
+    return 0;
+  }
+
+  for (;;) {
+    char header[HEADER_SIZE];
+    char payload[12];
+    size_t frame_size;
+    size_t payload_size;
+    uint8_t frame_type;
+
+    if (!inbound_peek(state, skip, header, HEADER_SIZE) ||
+        AMQP_STATUS_OK != frame_size_from_header(state, header, &frame_size) ||
+        frame_size > state->sock_inbound_used - skip) {
+      return 0;
+    }
+
+    frame_type = amqp_d8(header);
+    payload_size = frame_size - HEADER_SIZE - FOOTER_SIZE;
+
+    if (AMQP_FRAME_HEARTBEAT == frame_type) {
+      /* Skipped by the reader */
+    } else if (!have_deliver) {
+      if (AMQP_FRAME_METHOD != frame_type || payload_size < 4 ||
+          !inbound_peek(state, skip + HEADER_SIZE, payload, 4) ||
+          AMQP_BASIC_DELIVER_METHOD != amqp_d32(payload)) {
+        return 0;
+      }
+      channel = amqp_d16(amqp_offset(header, 1));
+      have_deliver = 1;
+    } else if (channel != amqp_d16(amqp_offset(header, 1))) {
+      return 0;
+    } else if (!have_header) {
+      if (AMQP_FRAME_HEADER != frame_type || payload_size < 12 ||
+          !inbound_peek(state, skip + HEADER_SIZE, payload, 12)) {
+        return 0;
+      }
+      body_left = amqp_d64(amqp_offset(payload, 4));
+      if (0 == body_left) {
+        return 1;
+      }
+      have_header = 1;
+    } else {
+      if (AMQP_FRAME_BODY != frame_type || payload_size > body_left) {
+        return 0;
+      }
+      body_left -= payload_size;
+      if (0 == body_left) {
+        return 1;
+      }
+    }
+
+    skip += frame_size;
+  }
+}
+
+int amqp_frame_to_bytes(const amqp_frame_t *frame, amqp_bytes_t buffer,
+                        amqp_bytes_t *encoded) {
   void *out_frame = buffer.bytes;
   size_t out_frame_len;
   int res;
@@ -514,32 +935,88 @@ int amqp_send_frame_inner(amqp_connection_state_t state,
                           const amqp_frame_t *frame, int flags,
                           amqp_time_t deadline) {
   int res;
-  ssize_t sent;
   amqp_bytes_t encoded;
+  struct iovec iov[3];
+  int iovcnt;
+  uint8_t frame_header[HEADER_SIZE];
+  uint8_t frame_footer = AMQP_FRAME_END;
+
+  if (AMQP_FRAME_BODY == frame->frame_type) {
+    /* Send body frames as header, body and footer directly from the caller's
+     * buffer rather than copying the content into outbound_buffer */
+    const amqp_bytes_t *body = &frame->payload.body_fragment;
+    if (body->len >
+        (size_t)state->frame_max - (HEADER_SIZE + FOOTER_SIZE)) {
+      return AMQP_STATUS_INVALID_PARAMETER;
+    }
+
+    amqp_e8(AMQP_FRAME_BODY, amqp_offset(frame_header, 0));
+    amqp_e16(frame->channel, amqp_offset(frame_header, 1));
+    amqp_e32((uint32_t)body->len, amqp_offset(frame_header, 3));
+
+    iov[0].iov_base = frame_header;
+    iov[0].iov_len = HEADER_SIZE;
+    iov[1].iov_base = body->bytes;
+    iov[1].iov_len = body->len;
+    iov[2].iov_base = &frame_footer;
+    iov[2].iov_len = FOOTER_SIZE;
+    iovcnt = 3;
+  } else {
+    if (AMQP_FRAME_METHOD == frame->frame_type) {
+      /* A method starts a frame on its own, so flow-ok replies can go first */
+      res = amqp_flow_send_oks(state);
+      if (AMQP_STATUS_OK != res) {
+        return res;
+      }
+    }
+    res = amqp_frame_to_bytes(frame, state->outbound_buffer, &encoded);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+    if (AMQP_FRAME_METHOD == frame->frame_type) {
+      if (AMQP_CHANNEL_OPEN_METHOD == frame->payload.method.id) {
+        res = amqp_channel_opened(state, frame->channel);
+        if (AMQP_STATUS_OK != res) {
+          return res;
+        }
+      } else if (AMQP_CHANNEL_CLOSE_OK_METHOD == frame->payload.method.id) {
+        amqp_channel_closed(state, frame->channel);
+      }
+    }
+    iov[0].iov_base = encoded.bytes;
+    iov[0].iov_len = encoded.len;
+    iovcnt = 1;
+  }
+
+  return amqp_send_iov_inner(state, iov, iovcnt, flags, deadline);
+}
+
+/* Writes all of iov, waiting for the socket as needed. On a timeout iov is
+ * left describing what was not written. */
+int amqp_send_iov_blocking(amqp_connection_state_t state, struct iovec *iov,
+                           int iovcnt, int flags, amqp_time_t deadline) {
+  int res;
+  ssize_t sent;
+  size_t len = 0;
+  int i;
   amqp_time_t next_timeout;
 
-  /* TODO: if the AMQP_SF_MORE socket optimization can be shown to work
-   * correctly, then this could be un-done so that body-frames are sent as 3
-   * send calls, getting rid of the copy of the body content, some testing
-   * would need to be done to see if this would actually a win for performance.
-   * */
-  res = amqp_frame_to_bytes(frame, state->outbound_buffer, &encoded);
-  if (AMQP_STATUS_OK != res) {
-    return res;
+  for (i = 0; i < iovcnt; ++i) {
+    len += iov[i].iov_len;
   }
 
 start_send:
 
   next_timeout = amqp_time_first(deadline, state->next_recv_heartbeat);
 
-  sent = amqp_try_send(state, encoded.bytes, encoded.len, next_timeout, flags);
+  sent = amqp_try_writev(state, iov, iovcnt, next_timeout, flags);
   if (0 > sent) {
     return (int)sent;
   }
 
   /* A partial send has occurred, because of a heartbeat timeout (so try recv
    * something) or common timeout (so return AMQP_STATUS_TIMEOUT) */
-  if ((ssize_t)encoded.len != sent) {
+  if ((ssize_t)len != sent) {
     if (amqp_time_equal(next_timeout, deadline)) {
       /* timeout of method was received, so return from method*/
       return AMQP_STATUS_TIMEOUT;
@@ -553,13 +1030,55 @@ start_send:
       return res;
     }
 
-    encoded.bytes = (uint8_t *)encoded.bytes + sent;
-    encoded.len -= sent;
+    /* amqp_try_writev() has already advanced iov past what was sent */
+    len -= sent;
     goto start_send;
   }
 
-  res = amqp_time_s_from_now(&state->next_send_heartbeat,
-                             amqp_heartbeat_send(state));
+  res = amqp_time_s_from_now_cached(&state->next_send_heartbeat,
+                                    amqp_heartbeat_send(state),
+                                    &state->heartbeat_clock);
+  return res;
+}
+
+int amqp_send_file_inner(amqp_connection_state_t state, int fd,
+                         uint64_t offset, size_t len, int flags,
+                         amqp_time_t deadline) {
+  int res;
+  ssize_t sent;
+  amqp_time_t next_timeout;
+
+start_send:
+
+  next_timeout = amqp_time_first(deadline, state->next_recv_heartbeat);
+
+  sent = amqp_try_sendfile(state, fd, offset, len, next_timeout, flags);
+  if (0 > sent) {
+    return (int)sent;
+  }
+
+  /* As in amqp_send_iov_blocking(), a partial send means a timeout */
+  if ((ssize_t)len != sent) {
+    if (amqp_time_equal(next_timeout, deadline)) {
+      return AMQP_STATUS_TIMEOUT;
+    }
+
+    res = amqp_try_recv(state);
+
+    if (AMQP_STATUS_TIMEOUT == res) {
+      return AMQP_STATUS_HEARTBEAT_TIMEOUT;
+    } else if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+
+    offset += sent;
+    len -= sent;
+    goto start_send;
+  }
+
+  res = amqp_time_s_from_now_cached(&state->next_send_heartbeat,
+                                    amqp_heartbeat_send(state),
+                                    &state->heartbeat_clock);
   return res;
 }
 
@@ -570,3 +1089,327 @@ amqp_table_t *amqp_get_server_properties(amqp_connection_state_t state) {
 amqp_table_t *amqp_get_client_properties(amqp_connection_state_t state) {
   return &state->client_properties;
 }
+
+/* Appends what is left in iov to the unsent queue. */
+static int queue_unsent(amqp_connection_state_t state, struct iovec *iov,
+                        int iovcnt) {
+  size_t len = 0;
+  int i;
+
+  for (i = 0; i < iovcnt; ++i) {
+    len += iov[i].iov_len;
+  }
+
+  if (state->unsent_offset + state->unsent_len + len >
+      state->unsent_buffer.len) {
+    size_t needed = state->unsent_len + len;
+
+    if (0 < state->unsent_offset) {
+      memmove(state->unsent_buffer.bytes,
+              amqp_offset(state->unsent_buffer.bytes, state->unsent_offset),
+              state->unsent_len);
+      state->unsent_offset = 0;
+    }
+    if (needed > state->unsent_buffer.len) {
+      size_t newlen = state->unsent_buffer.len;
+      void *newbuf;
+
+      if (0 == newlen) {
+        newlen = AMQP_INITIAL_UNSENT_BUFFER_SIZE;
+      }
+      while (newlen < needed) {
+        newlen *= 2;
+      }
+      newbuf = realloc(state->unsent_buffer.bytes, newlen);
+      if (NULL == newbuf) {
+        return AMQP_STATUS_NO_MEMORY;
+      }
+      state->unsent_buffer.bytes = newbuf;
+      state->unsent_buffer.len = newlen;
+    }
+  }
+
+  for (i = 0; i < iovcnt; ++i) {
+    memcpy(amqp_offset(state->unsent_buffer.bytes,
+                       state->unsent_offset + state->unsent_len),
+           iov[i].iov_base, iov[i].iov_len);
+    state->unsent_len += iov[i].iov_len;
+  }
+  return AMQP_STATUS_OK;
+}
+
+/* Writes what is left of iov without waiting for the socket, queueing
+ * whatever it does not accept. */
+static int send_iov_nonblocking(amqp_connection_state_t state,
+                                struct iovec *iov, int iovcnt, int flags) {
+  ssize_t sent;
+  size_t len = 0;
+  int res;
+  int i;
+
+  for (i = 0; i < iovcnt; ++i) {
+    len += iov[i].iov_len;
+  }
+
+  sent = amqp_try_writev(state, iov, iovcnt, amqp_time_immediate(), flags);
+  if (0 > sent) {
+    return (int)sent;
+  }
+  if (0 < sent) {
+    res = amqp_time_s_from_now_cached(&state->next_send_heartbeat,
+                                      amqp_heartbeat_send(state),
+                                      &state->heartbeat_clock);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+  if ((size_t)sent == len) {
+    return AMQP_STATUS_OK;
+  }
+
+  /* amqp_try_writev() has emptied the iovs that were written */
+  res = queue_unsent(state, iov, iovcnt);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+  return AMQP_STATUS_WOULD_BLOCK;
+}
+
+/* Writes the unsent queue, waiting for the socket if blocking is set. */
+static int send_unsent(amqp_connection_state_t state, int blocking, int flags,
+                       amqp_time_t deadline) {
+  struct iovec iov;
+  ssize_t sent;
+  int res;
+
+  if (0 == state->unsent_len) {
+    return AMQP_STATUS_OK;
+  }
+
+  iov.iov_base = amqp_offset(state->unsent_buffer.bytes, state->unsent_offset);
+  iov.iov_len = state->unsent_len;
+
+  if (blocking) {
+    res = amqp_send_iov_blocking(state, &iov, 1, flags, deadline);
+    sent = AMQP_STATUS_OK == res ? (ssize_t)state->unsent_len
+                                 : (ssize_t)(state->unsent_len - iov.iov_len);
+  } else {
+    sent = amqp_try_writev(state, &iov, 1, amqp_time_immediate(), flags);
+    if (0 > sent) {
+      return (int)sent;
+    }
+    res = AMQP_STATUS_OK;
+    if (0 < sent) {
+      res = amqp_time_s_from_now_cached(&state->next_send_heartbeat,
+                                        amqp_heartbeat_send(state),
+                                        &state->heartbeat_clock);
+    }
+    if (AMQP_STATUS_OK == res && (size_t)sent != state->unsent_len) {
+      res = AMQP_STATUS_WOULD_BLOCK;
+    }
+  }
+
+  state->unsent_offset += sent;
+  state->unsent_len -= sent;
+  if (0 == state->unsent_len) {
+    state->unsent_offset = 0;
+  }
+  return res;
+}
+
+int amqp_send_iov_unbuffered(amqp_connection_state_t state,
+                             struct iovec *iov, int iovcnt, int flags,
+                             amqp_time_t deadline) {
+  int res;
+
+  /* Queued data goes first, and while some of it is left so does anything
+   * sent after it */
+  res = send_unsent(state, !state->send_nonblocking, AMQP_SF_MORE, deadline);
+  if (AMQP_STATUS_WOULD_BLOCK == res) {
+    res = queue_unsent(state, iov, iovcnt);
+    return AMQP_STATUS_OK == res ? AMQP_STATUS_WOULD_BLOCK : res;
+  } else if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  if (state->send_nonblocking) {
+    return send_iov_nonblocking(state, iov, iovcnt, flags);
+  }
+  return amqp_send_iov_blocking(state, iov, iovcnt, flags, deadline);
+}
+
+static void reset_send_buffer(amqp_connection_state_t state) {
+  state->send_buffer_pending = 0;
+  state->send_buffer_deadline = amqp_time_infinite();
+}
+
+static int flush_send_buffer(amqp_connection_state_t state, int flags,
+                             amqp_time_t deadline) {
+  struct iovec iov;
+  int res;
+
+  if (0 == state->send_buffer_pending) {
+    return AMQP_STATUS_OK;
+  }
+
+  iov.iov_base = state->send_buffer.bytes;
+  iov.iov_len = state->send_buffer_pending;
+  /* Whatever happens the buffered frames leave the buffer: in non-blocking
+   * send mode what is not written is queued, otherwise a partial write leaves
+   * the connection unusable anyway */
+  reset_send_buffer(state);
+
+  res = amqp_send_iov_unbuffered(state, &iov, 1, flags, deadline);
+  return res;
+}
+
+int amqp_send_iov_inner(amqp_connection_state_t state, struct iovec *iov,
+                        int iovcnt, int flags, amqp_time_t deadline) {
+  struct iovec all[AMQP_SOCKET_MAX_IOV];
+  size_t len = 0;
+  int res;
+  int i;
+
+  if (0 == state->send_buffer_threshold) {
+    return amqp_send_iov_unbuffered(state, iov, iovcnt, flags, deadline);
+  }
+
+  for (i = 0; i < iovcnt; ++i) {
+    len += iov[i].iov_len;
+  }
+
+  if (state->send_buffer_pending + len <= state->send_buffer.len) {
+    if (0 == state->send_buffer_pending && NULL != state->send_buffer_delay) {
+      res = amqp_time_from_now(&state->send_buffer_deadline,
+                               state->send_buffer_delay);
+      if (AMQP_STATUS_OK != res) {
+        return res;
+      }
+    }
+
+    for (i = 0; i < iovcnt; ++i) {
+      memcpy(amqp_offset(state->send_buffer.bytes, state->send_buffer_pending),
+             iov[i].iov_base, iov[i].iov_len);
+      state->send_buffer_pending += iov[i].iov_len;
+    }
+
+    if (state->send_buffer_pending >= state->send_buffer_threshold) {
+      return flush_send_buffer(state, flags, deadline);
+    }
+    res = amqp_time_has_past(state->send_buffer_deadline);
+    if (AMQP_STATUS_TIMEOUT == res) {
+      return flush_send_buffer(state, flags, deadline);
+    }
+    return res;
+  }
+
+  /* Too big to buffer: write out what is buffered along with it rather than
+   * copying it */
+  if (0 == state->send_buffer_pending) {
+    return amqp_send_iov_unbuffered(state, iov, iovcnt, flags, deadline);
+  }
+  if (iovcnt + 1 > AMQP_SOCKET_MAX_IOV) {
+    res = flush_send_buffer(state, AMQP_SF_MORE, deadline);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+    return amqp_send_iov_unbuffered(state, iov, iovcnt, flags, deadline);
+  }
+
+  all[0].iov_base = state->send_buffer.bytes;
+  all[0].iov_len = state->send_buffer_pending;
+  memcpy(&all[1], iov, iovcnt * sizeof(struct iovec));
+  reset_send_buffer(state);
+
+  return amqp_send_iov_unbuffered(state, all, iovcnt + 1, flags, deadline);
+}
+
+int amqp_flush(amqp_connection_state_t state) {
+  if (0 < state->send_buffer_pending) {
+    /* Writes the unsent queue first */
+    return flush_send_buffer(state, AMQP_SF_NONE, amqp_time_infinite());
+  }
+  return send_unsent(state, !state->send_nonblocking, AMQP_SF_NONE,
+                     amqp_time_infinite());
+}
+
+int amqp_flush_blocking(amqp_connection_state_t state, amqp_time_t deadline) {
+  int res = flush_send_buffer(state, AMQP_SF_NONE, deadline);
+  if (AMQP_STATUS_OK != res && AMQP_STATUS_WOULD_BLOCK != res) {
+    return res;
+  }
+  return send_unsent(state, 1, AMQP_SF_NONE, deadline);
+}
+
+void amqp_set_send_nonblocking(amqp_connection_state_t state,
+                               amqp_boolean_t nonblocking) {
+  state->send_nonblocking = nonblocking;
+}
+
+int amqp_send_pending(amqp_connection_state_t state) {
+  return amqp_flush(state);
+}
+
+int amqp_set_write_coalescing(amqp_connection_state_t state,
+                              size_t flush_threshold,
+                              const struct timeval *max_delay) {
+  int res;
+
+  if (NULL != max_delay &&
+      (0 > max_delay->tv_sec || 0 > max_delay->tv_usec)) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  /* Only the coalescing buffer needs to be empty */
+  res = amqp_flush(state);
+  if (AMQP_STATUS_OK != res && AMQP_STATUS_WOULD_BLOCK != res) {
+    return res;
+  }
+
+  if (state->send_buffer.len < flush_threshold) {
+    void *newbuf = realloc(state->send_buffer.bytes, flush_threshold);
+    if (NULL == newbuf) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+    state->send_buffer.bytes = newbuf;
+    state->send_buffer.len = flush_threshold;
+  }
+
+  state->send_buffer_threshold = flush_threshold;
+  if (NULL == max_delay) {
+    state->send_buffer_delay = NULL;
+  } else {
+    state->internal_send_buffer_delay = *max_delay;
+    state->send_buffer_delay = &state->internal_send_buffer_delay;
+  }
+  return AMQP_STATUS_OK;
+}
+
+void amqp_set_body_codec(amqp_connection_state_t state,
+                         const amqp_body_codec_t *codec, void *user_data,
+                         size_t min_size) {
+  state->body_codec = codec;
+  state->body_codec_user_data = user_data;
+  state->body_codec_min_size = min_size;
+}
+
+void amqp_set_max_decoded_body_size(amqp_connection_state_t state,
+                                    uint64_t max_size) {
+  state->max_decoded_body_size = max_size;
+}
+
+void amqp_set_lazy_properties(amqp_connection_state_t state,
+                              amqp_boolean_t lazy) {
+  state->lazy_properties = lazy;
+}
+
+int amqp_set_inbound_buffer_limits(amqp_connection_state_t state,
+                                   size_t min_size, size_t max_size) {
+  if (min_size < AMQP_FRAME_MIN_SIZE || min_size > max_size) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  /* The buffer is resized before the next read */
+  state->sock_inbound_min_size = min_size;
+  state->sock_inbound_max_size = max_size;
+  return AMQP_STATUS_OK;
+}
@@ -88,6 +88,89 @@ static int amqp_basic_properties_clone(amqp_basic_properties_t *original,
 #undef CLONE_BYTES_POOL
 }
 
+/* Decodes the headers table of properties, which were decoded from raw, into
+ * the pool of channel, unless that has been done. An empty table can't be
+ * told from one not yet decoded, but decoding it again costs nothing. */
+static int decode_headers_once(amqp_connection_state_t state,
+                               amqp_channel_t channel, amqp_bytes_t raw,
+                               amqp_basic_properties_t *properties) {
+  amqp_basic_properties_t skipped;
+  amqp_bytes_t encoded;
+  amqp_pool_t *pool;
+  size_t offset = 0;
+  int res;
+
+  if (!(properties->_flags & AMQP_BASIC_HEADERS_FLAG)) {
+    properties->headers.num_entries = 0;
+    properties->headers.entries = NULL;
+    return AMQP_STATUS_OK;
+  }
+  if (0 != properties->headers.num_entries) {
+    return AMQP_STATUS_OK;
+  }
+
+  res = amqp_decode_properties_lazy(AMQP_BASIC_CLASS, raw, &skipped, &encoded);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+  pool = amqp_get_or_create_channel_pool(state, channel);
+  if (NULL == pool) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  return amqp_decode_table(encoded, pool, &properties->headers, &offset);
+}
+
+int amqp_frame_properties(amqp_connection_state_t state, amqp_frame_t *frame,
+                          amqp_basic_properties_t **properties) {
+  amqp_basic_properties_t *decoded;
+  amqp_bytes_t headers;
+  amqp_pool_t *pool;
+  int res;
+
+  if (AMQP_FRAME_HEADER != frame->frame_type ||
+      AMQP_BASIC_CLASS != frame->payload.properties.class_id) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  if (NULL == frame->payload.properties.decoded) {
+    pool = amqp_get_or_create_channel_pool(state, frame->channel);
+    if (NULL == pool) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+    decoded = amqp_pool_alloc(pool, sizeof(amqp_basic_properties_t));
+    if (NULL == decoded) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+    res = amqp_decode_properties_lazy(AMQP_BASIC_CLASS,
+                                      frame->payload.properties.raw, decoded,
+                                      &headers);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+    frame->payload.properties.decoded = decoded;
+  }
+
+  *properties = frame->payload.properties.decoded;
+  return AMQP_STATUS_OK;
+}
+
+int amqp_frame_headers(amqp_connection_state_t state, amqp_frame_t *frame,
+                       amqp_table_t **headers) {
+  amqp_basic_properties_t *properties;
+  int res = amqp_frame_properties(state, frame, &properties);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  res = decode_headers_once(state, frame->channel,
+                            frame->payload.properties.raw, properties);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+  *headers = &properties->headers;
+  return AMQP_STATUS_OK;
+}
+
 void amqp_destroy_message(amqp_message_t *message) {
   empty_amqp_pool(&message->pool);
   amqp_bytes_free(message->body);
@@ -107,31 +190,31 @@ static int amqp_bytes_malloc_dup_failed(amqp_bytes_t bytes) {
   return 0;
 }
 
-amqp_rpc_reply_t amqp_consume_message(amqp_connection_state_t state,
-                                      amqp_envelope_t *envelope,
+static amqp_rpc_reply_t wait_delivery(amqp_connection_state_t state,
                                       const struct timeval *timeout,
-                                      AMQP_UNUSED int flags) {
-  int res;
+                                      amqp_boolean_t buffered_only,
+                                      amqp_frame_t *frame);
+
+/* amqp_consume_message(), which with buffered_only set only consumes a
+ * delivery already read in full, and sets *consumed to whether it did. */
+static amqp_rpc_reply_t consume_message(amqp_connection_state_t state,
+                                        amqp_envelope_t *envelope,
+                                        const struct timeval *timeout,
+                                        amqp_boolean_t buffered_only,
+                                        amqp_boolean_t *consumed) {
   amqp_frame_t frame;
   amqp_basic_deliver_t *delivery_method;
   amqp_rpc_reply_t ret;
 
-  memset(&ret, 0, sizeof(ret));
   memset(envelope, 0, sizeof(*envelope));
+  *consumed = 0;
 
-  res = amqp_simple_wait_frame_noblock(state, &frame, timeout);
-  if (AMQP_STATUS_OK != res) {
-    ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
-    ret.library_error = res;
+  ret = wait_delivery(state, timeout, buffered_only, &frame);
+  if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
     goto error_out1;
   }
-
-  if (AMQP_FRAME_METHOD != frame.frame_type ||
-      AMQP_BASIC_DELIVER_METHOD != frame.payload.method.id) {
-    amqp_put_back_frame(state, &frame);
-    ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
-    ret.library_error = AMQP_STATUS_UNEXPECTED_STATE;
-    goto error_out1;
+  if (0 == frame.frame_type) {
+    return ret;
   }
 
   delivery_method = frame.payload.method.decoded;
@@ -157,6 +240,7 @@ amqp_rpc_reply_t amqp_consume_message(amqp_connection_state_t state,
   }
 
   ret.reply_type = AMQP_RESPONSE_NORMAL;
+  *consumed = 1;
   return ret;
 
 error_out2:
@@ -167,116 +251,794 @@ error_out1:
   return ret;
 }
 
+amqp_rpc_reply_t amqp_consume_message(amqp_connection_state_t state,
+                                      amqp_envelope_t *envelope,
+                                      const struct timeval *timeout,
+                                      AMQP_UNUSED int flags) {
+  amqp_boolean_t consumed;
+  return consume_message(state, envelope, timeout, 0, &consumed);
+}
+
+amqp_rpc_reply_t amqp_consume_messages(amqp_connection_state_t state,
+                                       amqp_envelope_t *envelopes, size_t max,
+                                       size_t *count,
+                                       const struct timeval *timeout,
+                                       AMQP_UNUSED int flags) {
+  struct timeval immediate = {0, 0};
+  amqp_boolean_t consumed;
+  amqp_rpc_reply_t ret;
+
+  *count = 0;
+  if (0 == max) {
+    memset(&ret, 0, sizeof(ret));
+    ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+    ret.library_error = AMQP_STATUS_INVALID_PARAMETER;
+    return ret;
+  }
+
+  ret = consume_message(state, &envelopes[0], timeout, 0, &consumed);
+  if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
+    return ret;
+  }
+  *count = 1;
+
+  /* Only deliveries that will not block to finish reading. Those dispatched
+   * to a handler may leave none for the envelope. */
+  while (*count < max && amqp_delivery_buffered(state)) {
+    ret = consume_message(state, &envelopes[*count], &immediate, 1, &consumed);
+    if (AMQP_RESPONSE_NORMAL != ret.reply_type || !consumed) {
+      break;
+    }
+    ++*count;
+  }
+  return ret;
+}
+
+/* Returns the connection's body codec if a message with properties was
+ * encoded with it. */
+static const amqp_body_codec_t *message_codec(
+    amqp_connection_state_t state, const amqp_basic_properties_t *properties) {
+  const amqp_body_codec_t *codec = state->body_codec;
+  amqp_bytes_t encoding;
+
+  if (NULL == codec ||
+      !(properties->_flags & AMQP_BASIC_CONTENT_ENCODING_FLAG)) {
+    return NULL;
+  }
+  encoding = amqp_cstring_bytes(codec->content_encoding);
+  if (encoding.len != properties->content_encoding.len ||
+      0 != memcmp(encoding.bytes, properties->content_encoding.bytes,
+                  encoding.len)) {
+    return NULL;
+  }
+  return codec;
+}
+
+/* Whether frame is a channel.close or connection.close, which ends the
+ * reading of a message */
+static amqp_boolean_t is_close_method(const amqp_frame_t *frame) {
+  return AMQP_FRAME_METHOD == frame->frame_type &&
+         (AMQP_CHANNEL_CLOSE_METHOD == frame->payload.method.id ||
+          AMQP_CONNECTION_CLOSE_METHOD == frame->payload.method.id);
+}
+
+/* Reads the content header frame of the next message on channel. A
+ * channel.close or connection.close is returned as a server exception,
+ * anything else is put back and fails with AMQP_STATUS_UNEXPECTED_STATE. */
+static amqp_rpc_reply_t read_header_frame(amqp_connection_state_t state,
+                                          amqp_channel_t channel,
+                                          amqp_frame_t *frame) {
+  amqp_rpc_reply_t ret;
+  int res;
+
+  res = amqp_simple_wait_frame_on_channel(state, channel, frame);
+  if (AMQP_STATUS_OK != res) {
+    return amqp_rpc_reply_error(res);
+  }
+
+  memset(&ret, 0, sizeof(ret));
+  if (AMQP_FRAME_HEADER == frame->frame_type) {
+    ret.reply_type = AMQP_RESPONSE_NORMAL;
+  } else if (is_close_method(frame)) {
+    ret.reply_type = AMQP_RESPONSE_SERVER_EXCEPTION;
+    ret.reply = frame->payload.method;
+  } else {
+    ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+    ret.library_error = AMQP_STATUS_UNEXPECTED_STATE;
+    amqp_put_back_frame(state, frame);
+  }
+  return ret;
+}
+
+typedef struct body_reader_t_ body_reader_t;
+
+/* Takes the next part of a body, found offset bytes into it. Returns an
+ * amqp_status_enum value, see body_reader_t. */
+typedef int (*body_part_fn)(body_reader_t *reader, amqp_bytes_t part,
+                            uint64_t offset);
+
+/* Reads the body frames of a message, see read_body() */
+struct body_reader_t_ {
+  amqp_connection_state_t state;
+  amqp_channel_t channel;
+  uint64_t body_size;
+  /* Release the channel's buffers before each frame is read, so only a few
+   * frames are held whatever the size of the body */
+  amqp_boolean_t release;
+  /* The codec the body is decoded with and its decoder, or NULL */
+  const amqp_body_codec_t *codec;
+  void *decoder;
+  /* The decoded body, allocated with malloc(), decoded_capacity bytes. It
+   * only holds what the last frame decoded to unless keep_decoded is set. */
+  amqp_bytes_t decoded;
+  size_t decoded_capacity;
+  amqp_boolean_t keep_decoded;
+  /* Called with each part of the body, decoded, if not NULL */
+  body_part_fn on_part;
+  void *context;
+  /* The size of the parts passed on so far */
+  uint64_t parts_len;
+  /* The first error of the codec or on_part. The rest of the body is still
+   * read, to keep the channel in step, but is dropped. */
+  int res;
+};
+
+/* Sets up reader for a body of body_size bytes on channel, encoded with codec
+ * if it is not NULL. If the decoder can't be created reader->res is set to
+ * AMQP_STATUS_CODEC_ERROR. */
+static void body_reader_start(amqp_connection_state_t state,
+                              body_reader_t *reader,
+                              const amqp_body_codec_t *codec,
+                              amqp_channel_t channel, uint64_t body_size) {
+  memset(reader, 0, sizeof(*reader));
+  reader->state = state;
+  reader->channel = channel;
+  reader->body_size = body_size;
+  reader->codec = codec;
+  reader->res = AMQP_STATUS_OK;
+
+  if (NULL != codec &&
+      AMQP_STATUS_OK != codec->decoder_new(state->body_codec_user_data,
+                                           body_size,
+                                           state->max_decoded_body_size,
+                                           &reader->decoder)) {
+    reader->decoder = NULL;
+    reader->res = AMQP_STATUS_CODEC_ERROR;
+  }
+}
+
+/* Reads the body frames following a content header frame, decoding them and
+ * passing them to reader->on_part. Fails with the first error of the codec or
+ * on_part once the whole body has been read, or straight away if the body
+ * can't be read. The decoder is freed, reader->decoded is left to the
+ * caller. */
+static amqp_rpc_reply_t read_body(body_reader_t *reader) {
+  amqp_connection_state_t state = reader->state;
+  amqp_frame_t frame;
+  amqp_rpc_reply_t ret;
+  amqp_bytes_t part;
+  uint64_t body_read;
+  size_t decoded_len;
+  int res;
+
+  memset(&ret, 0, sizeof(ret));
+
+  for (body_read = 0; body_read < reader->body_size;) {
+    if (reader->release) {
+      amqp_maybe_release_buffers_on_channel(state, reader->channel);
+    }
+
+    res = amqp_simple_wait_frame_on_channel(state, reader->channel, &frame);
+    if (AMQP_STATUS_OK != res) {
+      ret = amqp_rpc_reply_error(res);
+      goto out;
+    }
+    if (AMQP_FRAME_BODY != frame.frame_type) {
+      if (is_close_method(&frame)) {
+        ret.reply_type = AMQP_RESPONSE_SERVER_EXCEPTION;
+        ret.reply = frame.payload.method;
+      } else {
+        ret = amqp_rpc_reply_error(AMQP_STATUS_BAD_AMQP_DATA);
+      }
+      goto out;
+    }
+    part = frame.payload.body_fragment;
+    if (body_read + part.len > reader->body_size) {
+      ret = amqp_rpc_reply_error(AMQP_STATUS_BAD_AMQP_DATA);
+      goto out;
+    }
+    body_read += part.len;
+
+    if (AMQP_STATUS_OK != reader->res) {
+      continue;
+    }
+    if (NULL != reader->codec) {
+      if (!reader->keep_decoded) {
+        reader->decoded.len = 0;
+      }
+      decoded_len = reader->decoded.len;
+      if (AMQP_STATUS_OK != reader->codec->decode(reader->decoder, part,
+                                                  &reader->decoded,
+                                                  &reader->decoded_capacity)) {
+        reader->res = AMQP_STATUS_CODEC_ERROR;
+        continue;
+      }
+      part.len = reader->decoded.len - decoded_len;
+      part.bytes = 0 == part.len
+                       ? NULL
+                       : amqp_offset(reader->decoded.bytes, decoded_len);
+    }
+    if (0 != part.len && NULL != reader->on_part) {
+      reader->res = reader->on_part(reader, part, reader->parts_len);
+    }
+    reader->parts_len += part.len;
+  }
+
+  if (NULL != reader->codec && AMQP_STATUS_OK == reader->res) {
+    reader->res = reader->codec->decoder_finish(reader->decoder);
+    if (AMQP_STATUS_OK != reader->res) {
+      reader->res = AMQP_STATUS_CODEC_ERROR;
+    }
+  }
+  if (AMQP_STATUS_OK != reader->res) {
+    ret = amqp_rpc_reply_error(reader->res);
+  } else {
+    ret.reply_type = AMQP_RESPONSE_NORMAL;
+  }
+
+out:
+  if (NULL != reader->decoder) {
+    reader->codec->decoder_free(reader->decoder);
+    reader->decoder = NULL;
+  }
+  return ret;
+}
+
+/* Copies a part of the body into reader->context, a buffer of body_size
+ * bytes */
+static int copy_body_part(body_reader_t *reader, amqp_bytes_t part,
+                          uint64_t offset) {
+  memcpy(amqp_offset(reader->context, (size_t)offset), part.bytes, part.len);
+  return AMQP_STATUS_OK;
+}
+
 amqp_rpc_reply_t amqp_read_message(amqp_connection_state_t state,
                                    amqp_channel_t channel,
                                    amqp_message_t *message,
                                    AMQP_UNUSED int flags) {
   amqp_frame_t frame;
   amqp_rpc_reply_t ret;
-
-  size_t body_read;
-  char *body_read_ptr;
+  amqp_table_t *headers;
+  body_reader_t reader;
+  uint64_t body_size;
   int res;
 
-  memset(&ret, 0, sizeof(ret));
   memset(message, 0, sizeof(*message));
 
-  res = amqp_simple_wait_frame_on_channel(state, channel, &frame);
-  if (AMQP_STATUS_OK != res) {
-    ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
-    ret.library_error = res;
+  ret = read_header_frame(state, channel, &frame);
+  if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
+    return ret;
+  }
 
+  init_amqp_pool(&message->pool, 4096);
+  res = amqp_frame_headers(state, &frame, &headers);
+  if (AMQP_STATUS_OK == res) {
+    res = amqp_basic_properties_clone(frame.payload.properties.decoded,
+                                      &message->properties, &message->pool);
+  }
+  body_size = frame.payload.properties.body_size;
+  if (AMQP_STATUS_OK == res && SIZE_MAX < body_size) {
+    res = AMQP_STATUS_NO_MEMORY;
+  }
+  if (AMQP_STATUS_OK != res) {
+    ret = amqp_rpc_reply_error(res);
     goto error_out1;
   }
 
-  if (AMQP_FRAME_HEADER != frame.frame_type) {
-    if (AMQP_FRAME_METHOD == frame.frame_type &&
-        (AMQP_CHANNEL_CLOSE_METHOD == frame.payload.method.id ||
-         AMQP_CONNECTION_CLOSE_METHOD == frame.payload.method.id)) {
+  body_reader_start(state, &reader,
+                    message_codec(state, &message->properties), channel,
+                    body_size);
+  if (NULL != reader.codec) {
+    /* The body is decoded into reader.decoded as it arrives. A body that
+     * fails to decode is still read, to keep the channel in step. */
+    reader.keep_decoded = 1;
+  } else if (0 != body_size) {
+    message->body = amqp_bytes_malloc((size_t)body_size);
+    if (NULL == message->body.bytes) {
+      ret = amqp_rpc_reply_error(AMQP_STATUS_NO_MEMORY);
+      goto error_out1;
+    }
+    reader.on_part = copy_body_part;
+    reader.context = message->body.bytes;
+  }
 
-      ret.reply_type = AMQP_RESPONSE_SERVER_EXCEPTION;
-      ret.reply = frame.payload.method;
+  ret = read_body(&reader);
+  if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
+    amqp_bytes_free(reader.decoded);
+    goto error_out2;
+  }
 
-    } else {
-      ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
-      ret.library_error = AMQP_STATUS_UNEXPECTED_STATE;
+  if (NULL != reader.codec) {
+    message->body = reader.decoded;
+    message->properties._flags &= ~AMQP_BASIC_CONTENT_ENCODING_FLAG;
+    message->properties.content_encoding = amqp_empty_bytes;
+  }
+  return ret;
+
+error_out2:
+  amqp_bytes_free(message->body);
+error_out1:
+  empty_amqp_pool(&message->pool);
+  return ret;
+}
+
+/* A view body buffer grown beyond this is freed when the view is released
+ * rather than kept for the next message. */
+#define AMQP_VIEW_BODY_KEEP_SIZE 131072
 
-      amqp_put_back_frame(state, &frame);
+static void release_view(amqp_connection_state_t state) {
+  state->view_active = 0;
+  amqp_maybe_release_buffers_on_channel(state, state->view_channel);
+  if (state->view_body.len > AMQP_VIEW_BODY_KEEP_SIZE) {
+    amqp_bytes_free(state->view_body);
+    state->view_body = amqp_empty_bytes;
+  }
+}
+
+/* Makes the connection's view body buffer at least size bytes. */
+static int view_body_reserve(amqp_connection_state_t state, size_t size) {
+  void *bytes;
+
+  if (state->view_body.len >= size) {
+    return AMQP_STATUS_OK;
+  }
+  bytes = realloc(state->view_body.bytes, size);
+  if (NULL == bytes) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  state->view_body.bytes = bytes;
+  state->view_body.len = size;
+  return AMQP_STATUS_OK;
+}
+
+/* Puts a part of a body read without a codec into view->body: in place if
+ * the body came in one frame, copied into the view body buffer if not. */
+static int view_body_part(body_reader_t *reader, amqp_bytes_t part,
+                          uint64_t offset) {
+  amqp_message_view_t *view = reader->context;
+  int res;
+
+  if (part.len == reader->body_size) {
+    view->body = part;
+    return AMQP_STATUS_OK;
+  }
+  if (0 == offset) {
+    res = view_body_reserve(reader->state, (size_t)reader->body_size);
+    if (AMQP_STATUS_OK != res) {
+      return res;
     }
-    goto error_out1;
+    view->body.bytes = reader->state->view_body.bytes;
   }
+  memcpy(amqp_offset(view->body.bytes, (size_t)offset), part.bytes,
+         part.len);
+  view->body.len = (size_t)offset + part.len;
+  return AMQP_STATUS_OK;
+}
 
-  init_amqp_pool(&message->pool, 4096);
-  res = amqp_basic_properties_clone(frame.payload.properties.decoded,
-                                    &message->properties, &message->pool);
+/* Reads the header and body of the message delivered on view->channel. */
+static amqp_rpc_reply_t read_message_view(amqp_connection_state_t state,
+                                          amqp_message_view_t *view) {
+  amqp_frame_t frame;
+  amqp_rpc_reply_t ret;
+  amqp_basic_properties_t *properties;
+  body_reader_t reader;
+  int res;
 
+  ret = read_header_frame(state, view->channel, &frame);
+  if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
+    return ret;
+  }
+
+  /* The decoded properties live in the channel pool, like the frames */
+  res = amqp_frame_properties(state, &frame, &properties);
+  if (AMQP_STATUS_OK == res &&
+      SIZE_MAX < frame.payload.properties.body_size) {
+    res = AMQP_STATUS_NO_MEMORY;
+  }
   if (AMQP_STATUS_OK != res) {
-    ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
-    ret.library_error = res;
-    goto error_out3;
+    return amqp_rpc_reply_error(res);
   }
+  view->properties = *properties;
+  view->raw_properties = frame.payload.properties.raw;
+  view->body = amqp_empty_bytes;
 
-  if (0 == frame.payload.properties.body_size) {
-    message->body = amqp_empty_bytes;
+  body_reader_start(state, &reader, message_codec(state, &view->properties),
+                    view->channel, frame.payload.properties.body_size);
+  if (NULL != reader.codec) {
+    /* Decoded into the view body buffer, which the codec may grow */
+    reader.decoded.bytes = state->view_body.bytes;
+    reader.decoded_capacity = state->view_body.len;
+    reader.keep_decoded = 1;
   } else {
-    if (SIZE_MAX < frame.payload.properties.body_size) {
-      ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
-      ret.library_error = AMQP_STATUS_NO_MEMORY;
-      goto error_out1;
+    reader.on_part = view_body_part;
+    reader.context = view;
+  }
+
+  ret = read_body(&reader);
+
+  if (NULL != reader.codec) {
+    state->view_body.bytes = reader.decoded.bytes;
+    state->view_body.len = reader.decoded_capacity;
+    if (AMQP_RESPONSE_NORMAL == ret.reply_type) {
+      view->body = reader.decoded;
+      view->properties._flags &= ~AMQP_BASIC_CONTENT_ENCODING_FLAG;
+      view->properties.content_encoding = amqp_empty_bytes;
     }
-    message->body =
-        amqp_bytes_malloc((size_t)frame.payload.properties.body_size);
-    if (NULL == message->body.bytes) {
+  }
+  return ret;
+}
+
+/* Fills in the fields of view that come from frame, a basic.deliver. */
+static void view_from_delivery(amqp_message_view_t *view,
+                               const amqp_frame_t *frame) {
+  amqp_basic_deliver_t *delivery_method = frame->payload.method.decoded;
+
+  view->channel = frame->channel;
+  view->consumer_tag = delivery_method->consumer_tag;
+  view->delivery_tag = delivery_method->delivery_tag;
+  view->redelivered = delivery_method->redelivered;
+  view->exchange = delivery_method->exchange;
+  view->routing_key = delivery_method->routing_key;
+}
+
+/* Reads the message delivered by frame, a basic.deliver, and passes it to
+ * consumer's handler as a view. */
+static amqp_rpc_reply_t dispatch_delivery(
+    amqp_connection_state_t state, const amqp_frame_t *frame,
+    const amqp_consumer_entry_t *consumer) {
+  /* The handler may unregister its consumer */
+  amqp_consumer_handler_t handler = consumer->handler;
+  void *user_data = consumer->user_data;
+  amqp_message_view_t view;
+  amqp_rpc_reply_t ret;
+  int res;
+
+  if (state->view_active) {
+    release_view(state);
+  }
+
+  memset(&view, 0, sizeof(view));
+  view_from_delivery(&view, frame);
+  ret = read_message_view(state, &view);
+  if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
+    return ret;
+  }
+
+  state->view_active = 1;
+  state->view_channel = view.channel;
+  res = handler(user_data, state, &view);
+  if (state->view_active) {
+    release_view(state);
+  }
+
+  if (AMQP_STATUS_OK != res) {
+    ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+    ret.library_error = res;
+  }
+  return ret;
+}
+
+/* Waits for a basic.deliver to a consumer without a handler, dispatching the
+ * messages of those with one on the way. With buffered_only set it stops
+ * rather than wait once no further delivery has been read in full, with
+ * frame->frame_type set to 0. */
+static amqp_rpc_reply_t wait_delivery(amqp_connection_state_t state,
+                                      const struct timeval *timeout,
+                                      amqp_boolean_t buffered_only,
+                                      amqp_frame_t *frame) {
+  amqp_consumer_entry_t *consumer;
+  amqp_basic_deliver_t *delivery_method;
+  amqp_time_t deadline = amqp_time_infinite();
+  struct timeval left;
+  struct timeval *left_ptr;
+  amqp_rpc_reply_t ret;
+  int res;
+
+  memset(&ret, 0, sizeof(ret));
+
+  if (0 != state->consumer_count) {
+    /* Dispatching must not extend the wait */
+    res = amqp_time_from_now(&deadline, timeout);
+    if (AMQP_STATUS_OK != res) {
       ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
-      ret.library_error = AMQP_STATUS_NO_MEMORY;
-      goto error_out1;
+      ret.library_error = res;
+      return ret;
     }
   }
 
-  body_read = 0;
-  body_read_ptr = message->body.bytes;
-
-  while (body_read < message->body.len) {
-    res = amqp_simple_wait_frame_on_channel(state, channel, &frame);
+  for (;;) {
+    res = amqp_simple_wait_frame_noblock(state, frame, timeout);
     if (AMQP_STATUS_OK != res) {
       ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
       ret.library_error = res;
-      goto error_out2;
+      return ret;
     }
-    if (AMQP_FRAME_BODY != frame.frame_type) {
-      if (AMQP_FRAME_METHOD == frame.frame_type &&
-          (AMQP_CHANNEL_CLOSE_METHOD == frame.payload.method.id ||
-           AMQP_CONNECTION_CLOSE_METHOD == frame.payload.method.id)) {
 
-        ret.reply_type = AMQP_RESPONSE_SERVER_EXCEPTION;
-        ret.reply = frame.payload.method;
-      } else {
-        ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
-        ret.library_error = AMQP_STATUS_BAD_AMQP_DATA;
-      }
-      goto error_out2;
+    if (AMQP_FRAME_METHOD != frame->frame_type ||
+        AMQP_BASIC_DELIVER_METHOD != frame->payload.method.id) {
+      amqp_put_back_frame(state, frame);
+      ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+      ret.library_error = AMQP_STATUS_UNEXPECTED_STATE;
+      return ret;
+    }
+
+    delivery_method = frame->payload.method.decoded;
+    consumer = amqp_dispatch_find(state, frame->channel,
+                                  delivery_method->consumer_tag);
+    if (NULL == consumer) {
+      ret.reply_type = AMQP_RESPONSE_NORMAL;
+      return ret;
+    }
+
+    ret = dispatch_delivery(state, frame, consumer);
+    if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
+      return ret;
+    }
+    if (buffered_only && !amqp_delivery_buffered(state)) {
+      frame->frame_type = 0;
+      return ret;
     }
 
-    if (body_read + frame.payload.body_fragment.len > message->body.len) {
+    res = amqp_time_tv_until(deadline, &left, &left_ptr);
+    if (AMQP_STATUS_OK != res) {
       ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
-      ret.library_error = AMQP_STATUS_BAD_AMQP_DATA;
-      goto error_out2;
+      ret.library_error = res;
+      return ret;
     }
+    timeout = left_ptr;
+  }
+}
 
-    memcpy(body_read_ptr, frame.payload.body_fragment.bytes,
-           frame.payload.body_fragment.len);
+amqp_rpc_reply_t amqp_consume_message_view(amqp_connection_state_t state,
+                                           amqp_message_view_t *view,
+                                           const struct timeval *timeout,
+                                           AMQP_UNUSED int flags) {
+  amqp_frame_t frame;
+  amqp_rpc_reply_t ret;
 
-    body_read += frame.payload.body_fragment.len;
-    body_read_ptr += frame.payload.body_fragment.len;
+  memset(view, 0, sizeof(*view));
+
+  if (state->view_active) {
+    release_view(state);
   }
 
-  ret.reply_type = AMQP_RESPONSE_NORMAL;
+  ret = wait_delivery(state, timeout, 0, &frame);
+  if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
+    return ret;
+  }
+
+  view_from_delivery(view, &frame);
+  ret = read_message_view(state, view);
+  if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
+    return ret;
+  }
+
+  state->view_active = 1;
+  state->view_channel = view->channel;
   return ret;
+}
 
-error_out2:
-  amqp_bytes_free(message->body);
-error_out3:
-  empty_amqp_pool(&message->pool);
-error_out1:
+void amqp_release_message_view(amqp_connection_state_t state,
+                               amqp_message_view_t *view) {
+  if (state->view_active && view->channel == state->view_channel) {
+    release_view(state);
+  }
+  memset(view, 0, sizeof(*view));
+}
+
+int amqp_message_view_headers(amqp_connection_state_t state,
+                              amqp_message_view_t *view,
+                              amqp_table_t **headers) {
+  int res = decode_headers_once(state, view->channel, view->raw_properties,
+                                &view->properties);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+  *headers = &view->properties.headers;
+  return AMQP_STATUS_OK;
+}
+
+/* The callback of amqp_read_message_stream(), see stream_body_part() */
+typedef struct stream_callback_t_ {
+  amqp_body_fragment_callback_t on_fragment;
+  void *user_data;
+} stream_callback_t;
+
+static int stream_body_part(body_reader_t *reader, amqp_bytes_t part,
+                            AMQP_UNUSED uint64_t offset) {
+  stream_callback_t *callback = reader->context;
+  return callback->on_fragment(callback->user_data, reader->channel, part);
+}
+
+amqp_rpc_reply_t amqp_read_message_stream(
+    amqp_connection_state_t state, amqp_channel_t channel,
+    amqp_message_header_callback_t on_header,
+    amqp_body_fragment_callback_t on_fragment, void *user_data) {
+  amqp_frame_t frame;
+  amqp_rpc_reply_t ret;
+  amqp_basic_properties_t properties;
+  amqp_table_t *headers;
+  body_reader_t reader;
+  stream_callback_t callback;
+  int res;
+
+  if (NULL == on_fragment) {
+    return amqp_rpc_reply_error(AMQP_STATUS_INVALID_PARAMETER);
+  }
+  /* Fragments are released as they are passed on */
+  if (state->view_active && channel == state->view_channel) {
+    release_view(state);
+  }
+
+  ret = read_header_frame(state, channel, &frame);
+  if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
+    return ret;
+  }
+
+  res = amqp_frame_headers(state, &frame, &headers);
+  if (AMQP_STATUS_OK != res) {
+    return amqp_rpc_reply_error(res);
+  }
+  properties = *(amqp_basic_properties_t *)frame.payload.properties.decoded;
+
+  /* Once a callback or the codec fails the rest of the body is still read,
+   * and that error returned */
+  body_reader_start(state, &reader, message_codec(state, &properties),
+                    channel, frame.payload.properties.body_size);
+  if (NULL != reader.codec) {
+    properties._flags &= ~AMQP_BASIC_CONTENT_ENCODING_FLAG;
+    properties.content_encoding = amqp_empty_bytes;
+  }
+  if (NULL != on_header && AMQP_STATUS_OK == reader.res) {
+    reader.res = on_header(user_data, channel, &properties, reader.body_size);
+  }
+
+  callback.on_fragment = on_fragment;
+  callback.user_data = user_data;
+  reader.release = 1;
+  reader.on_part = stream_body_part;
+  reader.context = &callback;
+  ret = read_body(&reader);
+
+  free(reader.decoded.bytes);
+  if (AMQP_RESPONSE_SERVER_EXCEPTION != ret.reply_type) {
+    /* A server exception's method is in the channel's buffers */
+    amqp_maybe_release_buffers_on_channel(state, channel);
+  }
   return ret;
 }
+
+/* Gives amqp_read_message_into() its caller's buffer. */
+static int AMQP_CALL fixed_buffer_provider(
+    void *user_data, AMQP_UNUSED amqp_channel_t channel,
+    AMQP_UNUSED const amqp_basic_properties_t *properties,
+    AMQP_UNUSED uint64_t body_size, amqp_bytes_t *buffer) {
+  *buffer = *(amqp_bytes_t *)user_data;
+  return AMQP_STATUS_OK;
+}
+
+/* Copies a part of the body into reader->context, the caller's buffer,
+ * failing if it does not fit */
+static int buffer_body_part(body_reader_t *reader, amqp_bytes_t part,
+                            uint64_t offset) {
+  amqp_bytes_t *buffer = reader->context;
+  if (part.len > buffer->len - offset) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  memcpy(amqp_offset(buffer->bytes, (size_t)offset), part.bytes, part.len);
+  return AMQP_STATUS_OK;
+}
+
+/* Reads a message into the buffer given by provider. The channel's buffers
+ * are released as the body is read, so the properties the caller wants are
+ * copied out of them first. */
+static amqp_rpc_reply_t read_message_into(
+    amqp_connection_state_t state, amqp_channel_t channel,
+    amqp_basic_properties_t *properties_out,
+    amqp_body_buffer_provider_t provider, void *user_data, size_t *body_len) {
+  amqp_frame_t frame;
+  amqp_rpc_reply_t ret;
+  amqp_basic_properties_t properties;
+  amqp_basic_properties_t properties_copy;
+  amqp_table_t *headers;
+  amqp_bytes_t buffer = amqp_empty_bytes;
+  const amqp_body_codec_t *codec;
+  body_reader_t reader;
+  uint64_t body_size;
+  int res;
+
+  if (NULL != body_len) {
+    *body_len = 0;
+  }
+
+  if (state->view_active && channel == state->view_channel) {
+    release_view(state);
+  }
+
+  ret = read_header_frame(state, channel, &frame);
+  if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
+    return ret;
+  }
+
+  res = amqp_frame_headers(state, &frame, &headers);
+  if (AMQP_STATUS_OK != res) {
+    return amqp_rpc_reply_error(res);
+  }
+  properties = *(amqp_basic_properties_t *)frame.payload.properties.decoded;
+  body_size = frame.payload.properties.body_size;
+
+  codec = message_codec(state, &properties);
+  if (NULL != codec) {
+    properties._flags &= ~AMQP_BASIC_CONTENT_ENCODING_FLAG;
+    properties.content_encoding = amqp_empty_bytes;
+  }
+
+  res = provider(user_data, channel, &properties, body_size, &buffer);
+  if (AMQP_STATUS_OK == res && NULL == codec && buffer.len < body_size) {
+    res = AMQP_STATUS_INVALID_PARAMETER;
+  }
+  if (AMQP_STATUS_OK == res && NULL != properties_out) {
+    recycle_amqp_pool(&state->read_into_pool);
+    res = amqp_basic_properties_clone(&properties, &properties_copy,
+                                      &state->read_into_pool);
+  }
+  if (AMQP_STATUS_OK == res) {
+    body_reader_start(state, &reader, codec, channel, body_size);
+    res = reader.res;
+  }
+  if (AMQP_STATUS_OK != res) {
+    /* Nothing of the message has been taken yet: it is left to be read some
+     * other way */
+    amqp_put_back_frame(state, &frame);
+    return amqp_rpc_reply_error(res);
+  }
+
+  /* As in amqp_read_message_stream(), a body that can't be taken is still
+   * read to the end */
+  reader.release = 1;
+  reader.on_part = buffer_body_part;
+  reader.context = &buffer;
+  ret = read_body(&reader);
+
+  free(reader.decoded.bytes);
+  if (AMQP_RESPONSE_NORMAL == ret.reply_type) {
+    if (NULL != body_len) {
+      *body_len = (size_t)reader.parts_len;
+    }
+    if (NULL != properties_out) {
+      *properties_out = properties_copy;
+    }
+  }
+  if (AMQP_RESPONSE_SERVER_EXCEPTION != ret.reply_type) {
+    amqp_maybe_release_buffers_on_channel(state, channel);
+  }
+  return ret;
+}
+
+amqp_rpc_reply_t amqp_read_message_into(
+    amqp_connection_state_t state, amqp_channel_t channel,
+    amqp_basic_properties_t *properties, amqp_bytes_t buffer,
+    size_t *body_len) {
+  return read_message_into(state, channel, properties, fixed_buffer_provider,
+                           &buffer, body_len);
+}
+
+amqp_rpc_reply_t amqp_read_message_provided(
+    amqp_connection_state_t state, amqp_channel_t channel,
+    amqp_body_buffer_provider_t provider, void *user_data, size_t *body_len) {
+  if (NULL == provider) {
+    return amqp_rpc_reply_error(AMQP_STATUS_INVALID_PARAMETER);
+  }
+  return read_message_into(state, channel, NULL, provider, user_data,
+                           body_len);
+}
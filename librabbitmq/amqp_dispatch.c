@@ -0,0 +1,195 @@
+// Copyright 2007 - 2021, Alan Antonuk and the rabbitmq-c contributors.
+// SPDX-License-Identifier: mit
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+#include "rabbitmq-c/amqp.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Consumer dispatch table.
+ *
+ * Consumers registered with amqp_register_consumer() are kept in a chained
+ * hash table keyed on channel and consumer tag. The bucket array doubles when
+ * it holds more consumers than buckets, so looking up the consumer of a
+ * delivery costs a hash of its tag and, on average, a single compare however
+ * many consumers there are. The tag looked up is the one in the decoded
+ * basic.deliver, nothing is copied.
+ */
+
+#define AMQP_DISPATCH_INITIAL_BUCKETS 16
+
+/* FNV-1a over the tag, seeded with the channel */
+static uint32_t dispatch_hash(amqp_channel_t channel,
+                              amqp_bytes_t consumer_tag) {
+  uint32_t hash = 2166136261u ^ channel;
+  const uint8_t *p = consumer_tag.bytes;
+  size_t i;
+
+  hash *= 16777619u;
+  for (i = 0; i < consumer_tag.len; ++i) {
+    hash ^= p[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static amqp_consumer_entry_t **dispatch_find_link(
+    amqp_connection_state_t state, amqp_channel_t channel,
+    amqp_bytes_t consumer_tag, uint32_t hash) {
+  amqp_consumer_entry_t **link =
+      &state->consumer_buckets[hash & (state->consumer_bucket_count - 1)];
+
+  while (*link != NULL &&
+         ((*link)->hash != hash || (*link)->channel != channel ||
+          !amqp_bytes_equal((*link)->consumer_tag, consumer_tag))) {
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+/* Doubles the bucket array, or allocates it on first use. */
+static int dispatch_grow(amqp_connection_state_t state) {
+  size_t count = 0 == state->consumer_bucket_count
+                     ? AMQP_DISPATCH_INITIAL_BUCKETS
+                     : state->consumer_bucket_count * 2;
+  amqp_consumer_entry_t **buckets = calloc(count, sizeof(*buckets));
+  size_t i;
+
+  if (NULL == buckets) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  for (i = 0; i < state->consumer_bucket_count; ++i) {
+    while (state->consumer_buckets[i] != NULL) {
+      amqp_consumer_entry_t *consumer = state->consumer_buckets[i];
+      state->consumer_buckets[i] = consumer->next;
+      consumer->next = buckets[consumer->hash & (count - 1)];
+      buckets[consumer->hash & (count - 1)] = consumer;
+    }
+  }
+
+  free(state->consumer_buckets);
+  state->consumer_buckets = buckets;
+  state->consumer_bucket_count = count;
+  return AMQP_STATUS_OK;
+}
+
+amqp_consumer_entry_t *amqp_dispatch_find(amqp_connection_state_t state,
+                                          amqp_channel_t channel,
+                                          amqp_bytes_t consumer_tag) {
+  if (0 == state->consumer_count) {
+    return NULL;
+  }
+  return *dispatch_find_link(state, channel, consumer_tag,
+                             dispatch_hash(channel, consumer_tag));
+}
+
+int amqp_register_consumer(amqp_connection_state_t state,
+                           amqp_channel_t channel, amqp_bytes_t consumer_tag,
+                           amqp_consumer_handler_t handler, void *user_data) {
+  amqp_consumer_entry_t **link;
+  amqp_consumer_entry_t *consumer;
+  uint32_t hash = dispatch_hash(channel, consumer_tag);
+  int res;
+
+  if (NULL == handler) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  if (state->consumer_count >= state->consumer_bucket_count) {
+    res = dispatch_grow(state);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+
+  link = dispatch_find_link(state, channel, consumer_tag, hash);
+  if (*link != NULL) {
+    (*link)->handler = handler;
+    (*link)->user_data = user_data;
+    return AMQP_STATUS_OK;
+  }
+
+  consumer = malloc(sizeof(amqp_consumer_entry_t) + consumer_tag.len);
+  if (NULL == consumer) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  consumer->next = NULL;
+  consumer->hash = hash;
+  consumer->channel = channel;
+  consumer->consumer_tag.bytes = consumer + 1;
+  consumer->consumer_tag.len = consumer_tag.len;
+  if (0 != consumer_tag.len) {
+    memcpy(consumer->consumer_tag.bytes, consumer_tag.bytes, consumer_tag.len);
+  }
+  consumer->handler = handler;
+  consumer->user_data = user_data;
+
+  *link = consumer;
+  state->consumer_count++;
+  return AMQP_STATUS_OK;
+}
+
+int amqp_unregister_consumer(amqp_connection_state_t state,
+                             amqp_channel_t channel,
+                             amqp_bytes_t consumer_tag) {
+  amqp_consumer_entry_t **link;
+  amqp_consumer_entry_t *consumer;
+
+  if (0 == state->consumer_count) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  link = dispatch_find_link(state, channel, consumer_tag,
+                            dispatch_hash(channel, consumer_tag));
+  consumer = *link;
+  if (NULL == consumer) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  *link = consumer->next;
+  free(consumer);
+  state->consumer_count--;
+  return AMQP_STATUS_OK;
+}
+
+void amqp_dispatch_release(amqp_connection_state_t state,
+                           amqp_channel_t channel) {
+  size_t i;
+
+  for (i = 0; i < state->consumer_bucket_count && state->consumer_count > 0;
+       ++i) {
+    amqp_consumer_entry_t **link = &state->consumer_buckets[i];
+    while (*link != NULL) {
+      amqp_consumer_entry_t *consumer = *link;
+      if (consumer->channel == channel) {
+        *link = consumer->next;
+        free(consumer);
+        state->consumer_count--;
+      } else {
+        link = &consumer->next;
+      }
+    }
+  }
+}
+
+void amqp_dispatch_release_all(amqp_connection_state_t state) {
+  size_t i;
+
+  for (i = 0; i < state->consumer_bucket_count; ++i) {
+    while (state->consumer_buckets[i] != NULL) {
+      amqp_consumer_entry_t *consumer = state->consumer_buckets[i];
+      state->consumer_buckets[i] = consumer->next;
+      free(consumer);
+    }
+  }
+  free(state->consumer_buckets);
+  state->consumer_buckets = NULL;
+  state->consumer_bucket_count = 0;
+  state->consumer_count = 0;
+}
@@ -0,0 +1,212 @@
+// Copyright 2007 - 2021, Alan Antonuk and the rabbitmq-c contributors.
+// SPDX-License-Identifier: mit
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+#include "amqp_time.h"
+#include "rabbitmq-c/amqp.h"
+#include "rabbitmq-c/framing.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Broker flow control.
+ *
+ * connection.blocked/connection.unblocked and channel.flow are handled as
+ * they are read, like publisher confirms. Publishing checks the resulting
+ * state before writing anything, so a blocked publisher waits on the socket
+ * for the broker to lift the block, or gives up, rather than filling the TCP
+ * buffers and hanging in a write.
+ *
+ * A connection that only publishes never reads, so every
+ * AMQP_FLOW_POLL_INTERVAL publishes the socket is read without waiting to
+ * pick up any notification the broker has sent.
+ *
+ * channel.flow can be read while a frame is partly written, as sends read
+ * while they wait for the socket. Its channel.flow-ok is only noted then, and
+ * sent by amqp_flow_send_oks() at the next frame boundary: before a method
+ * frame, after reading in the wait loops, or before a publish. The reply
+ * carries the state the channel is in by the time it is sent.
+ */
+
+static amqp_flow_channel_t **flow_find(amqp_connection_state_t state,
+                                       amqp_channel_t channel) {
+  amqp_flow_channel_t **link = &state->flow_channels;
+  while (*link != NULL && (*link)->channel != channel) {
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+/* Frees the entry at *link once it has nothing left to track */
+static void flow_maybe_free(amqp_flow_channel_t **link) {
+  amqp_flow_channel_t *entry = *link;
+  if (!entry->paused && !entry->ok_pending) {
+    *link = entry->next;
+    free(entry);
+  }
+}
+
+int amqp_flow_handle_frame(amqp_connection_state_t state,
+                           const amqp_frame_t *frame) {
+  amqp_channel_flow_t *flow;
+  amqp_flow_channel_t **link;
+
+  if (AMQP_FRAME_METHOD != frame->frame_type) {
+    return 0;
+  }
+
+  switch (frame->payload.method.id) {
+    case AMQP_CONNECTION_BLOCKED_METHOD:
+      state->blocked = 1;
+      return 1;
+    case AMQP_CONNECTION_UNBLOCKED_METHOD:
+      state->blocked = 0;
+      return 1;
+    case AMQP_CHANNEL_FLOW_METHOD:
+      break;
+    default:
+      return 0;
+  }
+
+  flow = frame->payload.method.decoded;
+  link = flow_find(state, frame->channel);
+  if (NULL == *link) {
+    *link = calloc(1, sizeof(amqp_flow_channel_t));
+    if (NULL == *link) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+    (*link)->channel = frame->channel;
+  }
+  (*link)->paused = !flow->active;
+  (*link)->ok_pending = 1;
+  return 1;
+}
+
+int amqp_flow_send_oks(amqp_connection_state_t state) {
+  amqp_flow_channel_t **link = &state->flow_channels;
+  amqp_channel_flow_ok_t flow_ok;
+  amqp_channel_t channel;
+  int res;
+
+  while (*link != NULL) {
+    /* Not in the middle of a streamed publish's content on its channel */
+    if (!(*link)->ok_pending ||
+        (state->publish_active && state->publish_channel == (*link)->channel)) {
+      link = &(*link)->next;
+      continue;
+    }
+
+    channel = (*link)->channel;
+    flow_ok.active = !(*link)->paused;
+    (*link)->ok_pending = 0;
+    flow_maybe_free(link);
+
+    /* Sending sends the other replies, so look again from the start */
+    res = amqp_send_method(state, channel, AMQP_CHANNEL_FLOW_OK_METHOD,
+                           &flow_ok);
+    if (AMQP_STATUS_OK != res && AMQP_STATUS_WOULD_BLOCK != res) {
+      return res;
+    }
+    link = &state->flow_channels;
+  }
+  return AMQP_STATUS_OK;
+}
+
+static amqp_boolean_t flow_channel_active(amqp_connection_state_t state,
+                                          amqp_channel_t channel) {
+  amqp_flow_channel_t *entry = *flow_find(state, channel);
+  return NULL == entry || !entry->paused;
+}
+
+static amqp_boolean_t flow_publish_allowed(amqp_connection_state_t state,
+                                           amqp_channel_t channel) {
+  return !state->blocked && flow_channel_active(state, channel);
+}
+
+int amqp_flow_wait_for_publish(amqp_connection_state_t state,
+                               amqp_channel_t channel) {
+  amqp_time_t deadline;
+  int res;
+
+  if (++state->publishes_since_flow_poll >= AMQP_FLOW_POLL_INTERVAL) {
+    state->publishes_since_flow_poll = 0;
+    res = amqp_poll_input(state);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+
+  res = amqp_flow_send_oks(state);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  if (flow_publish_allowed(state, channel)) {
+    return AMQP_STATUS_OK;
+  }
+  if (state->publish_blocked_timeout != NULL &&
+      0 == state->publish_blocked_timeout->tv_sec &&
+      0 == state->publish_blocked_timeout->tv_usec) {
+    return AMQP_STATUS_CONNECTION_BLOCKED;
+  }
+
+  res = amqp_time_from_now(&deadline, state->publish_blocked_timeout);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  while (!flow_publish_allowed(state, channel)) {
+    res = amqp_wait_control_frame(state, deadline);
+    if (AMQP_STATUS_TIMEOUT == res) {
+      return AMQP_STATUS_CONNECTION_BLOCKED;
+    } else if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+  return AMQP_STATUS_OK;
+}
+
+void amqp_flow_release(amqp_connection_state_t state, amqp_channel_t channel) {
+  amqp_flow_channel_t **link = flow_find(state, channel);
+  if (*link != NULL) {
+    (*link)->paused = 0;
+    (*link)->ok_pending = 0;
+    flow_maybe_free(link);
+  }
+}
+
+void amqp_flow_release_all(amqp_connection_state_t state) {
+  while (state->flow_channels != NULL) {
+    amqp_flow_channel_t *entry = state->flow_channels;
+    state->flow_channels = entry->next;
+    free(entry);
+  }
+}
+
+amqp_boolean_t amqp_connection_is_blocked(amqp_connection_state_t state) {
+  return state->blocked;
+}
+
+amqp_boolean_t amqp_channel_flow_active(amqp_connection_state_t state,
+                                        amqp_channel_t channel) {
+  return flow_channel_active(state, channel);
+}
+
+int amqp_set_publish_blocked_timeout(amqp_connection_state_t state,
+                                     const struct timeval *timeout) {
+  if (timeout) {
+    if (timeout->tv_sec < 0 || timeout->tv_usec < 0) {
+      return AMQP_STATUS_INVALID_PARAMETER;
+    }
+    state->internal_publish_blocked_timeout = *timeout;
+    state->publish_blocked_timeout = &state->internal_publish_blocked_timeout;
+  } else {
+    state->publish_blocked_timeout = NULL;
+  }
+  return AMQP_STATUS_OK;
+}
@@ -1611,6 +1611,181 @@ int amqp_decode_properties(uint16_t class_id, amqp_pool_t *pool,
   }
 }
 
+int amqp_decode_properties_lazy(uint16_t class_id, amqp_bytes_t encoded,
+                                void *decoded, amqp_bytes_t *raw_table) {
+  size_t offset = 0;
+
+  amqp_flags_t flags = 0;
+  int flagword_index = 0;
+  uint16_t partial_flags;
+
+  *raw_table = amqp_empty_bytes;
+
+  do {
+    if (!amqp_decode_16(encoded, &offset, &partial_flags))
+      return AMQP_STATUS_BAD_AMQP_DATA;
+    flags |= (partial_flags << (flagword_index * 16));
+    flagword_index++;
+  } while (partial_flags & 1);
+
+  switch (class_id) {
+    case 10: {
+      amqp_connection_properties_t *p = (amqp_connection_properties_t *)decoded;
+      memset(p, 0, sizeof(amqp_connection_properties_t));
+      p->_flags = flags;
+      return 0;
+    }
+    case 20: {
+      amqp_channel_properties_t *p = (amqp_channel_properties_t *)decoded;
+      memset(p, 0, sizeof(amqp_channel_properties_t));
+      p->_flags = flags;
+      return 0;
+    }
+    case 30: {
+      amqp_access_properties_t *p = (amqp_access_properties_t *)decoded;
+      memset(p, 0, sizeof(amqp_access_properties_t));
+      p->_flags = flags;
+      return 0;
+    }
+    case 40: {
+      amqp_exchange_properties_t *p = (amqp_exchange_properties_t *)decoded;
+      memset(p, 0, sizeof(amqp_exchange_properties_t));
+      p->_flags = flags;
+      return 0;
+    }
+    case 50: {
+      amqp_queue_properties_t *p = (amqp_queue_properties_t *)decoded;
+      memset(p, 0, sizeof(amqp_queue_properties_t));
+      p->_flags = flags;
+      return 0;
+    }
+    case 60: {
+      amqp_basic_properties_t *p = (amqp_basic_properties_t *)decoded;
+      memset(p, 0, sizeof(amqp_basic_properties_t));
+      p->_flags = flags;
+      if (flags & AMQP_BASIC_CONTENT_TYPE_FLAG) {
+        {
+          uint8_t len;
+          if (!amqp_decode_8(encoded, &offset, &len) ||
+              !amqp_decode_bytes(encoded, &offset, &p->content_type, len))
+            return AMQP_STATUS_BAD_AMQP_DATA;
+        }
+      }
+      if (flags & AMQP_BASIC_CONTENT_ENCODING_FLAG) {
+        {
+          uint8_t len;
+          if (!amqp_decode_8(encoded, &offset, &len) ||
+              !amqp_decode_bytes(encoded, &offset, &p->content_encoding, len))
+            return AMQP_STATUS_BAD_AMQP_DATA;
+        }
+      }
+      if (flags & AMQP_BASIC_HEADERS_FLAG) {
+        {
+          size_t start = offset;
+          uint32_t len;
+          amqp_bytes_t table;
+          if (!amqp_decode_32(encoded, &offset, &len) ||
+              !amqp_decode_bytes(encoded, &offset, &table, len))
+            return AMQP_STATUS_BAD_AMQP_DATA;
+          raw_table->bytes = amqp_offset(encoded.bytes, start);
+          raw_table->len = offset - start;
+        }
+      }
+      if (flags & AMQP_BASIC_DELIVERY_MODE_FLAG) {
+        if (!amqp_decode_8(encoded, &offset, &p->delivery_mode))
+          return AMQP_STATUS_BAD_AMQP_DATA;
+      }
+      if (flags & AMQP_BASIC_PRIORITY_FLAG) {
+        if (!amqp_decode_8(encoded, &offset, &p->priority))
+          return AMQP_STATUS_BAD_AMQP_DATA;
+      }
+      if (flags & AMQP_BASIC_CORRELATION_ID_FLAG) {
+        {
+          uint8_t len;
+          if (!amqp_decode_8(encoded, &offset, &len) ||
+              !amqp_decode_bytes(encoded, &offset, &p->correlation_id, len))
+            return AMQP_STATUS_BAD_AMQP_DATA;
+        }
+      }
+      if (flags & AMQP_BASIC_REPLY_TO_FLAG) {
+        {
+          uint8_t len;
+          if (!amqp_decode_8(encoded, &offset, &len) ||
+              !amqp_decode_bytes(encoded, &offset, &p->reply_to, len))
+            return AMQP_STATUS_BAD_AMQP_DATA;
+        }
+      }
+      if (flags & AMQP_BASIC_EXPIRATION_FLAG) {
+        {
+          uint8_t len;
+          if (!amqp_decode_8(encoded, &offset, &len) ||
+              !amqp_decode_bytes(encoded, &offset, &p->expiration, len))
+            return AMQP_STATUS_BAD_AMQP_DATA;
+        }
+      }
+      if (flags & AMQP_BASIC_MESSAGE_ID_FLAG) {
+        {
+          uint8_t len;
+          if (!amqp_decode_8(encoded, &offset, &len) ||
+              !amqp_decode_bytes(encoded, &offset, &p->message_id, len))
+            return AMQP_STATUS_BAD_AMQP_DATA;
+        }
+      }
+      if (flags & AMQP_BASIC_TIMESTAMP_FLAG) {
+        if (!amqp_decode_64(encoded, &offset, &p->timestamp))
+          return AMQP_STATUS_BAD_AMQP_DATA;
+      }
+      if (flags & AMQP_BASIC_TYPE_FLAG) {
+        {
+          uint8_t len;
+          if (!amqp_decode_8(encoded, &offset, &len) ||
+              !amqp_decode_bytes(encoded, &offset, &p->type, len))
+            return AMQP_STATUS_BAD_AMQP_DATA;
+        }
+      }
+      if (flags & AMQP_BASIC_USER_ID_FLAG) {
+        {
+          uint8_t len;
+          if (!amqp_decode_8(encoded, &offset, &len) ||
+              !amqp_decode_bytes(encoded, &offset, &p->user_id, len))
+            return AMQP_STATUS_BAD_AMQP_DATA;
+        }
+      }
+      if (flags & AMQP_BASIC_APP_ID_FLAG) {
+        {
+          uint8_t len;
+          if (!amqp_decode_8(encoded, &offset, &len) ||
+              !amqp_decode_bytes(encoded, &offset, &p->app_id, len))
+            return AMQP_STATUS_BAD_AMQP_DATA;
+        }
+      }
+      if (flags & AMQP_BASIC_CLUSTER_ID_FLAG) {
+        {
+          uint8_t len;
+          if (!amqp_decode_8(encoded, &offset, &len) ||
+              !amqp_decode_bytes(encoded, &offset, &p->cluster_id, len))
+            return AMQP_STATUS_BAD_AMQP_DATA;
+        }
+      }
+      return 0;
+    }
+    case 90: {
+      amqp_tx_properties_t *p = (amqp_tx_properties_t *)decoded;
+      memset(p, 0, sizeof(amqp_tx_properties_t));
+      p->_flags = flags;
+      return 0;
+    }
+    case 85: {
+      amqp_confirm_properties_t *p = (amqp_confirm_properties_t *)decoded;
+      memset(p, 0, sizeof(amqp_confirm_properties_t));
+      p->_flags = flags;
+      return 0;
+    }
+    default:
+      return AMQP_STATUS_UNKNOWN_CLASS;
+  }
+}
+
 int amqp_encode_method(amqp_method_number_t methodNumber, void *decoded,
                        amqp_bytes_t encoded) {
   size_t offset = 0;
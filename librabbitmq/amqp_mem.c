@@ -6,6 +6,7 @@
 #endif
 
 #include "amqp_private.h"
+#include "threads.h"
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -17,6 +18,138 @@ char const *amqp_version(void) { return AMQP_VERSION_STRING; }
 
 uint32_t amqp_version_number(void) { return AMQP_VERSION; }
 
+/*
+ * Pool page cache.
+ *
+ * Every block a pool allocates, whether a page, a large block or the array
+ * listing them, is preceded by an amqp_pool_block_t recording its size. While
+ * the cache is enabled with amqp_set_page_cache(), blocks of up to
+ * AMQP_PAGE_CACHE_MAX_SIZE are allocated rounded up to a power of two, and
+ * freed blocks of those sizes are kept on a free list per size as long as the
+ * cache holds less than page_cache_max_bytes. The pools of every connection
+ * in the process share the cache. The mutex is only taken when a pool needs a
+ * new block or frees one, not for allocations made from a page.
+ */
+#define AMQP_PAGE_CACHE_MIN_SIZE 64
+#define AMQP_PAGE_CACHE_CLASSES 15
+#define AMQP_PAGE_CACHE_MAX_SIZE \
+  (AMQP_PAGE_CACHE_MIN_SIZE << (AMQP_PAGE_CACHE_CLASSES - 1))
+
+typedef union amqp_pool_block_t_ {
+  struct {
+    union amqp_pool_block_t_ *next; /* while on a free list */
+    size_t size;                    /* usable bytes following the header */
+  } h;
+  /* Keeps what follows the header aligned as malloc() aligns */
+  uint64_t align[2];
+} amqp_pool_block_t;
+
+static pthread_mutex_t page_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Only changed by amqp_set_page_cache(), which must not race pool use */
+static size_t page_cache_max_bytes;
+static size_t page_cache_bytes;
+static amqp_pool_block_t *page_cache[AMQP_PAGE_CACHE_CLASSES];
+
+/* Returns the free list for blocks of *size bytes, rounding *size up to its
+ * size, or -1 if blocks that size are not cached. */
+static int page_cache_class(size_t *size) {
+  size_t class_size = AMQP_PAGE_CACHE_MIN_SIZE;
+  int size_class = 0;
+
+  if (*size > AMQP_PAGE_CACHE_MAX_SIZE) {
+    return -1;
+  }
+  while (class_size < *size) {
+    class_size <<= 1;
+    size_class++;
+  }
+  *size = class_size;
+  return size_class;
+}
+
+static void *pool_block_alloc(size_t size) {
+  amqp_pool_block_t *block = NULL;
+
+  if (0 != page_cache_max_bytes) {
+    int size_class = page_cache_class(&size);
+    if (size_class >= 0) {
+      pthread_mutex_lock(&page_cache_mutex);
+      block = page_cache[size_class];
+      if (NULL != block) {
+        page_cache[size_class] = block->h.next;
+        page_cache_bytes -= size;
+      }
+      pthread_mutex_unlock(&page_cache_mutex);
+    }
+  }
+
+  if (NULL == block) {
+    if (size > SIZE_MAX - sizeof(amqp_pool_block_t)) {
+      return NULL;
+    }
+    block = malloc(sizeof(amqp_pool_block_t) + size);
+    if (NULL == block) {
+      return NULL;
+    }
+    block->h.size = size;
+  }
+  return block + 1;
+}
+
+static void pool_block_free(void *p) {
+  amqp_pool_block_t *block = (amqp_pool_block_t *)p - 1;
+
+  if (0 != page_cache_max_bytes) {
+    size_t size = block->h.size;
+    int size_class = page_cache_class(&size);
+
+    /* Blocks allocated while the cache was disabled may not be a class size */
+    if (size_class >= 0 && size == block->h.size) {
+      pthread_mutex_lock(&page_cache_mutex);
+      if (page_cache_bytes + size <= page_cache_max_bytes) {
+        block->h.next = page_cache[size_class];
+        page_cache[size_class] = block;
+        page_cache_bytes += size;
+        block = NULL;
+      }
+      pthread_mutex_unlock(&page_cache_mutex);
+      if (NULL == block) {
+        return;
+      }
+    }
+  }
+  free(block);
+}
+
+static size_t pool_block_size(void *p) {
+  return ((amqp_pool_block_t *)p - 1)->h.size;
+}
+
+void amqp_set_page_cache(size_t max_bytes) {
+  int i;
+
+  pthread_mutex_lock(&page_cache_mutex);
+  page_cache_max_bytes = max_bytes;
+  for (i = AMQP_PAGE_CACHE_CLASSES - 1; i >= 0; --i) {
+    while (page_cache_bytes > max_bytes && NULL != page_cache[i]) {
+      amqp_pool_block_t *block = page_cache[i];
+      page_cache[i] = block->h.next;
+      page_cache_bytes -= block->h.size;
+      free(block);
+    }
+  }
+  pthread_mutex_unlock(&page_cache_mutex);
+}
+
+size_t amqp_page_cache_bytes(void) {
+  size_t bytes;
+
+  pthread_mutex_lock(&page_cache_mutex);
+  bytes = page_cache_bytes;
+  pthread_mutex_unlock(&page_cache_mutex);
+  return bytes;
+}
+
 void init_amqp_pool(amqp_pool_t *pool, size_t pagesize) {
   pool->pagesize = pagesize ? pagesize : 4096;
 
@@ -36,9 +169,9 @@ static void empty_blocklist(amqp_pool_blocklist_t *x) {
 
   if (x->blocklist != NULL) {
     for (i = 0; i < x->num_blocks; i++) {
-      free(x->blocklist[i]);
+      pool_block_free(x->blocklist[i]);
     }
-    free(x->blocklist);
+    pool_block_free(x->blocklist);
   }
   x->num_blocks = 0;
   x->blocklist = NULL;
@@ -56,20 +189,23 @@ void empty_amqp_pool(amqp_pool_t *pool) {
   empty_blocklist(&pool->pages);
 }
 
+/* Block list arrays start with room for this many blocks, and double */
+#define AMQP_POOL_BLOCKLIST_MIN 8
+
 /* Returns 1 on success, 0 on failure */
 static int record_pool_block(amqp_pool_blocklist_t *x, void *block) {
-  size_t blocklistlength = sizeof(void *) * (x->num_blocks + 1);
-
-  if (x->blocklist == NULL) {
-    x->blocklist = malloc(blocklistlength);
-    if (x->blocklist == NULL) {
-      return 0;
-    }
-  } else {
-    void *newbl = realloc(x->blocklist, blocklistlength);
+  if (x->blocklist == NULL ||
+      (size_t)x->num_blocks == pool_block_size(x->blocklist) / sizeof(void *)) {
+    size_t capacity =
+        x->blocklist == NULL ? AMQP_POOL_BLOCKLIST_MIN : 2 * x->num_blocks;
+    void **newbl = pool_block_alloc(sizeof(void *) * capacity);
     if (newbl == NULL) {
       return 0;
     }
+    if (x->blocklist != NULL) {
+      memcpy(newbl, x->blocklist, sizeof(void *) * x->num_blocks);
+      pool_block_free(x->blocklist);
+    }
     x->blocklist = newbl;
   }
 
@@ -86,12 +222,12 @@ void *amqp_pool_alloc(amqp_pool_t *pool, size_t amount) {
   amount = (amount + 7) & (~7); /* round up to nearest 8-byte boundary */
 
   if (amount > pool->pagesize) {
-    void *result = calloc(1, amount);
+    void *result = pool_block_alloc(amount);
     if (result == NULL) {
       return NULL;
     }
     if (!record_pool_block(&pool->large_blocks, result)) {
-      free(result);
+      pool_block_free(result);
       return NULL;
     }
     return result;
@@ -108,11 +244,13 @@ void *amqp_pool_alloc(amqp_pool_t *pool, size_t amount) {
   }
 
   if (pool->next_page >= pool->pages.num_blocks) {
-    pool->alloc_block = calloc(1, pool->pagesize);
+    pool->alloc_block = pool_block_alloc(pool->pagesize);
     if (pool->alloc_block == NULL) {
       return NULL;
     }
     if (!record_pool_block(&pool->pages, pool->alloc_block)) {
+      pool_block_free(pool->alloc_block);
+      pool->alloc_block = NULL;
       return NULL;
     }
     pool->next_page = pool->pages.num_blocks;
@@ -158,17 +296,22 @@ amqp_bytes_t amqp_bytes_malloc(size_t amount) {
 
 void amqp_bytes_free(amqp_bytes_t bytes) { free(bytes.bytes); }
 
-amqp_pool_t *amqp_get_or_create_channel_pool(amqp_connection_state_t state,
-                                             amqp_channel_t channel) {
+amqp_pool_table_entry_t *amqp_get_or_create_channel_pool_entry(
+    amqp_connection_state_t state, amqp_channel_t channel) {
+  amqp_pool_table_entry_t **block = state->pool_table[channel >> 8];
   amqp_pool_table_entry_t *entry;
-  size_t index = channel % POOL_TABLE_SIZE;
 
-  entry = state->pool_table[index];
-
-  for (; NULL != entry; entry = entry->next) {
-    if (channel == entry->channel) {
-      return &entry->pool;
+  if (NULL == block) {
+    block = calloc(POOL_TABLE_SIZE, sizeof(amqp_pool_table_entry_t *));
+    if (NULL == block) {
+      return NULL;
     }
+    state->pool_table[channel >> 8] = block;
+  }
+
+  entry = block[channel & 0xFF];
+  if (NULL != entry) {
+    return entry;
   }
 
   entry = malloc(sizeof(amqp_pool_table_entry_t));
@@ -177,28 +320,56 @@ amqp_pool_t *amqp_get_or_create_channel_pool(amqp_connection_state_t state,
   }
 
   entry->channel = channel;
-  entry->next = state->pool_table[index];
-  state->pool_table[index] = entry;
+  entry->closed = 0;
+  entry->inbound_generation = 0;
+  entry->first_queued_frame = NULL;
+  entry->last_queued_frame = NULL;
+  entry->prev = NULL;
+  entry->next = state->pool_entries;
+  if (NULL != entry->next) {
+    entry->next->prev = entry;
+  }
+  state->pool_entries = entry;
+  block[channel & 0xFF] = entry;
 
-  init_amqp_pool(&entry->pool, state->frame_max);
+  init_amqp_pool(&entry->pool, AMQP_CHANNEL_POOL_PAGE_SIZE);
 
-  return &entry->pool;
+  return entry;
 }
 
-amqp_pool_t *amqp_get_channel_pool(amqp_connection_state_t state,
-                                   amqp_channel_t channel) {
-  amqp_pool_table_entry_t *entry;
-  size_t index = channel % POOL_TABLE_SIZE;
+void amqp_free_channel_pool_entry(amqp_connection_state_t state,
+                                  amqp_pool_table_entry_t *entry) {
+  state->pool_table[entry->channel >> 8][entry->channel & 0xFF] = NULL;
+  if (NULL == entry->prev) {
+    state->pool_entries = entry->next;
+  } else {
+    entry->prev->next = entry->next;
+  }
+  if (NULL != entry->next) {
+    entry->next->prev = entry->prev;
+  }
+  empty_amqp_pool(&entry->pool);
+  free(entry);
+}
+
+amqp_pool_t *amqp_get_or_create_channel_pool(amqp_connection_state_t state,
+                                             amqp_channel_t channel) {
+  amqp_pool_table_entry_t *entry =
+      amqp_get_or_create_channel_pool_entry(state, channel);
+  return NULL == entry ? NULL : &entry->pool;
+}
 
-  entry = state->pool_table[index];
+amqp_pool_table_entry_t *amqp_get_channel_pool_entry(
+    amqp_connection_state_t state, amqp_channel_t channel) {
+  amqp_pool_table_entry_t **block = state->pool_table[channel >> 8];
 
-  for (; NULL != entry; entry = entry->next) {
-    if (channel == entry->channel) {
-      return &entry->pool;
-    }
-  }
+  return NULL == block ? NULL : block[channel & 0xFF];
+}
 
-  return NULL;
+amqp_pool_t *amqp_get_channel_pool(amqp_connection_state_t state,
+                                   amqp_channel_t channel) {
+  amqp_pool_table_entry_t *entry = amqp_get_channel_pool_entry(state, channel);
+  return NULL == entry ? NULL : &entry->pool;
 }
 
 int amqp_bytes_equal(amqp_bytes_t r, amqp_bytes_t l) {
@@ -47,6 +47,13 @@ static ENGINE *openssl_engine = NULL;
     }                                                                       \
   } while (0)
 
+/* Buffers smaller than this are gathered into a single SSL_write() by
+ * amqp_ssl_socket_writev() so that frame headers and footers do not each end
+ * up in a TLS record of their own. */
+#define AMQP_SSL_WRITEV_COPY_MAX 4096
+/* Largest plaintext payload of a single TLS record */
+#define AMQP_SSL_WRITEV_BUFFER_SIZE 16384
+
 struct amqp_ssl_socket_t {
   const struct amqp_socket_class_t *klass;
   SSL_CTX *ctx;
@@ -55,6 +62,7 @@ struct amqp_ssl_socket_t {
   amqp_boolean_t verify_peer;
   amqp_boolean_t verify_hostname;
   int internal_error;
+  char writev_buffer[AMQP_SSL_WRITEV_BUFFER_SIZE];
 };
 
 static ssize_t amqp_ssl_socket_send(void *base, const void *buf, size_t len,
@@ -102,6 +110,35 @@ static ssize_t amqp_ssl_socket_send(void *base, const void *buf, size_t len,
   return (ssize_t)res;
 }
 
+static ssize_t amqp_ssl_socket_writev(void *base, const struct iovec *iov,
+                                      int iovcnt, int flags) {
+  struct amqp_ssl_socket_t *self = (struct amqp_ssl_socket_t *)base;
+  size_t used = 0;
+  int i;
+
+  /* OpenSSL has no scatter-gather write. Large buffers (message bodies) are
+   * written in place, small ones are coalesced into one record. Since the
+   * coalesced data is always a prefix of iov, a short write can be reported to
+   * the caller as-is. */
+  if (1 == iovcnt || iov[0].iov_len >= AMQP_SSL_WRITEV_COPY_MAX) {
+    return amqp_ssl_socket_send(base, iov[0].iov_base, iov[0].iov_len, flags);
+  }
+
+  for (i = 0; i < iovcnt && used < sizeof(self->writev_buffer); ++i) {
+    size_t len = iov[i].iov_len;
+    if (0 != i && len >= AMQP_SSL_WRITEV_COPY_MAX) {
+      break;
+    }
+    if (len > sizeof(self->writev_buffer) - used) {
+      len = sizeof(self->writev_buffer) - used;
+    }
+    memcpy(self->writev_buffer + used, iov[i].iov_base, len);
+    used += len;
+  }
+
+  return amqp_ssl_socket_send(base, self->writev_buffer, used, flags);
+}
+
 static ssize_t amqp_ssl_socket_recv(void *base, void *buf, size_t len,
                                     AMQP_UNUSED int flags) {
   struct amqp_ssl_socket_t *self = (struct amqp_ssl_socket_t *)base;
@@ -303,11 +340,14 @@ static void amqp_ssl_socket_delete(void *base) {
 
 static const struct amqp_socket_class_t amqp_ssl_socket_class = {
     amqp_ssl_socket_send,       /* send */
+    amqp_ssl_socket_writev,     /* writev */
     amqp_ssl_socket_recv,       /* recv */
     amqp_ssl_socket_open,       /* open */
     amqp_ssl_socket_close,      /* close */
     amqp_ssl_socket_get_sockfd, /* get_sockfd */
-    amqp_ssl_socket_delete      /* delete */
+    amqp_ssl_socket_delete,     /* delete */
+    NULL,                       /* sendfile */
+    NULL                        /* readv */
 };
 
 amqp_socket_t *amqp_ssl_socket_new(amqp_connection_state_t state) {
@@ -336,7 +376,10 @@ amqp_socket_t *amqp_ssl_socket_new(amqp_connection_state_t state) {
   amqp_ssl_socket_set_ssl_versions((amqp_socket_t *)self, AMQP_TLSv1_2,
                                    AMQP_TLSvLATEST);
 
-  SSL_CTX_set_mode(self->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE);
+  /* amqp_ssl_socket_writev() may retry a write from its own buffer rather
+   * than the caller's, so allow the buffer to move between retries. */
+  SSL_CTX_set_mode(self->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                                  SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
   /* OpenSSL v1.1.1 turns this on by default, which makes the non-blocking
    * logic not behave as expected, so turn this back off */
   SSL_CTX_clear_mode(self->ctx, SSL_MODE_AUTO_RETRY);
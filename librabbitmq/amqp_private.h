@@ -28,11 +28,26 @@
 #define WIN32_LEAN_AND_MEAN
 #endif
 #include <winsock2.h>
+/* Windows has no struct iovec; WSABUF has the fields in the other order, so
+ * the socket layer converts between the two. */
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
 #else
 #include <arpa/inet.h>
+#include <limits.h>
 #include <sys/uio.h>
 #endif
 
+/* Upper bound on the number of buffers passed to a single
+ * amqp_socket_writev() call. */
+#if defined(IOV_MAX) && IOV_MAX < 64
+#define AMQP_SOCKET_MAX_IOV IOV_MAX
+#else
+#define AMQP_SOCKET_MAX_IOV 64
+#endif
+
 /* GCC attributes */
 #if __GNUC__ > 2 || (__GNUC__ == 2 && __GNUC_MINOR__ > 4)
 #define AMQP_NORETURN __attribute__((__noreturn__))
@@ -89,7 +104,8 @@ typedef enum amqp_status_private_enum_ {
   /* 0x01xx -> AMQP_STATUS_TCP_* */
   /* 0x02xx -> AMQP_STATUS_SSL_* */
   AMQP_PRIVATE_STATUS_SOCKET_NEEDREAD = -0x1301,
-  AMQP_PRIVATE_STATUS_SOCKET_NEEDWRITE = -0x1302
+  AMQP_PRIVATE_STATUS_SOCKET_NEEDWRITE = -0x1302,
+  AMQP_PRIVATE_STATUS_FILE_ENDED = -0x1303
 } amqp_status_private_enum;
 
 /* 7 bytes up front, then payload, then 1 byte footer */
@@ -98,21 +114,106 @@ typedef enum amqp_status_private_enum_ {
 
 #define AMQP_PSEUDOFRAME_PROTOCOL_HEADER 'A'
 
-typedef struct amqp_link_t_ {
-  struct amqp_link_t_ *next;
-  void *data;
-} amqp_link_t;
-
-#define POOL_TABLE_SIZE 16
+/* Channel pools are found through a two level table, indexed by the high
+ * then the low byte of the channel number. Blocks of the second level are
+ * only allocated for the ranges of channels in use. */
+#define POOL_TABLE_SIZE 256
+
+/* Channel pools decode methods and headers into pages of this size, whatever
+ * frame_max is. Larger frames, body frames mostly, get a block of their own,
+ * freed when the channel's buffers are released. */
+#define AMQP_CHANNEL_POOL_PAGE_SIZE 4096
+
+struct amqp_pool_table_entry_t_;
+
+/* A frame read but not yet returned, allocated from its channel's pool. It is
+ * on the connection's list of queued frames, in the order they arrived, and
+ * on its channel's, so that either can be dequeued from in O(1). */
+typedef struct amqp_queued_frame_t_ {
+  struct amqp_queued_frame_t_ *next;
+  struct amqp_queued_frame_t_ *prev;
+  struct amqp_queued_frame_t_ *channel_next;
+  struct amqp_pool_table_entry_t_ *entry;
+  amqp_frame_t frame;
+} amqp_queued_frame_t;
 
 typedef struct amqp_pool_table_entry_t_ {
+  /* The connection's list of entries, in no particular order */
   struct amqp_pool_table_entry_t_ *next;
+  struct amqp_pool_table_entry_t_ *prev;
   amqp_pool_t pool;
   amqp_channel_t channel;
+  /* Set once channel.close-ok is sent or received, the entry is then freed
+   * when the channel's buffers are released. See amqp_channel.c */
+  amqp_boolean_t closed;
+  /* Oldest socket buffer generation frames in pool may point into, 0 for
+   * none. See amqp_handle_input_in_place(). */
+  uint64_t inbound_generation;
+  /* Frames queued for the channel */
+  amqp_queued_frame_t *first_queued_frame;
+  amqp_queued_frame_t *last_queued_frame;
 } amqp_pool_table_entry_t;
 
+/* A socket buffer that frames decoded in place may still point into, kept
+ * until every channel pool referencing it has been recycled */
+typedef struct amqp_retired_buffer_t_ {
+  struct amqp_retired_buffer_t_ *next;
+  amqp_bytes_t bytes;
+  uint64_t generation;
+} amqp_retired_buffer_t;
+
+/* Publisher confirm bookkeeping for a channel in confirm mode, see
+ * amqp_confirm.c */
+typedef struct amqp_confirm_tracker_t_ {
+  struct amqp_confirm_tracker_t_ *next;
+  amqp_channel_t channel;
+
+  /* Sequence number of the next message published, and the lowest sequence
+   * number not yet confirmed. Everything in between is in flight. */
+  uint64_t next_seqno;
+  uint64_t first_unconfirmed;
+
+  size_t max_in_flight;
+  /* Bit per in-flight sequence number, indexed modulo window_mask + 1, set
+   * for messages confirmed out of order */
+  uint64_t *confirmed;
+  uint64_t window_mask;
+
+  /* Ring of max_in_flight confirms waiting for amqp_confirm_poll() */
+  amqp_confirm_t *events;
+  size_t events_head;
+  size_t events_count;
+
+  amqp_confirm_callback_t callback;
+  void *user_data;
+} amqp_confirm_tracker_t;
+
+/* A channel the broker has paused with channel.flow, or whose channel.flow-ok
+ * is yet to be sent, see amqp_flow.c */
+typedef struct amqp_flow_channel_t_ {
+  struct amqp_flow_channel_t_ *next;
+  amqp_channel_t channel;
+  amqp_boolean_t paused;
+  amqp_boolean_t ok_pending;
+} amqp_flow_channel_t;
+
+/* A consumer registered with amqp_register_consumer(), see
+ * amqp_dispatch.c. consumer_tag is a copy, allocated along with the entry. */
+typedef struct amqp_consumer_entry_t_ {
+  struct amqp_consumer_entry_t_ *next;
+  uint32_t hash;
+  amqp_channel_t channel;
+  amqp_bytes_t consumer_tag;
+  amqp_consumer_handler_t handler;
+  void *user_data;
+} amqp_consumer_entry_t;
+
+/* Publishes between reads for flow control notifications, see amqp_flow.c */
+#define AMQP_FLOW_POLL_INTERVAL 64
+
 struct amqp_connection_state_t_ {
-  amqp_pool_table_entry_t *pool_table[POOL_TABLE_SIZE];
+  amqp_pool_table_entry_t **pool_table[POOL_TABLE_SIZE];
+  amqp_pool_table_entry_t *pool_entries;
 
   amqp_connection_state_enum state;
 
@@ -125,6 +226,8 @@ struct amqp_connection_state_t_ {
   int heartbeat;
   amqp_time_t next_recv_heartbeat;
   amqp_time_t next_send_heartbeat;
+  /* Time for updating the heartbeat deadlines, see amqp_clock_cache_t */
+  amqp_clock_cache_t heartbeat_clock;
 
   /* buffer for holding frame headers.  Allows us to delay allocating
    * the raw frame buffer until the type, channel, and size are all known
@@ -137,14 +240,111 @@ struct amqp_connection_state_t_ {
 
   amqp_bytes_t outbound_buffer;
 
+  /* Buffer several frames are encoded into before being written together,
+   * see amqp_basic_publish_batch() and amqp_set_write_coalescing(). Allocated
+   * on first use, len is its capacity. */
+  amqp_bytes_t send_buffer;
+
+  /* Write coalescing: send_buffer_pending bytes of frames are waiting in
+   * send_buffer, to be written once there are send_buffer_threshold of them or
+   * send_buffer_deadline passes. A threshold of 0 disables coalescing. */
+  size_t send_buffer_pending;
+  size_t send_buffer_threshold;
+  amqp_time_t send_buffer_deadline;
+  struct timeval *send_buffer_delay;
+  struct timeval internal_send_buffer_delay;
+
+  /* Non-blocking send mode: unsent_len bytes at unsent_offset in
+   * unsent_buffer were accepted by a send call but not yet written. They are
+   * written before anything sent later. len is the buffer's capacity. */
+  amqp_boolean_t send_nonblocking;
+  amqp_bytes_t unsent_buffer;
+  size_t unsent_offset;
+  size_t unsent_len;
+
+  /* Message being published with amqp_basic_publish_begin(): the next
+   * publish_remaining bytes written are its body, sent on publish_channel.
+   * Data written in pieces smaller than a frame is collected in
+   * publish_frame, after room for the frame header, until it fills a frame;
+   * publish_frame_fill is how much. len is the buffer's capacity. */
+  amqp_boolean_t publish_active;
+  amqp_channel_t publish_channel;
+  uint64_t publish_remaining;
+  amqp_bytes_t publish_frame;
+  size_t publish_frame_fill;
+
+  /* See amqp_set_body_codec() */
+  const amqp_body_codec_t *body_codec;
+  void *body_codec_user_data;
+  size_t body_codec_min_size;
+
+  /* See amqp_set_max_decoded_body_size() */
+  uint64_t max_decoded_body_size;
+
+  /* See amqp_set_lazy_properties() */
+  amqp_boolean_t lazy_properties;
+
+  /* The view last returned by amqp_consume_message_view(), if not yet
+   * released. view_body holds bodies that had to be put together, its len is
+   * the capacity. */
+  amqp_boolean_t view_active;
+  amqp_channel_t view_channel;
+  amqp_bytes_t view_body;
+  /* Holds the properties last returned by amqp_read_message_into() */
+  amqp_pool_t read_into_pool;
+
   amqp_socket_t *socket;
 
+  /* Ring buffer of data read from the socket: sock_inbound_used bytes from
+   * sock_inbound_offset, wrapping around at the end. A frame that has only
+   * partly arrived is left there for the next read to complete, unless it
+   * could never fit, so that it can still be decoded in place. */
   amqp_bytes_t sock_inbound_buffer;
   size_t sock_inbound_offset;
-  size_t sock_inbound_limit;
-
-  amqp_link_t *first_queued_frame;
-  amqp_link_t *last_queued_frame;
+  size_t sock_inbound_used;
+  /* Adaptive sizing, see amqp_set_inbound_buffer_limits(). The buffer grows
+   * after a read fills it, and shrinks after AMQP_INBOUND_SHRINK_READS reads
+   * in a row used under a quarter of it, the largest of which was
+   * sock_inbound_peak_read bytes. */
+  size_t sock_inbound_min_size;
+  size_t sock_inbound_max_size;
+  amqp_boolean_t sock_inbound_grow;
+  unsigned int sock_inbound_small_reads;
+  size_t sock_inbound_peak_read;
+  /* Frames decoded in place point into sock_inbound_buffer, from
+   * sock_inbound_referenced_start up to sock_inbound_offset. Reads go on into
+   * the rest of the ring until too little of it is left. Then the buffer is
+   * retired until no channel pool references it, and a new generation takes
+   * its place. A released retired buffer is kept as the spare. */
+  uint64_t sock_inbound_generation;
+  amqp_boolean_t sock_inbound_referenced;
+  size_t sock_inbound_referenced_start;
+  amqp_retired_buffer_t *retired_inbound_buffers;
+  amqp_bytes_t spare_inbound_buffer;
+
+  amqp_queued_frame_t *first_queued_frame;
+  amqp_queued_frame_t *last_queued_frame;
+
+  /* Channels in confirm mode */
+  amqp_confirm_tracker_t *confirm_trackers;
+
+  /* Flow control, see amqp_flow.c */
+  amqp_boolean_t blocked;
+  amqp_flow_channel_t *flow_channels;
+  unsigned int publishes_since_flow_poll;
+  struct timeval *publish_blocked_timeout;
+  struct timeval internal_publish_blocked_timeout;
+
+  /* Channels in use, a bit per channel, see amqp_channel.c */
+  uint64_t *channel_ids;
+  size_t channel_id_words;
+  size_t channel_id_hint;
+
+  /* Registered consumers, see amqp_dispatch.c. consumer_bucket_count is 0 or
+   * a power of two. */
+  amqp_consumer_entry_t **consumer_buckets;
+  size_t consumer_bucket_count;
+  size_t consumer_count;
 
   amqp_rpc_reply_t most_recent_api_result;
 
@@ -158,10 +358,57 @@ struct amqp_connection_state_t_ {
   struct timeval internal_rpc_timeout;
 };
 
+/* Bytes held by the page cache, see amqp_set_page_cache() */
+size_t amqp_page_cache_bytes(void);
+
 amqp_pool_t *amqp_get_or_create_channel_pool(amqp_connection_state_t connection,
                                              amqp_channel_t channel);
 amqp_pool_t *amqp_get_channel_pool(amqp_connection_state_t state,
                                    amqp_channel_t channel);
+amqp_pool_table_entry_t *amqp_get_channel_pool_entry(
+    amqp_connection_state_t state, amqp_channel_t channel);
+amqp_pool_table_entry_t *amqp_get_or_create_channel_pool_entry(
+    amqp_connection_state_t state, amqp_channel_t channel);
+/* Frees entry and its pool, and removes it from the pool table */
+void amqp_free_channel_pool_entry(amqp_connection_state_t state,
+                                  amqp_pool_table_entry_t *entry);
+
+/* Like amqp_handle_input(), but a frame wholly inside received_data is
+ * decoded where it is rather than copied, and may point into it. *in_place is
+ * set when that happens; received_data must then stay valid until the frame's
+ * channel pool is recycled, see amqp_inbound_buffer_referenced(). */
+int amqp_handle_input_in_place(amqp_connection_state_t state,
+                               amqp_bytes_t received_data,
+                               amqp_frame_t *decoded_frame,
+                               amqp_boolean_t *in_place);
+
+/* Records that a frame on channel was decoded in place from
+ * sock_inbound_buffer. */
+void amqp_inbound_buffer_referenced(amqp_connection_state_t state,
+                                    amqp_channel_t channel);
+
+/* Called before reading into sock_inbound_buffer: resizes it, and retires it
+ * if frames decoded in place that may still be in use leave too little room
+ * to read into. */
+int amqp_inbound_buffer_prepare(amqp_connection_state_t state);
+
+/* Sets iov to the free space of sock_inbound_buffer, returning the number of
+ * entries used, 1 or 2. */
+int amqp_inbound_buffer_free_space(amqp_connection_state_t state,
+                                   struct iovec *iov);
+
+/* Records that len bytes were read into the free space, which filled it if
+ * full is set. */
+void amqp_inbound_buffer_filled(amqp_connection_state_t state, size_t len,
+                                amqp_boolean_t full);
+
+/* Checks whether the socket buffer holds enough to decode the next frame, or
+ * to continue copying out one too big for it. */
+amqp_boolean_t amqp_inbound_frame_ready(amqp_connection_state_t state);
+
+/* Checks whether the socket buffer holds the whole of a basic.deliver, its
+ * content header and body, ready to be decoded. */
+amqp_boolean_t amqp_delivery_buffered(amqp_connection_state_t state);
 
 static inline int amqp_heartbeat_send(amqp_connection_state_t state) {
   return state->heartbeat;
@@ -173,6 +420,10 @@ static inline int amqp_heartbeat_recv(amqp_connection_state_t state) {
 
 int amqp_try_recv(amqp_connection_state_t state);
 
+/* Reads what the socket has without waiting and processes it, handling
+ * control frames and queueing the rest. */
+int amqp_poll_input(amqp_connection_state_t state);
+
 static inline void *amqp_offset(void *data, size_t offset) {
   return (char *)data + offset;
 }
@@ -334,4 +585,106 @@ static inline amqp_rpc_reply_t amqp_rpc_reply_error(amqp_status_enum status) {
 int amqp_send_frame_inner(amqp_connection_state_t state,
                           const amqp_frame_t *frame, int flags,
                           amqp_time_t deadline);
+
+/* Write already-encoded frames held in iov to the socket, servicing the
+ * broker heartbeat if the send stalls. iov is modified. If write coalescing
+ * is enabled the frames may be buffered instead. */
+int amqp_send_iov_inner(amqp_connection_state_t state, struct iovec *iov,
+                        int iovcnt, int flags, amqp_time_t deadline);
+
+/* As amqp_send_iov_inner(), bypassing the write coalescing buffer. In
+ * non-blocking send mode returns AMQP_STATUS_WOULD_BLOCK once whatever the
+ * socket did not take has been queued. */
+int amqp_send_iov_unbuffered(amqp_connection_state_t state,
+                             struct iovec *iov, int iovcnt, int flags,
+                             amqp_time_t deadline);
+
+/* As amqp_send_iov_unbuffered(), blocking even in non-blocking send mode.
+ * Anything queued must have been written first. */
+int amqp_send_iov_blocking(amqp_connection_state_t state, struct iovec *iov,
+                           int iovcnt, int flags, amqp_time_t deadline);
+
+/* Writes len bytes of fd from offset to the socket with sendfile, blocking
+ * and servicing the broker heartbeat like amqp_send_iov_blocking(). Returns
+ * AMQP_STATUS_UNSUPPORTED if the socket or fd can't do it, having sent
+ * nothing, or AMQP_PRIVATE_STATUS_FILE_ENDED if fd ends early. */
+int amqp_send_file_inner(amqp_connection_state_t state, int fd,
+                         uint64_t offset, size_t len, int flags,
+                         amqp_time_t deadline);
+
+/* Writes out coalesced and queued frames, blocking even in non-blocking send
+ * mode. Used before waiting for incoming frames. */
+int amqp_flush_blocking(amqp_connection_state_t state, amqp_time_t deadline);
+
+/* Serialize a frame into buffer, which must be at least buffer.len bytes.
+ * On success encoded points at the frame inside buffer. */
+int amqp_frame_to_bytes(const amqp_frame_t *frame, amqp_bytes_t buffer,
+                        amqp_bytes_t *encoded);
+
+/* Decodes properties as amqp_decode_properties() does into decoded, which must
+ * be the properties struct of class_id, without allocating. A table field is
+ * skipped and left empty, its encoding stored in *raw_table. Generated, see
+ * codegen.py. */
+int amqp_decode_properties_lazy(uint16_t class_id, amqp_bytes_t encoded,
+                                void *decoded, amqp_bytes_t *raw_table);
+
+/* Read frames until a publisher confirm or flow control frame is processed,
+ * queueing any other frames read. */
+int amqp_wait_control_frame(amqp_connection_state_t state,
+                            amqp_time_t deadline);
+
+amqp_confirm_tracker_t *amqp_confirm_get_tracker(amqp_connection_state_t state,
+                                                 amqp_channel_t channel);
+
+/* Returns non-zero if frame was a basic.ack or basic.nack for a channel in
+ * confirm mode, in which case it has been processed. */
+int amqp_confirm_handle_frame(amqp_connection_state_t state,
+                              const amqp_frame_t *frame);
+
+int amqp_confirm_has_room(amqp_confirm_tracker_t *tracker);
+
+/* Blocks until tracker has room for another message in flight. */
+int amqp_confirm_wait_for_room(amqp_connection_state_t state,
+                               amqp_confirm_tracker_t *tracker);
+
+/* Assigns the next sequence number to a message about to be sent. */
+void amqp_confirm_published(amqp_confirm_tracker_t *tracker);
+
+void amqp_confirm_release(amqp_connection_state_t state,
+                          amqp_channel_t channel);
+void amqp_confirm_release_all(amqp_connection_state_t state);
+
+/* Returns 1 if frame was connection.blocked, connection.unblocked or
+ * channel.flow, in which case it has been processed, 0 if not, or an
+ * amqp_status_enum error. */
+int amqp_flow_handle_frame(amqp_connection_state_t state,
+                           const amqp_frame_t *frame);
+
+/* Sends the channel.flow-ok replies amqp_flow_handle_frame() left pending.
+ * Must only be called between frames. */
+int amqp_flow_send_oks(amqp_connection_state_t state);
+
+/* Called before publishing on channel: reads pending input every so often,
+ * then waits for the broker to allow publishing, up to the publish blocked
+ * timeout. */
+int amqp_flow_wait_for_publish(amqp_connection_state_t state,
+                               amqp_channel_t channel);
+
+/* Returns the consumer registered for consumer_tag on channel, or NULL. */
+amqp_consumer_entry_t *amqp_dispatch_find(amqp_connection_state_t state,
+                                          amqp_channel_t channel,
+                                          amqp_bytes_t consumer_tag);
+
+void amqp_dispatch_release(amqp_connection_state_t state,
+                           amqp_channel_t channel);
+void amqp_dispatch_release_all(amqp_connection_state_t state);
+
+void amqp_flow_release(amqp_connection_state_t state, amqp_channel_t channel);
+void amqp_flow_release_all(amqp_connection_state_t state);
+
+/* Called when channel.open is sent on channel */
+int amqp_channel_opened(amqp_connection_state_t state, amqp_channel_t channel);
+/* Called when channel.close-ok is sent or received on channel */
+void amqp_channel_closed(amqp_connection_state_t state,
+                         amqp_channel_t channel);
 #endif
@@ -96,6 +96,23 @@ ssize_t amqp_socket_send(amqp_socket_t *self, const void *buf, size_t len,
   return self->klass->send(self, buf, len, flags);
 }
 
+ssize_t amqp_socket_writev(amqp_socket_t *self, const struct iovec *iov,
+                           int iovcnt, int flags) {
+  assert(self);
+  assert(self->klass->writev);
+  assert(0 < iovcnt && iovcnt <= AMQP_SOCKET_MAX_IOV);
+  return self->klass->writev(self, iov, iovcnt, flags);
+}
+
+ssize_t amqp_socket_sendfile(amqp_socket_t *self, int fd, uint64_t offset,
+                             size_t len, int flags) {
+  assert(self);
+  if (NULL == self->klass->sendfile) {
+    return AMQP_STATUS_UNSUPPORTED;
+  }
+  return self->klass->sendfile(self, fd, offset, len, flags);
+}
+
 ssize_t amqp_socket_recv(amqp_socket_t *self, void *buf, size_t len,
                          int flags) {
   assert(self);
@@ -103,6 +120,16 @@ ssize_t amqp_socket_recv(amqp_socket_t *self, void *buf, size_t len,
   return self->klass->recv(self, buf, len, flags);
 }
 
+ssize_t amqp_socket_readv(amqp_socket_t *self, const struct iovec *iov,
+                          int iovcnt, int flags) {
+  assert(self);
+  assert(0 < iovcnt && iovcnt <= AMQP_SOCKET_MAX_IOV);
+  if (NULL == self->klass->readv) {
+    return amqp_socket_recv(self, iov[0].iov_base, iov[0].iov_len, flags);
+  }
+  return self->klass->readv(self, iov, iovcnt, flags);
+}
+
 int amqp_socket_open(amqp_socket_t *self, const char *host, int port) {
   assert(self);
   assert(self->klass->open);
@@ -235,7 +262,14 @@ start_select:
 
 static ssize_t do_poll(amqp_connection_state_t state, ssize_t res,
                        amqp_time_t deadline) {
-  int fd = amqp_get_sockfd(state);
+  int fd;
+  if ((AMQP_PRIVATE_STATUS_SOCKET_NEEDREAD == res ||
+       AMQP_PRIVATE_STATUS_SOCKET_NEEDWRITE == res) &&
+      amqp_time_equal(deadline, amqp_time_immediate())) {
+    /* Don't spend a syscall on a poll that can't wait */
+    return AMQP_STATUS_TIMEOUT;
+  }
+  fd = amqp_get_sockfd(state);
   if (-1 == fd) {
     return AMQP_STATUS_SOCKET_CLOSED;
   }
@@ -247,6 +281,8 @@ static ssize_t do_poll(amqp_connection_state_t state, ssize_t res,
       res = amqp_poll(fd, AMQP_SF_POLLOUT, deadline);
       break;
   }
+  /* The wait may have been long */
+  amqp_clock_cache_invalidate(&state->heartbeat_clock);
   return res;
 }
 
@@ -278,6 +314,88 @@ start_send:
   return res;
 }
 
+ssize_t amqp_try_writev(amqp_connection_state_t state, struct iovec *iov,
+                        int iovcnt, amqp_time_t deadline, int flags) {
+  ssize_t res;
+  size_t len = 0;
+  size_t len_left;
+  int i;
+
+  for (i = 0; i < iovcnt; ++i) {
+    len += iov[i].iov_len;
+  }
+  len_left = len;
+
+  /* Skip over any leading empty buffers */
+  while (iovcnt > 0 && 0 == iov->iov_len) {
+    iov++;
+    iovcnt--;
+  }
+  if (0 == iovcnt) {
+    return 0;
+  }
+
+start_send:
+  res = amqp_socket_writev(state->socket, iov, iovcnt, flags);
+
+  if (res > 0) {
+    len_left -= res;
+    if (0 == len_left) {
+      return (ssize_t)len;
+    }
+    while ((size_t)res >= iov->iov_len) {
+      res -= iov->iov_len;
+      iov->iov_len = 0;
+      iov++;
+      iovcnt--;
+    }
+    iov->iov_base = (char *)iov->iov_base + res;
+    iov->iov_len -= res;
+    goto start_send;
+  }
+  res = do_poll(state, res, deadline);
+  if (AMQP_STATUS_OK == res) {
+    goto start_send;
+  }
+  if (AMQP_STATUS_TIMEOUT == res) {
+    return (ssize_t)(len - len_left);
+  }
+  return res;
+}
+
+ssize_t amqp_try_sendfile(amqp_connection_state_t state, int fd,
+                          uint64_t offset, size_t len, amqp_time_t deadline,
+                          int flags) {
+  ssize_t res;
+  size_t len_left = len;
+
+start_send:
+  res = amqp_socket_sendfile(state->socket, fd, offset, len_left, flags);
+
+  if (res > 0) {
+    len_left -= res;
+    offset += res;
+    if (0 == len_left) {
+      return (ssize_t)len;
+    }
+    goto start_send;
+  }
+  if (0 == res) {
+    return AMQP_PRIVATE_STATUS_FILE_ENDED;
+  }
+  res = do_poll(state, res, deadline);
+  if (AMQP_STATUS_OK == res) {
+    goto start_send;
+  }
+  if (AMQP_STATUS_TIMEOUT == res) {
+    return (ssize_t)(len - len_left);
+  }
+  if (AMQP_STATUS_UNSUPPORTED == res && len_left != len) {
+    return AMQP_STATUS_SOCKET_ERROR;
+  }
+  return res;
+}
+
 int amqp_open_socket(char const *hostname, int portnumber) {
   return amqp_open_socket_inner(hostname, portnumber, amqp_time_infinite());
 }
@@ -627,45 +745,98 @@ amqp_boolean_t amqp_frames_enqueued(amqp_connection_state_t state) {
  * will avoid an immediate blocking read in amqp_simple_wait_frame.
  */
 amqp_boolean_t amqp_data_in_buffer(amqp_connection_state_t state) {
-  return (state->sock_inbound_offset < state->sock_inbound_limit);
+  return amqp_inbound_frame_ready(state);
 }
 
 static int consume_one_frame(amqp_connection_state_t state,
                              amqp_frame_t *decoded_frame) {
   int res;
+  amqp_boolean_t in_place;
 
+  /* Up to the end of the ring, the rest is consumed by the next call */
   amqp_bytes_t buffer;
-  buffer.len = state->sock_inbound_limit - state->sock_inbound_offset;
+  buffer.len = state->sock_inbound_buffer.len - state->sock_inbound_offset;
+  if (buffer.len > state->sock_inbound_used) {
+    buffer.len = state->sock_inbound_used;
+  }
   buffer.bytes =
       ((char *)state->sock_inbound_buffer.bytes) + state->sock_inbound_offset;
 
-  res = amqp_handle_input(state, buffer, decoded_frame);
+  res = amqp_handle_input_in_place(state, buffer, decoded_frame, &in_place);
   if (res < 0) {
     return res;
   }
+  if (in_place && decoded_frame->frame_type != 0 &&
+      decoded_frame->frame_type != AMQP_FRAME_HEARTBEAT) {
+    amqp_inbound_buffer_referenced(state, decoded_frame->channel);
+  }
 
   state->sock_inbound_offset += res;
+  state->sock_inbound_used -= res;
+  if (state->sock_inbound_offset == state->sock_inbound_buffer.len) {
+    state->sock_inbound_offset = 0;
+  }
 
   return AMQP_STATUS_OK;
 }
 
+/* Reads once from the socket into the socket buffer, without waiting. Sets
+ * *full if the read filled the buffer, so more may be waiting. Returns the
+ * socket's AMQP_PRIVATE_STATUS_SOCKET_NEED* status if nothing could be
+ * read. */
+static int recv_once(amqp_connection_state_t state, amqp_boolean_t *full) {
+  ssize_t res;
+  struct iovec iov[2];
+  int iovcnt;
+  size_t free_space;
+
+  res = amqp_inbound_buffer_prepare(state);
+  if (AMQP_STATUS_OK != res) {
+    return (int)res;
+  }
+
+  iovcnt = amqp_inbound_buffer_free_space(state, iov);
+  free_space = iov[0].iov_len + (2 == iovcnt ? iov[1].iov_len : 0);
+
+  res = amqp_socket_readv(state->socket, iov, iovcnt, 0);
+  if (res < 0) {
+    return (int)res;
+  }
+
+  *full = (size_t)res == free_space;
+  amqp_inbound_buffer_filled(state, (size_t)res, *full);
+
+  /* The recv heartbeat deadline must not come out early, so take a fresh
+   * reading, which later sends get to reuse */
+  amqp_clock_cache_invalidate(&state->heartbeat_clock);
+  return amqp_time_s_from_now_cached(&state->next_recv_heartbeat,
+                                     amqp_heartbeat_recv(state),
+                                     &state->heartbeat_clock);
+}
+
 static int recv_with_timeout(amqp_connection_state_t state,
                              amqp_time_t timeout) {
-  ssize_t res;
+  int res;
   int fd;
+  amqp_boolean_t full;
 
 start_recv:
-  res = amqp_socket_recv(state->socket, state->sock_inbound_buffer.bytes,
-                         state->sock_inbound_buffer.len, 0);
+  res = recv_once(state, &full);
 
   if (res < 0) {
+    if ((AMQP_PRIVATE_STATUS_SOCKET_NEEDREAD == res ||
+         AMQP_PRIVATE_STATUS_SOCKET_NEEDWRITE == res) &&
+        amqp_time_equal(timeout, amqp_time_immediate())) {
+      /* Polling could only confirm nothing is ready */
+      return AMQP_STATUS_TIMEOUT;
+    }
     fd = amqp_get_sockfd(state);
     if (-1 == fd) {
       return AMQP_STATUS_CONNECTION_CLOSED;
     }
     switch (res) {
       default:
-        return (int)res;
+        return res;
       case AMQP_PRIVATE_STATUS_SOCKET_NEEDREAD:
         res = amqp_poll(fd, AMQP_SF_POLLIN, timeout);
         break;
@@ -673,25 +844,33 @@ start_recv:
         res = amqp_poll(fd, AMQP_SF_POLLOUT, timeout);
         break;
     }
+    amqp_clock_cache_invalidate(&state->heartbeat_clock);
     if (AMQP_STATUS_OK == res) {
       goto start_recv;
     }
-    return (int)res;
+    return res;
   }
+  return AMQP_STATUS_OK;
+}
 
-  state->sock_inbound_limit = res;
-  state->sock_inbound_offset = 0;
-
-  res = amqp_time_s_from_now(&state->next_recv_heartbeat,
-                             amqp_heartbeat_recv(state));
-  if (AMQP_STATUS_OK != res) {
-    return (int)res;
+/* Processes frame if the library handles it itself: heartbeats, publisher
+ * confirms and flow control. Returns 1 if it did, 0 if frame is for the
+ * caller, or an error. */
+static int handle_control_frame(amqp_connection_state_t state,
+                                amqp_frame_t *frame) {
+  if (AMQP_FRAME_HEARTBEAT == frame->frame_type) {
+    amqp_maybe_release_buffers_on_channel(state, 0);
+    return 1;
   }
-  return AMQP_STATUS_OK;
+  if (amqp_confirm_handle_frame(state, frame)) {
+    return 1;
+  }
+  return amqp_flow_handle_frame(state, frame);
 }
 
-int amqp_try_recv(amqp_connection_state_t state) {
-  amqp_time_t timeout;
+/* Processes the frames in the socket buffer, queueing those for the
+ * caller. */
+static int process_buffered_frames(amqp_connection_state_t state) {
   int res;
 
   while (amqp_data_in_buffer(state)) {
@@ -701,48 +880,51 @@ int amqp_try_recv(amqp_connection_state_t state) {
     if (AMQP_STATUS_OK != res) {
       return res;
     }
+    if (0 == frame.frame_type) {
+      continue;
+    }
 
-    if (frame.frame_type != 0) {
-      amqp_pool_t *channel_pool;
-      amqp_frame_t *frame_copy;
-      amqp_link_t *link;
-
-      channel_pool = amqp_get_or_create_channel_pool(state, frame.channel);
-      if (NULL == channel_pool) {
-        return AMQP_STATUS_NO_MEMORY;
-      }
-
-      frame_copy = amqp_pool_alloc(channel_pool, sizeof(amqp_frame_t));
-      link = amqp_pool_alloc(channel_pool, sizeof(amqp_link_t));
-
-      if (frame_copy == NULL || link == NULL) {
-        return AMQP_STATUS_NO_MEMORY;
-      }
-
-      *frame_copy = frame;
-
-      link->next = NULL;
-      link->data = frame_copy;
-
-      if (state->last_queued_frame == NULL) {
-        state->first_queued_frame = link;
-      } else {
-        state->last_queued_frame->next = link;
+    res = handle_control_frame(state, &frame);
+    if (res < 0) {
+      return res;
+    }
+    if (0 == res) {
+      res = amqp_queue_frame(state, &frame);
+      if (AMQP_STATUS_OK != res) {
+        return res;
       }
-      state->last_queued_frame = link;
     }
   }
-  res = amqp_time_s_from_now(&timeout, 0);
+  return AMQP_STATUS_OK;
+}
+
+int amqp_try_recv(amqp_connection_state_t state) {
+  int res = process_buffered_frames(state);
   if (AMQP_STATUS_OK != res) {
     return res;
   }
 
-  return recv_with_timeout(state, timeout);
+  return recv_with_timeout(state, amqp_time_immediate());
 }
 
-static int wait_frame_inner(amqp_connection_state_t state,
-                            amqp_frame_t *decoded_frame,
-                            amqp_time_t timeout_deadline) {
+int amqp_poll_input(amqp_connection_state_t state) {
+  int res = amqp_try_recv(state);
+  if (AMQP_STATUS_TIMEOUT == res) {
+    return AMQP_STATUS_OK;
+  } else if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+  return process_buffered_frames(state);
+}
+
+/* Reads the next frame. Publisher confirms for channels in confirm mode and
+ * flow control frames are processed rather than returned; if
+ * return_on_control is set, processing one returns AMQP_STATUS_OK with a
+ * frame_type of 0. */
+static int wait_frame_or_control_inner(amqp_connection_state_t state,
+                                       amqp_frame_t *decoded_frame,
+                                       amqp_time_t timeout_deadline,
+                                       amqp_boolean_t return_on_control) {
   amqp_time_t deadline;
   int res;
 
@@ -754,18 +936,33 @@ static int wait_frame_inner(amqp_connection_state_t state,
         return res;
       }
 
-      if (AMQP_FRAME_HEARTBEAT == decoded_frame->frame_type) {
-        amqp_maybe_release_buffers_on_channel(state, 0);
+      if (0 == decoded_frame->frame_type) {
         continue;
       }
 
-      if (decoded_frame->frame_type != 0) {
+      res = handle_control_frame(state, decoded_frame);
+      if (res < 0) {
+        return res;
+      }
+      if (0 == res) {
         /* Complete frame was read. Return it. */
         return AMQP_STATUS_OK;
       }
+      res = amqp_flow_send_oks(state);
+      if (AMQP_STATUS_OK != res) {
+        return res;
+      }
+      if (return_on_control &&
+          AMQP_FRAME_HEARTBEAT != decoded_frame->frame_type) {
+        decoded_frame->frame_type = 0;
+        return AMQP_STATUS_OK;
+      }
     }
 
   beginrecv:
+    /* The caller may have been away for a while, the heartbeat sent below
+     * must be timed from the current time */
+    amqp_clock_cache_invalidate(&state->heartbeat_clock);
     res = amqp_time_has_past(state->next_send_heartbeat);
     if (AMQP_STATUS_TIMER_FAILURE == res) {
       return res;
@@ -775,10 +972,16 @@ static int wait_frame_inner(amqp_connection_state_t state,
       heartbeat.frame_type = AMQP_FRAME_HEARTBEAT;
 
       res = amqp_send_frame(state, &heartbeat);
-      if (AMQP_STATUS_OK != res) {
+      if (AMQP_STATUS_OK != res && AMQP_STATUS_WOULD_BLOCK != res) {
         return res;
       }
     }
+    /* Nothing coalesced or queued may be held back while blocked */
+    res = amqp_flush_blocking(state, timeout_deadline);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+
     deadline = amqp_time_first(timeout_deadline,
                                amqp_time_first(state->next_recv_heartbeat,
                                                state->next_send_heartbeat));
@@ -805,87 +1008,124 @@ static int wait_frame_inner(amqp_connection_state_t state,
   }
 }
 
-static amqp_link_t *amqp_create_link_for_frame(amqp_connection_state_t state,
-                                               amqp_frame_t *frame) {
-  amqp_link_t *link;
-  amqp_frame_t *frame_copy;
+static int wait_frame_inner(amqp_connection_state_t state,
+                            amqp_frame_t *decoded_frame,
+                            amqp_time_t timeout_deadline) {
+  return wait_frame_or_control_inner(state, decoded_frame, timeout_deadline,
+                                     0);
+}
+
+static amqp_queued_frame_t *new_queued_frame(amqp_connection_state_t state,
+                                             amqp_frame_t *frame) {
+  amqp_queued_frame_t *queued;
 
-  amqp_pool_t *channel_pool =
-      amqp_get_or_create_channel_pool(state, frame->channel);
+  amqp_pool_table_entry_t *entry =
+      amqp_get_or_create_channel_pool_entry(state, frame->channel);
 
-  if (NULL == channel_pool) {
+  if (NULL == entry) {
     return NULL;
   }
 
-  link = amqp_pool_alloc(channel_pool, sizeof(amqp_link_t));
-  frame_copy = amqp_pool_alloc(channel_pool, sizeof(amqp_frame_t));
-
-  if (NULL == link || NULL == frame_copy) {
+  queued = amqp_pool_alloc(&entry->pool, sizeof(amqp_queued_frame_t));
+  if (NULL == queued) {
     return NULL;
   }
 
-  *frame_copy = *frame;
-  link->data = frame_copy;
+  queued->entry = entry;
+  queued->frame = *frame;
 
-  return link;
+  return queued;
 }
 
 int amqp_queue_frame(amqp_connection_state_t state, amqp_frame_t *frame) {
-  amqp_link_t *link = amqp_create_link_for_frame(state, frame);
-  if (NULL == link) {
+  amqp_queued_frame_t *queued = new_queued_frame(state, frame);
+  amqp_pool_table_entry_t *entry;
+  if (NULL == queued) {
     return AMQP_STATUS_NO_MEMORY;
   }
+  entry = queued->entry;
 
-  if (NULL == state->first_queued_frame) {
-    state->first_queued_frame = link;
+  queued->next = NULL;
+  queued->prev = state->last_queued_frame;
+  if (NULL == state->last_queued_frame) {
+    state->first_queued_frame = queued;
   } else {
-    state->last_queued_frame->next = link;
+    state->last_queued_frame->next = queued;
   }
+  state->last_queued_frame = queued;
 
-  link->next = NULL;
-  state->last_queued_frame = link;
+  queued->channel_next = NULL;
+  if (NULL == entry->last_queued_frame) {
+    entry->first_queued_frame = queued;
+  } else {
+    entry->last_queued_frame->channel_next = queued;
+  }
+  entry->last_queued_frame = queued;
 
   return AMQP_STATUS_OK;
 }
 
 int amqp_put_back_frame(amqp_connection_state_t state, amqp_frame_t *frame) {
-  amqp_link_t *link = amqp_create_link_for_frame(state, frame);
-  if (NULL == link) {
+  amqp_queued_frame_t *queued = new_queued_frame(state, frame);
+  amqp_pool_table_entry_t *entry;
+  if (NULL == queued) {
     return AMQP_STATUS_NO_MEMORY;
   }
+  entry = queued->entry;
 
+  queued->prev = NULL;
+  queued->next = state->first_queued_frame;
   if (NULL == state->first_queued_frame) {
-    state->first_queued_frame = link;
-    state->last_queued_frame = link;
-    link->next = NULL;
+    state->last_queued_frame = queued;
   } else {
-    link->next = state->first_queued_frame;
-    state->first_queued_frame = link;
+    state->first_queued_frame->prev = queued;
   }
+  state->first_queued_frame = queued;
+
+  queued->channel_next = entry->first_queued_frame;
+  if (NULL == entry->first_queued_frame) {
+    entry->last_queued_frame = queued;
+  }
+  entry->first_queued_frame = queued;
 
   return AMQP_STATUS_OK;
 }
 
+/* Removes queued, the first frame queued for its channel, from the queues
+ * and copies it to frame. */
+static void dequeue_frame(amqp_connection_state_t state,
+                          amqp_queued_frame_t *queued, amqp_frame_t *frame) {
+  amqp_pool_table_entry_t *entry = queued->entry;
+
+  if (NULL == queued->prev) {
+    state->first_queued_frame = queued->next;
+  } else {
+    queued->prev->next = queued->next;
+  }
+  if (NULL == queued->next) {
+    state->last_queued_frame = queued->prev;
+  } else {
+    queued->next->prev = queued->prev;
+  }
+
+  entry->first_queued_frame = queued->channel_next;
+  if (NULL == entry->first_queued_frame) {
+    entry->last_queued_frame = NULL;
+  }
+
+  *frame = queued->frame;
+}
+
 int amqp_simple_wait_frame_on_channel(amqp_connection_state_t state,
                                       amqp_channel_t channel,
                                       amqp_frame_t *decoded_frame) {
-  amqp_frame_t *frame_ptr;
-  amqp_link_t *cur;
+  amqp_pool_table_entry_t *entry;
   int res;
 
-  for (cur = state->first_queued_frame; NULL != cur; cur = cur->next) {
-    frame_ptr = cur->data;
-
-    if (channel == frame_ptr->channel) {
-      state->first_queued_frame = cur->next;
-      if (NULL == state->first_queued_frame) {
-        state->last_queued_frame = NULL;
-      }
-
-      *decoded_frame = *frame_ptr;
-
-      return AMQP_STATUS_OK;
-    }
+  entry = amqp_get_channel_pool_entry(state, channel);
+  if (NULL != entry && NULL != entry->first_queued_frame) {
+    dequeue_frame(state, entry->first_queued_frame, decoded_frame);
+    return AMQP_STATUS_OK;
   }
 
   for (;;) {
@@ -906,6 +1146,26 @@ int amqp_simple_wait_frame_on_channel(amqp_connection_state_t state,
   }
 }
 
+int amqp_wait_control_frame(amqp_connection_state_t state,
+                            amqp_time_t deadline) {
+  amqp_frame_t frame;
+  int res;
+
+  for (;;) {
+    res = wait_frame_or_control_inner(state, &frame, deadline, 1);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+    if (0 == frame.frame_type) {
+      return AMQP_STATUS_OK;
+    }
+    res = amqp_queue_frame(state, &frame);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+}
+
 int amqp_simple_wait_frame(amqp_connection_state_t state,
                            amqp_frame_t *decoded_frame) {
   return amqp_simple_wait_frame_noblock(state, decoded_frame, NULL);
@@ -922,18 +1182,127 @@ int amqp_simple_wait_frame_noblock(amqp_connection_state_t state,
   }
 
   if (state->first_queued_frame != NULL) {
-    amqp_frame_t *f = (amqp_frame_t *)state->first_queued_frame->data;
-    state->first_queued_frame = state->first_queued_frame->next;
-    if (state->first_queued_frame == NULL) {
-      state->last_queued_frame = NULL;
-    }
-    *decoded_frame = *f;
+    /* The oldest frame is also the first queued for its channel */
+    dequeue_frame(state, state->first_queued_frame, decoded_frame);
     return AMQP_STATUS_OK;
   } else {
     return wait_frame_inner(state, decoded_frame, deadline);
   }
 }
 
+/* Passes the frames queued by earlier calls, then those complete in the
+ * socket buffer, to on_frame, until it returns an error. */
+static int deliver_frames(amqp_connection_state_t state,
+                          amqp_frame_callback_t on_frame, void *user_data) {
+  amqp_frame_t frame;
+  int res;
+
+  while (state->first_queued_frame != NULL) {
+    dequeue_frame(state, state->first_queued_frame, &frame);
+    res = on_frame(user_data, state, &frame);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+
+  while (amqp_data_in_buffer(state)) {
+    res = consume_one_frame(state, &frame);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+    if (0 == frame.frame_type) {
+      continue;
+    }
+
+    res = handle_control_frame(state, &frame);
+    if (res < 0) {
+      return res;
+    }
+    if (0 == res) {
+      res = on_frame(user_data, state, &frame);
+    } else {
+      res = amqp_flow_send_oks(state);
+    }
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+  return AMQP_STATUS_OK;
+}
+
+int amqp_process_input(amqp_connection_state_t state,
+                       amqp_frame_callback_t on_frame, void *user_data,
+                       amqp_io_interest_t *interest) {
+  amqp_boolean_t full = 0;
+  int res;
+
+  if (NULL == on_frame || NULL == interest) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  interest->want_read = 1;
+  interest->want_write = 0;
+  interest->timeout_ms = -1;
+
+  res = deliver_frames(state, on_frame, user_data);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  res = recv_once(state, &full);
+  if (AMQP_STATUS_OK == res) {
+    res = deliver_frames(state, on_frame, user_data);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  } else if (AMQP_PRIVATE_STATUS_SOCKET_NEEDREAD == res ||
+             AMQP_PRIVATE_STATUS_SOCKET_NEEDWRITE == res) {
+    /* SSL may need the socket to be writable to read */
+    interest->want_write = AMQP_PRIVATE_STATUS_SOCKET_NEEDWRITE == res;
+
+    res = amqp_time_has_past(state->next_recv_heartbeat);
+    if (AMQP_STATUS_TIMEOUT == res) {
+      amqp_socket_close(state->socket, AMQP_SC_FORCE);
+      return AMQP_STATUS_HEARTBEAT_TIMEOUT;
+    } else if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  } else {
+    return res;
+  }
+
+  amqp_clock_cache_invalidate(&state->heartbeat_clock);
+  res = amqp_time_has_past(state->next_send_heartbeat);
+  if (AMQP_STATUS_TIMEOUT == res) {
+    amqp_frame_t heartbeat;
+    heartbeat.channel = 0;
+    heartbeat.frame_type = AMQP_FRAME_HEARTBEAT;
+
+    res = amqp_send_frame(state, &heartbeat);
+    if (AMQP_STATUS_OK != res && AMQP_STATUS_WOULD_BLOCK != res) {
+      return res;
+    }
+  } else if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  if (0 != state->unsent_len || 0 != state->send_buffer_pending) {
+    interest->want_write = 1;
+  }
+
+  if (full) {
+    /* More may be waiting that an edge-triggered poll would not report */
+    interest->timeout_ms = 0;
+  } else {
+    res = amqp_time_ms_until(amqp_time_first(state->next_recv_heartbeat,
+                                             state->next_send_heartbeat));
+    if (AMQP_STATUS_TIMER_FAILURE == res) {
+      return res;
+    }
+    interest->timeout_ms = res;
+  }
+  return AMQP_STATUS_OK;
+}
+
 static int amqp_simple_wait_method_list(amqp_connection_state_t state,
                                         amqp_channel_t expected_channel,
                                         amqp_method_number_t *expected_methods,
@@ -1021,7 +1390,8 @@ static amqp_rpc_reply_t simple_rpc_inner(
   memset(&result, 0, sizeof(result));
 
   status = amqp_send_method(state, channel, request_id, decoded_request_method);
-  if (status < 0) {
+  /* A queued request is written before the reply is waited for */
+  if (status < 0 && AMQP_STATUS_WOULD_BLOCK != status) {
     return amqp_rpc_reply_error(status);
   }
 
@@ -1052,34 +1422,11 @@ static amqp_rpc_reply_t simple_rpc_inner(
              (frame.payload.method.id == AMQP_CHANNEL_CLOSE_METHOD))) ||
            ((frame.channel == 0) &&
             (frame.payload.method.id == AMQP_CONNECTION_CLOSE_METHOD))))) {
-      amqp_pool_t *channel_pool;
-      amqp_frame_t *frame_copy;
-      amqp_link_t *link;
-
-      channel_pool = amqp_get_or_create_channel_pool(state, frame.channel);
-      if (NULL == channel_pool) {
-        return amqp_rpc_reply_error(AMQP_STATUS_NO_MEMORY);
-      }
-
-      frame_copy = amqp_pool_alloc(channel_pool, sizeof(amqp_frame_t));
-      link = amqp_pool_alloc(channel_pool, sizeof(amqp_link_t));
-
-      if (frame_copy == NULL || link == NULL) {
-        return amqp_rpc_reply_error(AMQP_STATUS_NO_MEMORY);
+      status = amqp_queue_frame(state, &frame);
+      if (AMQP_STATUS_OK != status) {
+        return amqp_rpc_reply_error(status);
       }
 
-      *frame_copy = frame;
-
-      link->next = NULL;
-      link->data = frame_copy;
-
-      if (state->last_queued_frame == NULL) {
-        state->first_queued_frame = link;
-      } else {
-        state->last_queued_frame->next = link;
-      }
-      state->last_queued_frame = link;
-
       goto retry;
     }
 
@@ -1282,7 +1629,7 @@ static amqp_rpc_reply_t amqp_login_inner(amqp_connection_state_t state,
   {
     amqp_table_entry_t default_properties[6];
     amqp_table_t default_table;
-    amqp_table_entry_t client_capabilities[2];
+    amqp_table_entry_t client_capabilities[3];
     amqp_table_t client_capabilities_table;
     amqp_connection_start_ok_t s;
     amqp_pool_t *channel_pool;
@@ -1304,6 +1651,8 @@ static amqp_rpc_reply_t amqp_login_inner(amqp_connection_state_t state,
         amqp_table_construct_bool_entry("authentication_failure_close", 1);
     client_capabilities[1] =
         amqp_table_construct_bool_entry("exchange_exchange_bindings", 1);
+    client_capabilities[2] =
+        amqp_table_construct_bool_entry("connection.blocked", 1);
 
     client_capabilities_table.entries = client_capabilities;
     client_capabilities_table.num_entries =
@@ -1339,7 +1688,8 @@ static amqp_rpc_reply_t amqp_login_inner(amqp_connection_state_t state,
 
     res = amqp_send_method_inner(state, 0, AMQP_CONNECTION_START_OK_METHOD, &s,
                                  AMQP_SF_NONE, deadline);
-    if (res < 0) {
+    /* A queued method is written before the reply is waited for */
+    if (res < 0 && AMQP_STATUS_WOULD_BLOCK != res) {
       goto error_res;
     }
   }
@@ -1399,7 +1749,8 @@ static amqp_rpc_reply_t amqp_login_inner(amqp_connection_state_t state,
 
     res = amqp_send_method_inner(state, 0, AMQP_CONNECTION_TUNE_OK_METHOD, &s,
                                  AMQP_SF_NONE, deadline);
-    if (res < 0) {
+    /* A queued method is written before the reply is waited for */
+    if (res < 0 && AMQP_STATUS_WOULD_BLOCK != res) {
       goto error_res;
     }
   }
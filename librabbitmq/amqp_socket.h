@@ -32,21 +32,32 @@ int amqp_os_socket_close(int sockfd);
 
 /* Socket callbacks. */
 typedef ssize_t (*amqp_socket_send_fn)(void *, const void *, size_t, int);
+typedef ssize_t (*amqp_socket_writev_fn)(void *, const struct iovec *, int,
+                                         int);
 typedef ssize_t (*amqp_socket_recv_fn)(void *, void *, size_t, int);
 typedef int (*amqp_socket_open_fn)(void *, const char *, int,
                                    const struct timeval *);
 typedef int (*amqp_socket_close_fn)(void *, amqp_socket_close_enum);
 typedef int (*amqp_socket_get_sockfd_fn)(void *);
 typedef void (*amqp_socket_delete_fn)(void *);
+typedef ssize_t (*amqp_socket_sendfile_fn)(void *, int, uint64_t, size_t,
+                                           int);
+typedef ssize_t (*amqp_socket_readv_fn)(void *, const struct iovec *, int,
+                                        int);
 
 /** V-table for amqp_socket_t */
 struct amqp_socket_class_t {
   amqp_socket_send_fn send;
+  amqp_socket_writev_fn writev;
   amqp_socket_recv_fn recv;
   amqp_socket_open_fn open;
   amqp_socket_close_fn close;
   amqp_socket_get_sockfd_fn get_sockfd;
   amqp_socket_delete_fn delete_sock;
+  /* Optional, NULL if the socket can't send from a file descriptor */
+  amqp_socket_sendfile_fn sendfile;
+  /* Optional, NULL if the socket can only receive into one buffer */
+  amqp_socket_readv_fn readv;
 };
 
 /** Abstract base class for amqp_socket_t */
@@ -86,6 +97,56 @@ ssize_t amqp_socket_send(amqp_socket_t *self, const void *buf, size_t len,
 ssize_t amqp_try_send(amqp_connection_state_t state, const void *buf,
                       size_t len, amqp_time_t deadline, int flags);
 
+/**
+ * Send a scatter-gather list from a socket.
+ *
+ * This function wraps writev(2)/sendmsg(2) functionality. The socket may send
+ * fewer bytes than were passed in, the caller is responsible for advancing
+ * \e iov and trying again.
+ *
+ * \param [in,out] self A socket object.
+ * \param [in] iov The buffers to send, in order.
+ * \param [in] iovcnt The number of entries in \e iov, at most
+ *             AMQP_SOCKET_MAX_IOV.
+ * \param [in] flags AMQP_SF_MORE if more data will immediately follow.
+ *
+ * \return The number of bytes sent, or < 0 on error (\ref amqp_status_enum)
+ */
+ssize_t amqp_socket_writev(amqp_socket_t *self, const struct iovec *iov,
+                           int iovcnt, int flags);
+
+/* Like amqp_try_send(), but for a scatter-gather list. iov is updated in
+ * place to reflect what was sent, so that on a partial send (deadline
+ * reached) the caller can resume with the same array. */
+ssize_t amqp_try_writev(amqp_connection_state_t state, struct iovec *iov,
+                        int iovcnt, amqp_time_t deadline, int flags);
+
+/**
+ * Send part of a file from a socket without copying it through user space.
+ *
+ * This function wraps sendfile(2) functionality. The socket may send fewer
+ * bytes than were asked for.
+ *
+ * \param [in,out] self A socket object.
+ * \param [in] fd The file descriptor to read from.
+ * \param [in] offset The position in \e fd to start reading at.
+ * \param [in] len The number of bytes to send.
+ * \param [in] flags AMQP_SF_MORE if more data will immediately follow.
+ *
+ * \return The number of bytes sent, 0 at the end of the file, or < 0 on
+ * error (\ref amqp_status_enum). AMQP_STATUS_UNSUPPORTED if the socket or
+ * the file does not support it, in which case nothing was sent.
+ */
+ssize_t amqp_socket_sendfile(amqp_socket_t *self, int fd, uint64_t offset,
+                             size_t len, int flags);
+
+/* Like amqp_try_send(), but sending len bytes of fd from offset with
+ * amqp_socket_sendfile(). Returns AMQP_PRIVATE_STATUS_FILE_ENDED if the file
+ * ends first. */
+ssize_t amqp_try_sendfile(amqp_connection_state_t state, int fd,
+                          uint64_t offset, size_t len, amqp_time_t deadline,
+                          int flags);
+
 /**
  * Receive a message from a socket.
  *
@@ -100,6 +161,23 @@ ssize_t amqp_try_send(amqp_connection_state_t state, const void *buf,
  */
 ssize_t amqp_socket_recv(amqp_socket_t *self, void *buf, size_t len, int flags);
 
+/**
+ * Receive into a scatter-gather list from a socket.
+ *
+ * This function wraps readv(2)/recvmsg(2) functionality. Sockets that cannot
+ * do that receive into the first buffer only.
+ *
+ * \param [in,out] self A socket object.
+ * \param [in] iov The buffers to fill, in order.
+ * \param [in] iovcnt The number of entries in \e iov, at most
+ *             AMQP_SOCKET_MAX_IOV.
+ * \param [in] flags Receive flags, implementation specific.
+ *
+ * \return The number of bytes received, or < 0 on error (\ref amqp_status_enum)
+ */
+ssize_t amqp_socket_readv(amqp_socket_t *self, const struct iovec *iov,
+                          int iovcnt, int flags);
+
 /**
  * Close a socket connection and free resources.
  *
@@ -19,8 +19,12 @@
 #include <netinet/tcp.h>
 #include <sys/socket.h>
 #endif
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 struct amqp_tcp_socket_t {
   const struct amqp_socket_class_t *klass;
@@ -29,21 +33,21 @@ struct amqp_tcp_socket_t {
   int state;
 };
 
-static ssize_t amqp_tcp_socket_send(void *base, const void *buf, size_t len,
-                                    int flags) {
-  struct amqp_tcp_socket_t *self = (struct amqp_tcp_socket_t *)base;
-  ssize_t res;
+/* Translates AMQP_SF_* flags to flags for send(2)/sendmsg(2). Returns the
+ * flags, or an amqp_status_enum value < 0 on error. */
+static int amqp_tcp_socket_send_flags(struct amqp_tcp_socket_t *self,
+                                      int flags) {
   int flagz = 0;
-
-  if (-1 == self->sockfd) {
-    return AMQP_STATUS_SOCKET_CLOSED;
-  }
+#if !defined(MSG_MORE) && defined(TCP_NOPUSH) && !defined(__CYGWIN__)
+  int res;
+#endif
 
 #ifdef MSG_NOSIGNAL
   flagz |= MSG_NOSIGNAL;
 #endif
 
 #if defined(MSG_MORE)
+  (void)self;
   if (flags & AMQP_SF_MORE) {
     flagz |= MSG_MORE;
   }
@@ -64,13 +68,50 @@ static ssize_t amqp_tcp_socket_send(void *base, const void *buf, size_t len,
         setsockopt(self->sockfd, IPPROTO_TCP, TCP_NOPUSH, &zero, sizeof(&zero));
     if (0 != res) {
       self->internal_error = res;
-      res = AMQP_STATUS_SOCKET_ERROR;
-    } else {
-      self->state &= ~AMQP_SF_MORE;
+      return AMQP_STATUS_SOCKET_ERROR;
     }
+    self->state &= ~AMQP_SF_MORE;
   }
+#else
+  (void)self;
+  (void)flags;
 #endif
 
+  return flagz;
+}
+
+static ssize_t amqp_tcp_socket_error(struct amqp_tcp_socket_t *self) {
+  self->internal_error = amqp_os_socket_error();
+  switch (self->internal_error) {
+#ifdef _WIN32
+    case WSAEWOULDBLOCK:
+#else
+    case EWOULDBLOCK:
+#endif
+#if defined(EAGAIN) && EAGAIN != EWOULDBLOCK
+    case EAGAIN:
+#endif
+      return AMQP_PRIVATE_STATUS_SOCKET_NEEDWRITE;
+    default:
+      return AMQP_STATUS_SOCKET_ERROR;
+  }
+}
+
+static ssize_t amqp_tcp_socket_send(void *base, const void *buf, size_t len,
+                                    int flags) {
+  struct amqp_tcp_socket_t *self = (struct amqp_tcp_socket_t *)base;
+  ssize_t res;
+  int flagz;
+
+  if (-1 == self->sockfd) {
+    return AMQP_STATUS_SOCKET_CLOSED;
+  }
+
+  flagz = amqp_tcp_socket_send_flags(self, flags);
+  if (flagz < 0) {
+    return flagz;
+  }
+
 start:
 #ifdef _WIN32
   res = send(self->sockfd, buf, (int)len, flagz);
@@ -79,6 +120,131 @@ start:
 #endif
 
   if (res < 0) {
+    if (EINTR == amqp_os_socket_error()) {
+      goto start;
+    }
+    res = amqp_tcp_socket_error(self);
+  } else {
+    self->internal_error = 0;
+  }
+
+  return res;
+}
+
+static ssize_t amqp_tcp_socket_writev(void *base, const struct iovec *iov,
+                                      int iovcnt, int flags) {
+  struct amqp_tcp_socket_t *self = (struct amqp_tcp_socket_t *)base;
+  ssize_t res;
+  int flagz;
+#ifdef _WIN32
+  WSABUF bufs[AMQP_SOCKET_MAX_IOV];
+  DWORD sent;
+  int i;
+#else
+  struct msghdr msg;
+#endif
+
+  if (-1 == self->sockfd) {
+    return AMQP_STATUS_SOCKET_CLOSED;
+  }
+
+  flagz = amqp_tcp_socket_send_flags(self, flags);
+  if (flagz < 0) {
+    return flagz;
+  }
+
+#ifdef _WIN32
+  for (i = 0; i < iovcnt; ++i) {
+    bufs[i].buf = iov[i].iov_base;
+    bufs[i].len = (ULONG)iov[i].iov_len;
+  }
+#else
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = (struct iovec *)iov;
+  msg.msg_iovlen = iovcnt;
+#endif
+
+start:
+#ifdef _WIN32
+  if (0 == WSASend(self->sockfd, bufs, (DWORD)iovcnt, &sent, (DWORD)flagz,
+                   NULL, NULL)) {
+    res = (ssize_t)sent;
+  } else {
+    res = -1;
+  }
+#else
+  res = sendmsg(self->sockfd, &msg, flagz);
+#endif
+
+  if (res < 0) {
+    if (EINTR == amqp_os_socket_error()) {
+      goto start;
+    }
+    res = amqp_tcp_socket_error(self);
+  } else {
+    self->internal_error = 0;
+  }
+
+  return res;
+}
+
+#ifdef HAVE_SENDFILE
+static ssize_t amqp_tcp_socket_sendfile(void *base, int fd, uint64_t offset,
+                                        size_t len, int flags) {
+  struct amqp_tcp_socket_t *self = (struct amqp_tcp_socket_t *)base;
+  ssize_t res;
+  off_t off = (off_t)offset;
+
+  /* sendfile() has no flags, the kernel corks between its own chunks */
+  (void)flags;
+
+  if (-1 == self->sockfd) {
+    return AMQP_STATUS_SOCKET_CLOSED;
+  }
+  if ((uint64_t)off != offset) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+start:
+  res = sendfile(self->sockfd, fd, &off, len);
+
+  if (res < 0) {
+    switch (amqp_os_socket_error()) {
+      case EINTR:
+        goto start;
+      case EINVAL:
+      case ENOSYS:
+        /* fd is not a file sendfile() can read from */
+        self->internal_error = amqp_os_socket_error();
+        return AMQP_STATUS_UNSUPPORTED;
+    }
+    res = amqp_tcp_socket_error(self);
+  } else {
+    self->internal_error = 0;
+  }
+
+  return res;
+}
+#else
+#define amqp_tcp_socket_sendfile NULL
+#endif
+
+static ssize_t amqp_tcp_socket_recv(void *base, void *buf, size_t len,
+                                    int flags) {
+  struct amqp_tcp_socket_t *self = (struct amqp_tcp_socket_t *)base;
+  ssize_t ret;
+  if (-1 == self->sockfd) {
+    return AMQP_STATUS_SOCKET_CLOSED;
+  }
+
+start:
+#ifdef _WIN32
+  ret = recv(self->sockfd, buf, (int)len, flags);
+#else
+  ret = recv(self->sockfd, buf, len, flags);
+#endif
+
+  if (0 > ret) {
     self->internal_error = amqp_os_socket_error();
     switch (self->internal_error) {
       case EINTR:
@@ -91,31 +257,57 @@ start:
 #if defined(EAGAIN) && EAGAIN != EWOULDBLOCK
       case EAGAIN:
 #endif
-        res = AMQP_PRIVATE_STATUS_SOCKET_NEEDWRITE;
+        ret = AMQP_PRIVATE_STATUS_SOCKET_NEEDREAD;
         break;
       default:
-        res = AMQP_STATUS_SOCKET_ERROR;
+        ret = AMQP_STATUS_SOCKET_ERROR;
     }
-  } else {
-    self->internal_error = 0;
+  } else if (0 == ret) {
+    ret = AMQP_STATUS_CONNECTION_CLOSED;
   }
 
-  return res;
+  return ret;
 }
 
-static ssize_t amqp_tcp_socket_recv(void *base, void *buf, size_t len,
-                                    int flags) {
+static ssize_t amqp_tcp_socket_readv(void *base, const struct iovec *iov,
+                                     int iovcnt, int flags) {
   struct amqp_tcp_socket_t *self = (struct amqp_tcp_socket_t *)base;
   ssize_t ret;
+#ifdef _WIN32
+  WSABUF bufs[AMQP_SOCKET_MAX_IOV];
+  DWORD received;
+  DWORD flagz;
+  int i;
+#else
+  struct msghdr msg;
+#endif
+
   if (-1 == self->sockfd) {
     return AMQP_STATUS_SOCKET_CLOSED;
   }
 
+#ifdef _WIN32
+  for (i = 0; i < iovcnt; ++i) {
+    bufs[i].buf = iov[i].iov_base;
+    bufs[i].len = (ULONG)iov[i].iov_len;
+  }
+#else
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = (struct iovec *)iov;
+  msg.msg_iovlen = iovcnt;
+#endif
+
 start:
 #ifdef _WIN32
-  ret = recv(self->sockfd, buf, (int)len, flags);
+  flagz = (DWORD)flags;
+  if (0 == WSARecv(self->sockfd, bufs, (DWORD)iovcnt, &received, &flagz, NULL,
+                   NULL)) {
+    ret = (ssize_t)received;
+  } else {
+    ret = -1;
+  }
 #else
-  ret = recv(self->sockfd, buf, len, flags);
+  ret = recvmsg(self->sockfd, &msg, flags);
 #endif
 
   if (0 > ret) {
@@ -189,11 +381,14 @@ static void amqp_tcp_socket_delete(void *base) {
 
 static const struct amqp_socket_class_t amqp_tcp_socket_class = {
     amqp_tcp_socket_send,       /* send */
+    amqp_tcp_socket_writev,     /* writev */
     amqp_tcp_socket_recv,       /* recv */
     amqp_tcp_socket_open,       /* open */
     amqp_tcp_socket_close,      /* close */
     amqp_tcp_socket_get_sockfd, /* get_sockfd */
-    amqp_tcp_socket_delete      /* delete */
+    amqp_tcp_socket_delete,     /* delete */
+    amqp_tcp_socket_sendfile,   /* sendfile */
+    amqp_tcp_socket_readv       /* readv */
 };
 
 amqp_socket_t *amqp_tcp_socket_new(amqp_connection_state_t state) {
@@ -80,8 +80,43 @@ uint64_t amqp_get_monotonic_timestamp(void) {
   return ((uint64_t)tp.tv_sec * AMQP_NS_PER_S + (uint64_t)tp.tv_nsec);
 #endif
 }
+
+#ifdef CLOCK_MONOTONIC_COARSE
+#define AMQP_HAVE_COARSE_TIMER
+uint64_t amqp_get_coarse_monotonic_timestamp(void) {
+  struct timespec tp;
+  if (-1 == clock_gettime(CLOCK_MONOTONIC_COARSE, &tp)) {
+    return amqp_get_monotonic_timestamp();
+  }
+
+  return ((uint64_t)tp.tv_sec * AMQP_NS_PER_S + (uint64_t)tp.tv_nsec);
+}
+#endif
 #endif /* AMQP_POSIX_TIMER_API */
 
+#ifndef AMQP_HAVE_COARSE_TIMER
+uint64_t amqp_get_coarse_monotonic_timestamp(void) {
+  return amqp_get_monotonic_timestamp();
+}
+#endif
+
+/* Gets the time from cache, refreshing it if it has been used up. */
+static uint64_t clock_cache_now(amqp_clock_cache_t *cache) {
+  if (0 == cache->uses_left) {
+    cache->now_ns = amqp_get_coarse_monotonic_timestamp();
+    if (0 == cache->now_ns) {
+      return 0;
+    }
+    cache->uses_left = AMQP_CLOCK_CACHE_USES;
+  }
+  cache->uses_left--;
+  return cache->now_ns;
+}
+
+void amqp_clock_cache_invalidate(amqp_clock_cache_t *cache) {
+  cache->uses_left = 0;
+}
+
 int amqp_time_from_now(amqp_time_t *time, const struct timeval *timeout) {
   uint64_t now_ns;
   uint64_t delta_ns;
@@ -113,17 +148,9 @@ int amqp_time_from_now(amqp_time_t *time, const struct timeval *timeout) {
   return AMQP_STATUS_OK;
 }
 
-int amqp_time_s_from_now(amqp_time_t *time, int seconds) {
-  uint64_t now_ns;
+static int time_s_from(amqp_time_t *time, int seconds, uint64_t now_ns) {
   uint64_t delta_ns;
-  assert(NULL != time);
-
-  if (0 >= seconds) {
-    *time = amqp_time_infinite();
-    return AMQP_STATUS_OK;
-  }
 
-  now_ns = amqp_get_monotonic_timestamp();
   if (0 == now_ns) {
     return AMQP_STATUS_TIMER_FAILURE;
   }
@@ -137,12 +164,39 @@ int amqp_time_s_from_now(amqp_time_t *time, int seconds) {
   return AMQP_STATUS_OK;
 }
 
+int amqp_time_s_from_now(amqp_time_t *time, int seconds) {
+  assert(NULL != time);
+
+  if (0 >= seconds) {
+    *time = amqp_time_infinite();
+    return AMQP_STATUS_OK;
+  }
+  return time_s_from(time, seconds, amqp_get_monotonic_timestamp());
+}
+
+int amqp_time_s_from_now_cached(amqp_time_t *time, int seconds,
+                                amqp_clock_cache_t *cache) {
+  assert(NULL != time);
+
+  if (0 >= seconds) {
+    *time = amqp_time_infinite();
+    return AMQP_STATUS_OK;
+  }
+  return time_s_from(time, seconds, clock_cache_now(cache));
+}
+
 amqp_time_t amqp_time_infinite(void) {
   amqp_time_t time;
   time.time_point_ns = UINT64_MAX;
   return time;
 }
 
+amqp_time_t amqp_time_immediate(void) {
+  amqp_time_t time;
+  time.time_point_ns = 0;
+  return time;
+}
+
 int amqp_time_ms_until(amqp_time_t time) {
   uint64_t now_ns;
   uint64_t delta_ns;
@@ -207,13 +261,7 @@ int amqp_time_tv_until(amqp_time_t time, struct timeval *in,
   return AMQP_STATUS_OK;
 }
 
-int amqp_time_has_past(amqp_time_t time) {
-  uint64_t now_ns;
-  if (UINT64_MAX == time.time_point_ns) {
-    return AMQP_STATUS_OK;
-  }
-
-  now_ns = amqp_get_monotonic_timestamp();
+static int time_has_past_at(amqp_time_t time, uint64_t now_ns) {
   if (0 == now_ns) {
     return AMQP_STATUS_TIMER_FAILURE;
   }
@@ -224,6 +272,20 @@ int amqp_time_has_past(amqp_time_t time) {
   return AMQP_STATUS_OK;
 }
 
+int amqp_time_has_past(amqp_time_t time) {
+  if (UINT64_MAX == time.time_point_ns) {
+    return AMQP_STATUS_OK;
+  }
+  return time_has_past_at(time, amqp_get_monotonic_timestamp());
+}
+
+int amqp_time_has_past_cached(amqp_time_t time, amqp_clock_cache_t *cache) {
+  if (UINT64_MAX == time.time_point_ns) {
+    return AMQP_STATUS_OK;
+  }
+  return time_has_past_at(time, clock_cache_now(cache));
+}
+
 amqp_time_t amqp_time_first(amqp_time_t l, amqp_time_t r) {
   if (l.time_point_ns < r.time_point_ns) {
     return l;
@@ -38,11 +38,39 @@ typedef struct amqp_time_t_ {
   uint64_t time_point_ns;
 } amqp_time_t;
 
+/* A cached reading of the coarse monotonic clock, for heartbeat bookkeeping
+ * that would otherwise read the clock for every frame. The cached time is
+ * refreshed every AMQP_CLOCK_CACHE_USES reads, and invalidated after every
+ * wait for the socket and before a blocking wait sends a heartbeat, so an
+ * idle connection does not time its heartbeats from an old reading. Between
+ * those points, as in a run of publishes, it may lag the real time. It must
+ * only be used where a time in the past errs on the safe side: a heartbeat
+ * send deadline computed from it comes out early, and a check that a deadline
+ * has passed notices it late.
+ *
+ * A zeroed amqp_clock_cache_t is refreshed on first use.
+ */
+typedef struct amqp_clock_cache_t_ {
+  uint64_t now_ns;
+  unsigned int uses_left;
+} amqp_clock_cache_t;
+
+#ifndef AMQP_CLOCK_CACHE_USES
+#define AMQP_CLOCK_CACHE_USES 64
+#endif
+
 /* Gets a monotonic timestamp. This will return 0 if the underlying call to the
  * system fails.
  */
 uint64_t amqp_get_monotonic_timestamp(void);
 
+/* Gets a monotonic timestamp that may be a few milliseconds behind
+ * amqp_get_monotonic_timestamp(), but is cheaper to get where the platform
+ * has such a clock. This will return 0 if the underlying call to the system
+ * fails.
+ */
+uint64_t amqp_get_coarse_monotonic_timestamp(void);
+
 /* Get a amqp_time_t that is timeout from now.
  * If timeout is NULL, an amqp_time_infinite() is created.
  *
@@ -62,9 +90,21 @@ int amqp_time_from_now(amqp_time_t *time, const struct timeval *timeout);
  */
 int amqp_time_s_from_now(amqp_time_t *time, int seconds);
 
+/* As amqp_time_s_from_now(), using the time in cache. */
+int amqp_time_s_from_now_cached(amqp_time_t *time, int seconds,
+                                amqp_clock_cache_t *cache);
+
+/* Makes the next read of cache get the current time. Used after anything
+ * that may have taken a while, such as waiting for the socket. */
+void amqp_clock_cache_invalidate(amqp_clock_cache_t *cache);
+
 /* Create an infinite amqp_time_t */
 amqp_time_t amqp_time_infinite(void);
 
+/* Create an amqp_time_t that has already passed, for polling without
+ * waiting */
+amqp_time_t amqp_time_immediate(void);
+
 /* Gets the number of ms until the amqp_time_t, suitable for the timeout
  * parameter in poll().
  *
@@ -102,6 +142,9 @@ int amqp_time_tv_until(amqp_time_t time, struct timeval *in,
  */
 int amqp_time_has_past(amqp_time_t time);
 
+/* As amqp_time_has_past(), using the time in cache. */
+int amqp_time_has_past_cached(amqp_time_t time, amqp_clock_cache_t *cache);
+
 /* Return the time value that happens first */
 amqp_time_t amqp_time_first(amqp_time_t l, amqp_time_t r);
 
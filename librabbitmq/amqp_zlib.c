@@ -0,0 +1,196 @@
+// Copyright 2007 - 2021, Alan Antonuk and the rabbitmq-c contributors.
+// SPDX-License-Identifier: mit
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+#include "rabbitmq-c/zlib_codec.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#define AMQP_DEFLATE_INITIAL_CAPACITY 4096
+
+typedef struct amqp_inflate_t_ {
+  z_stream stream;
+  uint64_t encoded_size;
+  uint64_t decoded_size;
+  uint64_t max_size;
+  int ended;
+} amqp_inflate_t;
+
+static int AMQP_CALL deflate_encode(void *user_data, amqp_bytes_t body,
+                                    amqp_bytes_t *encoded) {
+  int level = (int)(intptr_t)user_data;
+  uLong encoded_len;
+
+  if ((uint64_t)body.len > (uLong)-1) {
+    return AMQP_STATUS_UNSUPPORTED;
+  }
+
+  encoded_len = compressBound((uLong)body.len);
+  *encoded = amqp_bytes_malloc(encoded_len);
+  if (NULL == encoded->bytes) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  if (Z_OK != compress2(encoded->bytes, &encoded_len, body.bytes,
+                        (uLong)body.len, level)) {
+    amqp_bytes_free(*encoded);
+    return AMQP_STATUS_CODEC_ERROR;
+  }
+  encoded->len = encoded_len;
+  return AMQP_STATUS_OK;
+}
+
+static int AMQP_CALL deflate_decoder_new(AMQP_UNUSED void *user_data,
+                                         uint64_t encoded_size,
+                                         uint64_t max_size, void **decoder) {
+  amqp_inflate_t *inflater = calloc(1, sizeof(amqp_inflate_t));
+  if (NULL == inflater) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  if (Z_OK != inflateInit(&inflater->stream)) {
+    free(inflater);
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  inflater->encoded_size = encoded_size;
+  inflater->max_size = max_size;
+  *decoder = inflater;
+  return AMQP_STATUS_OK;
+}
+
+/* Makes room for more output at the end of body, up to limit bytes. */
+static int inflate_grow(amqp_inflate_t *inflater, amqp_bytes_t *body,
+                        size_t *capacity, uint64_t limit) {
+  size_t new_capacity;
+  void *new_bytes;
+
+  if (0 == *capacity) {
+    /* Guess at a compression ratio of 2 to start with. */
+    new_capacity = AMQP_DEFLATE_INITIAL_CAPACITY;
+    if (inflater->encoded_size < SIZE_MAX / 4 &&
+        new_capacity < 2 * inflater->encoded_size) {
+      new_capacity = (size_t)(2 * inflater->encoded_size);
+    }
+  } else if (*capacity > SIZE_MAX / 2) {
+    return AMQP_STATUS_NO_MEMORY;
+  } else {
+    new_capacity = 2 * *capacity;
+  }
+  if (new_capacity - body->len > limit) {
+    new_capacity = body->len + (size_t)limit;
+  }
+
+  new_bytes = realloc(body->bytes, new_capacity);
+  if (NULL == new_bytes) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  body->bytes = new_bytes;
+  *capacity = new_capacity;
+  return AMQP_STATUS_OK;
+}
+
+static int AMQP_CALL deflate_decode(void *decoder, amqp_bytes_t fragment,
+                                    amqp_bytes_t *body, size_t *capacity) {
+  amqp_inflate_t *inflater = decoder;
+  z_stream *stream = &inflater->stream;
+  int res;
+
+  if (0 == fragment.len) {
+    return AMQP_STATUS_OK;
+  }
+  if (inflater->ended) {
+    /* Trailing data after the end of the zlib stream */
+    return AMQP_STATUS_CODEC_ERROR;
+  }
+
+  stream->next_in = fragment.bytes;
+  stream->avail_in = (uInt)fragment.len;
+
+  for (;;) {
+    /* One byte past the limit, to tell a body that ends at the limit from
+     * one that goes over it */
+    uint64_t limit = inflater->max_size - inflater->decoded_size;
+    size_t room;
+
+    if (limit < UINT64_MAX) {
+      ++limit;
+    }
+
+    if (body->len == *capacity) {
+      res = inflate_grow(inflater, body, capacity, limit);
+      if (AMQP_STATUS_OK != res) {
+        return res;
+      }
+    }
+
+    room = *capacity - body->len;
+    if (room > limit) {
+      room = (size_t)limit;
+    }
+    if (room > UINT_MAX) {
+      room = UINT_MAX;
+    }
+    stream->next_out = (Bytef *)body->bytes + body->len;
+    stream->avail_out = (uInt)room;
+
+    res = inflate(stream, Z_NO_FLUSH);
+    body->len += room - stream->avail_out;
+    inflater->decoded_size += room - stream->avail_out;
+    if (inflater->decoded_size > inflater->max_size) {
+      return AMQP_STATUS_CODEC_ERROR;
+    }
+
+    if (Z_STREAM_END == res) {
+      inflater->ended = 1;
+      return 0 == stream->avail_in ? AMQP_STATUS_OK : AMQP_STATUS_CODEC_ERROR;
+    }
+    if (Z_BUF_ERROR == res && 0 == stream->avail_in) {
+      /* Needs the next fragment to make progress */
+      return AMQP_STATUS_OK;
+    }
+    if (Z_OK != res) {
+      return AMQP_STATUS_CODEC_ERROR;
+    }
+    if (0 == stream->avail_in && 0 != stream->avail_out) {
+      return AMQP_STATUS_OK;
+    }
+  }
+}
+
+static int AMQP_CALL deflate_decoder_finish(void *decoder) {
+  amqp_inflate_t *inflater = decoder;
+  return inflater->ended ? AMQP_STATUS_OK : AMQP_STATUS_CODEC_ERROR;
+}
+
+static void AMQP_CALL deflate_decoder_free(void *decoder) {
+  amqp_inflate_t *inflater = decoder;
+  inflateEnd(&inflater->stream);
+  free(inflater);
+}
+
+const amqp_body_codec_t amqp_deflate_codec = {
+    "deflate",              /* content_encoding */
+    deflate_encode,         /* encode */
+    deflate_decoder_new,    /* decoder_new */
+    deflate_decode,         /* decode */
+    deflate_decoder_finish, /* decoder_finish */
+    deflate_decoder_free    /* decoder_free */
+};
+
+int amqp_set_deflate_codec(amqp_connection_state_t state, int level,
+                           size_t min_size) {
+  if (level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  amqp_set_body_codec(state, &amqp_deflate_codec, (void *)(intptr_t)level,
+                      min_size);
+  return AMQP_STATUS_OK;
+}
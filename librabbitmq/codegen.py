@@ -150,6 +150,18 @@ class TableType(object):
         emitter.emit("  if (res < 0) return res;")
         emitter.emit("}")
 
+    def skip(self, emitter):
+        emitter.emit("{")
+        emitter.emit("  size_t start = offset;")
+        emitter.emit("  uint32_t len;")
+        emitter.emit("  amqp_bytes_t table;")
+        emitter.emit("  if (!amqp_decode_32(encoded, &offset, &len)")
+        emitter.emit("      || !amqp_decode_bytes(encoded, &offset, &table, len))")
+        emitter.emit("    return AMQP_STATUS_BAD_AMQP_DATA;")
+        emitter.emit("  raw_table->bytes = amqp_offset(encoded.bytes, start);")
+        emitter.emit("  raw_table->len = offset - start;")
+        emitter.emit("}")
+
     def encode(self, emitter, value):
         emitter.emit("{")
         emitter.emit("  int res = amqp_encode_table(encoded, &(%s), &offset);" % (value,))
@@ -282,6 +294,29 @@ def genErl(spec):
         print("      return 0;")
         print("    }")
 
+    def genDecodePropertiesLazy(c):
+        tables = [f for f in c.fields if spec.resolveDomain(f.domain) == 'table']
+        if len(tables) > 1:
+            # Only one raw table can be returned
+            raise NotImplementedError()
+
+        print("    case %d: {" % (c.index,))
+        print("      %s *p = (%s *) decoded;" % (c.structName(), c.structName()))
+        print("      memset(p, 0, sizeof(%s));" % (c.structName(),))
+        print("      p->_flags = flags;")
+
+        emitter = Emitter("      ")
+        for f in c.fields:
+            emitter.emit("if (flags & %s) {" % (cFlagName(c, f),))
+            if f in tables:
+                typeFor(spec, f).skip(emitter)
+            else:
+                typeFor(spec, f).decode(emitter, "p->"+c_ize(f.name))
+            emitter.emit("}")
+
+        print("      return 0;")
+        print("    }")
+
     def genEncodeMethodFields(m):
         print("    case %s: {" % (m.defName(),))
         if m.arguments:
@@ -404,6 +439,33 @@ int amqp_decode_properties(uint16_t class_id,
   }
 }""")
 
+    print("""
+int amqp_decode_properties_lazy(uint16_t class_id,
+                                amqp_bytes_t encoded,
+                                void *decoded,
+                                amqp_bytes_t *raw_table)
+{
+  size_t offset = 0;
+
+  amqp_flags_t flags = 0;
+  int flagword_index = 0;
+  uint16_t partial_flags;
+
+  *raw_table = amqp_empty_bytes;
+
+  do {
+    if (!amqp_decode_16(encoded, &offset, &partial_flags))
+      return AMQP_STATUS_BAD_AMQP_DATA;
+    flags |= (partial_flags << (flagword_index * 16));
+    flagword_index++;
+  } while (partial_flags & 1);
+
+  switch (class_id) {""")
+    for c in spec.allClasses(): genDecodePropertiesLazy(c)
+    print("""    default: return AMQP_STATUS_UNKNOWN_CLASS;
+  }
+}""")
+
     print("""
 int amqp_encode_method(amqp_method_number_t methodNumber,
                        void *decoded,
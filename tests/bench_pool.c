@@ -0,0 +1,157 @@
+// Copyright 2007 - 2021, Alan Antonuk and the rabbitmq-c contributors.
+// SPDX-License-Identifier: mit
+
+/* Measures the allocator calls and time taken by the pools of messages and
+ * connections, with and without the page cache. Built but not run as a
+ * test. */
+
+#include "amqp_private.h"
+#include "amqp_time.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+/* Count every allocator call made in the process */
+#define BENCH_COUNT_ALLOCATOR_CALLS
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long allocator_calls;
+
+void *malloc(size_t size) {
+  allocator_calls++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  allocator_calls++;
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  allocator_calls++;
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+  if (ptr != NULL) {
+    allocator_calls++;
+  }
+  __libc_free(ptr);
+}
+#endif
+
+#define MESSAGES 1000000
+#define CONNECTIONS 100000
+
+static void die(const char *msg) {
+  fprintf(stderr, "%s\n", msg);
+  abort();
+}
+
+/* The pool work amqp_read_message() and amqp_destroy_message() do for a
+ * message with a few properties and headers */
+static void message_pool(const amqp_table_t *headers) {
+  amqp_pool_t pool;
+  amqp_table_t clone;
+  amqp_bytes_t bytes;
+
+  init_amqp_pool(&pool, 4096);
+  amqp_pool_alloc_bytes(&pool, 16, &bytes);
+  amqp_pool_alloc_bytes(&pool, 36, &bytes);
+  if (NULL == bytes.bytes ||
+      AMQP_STATUS_OK != amqp_table_clone(headers, &clone, &pool)) {
+    die("out of memory");
+  }
+  empty_amqp_pool(&pool);
+}
+
+/* A connection that has read frames on one channel */
+static void connection_pools(void) {
+  amqp_connection_state_t conn = amqp_new_connection();
+  if (NULL == conn) {
+    die("amqp_new_connection failed");
+  }
+  conn->state = CONNECTION_STATE_IDLE;
+  if (AMQP_STATUS_OK != amqp_tune_connection(conn, 0, 131072, 0) ||
+      NULL == amqp_get_or_create_channel_pool(conn, 1) ||
+      NULL == amqp_pool_alloc(amqp_get_channel_pool(conn, 1), 1000)) {
+    die("out of memory");
+  }
+  amqp_destroy_connection(conn);
+}
+
+static void report(const char *name, int count, uint64_t start,
+                   unsigned long calls) {
+  uint64_t elapsed = amqp_get_monotonic_timestamp() - start;
+#ifdef BENCH_COUNT_ALLOCATOR_CALLS
+  printf("%-34s %6.2f allocator calls, %8.1f ns each\n", name,
+         (double)(allocator_calls - calls) / count, (double)elapsed / count);
+#else
+  (void)calls;
+  printf("%-34s %8.1f ns each\n", name, (double)elapsed / count);
+#endif
+}
+
+static void run(const char *name, size_t cache_bytes,
+                const amqp_table_t *headers) {
+  unsigned long calls = 0;
+  uint64_t start;
+  char label[64];
+  int i;
+
+  amqp_set_page_cache(cache_bytes);
+  /* Warm the cache */
+  message_pool(headers);
+  connection_pools();
+
+#ifdef BENCH_COUNT_ALLOCATOR_CALLS
+  calls = allocator_calls;
+#endif
+  start = amqp_get_monotonic_timestamp();
+  for (i = 0; i < MESSAGES; ++i) {
+    message_pool(headers);
+  }
+  snprintf(label, sizeof(label), "message, %s", name);
+  report(label, MESSAGES, start, calls);
+
+#ifdef BENCH_COUNT_ALLOCATOR_CALLS
+  calls = allocator_calls;
+#endif
+  start = amqp_get_monotonic_timestamp();
+  for (i = 0; i < CONNECTIONS; ++i) {
+    connection_pools();
+  }
+  snprintf(label, sizeof(label), "connection, %s", name);
+  report(label, CONNECTIONS, start, calls);
+
+  amqp_set_page_cache(0);
+}
+
+int main(void) {
+  amqp_table_entry_t entries[4];
+  amqp_table_t headers;
+
+  entries[0].key = amqp_cstring_bytes("x-trace-id");
+  entries[0].value.kind = AMQP_FIELD_KIND_UTF8;
+  entries[0].value.value.bytes = amqp_cstring_bytes("5f0c2a7e9b1d4c3a");
+  entries[1].key = amqp_cstring_bytes("x-retries");
+  entries[1].value.kind = AMQP_FIELD_KIND_I32;
+  entries[1].value.value.i32 = 3;
+  entries[2].key = amqp_cstring_bytes("x-source");
+  entries[2].value.kind = AMQP_FIELD_KIND_UTF8;
+  entries[2].value.value.bytes = amqp_cstring_bytes("ingest-7");
+  entries[3].key = amqp_cstring_bytes("x-priority");
+  entries[3].value.kind = AMQP_FIELD_KIND_BOOLEAN;
+  entries[3].value.value.boolean = 1;
+  headers.num_entries = 4;
+  headers.entries = entries;
+
+  run("no page cache", 0, &headers);
+  run("page cache", 4 * 1024 * 1024, &headers);
+  return 0;
+}
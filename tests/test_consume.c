@@ -0,0 +1,1250 @@
+// Copyright 2007 - 2021, Alan Antonuk and the rabbitmq-c contributors.
+// SPDX-License-Identifier: mit
+
+#include "test_socket.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Queues a basic.deliver of body with properties to consumer_tag on channel,
+ * split into body frames of at most frame_max bytes. */
+static void script_delivery_to(struct test_socket_t *sock,
+                               amqp_channel_t channel, const char *consumer_tag,
+                               uint64_t delivery_tag,
+                               amqp_basic_properties_t *properties,
+                               amqp_bytes_t body, size_t frame_max) {
+  amqp_basic_deliver_t deliver;
+  amqp_frame_t frame;
+  size_t offset;
+
+  memset(&deliver, 0, sizeof(deliver));
+  deliver.consumer_tag = amqp_cstring_bytes(consumer_tag);
+  deliver.delivery_tag = delivery_tag;
+  deliver.exchange = amqp_cstring_bytes("exchange");
+  deliver.routing_key = amqp_cstring_bytes("routing.key");
+
+  frame.frame_type = AMQP_FRAME_METHOD;
+  frame.channel = channel;
+  frame.payload.method.id = AMQP_BASIC_DELIVER_METHOD;
+  frame.payload.method.decoded = &deliver;
+  script_frame(sock, &frame);
+
+  frame.frame_type = AMQP_FRAME_HEADER;
+  frame.payload.properties.class_id = AMQP_BASIC_CLASS;
+  frame.payload.properties.body_size = body.len;
+  frame.payload.properties.decoded = properties;
+  script_frame(sock, &frame);
+
+  for (offset = 0; offset < body.len;) {
+    size_t len = body.len - offset;
+    if (len > frame_max - HEADER_SIZE - FOOTER_SIZE) {
+      len = frame_max - HEADER_SIZE - FOOTER_SIZE;
+    }
+    frame.frame_type = AMQP_FRAME_BODY;
+    frame.payload.body_fragment.bytes = (char *)body.bytes + offset;
+    frame.payload.body_fragment.len = len;
+    script_frame(sock, &frame);
+    offset += len;
+  }
+}
+
+/* Queues a basic.deliver of body with properties to the consumer "consumer".
+ */
+static void script_delivery_with(struct test_socket_t *sock,
+                                 amqp_channel_t channel, uint64_t delivery_tag,
+                                 amqp_basic_properties_t *properties,
+                                 amqp_bytes_t body, size_t frame_max) {
+  script_delivery_to(sock, channel, "consumer", delivery_tag, properties, body,
+                     frame_max);
+}
+
+/* Queues a basic.deliver of a text/plain body. */
+static void script_delivery(struct test_socket_t *sock, amqp_channel_t channel,
+                            uint64_t delivery_tag, amqp_bytes_t body,
+                            size_t frame_max) {
+  amqp_basic_properties_t properties;
+
+  properties._flags = AMQP_BASIC_CONTENT_TYPE_FLAG;
+  properties.content_type = amqp_cstring_bytes("text/plain");
+  script_delivery_with(sock, channel, delivery_tag, &properties, body,
+                       frame_max);
+}
+
+static void wait_frame(amqp_connection_state_t conn, amqp_frame_t *frame,
+                       uint8_t frame_type) {
+  if (AMQP_STATUS_OK != amqp_simple_wait_frame(conn, frame) ||
+      frame_type != frame->frame_type) {
+    die("unexpected frame");
+  }
+}
+
+static int in_socket_buffer(amqp_connection_state_t conn, const void *p) {
+  const char *start = conn->sock_inbound_buffer.bytes;
+  return (const char *)p >= start &&
+         (const char *)p < start + conn->sock_inbound_buffer.len;
+}
+
+/* Waits for a delivery with a single body frame. */
+static void wait_delivery(amqp_connection_state_t conn, amqp_frame_t *body) {
+  amqp_frame_t frame;
+  wait_frame(conn, &frame, AMQP_FRAME_METHOD);
+  wait_frame(conn, &frame, AMQP_FRAME_HEADER);
+  wait_frame(conn, body, AMQP_FRAME_BODY);
+}
+
+static void test_decode_in_place(void) {
+  amqp_connection_state_t conn;
+  struct test_socket_t *sock = new_test_connection(&conn, 4096);
+  amqp_bytes_t first = amqp_cstring_bytes("first body");
+  amqp_bytes_t second = amqp_cstring_bytes("second body");
+  amqp_bytes_t filler = make_body(1500);
+  amqp_frame_t first_body;
+  amqp_frame_t frame;
+  void *buffer;
+  int i;
+
+  if (AMQP_STATUS_OK != amqp_set_inbound_buffer_limits(conn, 4096, 4096)) {
+    die("amqp_set_inbound_buffer_limits failed");
+  }
+
+  /* Frames that arrive whole point into the socket buffer */
+  script_delivery(sock, 1, 1, first, 4096);
+  wait_delivery(conn, &first_body);
+  if (!in_socket_buffer(conn, first_body.payload.body_fragment.bytes)) {
+    die("the body frame should have been decoded in place");
+  }
+
+  /* Reading more while they are held goes on after them */
+  buffer = conn->sock_inbound_buffer.bytes;
+  script_delivery(sock, 2, 1, second, 4096);
+  wait_delivery(conn, &frame);
+  if (buffer != conn->sock_inbound_buffer.bytes ||
+      !in_socket_buffer(conn, frame.payload.body_fragment.bytes)) {
+    die("the socket buffer should have been read into after held frames");
+  }
+  if (!amqp_bytes_equal(first, first_body.payload.body_fragment) ||
+      !amqp_bytes_equal(second, frame.payload.body_fragment)) {
+    die("body frames were overwritten");
+  }
+
+  /* Once held frames take up most of it, it is retired and left intact */
+  for (i = 0; i < 4; ++i) {
+    script_delivery(sock, 2, (uint64_t)i + 2, filler, 4096);
+  }
+  for (i = 0; i < 4; ++i) {
+    wait_delivery(conn, &frame);
+    if (!amqp_bytes_equal(filler, frame.payload.body_fragment)) {
+      die("unexpected body");
+    }
+  }
+  if (buffer == conn->sock_inbound_buffer.bytes ||
+      NULL == conn->retired_inbound_buffers ||
+      !amqp_bytes_equal(first, first_body.payload.body_fragment)) {
+    die("a full socket buffer should have been retired");
+  }
+
+  /* A channel with frames still held keeps its buffer alive */
+  amqp_maybe_release_buffers_on_channel(conn, 2);
+  if (NULL == conn->retired_inbound_buffers) {
+    die("channel 1 still references the retired buffer");
+  }
+  amqp_maybe_release_buffers_on_channel(conn, 1);
+  if (NULL != conn->retired_inbound_buffers) {
+    die("the retired buffer should have been released");
+  }
+
+  amqp_bytes_free(filler);
+  amqp_destroy_connection(conn);
+}
+
+static void test_decode_split_frames(void) {
+  amqp_connection_state_t conn;
+  struct test_socket_t *sock = new_test_connection(&conn, 4096);
+  amqp_bytes_t body = make_body(5 * 4096 + 100);
+  amqp_envelope_t envelope;
+  amqp_rpc_reply_t reply;
+  int i;
+
+  /* Frames straddling reads are completed by the next read */
+  sock->max_read = 1000;
+  for (i = 0; i < 3; ++i) {
+    script_delivery(sock, 1, (uint64_t)i + 1, body, 4096);
+  }
+  for (i = 0; i < 3; ++i) {
+    amqp_maybe_release_buffers(conn);
+    reply = amqp_consume_message(conn, &envelope, NULL, 0);
+    if (AMQP_RESPONSE_NORMAL != reply.reply_type ||
+        envelope.delivery_tag != (uint64_t)i + 1 ||
+        !amqp_bytes_equal(body, envelope.message.body)) {
+      die("amqp_consume_message failed");
+    }
+    amqp_destroy_envelope(&envelope);
+  }
+
+  amqp_bytes_free(body);
+  amqp_destroy_connection(conn);
+}
+
+static void test_channel_pool_size(void) {
+  amqp_connection_state_t conn;
+  struct test_socket_t *sock = new_test_connection(&conn, 131072);
+  amqp_bytes_t body = make_body(100000);
+  amqp_bytes_t data;
+  amqp_frame_t frame;
+  amqp_pool_t *pool;
+  size_t offset;
+  int res;
+
+  /* Frames handed to amqp_handle_input() are copied into their channel's
+   * pool */
+  script_delivery(sock, 1, 1, amqp_cstring_bytes("small"), 131072);
+  script_delivery(sock, 2, 1, body, 131072);
+  for (offset = 0; offset < sock->recv_len; offset += (size_t)res) {
+    data.bytes = sock->recv_data + offset;
+    data.len = sock->recv_len - offset;
+    res = amqp_handle_input(conn, data, &frame);
+    if (res <= 0) {
+      die("amqp_handle_input failed");
+    }
+  }
+
+  /* A channel carrying small frames takes a small page, whatever frame_max
+   * is */
+  pool = amqp_get_channel_pool(conn, 1);
+  if (NULL == pool || AMQP_CHANNEL_POOL_PAGE_SIZE != pool->pagesize ||
+      1 != pool->pages.num_blocks || 0 != pool->large_blocks.num_blocks) {
+    die("expected channel 1 to use a single small page");
+  }
+
+  /* Large frames get a block of their own, freed once released */
+  pool = amqp_get_channel_pool(conn, 2);
+  if (NULL == pool || 1 != pool->large_blocks.num_blocks ||
+      !amqp_bytes_equal(body, frame.payload.body_fragment)) {
+    die("expected the body frame to be read into a block of its own");
+  }
+  amqp_maybe_release_buffers_on_channel(conn, 2);
+  if (0 != pool->large_blocks.num_blocks) {
+    die("expected the body frame's block to be freed");
+  }
+
+  amqp_bytes_free(body);
+  amqp_destroy_connection(conn);
+}
+
+/* A codec whose encoding drops every other byte of a body of byte pairs */
+static int AMQP_CALL pairs_decoder_new(AMQP_UNUSED void *user_data,
+                                       AMQP_UNUSED uint64_t encoded_size,
+                                       AMQP_UNUSED uint64_t max_size,
+                                       void **decoder) {
+  static int dummy;
+  *decoder = &dummy;
+  return AMQP_STATUS_OK;
+}
+
+static int AMQP_CALL pairs_decode(AMQP_UNUSED void *decoder,
+                                  amqp_bytes_t fragment, amqp_bytes_t *body,
+                                  size_t *capacity) {
+  size_t i;
+  if (body->len + 2 * fragment.len > *capacity) {
+    size_t new_capacity = body->len + 2 * fragment.len;
+    void *bytes = realloc(body->bytes, new_capacity);
+    if (NULL == bytes) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+    body->bytes = bytes;
+    *capacity = new_capacity;
+  }
+  for (i = 0; i < fragment.len; ++i) {
+    ((char *)body->bytes)[body->len++] = ((char *)fragment.bytes)[i];
+    ((char *)body->bytes)[body->len++] = ((char *)fragment.bytes)[i];
+  }
+  return AMQP_STATUS_OK;
+}
+
+static int AMQP_CALL pairs_decoder_finish(AMQP_UNUSED void *decoder) {
+  return AMQP_STATUS_OK;
+}
+
+static void AMQP_CALL pairs_decoder_free(AMQP_UNUSED void *decoder) {}
+
+static const amqp_body_codec_t pairs_codec = {
+    "x-pairs",            /* content_encoding */
+    NULL,                 /* encode */
+    pairs_decoder_new,    /* decoder_new */
+    pairs_decode,         /* decode */
+    pairs_decoder_finish, /* decoder_finish */
+    pairs_decoder_free    /* decoder_free */
+};
+
+static void consume_view(amqp_connection_state_t conn,
+                         amqp_message_view_t *view, uint64_t delivery_tag,
+                         amqp_bytes_t body) {
+  amqp_rpc_reply_t reply = amqp_consume_message_view(conn, view, NULL, 0);
+  if (AMQP_RESPONSE_NORMAL != reply.reply_type ||
+      view->delivery_tag != delivery_tag ||
+      !amqp_bytes_equal(amqp_cstring_bytes("consumer"), view->consumer_tag) ||
+      !amqp_bytes_equal(amqp_cstring_bytes("routing.key"),
+                        view->routing_key) ||
+      !amqp_bytes_equal(body, view->body)) {
+    die("amqp_consume_message_view failed");
+  }
+}
+
+static void test_message_view(void) {
+  amqp_connection_state_t conn;
+  struct test_socket_t *sock = new_test_connection(&conn, 4096);
+  amqp_bytes_t small = amqp_cstring_bytes("a small body");
+  amqp_bytes_t large = make_body(3 * 4096 + 100);
+  amqp_bytes_t encoded = amqp_cstring_bytes("abc");
+  amqp_basic_properties_t properties;
+  amqp_message_view_t view;
+
+  script_delivery(sock, 1, 1, small, 4096);
+  script_delivery(sock, 1, 2, large, 4096);
+  script_delivery(sock, 2, 3, small, 4096);
+  properties._flags = AMQP_BASIC_CONTENT_ENCODING_FLAG;
+  properties.content_encoding = amqp_cstring_bytes("x-pairs");
+  script_delivery_with(sock, 1, 4, &properties, encoded, 4096);
+
+  /* A single body frame is returned in place */
+  consume_view(conn, &view, 1, small);
+  if (!in_socket_buffer(conn, view.body.bytes) ||
+      !in_socket_buffer(conn, view.routing_key.bytes) ||
+      !amqp_bytes_equal(amqp_cstring_bytes("text/plain"),
+                        view.properties.content_type)) {
+    die("the view should point into the socket buffer");
+  }
+
+  /* A body split over frames is put together, releasing the last view */
+  consume_view(conn, &view, 2, large);
+  if (view.body.bytes != conn->view_body.bytes) {
+    die("a split body should be put together in the view buffer");
+  }
+
+  /* Releasing the view releases its channel */
+  amqp_release_message_view(conn, &view);
+  if (conn->view_active || NULL != conn->retired_inbound_buffers) {
+    die("the view should have been released");
+  }
+
+  consume_view(conn, &view, 3, small);
+  if (2 != view.channel) {
+    die("unexpected channel");
+  }
+
+  /* Bodies are decoded into the view buffer */
+  amqp_set_body_codec(conn, &pairs_codec, NULL, 0);
+  consume_view(conn, &view, 4, amqp_cstring_bytes("aabbcc"));
+  if (view.body.bytes != conn->view_body.bytes ||
+      (view.properties._flags & AMQP_BASIC_CONTENT_ENCODING_FLAG)) {
+    die("the view body should have been decoded");
+  }
+  amqp_release_message_view(conn, &view);
+
+  amqp_bytes_free(large);
+  amqp_destroy_connection(conn);
+}
+
+static void consume_batch(amqp_connection_state_t conn,
+                          amqp_envelope_t *envelopes, size_t max,
+                          size_t expected, uint64_t first_delivery_tag) {
+  amqp_rpc_reply_t reply;
+  size_t count;
+  size_t i;
+
+  reply = amqp_consume_messages(conn, envelopes, max, &count, NULL, 0);
+  if (AMQP_RESPONSE_NORMAL != reply.reply_type || count != expected) {
+    die("amqp_consume_messages returned the wrong number of messages");
+  }
+  for (i = 0; i < count; ++i) {
+    if (envelopes[i].delivery_tag != first_delivery_tag + i) {
+      die("amqp_consume_messages returned the wrong message");
+    }
+    amqp_destroy_envelope(&envelopes[i]);
+  }
+}
+
+static void test_consume_batch(void) {
+  amqp_connection_state_t conn;
+  struct test_socket_t *sock = new_test_connection(&conn, 4096);
+  amqp_bytes_t small = amqp_cstring_bytes("a small body");
+  amqp_bytes_t large = make_body(3 * 4096);
+  amqp_envelope_t envelopes[10];
+  amqp_rpc_reply_t reply;
+  amqp_frame_t frame;
+  size_t count;
+  size_t recv_len;
+
+  reply = amqp_consume_messages(conn, envelopes, 0, &count, NULL, 0);
+  if (AMQP_RESPONSE_LIBRARY_EXCEPTION != reply.reply_type ||
+      AMQP_STATUS_INVALID_PARAMETER != reply.library_error || 0 != count) {
+    die("a batch of 0 messages should be rejected");
+  }
+
+  /* Everything buffered, up to max */
+  script_delivery(sock, 1, 1, small, 4096);
+  script_delivery(sock, 2, 2, large, 4096);
+  script_delivery(sock, 1, 3, small, 4096);
+  script_delivery(sock, 1, 4, large, 4096);
+  consume_batch(conn, envelopes, 3, 3, 1);
+  consume_batch(conn, envelopes, 10, 1, 4);
+
+  /* A delivery that is not all there yet is not waited for */
+  script_delivery(sock, 1, 5, small, 4096);
+  script_delivery(sock, 1, 6, large, 4096);
+  recv_len = sock->recv_len;
+  sock->recv_len -= 10;
+  consume_batch(conn, envelopes, 10, 1, 5);
+  sock->recv_len = recv_len;
+  consume_batch(conn, envelopes, 10, 1, 6);
+
+  /* Nor is anything after a frame other than a delivery */
+  script_delivery(sock, 1, 7, small, 4096);
+  frame.frame_type = AMQP_FRAME_HEARTBEAT;
+  frame.channel = 0;
+  script_frame(sock, &frame);
+  script_delivery(sock, 1, 8, small, 4096);
+  frame.frame_type = AMQP_FRAME_METHOD;
+  frame.channel = 1;
+  frame.payload.method.id = AMQP_BASIC_RECOVER_OK_METHOD;
+  frame.payload.method.decoded = NULL;
+  script_frame(sock, &frame);
+  script_delivery(sock, 1, 9, small, 4096);
+  consume_batch(conn, envelopes, 10, 2, 7);
+  wait_frame(conn, &frame, AMQP_FRAME_METHOD);
+  consume_batch(conn, envelopes, 10, 1, 9);
+
+  amqp_bytes_free(large);
+  amqp_destroy_connection(conn);
+}
+
+static void consume_bodies(amqp_connection_state_t conn, int count,
+                           amqp_bytes_t body) {
+  amqp_envelope_t envelope;
+  amqp_rpc_reply_t reply;
+  int i;
+
+  for (i = 0; i < count; ++i) {
+    amqp_maybe_release_buffers(conn);
+    reply = amqp_consume_message(conn, &envelope, NULL, 0);
+    if (AMQP_RESPONSE_NORMAL != reply.reply_type ||
+        !amqp_bytes_equal(body, envelope.message.body)) {
+      die("amqp_consume_message failed");
+    }
+    amqp_destroy_envelope(&envelope);
+  }
+}
+
+static void test_inbound_ring(void) {
+  amqp_connection_state_t conn;
+  struct test_socket_t *sock = new_test_connection(&conn, 4096);
+  amqp_bytes_t small = make_body(100);
+  amqp_bytes_t body = make_body(3000);
+  amqp_frame_t frame;
+  int i;
+
+  if (AMQP_STATUS_INVALID_PARAMETER !=
+          amqp_set_inbound_buffer_limits(conn, 1024, 65536) ||
+      AMQP_STATUS_INVALID_PARAMETER !=
+          amqp_set_inbound_buffer_limits(conn, 8192, 4096)) {
+    die("invalid buffer limits should be rejected");
+  }
+
+  /* A frame that arrives in pieces is completed in place */
+  sock->max_read = 1000;
+  script_delivery(sock, 1, 1, body, 4096);
+  wait_frame(conn, &frame, AMQP_FRAME_METHOD);
+  wait_frame(conn, &frame, AMQP_FRAME_HEADER);
+  wait_frame(conn, &frame, AMQP_FRAME_BODY);
+  if (!in_socket_buffer(conn, frame.payload.body_fragment.bytes) ||
+      !amqp_bytes_equal(body, frame.payload.body_fragment)) {
+    die("the body frame should have been decoded in place");
+  }
+
+  /* Reads wrap around the end of the buffer, frames that do too are still
+   * decoded */
+  if (AMQP_STATUS_OK != amqp_set_inbound_buffer_limits(conn, 4096, 4096)) {
+    die("amqp_set_inbound_buffer_limits failed");
+  }
+  for (i = 0; i < 20; ++i) {
+    script_delivery(sock, 1, 1, body, 4096);
+  }
+  consume_bodies(conn, 20, body);
+  if (4096 != conn->sock_inbound_buffer.len || 0 == sock->split_reads) {
+    die("reads should have wrapped around a 4096 byte buffer");
+  }
+
+  /* Reads that fill the buffer grow it */
+  if (AMQP_STATUS_OK != amqp_set_inbound_buffer_limits(conn, 4096, 32768)) {
+    die("amqp_set_inbound_buffer_limits failed");
+  }
+  sock->max_read = 0;
+  for (i = 0; i < 40; ++i) {
+    script_delivery(sock, 1, 1, body, 4096);
+  }
+  consume_bodies(conn, 40, body);
+  if (32768 != conn->sock_inbound_buffer.len) {
+    die("the buffer should have grown to its limit");
+  }
+
+  /* and a run of small reads shrinks it */
+  for (i = 0; i < 20; ++i) {
+    script_delivery(sock, 1, 1, small, 4096);
+    consume_bodies(conn, 1, small);
+  }
+  if (4096 != conn->sock_inbound_buffer.len) {
+    die("the buffer should have shrunk");
+  }
+
+  amqp_bytes_free(small);
+  amqp_bytes_free(body);
+  amqp_destroy_connection(conn);
+}
+
+static void expect_frame(amqp_connection_state_t conn, amqp_channel_t channel,
+                         amqp_method_number_t id, amqp_boolean_t any) {
+  amqp_frame_t frame;
+  int res = any ? amqp_simple_wait_frame(conn, &frame)
+                : amqp_simple_wait_frame_on_channel(conn, channel, &frame);
+  if (AMQP_STATUS_OK != res || AMQP_FRAME_METHOD != frame.frame_type ||
+      channel != frame.channel || id != frame.payload.method.id) {
+    die("frames were returned out of order");
+  }
+}
+
+static void test_frame_queues(void) {
+  amqp_connection_state_t conn;
+  struct test_socket_t *sock = new_test_connection(&conn, 4096);
+  amqp_frame_t frame;
+
+  script_method(sock, 1, AMQP_BASIC_RECOVER_OK_METHOD, NULL);
+  script_method(sock, 2, AMQP_BASIC_RECOVER_OK_METHOD, NULL);
+  script_method(sock, 1, AMQP_BASIC_QOS_OK_METHOD, NULL);
+  script_method(sock, 2, AMQP_BASIC_QOS_OK_METHOD, NULL);
+  script_method(sock, 3, AMQP_BASIC_RECOVER_OK_METHOD, NULL);
+
+  /* Frames read on the way to channel 3 are queued in order */
+  expect_frame(conn, 3, AMQP_BASIC_RECOVER_OK_METHOD, 0);
+
+  /* Taking one from the middle leaves the others queued */
+  expect_frame(conn, 2, AMQP_BASIC_RECOVER_OK_METHOD, 0);
+  if (!amqp_frames_enqueued(conn)) {
+    die("frames should still be queued");
+  }
+
+  /* A frame put back comes first, on its channel and overall */
+  expect_frame(conn, 1, AMQP_BASIC_RECOVER_OK_METHOD, 1);
+  frame.frame_type = AMQP_FRAME_METHOD;
+  frame.channel = 1;
+  frame.payload.method.id = AMQP_BASIC_RECOVER_OK_METHOD;
+  frame.payload.method.decoded = NULL;
+  if (AMQP_STATUS_OK != amqp_put_back_frame(conn, &frame)) {
+    die("amqp_put_back_frame failed");
+  }
+  expect_frame(conn, 1, AMQP_BASIC_RECOVER_OK_METHOD, 0);
+  expect_frame(conn, 1, AMQP_BASIC_QOS_OK_METHOD, 1);
+  expect_frame(conn, 2, AMQP_BASIC_QOS_OK_METHOD, 0);
+  if (amqp_frames_enqueued(conn)) {
+    die("no frames should be queued");
+  }
+
+  amqp_destroy_connection(conn);
+}
+
+static void expect_allocated(amqp_connection_state_t conn,
+                             amqp_channel_t expected) {
+  amqp_channel_t channel;
+  if (AMQP_STATUS_OK != amqp_allocate_channel(conn, &channel) ||
+      expected != channel) {
+    die("unexpected channel allocated");
+  }
+}
+
+static void test_channel_lifetime(void) {
+  amqp_connection_state_t conn;
+  struct test_socket_t *sock = new_test_connection(&conn, 4096);
+  amqp_channel_open_t open;
+  amqp_channel_close_t close;
+  amqp_channel_close_ok_t close_ok;
+  amqp_channel_t channel;
+  amqp_rpc_reply_t reply;
+  amqp_frame_t frame;
+
+  if (AMQP_STATUS_OK != amqp_tune_connection(conn, 3, 4096, 0)) {
+    die("amqp_tune_connection failed");
+  }
+  open.out_of_band = amqp_empty_bytes;
+  close_ok.dummy = 0;
+
+  /* The lowest channel numbers not in use are handed out */
+  expect_allocated(conn, 1);
+  expect_allocated(conn, 2);
+  expect_allocated(conn, 3);
+  if (AMQP_STATUS_NO_FREE_CHANNEL != amqp_allocate_channel(conn, &channel)) {
+    die("expected every channel to be in use");
+  }
+  amqp_release_channel(conn, 2);
+  expect_allocated(conn, 2);
+
+  /* A closed channel's number is free again at once, its pool once its
+   * buffers are released */
+  script_method(sock, 1, AMQP_CHANNEL_CLOSE_OK_METHOD, NULL);
+  reply = amqp_channel_close(conn, 1, AMQP_REPLY_SUCCESS);
+  if (AMQP_RESPONSE_NORMAL != reply.reply_type ||
+      NULL == amqp_get_channel_pool(conn, 1)) {
+    die("amqp_channel_close failed");
+  }
+  expect_allocated(conn, 1);
+  amqp_maybe_release_buffers(conn);
+  if (NULL != amqp_get_channel_pool(conn, 1)) {
+    die("expected the closed channel's pool to be freed");
+  }
+
+  /* The same goes for channels the broker closes, and what was read on them
+   * stays valid until then */
+  memset(&close, 0, sizeof(close));
+  close.reply_code = 406;
+  close.reply_text = amqp_cstring_bytes("PRECONDITION_FAILED");
+  frame.frame_type = AMQP_FRAME_METHOD;
+  frame.channel = 3;
+  frame.payload.method.id = AMQP_CHANNEL_CLOSE_METHOD;
+  frame.payload.method.decoded = &close;
+  script_frame(sock, &frame);
+  if (AMQP_STATUS_OK != amqp_simple_wait_frame(conn, &frame) ||
+      AMQP_CHANNEL_CLOSE_METHOD != frame.payload.method.id ||
+      AMQP_STATUS_OK !=
+          amqp_send_method(conn, 3, AMQP_CHANNEL_CLOSE_OK_METHOD, &close_ok)) {
+    die("expected channel.close");
+  }
+  if (!amqp_bytes_equal(
+          close.reply_text,
+          ((amqp_channel_close_t *)frame.payload.method.decoded)->reply_text)) {
+    die("channel.close was freed before buffers were released");
+  }
+  expect_allocated(conn, 3);
+  amqp_release_channel(conn, 3);
+  amqp_maybe_release_buffers_on_channel(conn, 3);
+  if (NULL != amqp_get_channel_pool(conn, 3)) {
+    die("expected the closed channel's pool to be freed");
+  }
+
+  /* Unless the channel is opened again first */
+  script_method(sock, 2, AMQP_CHANNEL_CLOSE_OK_METHOD, NULL);
+  amqp_channel_close(conn, 2, AMQP_REPLY_SUCCESS);
+  if (AMQP_STATUS_OK !=
+      amqp_send_method(conn, 2, AMQP_CHANNEL_OPEN_METHOD, &open)) {
+    die("amqp_send_method failed");
+  }
+  amqp_maybe_release_buffers(conn);
+  if (NULL == amqp_get_channel_pool(conn, 2)) {
+    die("expected the reopened channel's pool to be kept");
+  }
+  expect_allocated(conn, 3);
+  if (AMQP_STATUS_NO_FREE_CHANNEL != amqp_allocate_channel(conn, &channel)) {
+    die("expected every channel to be in use");
+  }
+
+  amqp_destroy_connection(conn);
+}
+
+static void check_properties(const amqp_basic_properties_t *properties,
+                             int headers) {
+  if (!amqp_bytes_equal(amqp_cstring_bytes("text/plain"),
+                        properties->content_type) ||
+      2 != properties->delivery_mode || 1234 != properties->timestamp ||
+      !amqp_bytes_equal(amqp_cstring_bytes("app"), properties->app_id) ||
+      headers != properties->headers.num_entries) {
+    die("unexpected properties");
+  }
+}
+
+static void check_headers(const amqp_table_t *headers) {
+  if (1 != headers->num_entries ||
+      !amqp_bytes_equal(amqp_cstring_bytes("key"), headers->entries[0].key) ||
+      AMQP_FIELD_KIND_UTF8 != headers->entries[0].value.kind ||
+      !amqp_bytes_equal(amqp_cstring_bytes("value"),
+                        headers->entries[0].value.value.bytes)) {
+    die("unexpected headers");
+  }
+}
+
+static void test_lazy_properties(void) {
+  amqp_connection_state_t conn;
+  struct test_socket_t *sock = new_test_connection(&conn, 4096);
+  amqp_bytes_t body = amqp_cstring_bytes("body");
+  amqp_table_entry_t entry;
+  amqp_basic_properties_t properties;
+  amqp_basic_properties_t *decoded;
+  amqp_table_t *headers;
+  amqp_message_view_t view;
+  amqp_envelope_t envelope;
+  amqp_frame_t frame;
+  int i;
+
+  entry.key = amqp_cstring_bytes("key");
+  entry.value.kind = AMQP_FIELD_KIND_UTF8;
+  entry.value.value.bytes = amqp_cstring_bytes("value");
+  properties._flags = AMQP_BASIC_CONTENT_TYPE_FLAG | AMQP_BASIC_HEADERS_FLAG |
+                      AMQP_BASIC_DELIVERY_MODE_FLAG |
+                      AMQP_BASIC_TIMESTAMP_FLAG | AMQP_BASIC_APP_ID_FLAG;
+  properties.content_type = amqp_cstring_bytes("text/plain");
+  properties.headers.num_entries = 1;
+  properties.headers.entries = &entry;
+  properties.delivery_mode = 2;
+  properties.timestamp = 1234;
+  properties.app_id = amqp_cstring_bytes("app");
+  for (i = 1; i <= 4; ++i) {
+    script_delivery_with(sock, 1, i, &properties, body, 4096);
+  }
+
+  /* Header frames are left encoded until asked for */
+  amqp_set_lazy_properties(conn, 1);
+  wait_frame(conn, &frame, AMQP_FRAME_METHOD);
+  wait_frame(conn, &frame, AMQP_FRAME_HEADER);
+  if (NULL != frame.payload.properties.decoded) {
+    die("the properties should not have been decoded");
+  }
+  if (AMQP_STATUS_OK != amqp_frame_properties(conn, &frame, &decoded) ||
+      frame.payload.properties.decoded != decoded) {
+    die("amqp_frame_properties failed");
+  }
+  check_properties(decoded, 0);
+  if (AMQP_STATUS_OK != amqp_frame_headers(conn, &frame, &headers) ||
+      &decoded->headers != headers) {
+    die("amqp_frame_headers failed");
+  }
+  check_headers(headers);
+  wait_frame(conn, &frame, AMQP_FRAME_BODY);
+  if (AMQP_STATUS_INVALID_PARAMETER !=
+      amqp_frame_properties(conn, &frame, &decoded)) {
+    die("only header frames have properties");
+  }
+
+  /* A view decodes its headers on demand */
+  consume_view(conn, &view, 2, body);
+  check_properties(&view.properties, 0);
+  if (AMQP_STATUS_OK != amqp_message_view_headers(conn, &view, &headers)) {
+    die("amqp_message_view_headers failed");
+  }
+  check_headers(headers);
+  amqp_release_message_view(conn, &view);
+
+  /* Messages are still returned whole */
+  if (AMQP_RESPONSE_NORMAL !=
+      amqp_consume_message(conn, &envelope, NULL, 0).reply_type) {
+    die("amqp_consume_message failed");
+  }
+  check_properties(&envelope.message.properties, 1);
+  check_headers(&envelope.message.properties.headers);
+  amqp_destroy_envelope(&envelope);
+
+  /* The accessors work on frames decoded as they were read */
+  amqp_set_lazy_properties(conn, 0);
+  wait_frame(conn, &frame, AMQP_FRAME_METHOD);
+  wait_frame(conn, &frame, AMQP_FRAME_HEADER);
+  if (NULL == frame.payload.properties.decoded ||
+      AMQP_STATUS_OK != amqp_frame_headers(conn, &frame, &headers)) {
+    die("the properties should have been decoded");
+  }
+  check_headers(headers);
+
+  amqp_destroy_connection(conn);
+}
+
+/* Records the frames passed by amqp_process_input(), failing once it has
+ * seen stop_after of them. */
+struct frame_log_t {
+  int count;
+  int stop_after;
+  amqp_channel_t channels[8];
+  uint8_t frame_types[8];
+};
+
+static int AMQP_CALL log_frame(void *user_data,
+                               AMQP_UNUSED amqp_connection_state_t state,
+                               amqp_frame_t *frame) {
+  struct frame_log_t *log = user_data;
+  if (log->count == 8) {
+    die("too many frames");
+  }
+  log->channels[log->count] = frame->channel;
+  log->frame_types[log->count] = frame->frame_type;
+  log->count++;
+  return log->count == log->stop_after ? AMQP_STATUS_UNEXPECTED_STATE
+                                       : AMQP_STATUS_OK;
+}
+
+static void test_process_input(void) {
+  amqp_connection_state_t conn;
+  struct test_socket_t *sock = new_test_connection(&conn, 4096);
+  struct frame_log_t log;
+  amqp_io_interest_t interest;
+  amqp_frame_t frame;
+
+  script_method(sock, 1, AMQP_BASIC_RECOVER_OK_METHOD, NULL);
+  script_method(sock, 2, AMQP_BASIC_QOS_OK_METHOD, NULL);
+  frame.frame_type = AMQP_FRAME_HEARTBEAT;
+  frame.channel = 0;
+  script_frame(sock, &frame);
+  script_delivery(sock, 1, 1, amqp_cstring_bytes("body"), 4096);
+  expect_frame(conn, 2, AMQP_BASIC_QOS_OK_METHOD, 0);
+
+  /* Queued frames come first, heartbeats are handled */
+  memset(&log, 0, sizeof(log));
+  if (AMQP_STATUS_OK !=
+          amqp_process_input(conn, log_frame, &log, &interest) ||
+      4 != log.count || 1 != log.channels[0] ||
+      AMQP_FRAME_METHOD != log.frame_types[0] ||
+      AMQP_FRAME_METHOD != log.frame_types[1] ||
+      AMQP_FRAME_HEADER != log.frame_types[2] ||
+      AMQP_FRAME_BODY != log.frame_types[3] || !interest.want_read ||
+      interest.want_write || -1 != interest.timeout_ms) {
+    die("amqp_process_input failed");
+  }
+
+  /* Nothing to read is not an error */
+  memset(&log, 0, sizeof(log));
+  if (AMQP_STATUS_OK !=
+          amqp_process_input(conn, log_frame, &log, &interest) ||
+      0 != log.count) {
+    die("amqp_process_input should not wait");
+  }
+
+  /* The callback can stop processing, the rest is left for the next call */
+  script_method(sock, 1, AMQP_BASIC_RECOVER_OK_METHOD, NULL);
+  script_method(sock, 2, AMQP_BASIC_RECOVER_OK_METHOD, NULL);
+  memset(&log, 0, sizeof(log));
+  log.stop_after = 1;
+  if (AMQP_STATUS_UNEXPECTED_STATE !=
+          amqp_process_input(conn, log_frame, &log, &interest) ||
+      1 != log.count || 1 != log.channels[0]) {
+    die("the callback should have stopped amqp_process_input");
+  }
+  log.stop_after = 0;
+  if (AMQP_STATUS_OK !=
+          amqp_process_input(conn, log_frame, &log, &interest) ||
+      2 != log.count || 2 != log.channels[1]) {
+    die("the remaining frame should have been processed");
+  }
+
+  /* Heartbeats are sent when due, and missed ones detected */
+  if (AMQP_STATUS_OK != amqp_tune_connection(conn, 0, 4096, 10)) {
+    die("amqp_tune_connection failed");
+  }
+  conn->next_send_heartbeat = amqp_time_immediate();
+  if (AMQP_STATUS_OK !=
+          amqp_process_input(conn, log_frame, &log, &interest) ||
+      amqp_time_equal(conn->next_send_heartbeat, amqp_time_immediate()) ||
+      interest.timeout_ms <= 0 || interest.timeout_ms > 10000) {
+    die("a heartbeat should have been sent");
+  }
+  /* Timed from the current time, however stale the cached clock */
+  conn->heartbeat_clock.now_ns = 1;
+  conn->heartbeat_clock.uses_left = AMQP_CLOCK_CACHE_USES;
+  conn->next_send_heartbeat = amqp_time_immediate();
+  if (AMQP_STATUS_OK !=
+          amqp_process_input(conn, log_frame, &log, &interest) ||
+      amqp_time_ms_until(conn->next_send_heartbeat) <= 0) {
+    die("the next heartbeat should not be due already");
+  }
+  conn->next_recv_heartbeat = amqp_time_immediate();
+  if (AMQP_STATUS_HEARTBEAT_TIMEOUT !=
+      amqp_process_input(conn, log_frame, &log, &interest)) {
+    die("the missed heartbeat should have been detected");
+  }
+
+  amqp_destroy_connection(conn);
+}
+
+/* Counts the messages handled, failing with fail_with if set */
+struct handled_t {
+  int count;
+  uint64_t last_delivery_tag;
+  int fail_with;
+};
+
+static int AMQP_CALL handle_message(void *user_data,
+                                    AMQP_UNUSED amqp_connection_state_t state,
+                                    amqp_message_view_t *message) {
+  struct handled_t *handled = user_data;
+  if (!amqp_bytes_equal(amqp_cstring_bytes("handled body"), message->body)) {
+    die("the handler got the wrong body");
+  }
+  handled->count++;
+  handled->last_delivery_tag = message->delivery_tag;
+  return handled->fail_with;
+}
+
+static void test_consumer_dispatch(void) {
+  amqp_connection_state_t conn;
+  struct test_socket_t *sock = new_test_connection(&conn, 4096);
+  amqp_bytes_t handled_body = amqp_cstring_bytes("handled body");
+  amqp_bytes_t body = amqp_cstring_bytes("body");
+  amqp_basic_properties_t properties;
+  struct handled_t handled;
+  amqp_message_view_t view;
+  amqp_envelope_t envelope;
+  amqp_envelope_t envelopes[10];
+  amqp_rpc_reply_t reply;
+  size_t count;
+  char tag[16];
+  int i;
+
+  memset(&handled, 0, sizeof(handled));
+  properties._flags = 0;
+
+  /* Many consumers, to grow the table */
+  for (i = 0; i < 100; ++i) {
+    sprintf(tag, "tag-%d", i);
+    if (AMQP_STATUS_OK != amqp_register_consumer(conn, 1,
+                                                 amqp_cstring_bytes(tag),
+                                                 handle_message, &handled)) {
+      die("amqp_register_consumer failed");
+    }
+  }
+  if (100 != conn->consumer_count || conn->consumer_bucket_count < 100) {
+    die("the consumer table should have grown");
+  }
+
+  script_delivery_to(sock, 1, "tag-7", 1, &properties, handled_body, 4096);
+  script_delivery_to(sock, 2, "tag-7", 2, &properties, body, 4096);
+  script_delivery_to(sock, 1, "tag-42", 3, &properties, handled_body, 4096);
+  script_delivery_to(sock, 1, "tag-7", 4, &properties, body, 4096);
+  script_delivery_to(sock, 1, "tag-8", 5, &properties, handled_body, 4096);
+
+  /* Handled deliveries are passed over, the channel is part of the key */
+  if (AMQP_RESPONSE_NORMAL !=
+          amqp_consume_message(conn, &envelope, NULL, 0).reply_type ||
+      2 != envelope.delivery_tag || 1 != handled.count) {
+    die("the first delivery should have been dispatched");
+  }
+  amqp_destroy_envelope(&envelope);
+
+  /* So they are by the view API, until unregistered */
+  if (AMQP_STATUS_OK !=
+      amqp_unregister_consumer(conn, 1, amqp_cstring_bytes("tag-7"))) {
+    die("amqp_unregister_consumer failed");
+  }
+  if (AMQP_STATUS_INVALID_PARAMETER !=
+      amqp_unregister_consumer(conn, 1, amqp_cstring_bytes("tag-7"))) {
+    die("tag-7 should no longer be registered");
+  }
+  if (AMQP_RESPONSE_NORMAL !=
+          amqp_consume_message_view(conn, &view, NULL, 0).reply_type ||
+      4 != view.delivery_tag || !amqp_bytes_equal(body, view.body) ||
+      2 != handled.count || 3 != handled.last_delivery_tag ||
+      !amqp_bytes_equal(amqp_cstring_bytes("tag-7"), view.consumer_tag)) {
+    die("the third delivery should have been dispatched");
+  }
+  amqp_release_message_view(conn, &view);
+
+  /* A handler's error is returned */
+  handled.fail_with = AMQP_STATUS_UNEXPECTED_STATE;
+  reply = amqp_consume_message(conn, &envelope, NULL, 0);
+  if (AMQP_RESPONSE_LIBRARY_EXCEPTION != reply.reply_type ||
+      AMQP_STATUS_UNEXPECTED_STATE != reply.library_error ||
+      3 != handled.count) {
+    die("the handler's error should have been returned");
+  }
+
+  /* A batch passes over buffered deliveries to handlers, ending where the
+   * buffered deliveries do */
+  handled.fail_with = AMQP_STATUS_OK;
+  script_delivery_to(sock, 1, "tag-7", 6, &properties, body, 4096);
+  script_delivery_to(sock, 1, "tag-9", 7, &properties, handled_body, 4096);
+  script_delivery_to(sock, 1, "tag-7", 8, &properties, body, 4096);
+  script_delivery_to(sock, 1, "tag-9", 9, &properties, handled_body, 4096);
+  reply = amqp_consume_messages(conn, envelopes, 10, &count, NULL, 0);
+  if (AMQP_RESPONSE_NORMAL != reply.reply_type || 2 != count ||
+      6 != envelopes[0].delivery_tag || 8 != envelopes[1].delivery_tag ||
+      5 != handled.count || 9 != handled.last_delivery_tag) {
+    die("the batch should have skipped the handled deliveries");
+  }
+  amqp_destroy_envelope(&envelopes[0]);
+  amqp_destroy_envelope(&envelopes[1]);
+
+  amqp_destroy_connection(conn);
+}
+
+/* Checks a streamed body against make_body(), failing once fail_at bytes
+ * have been seen if set */
+struct stream_t {
+  amqp_connection_state_t conn;
+  uint64_t body_size;
+  size_t received;
+  int fragments;
+  int max_retired;
+  size_t fail_at;
+  amqp_bytes_t expected;
+};
+
+static int AMQP_CALL stream_header(void *user_data, amqp_channel_t channel,
+                                   const amqp_basic_properties_t *properties,
+                                   uint64_t body_size) {
+  struct stream_t *stream = user_data;
+  if (1 != channel || (properties->_flags & AMQP_BASIC_CONTENT_ENCODING_FLAG)) {
+    die("unexpected message header");
+  }
+  stream->body_size = body_size;
+  return AMQP_STATUS_OK;
+}
+
+static int AMQP_CALL stream_fragment(void *user_data,
+                                     AMQP_UNUSED amqp_channel_t channel,
+                                     amqp_bytes_t fragment) {
+  struct stream_t *stream = user_data;
+  amqp_retired_buffer_t *retired;
+  int count = 0;
+
+  if (stream->received + fragment.len > stream->expected.len ||
+      0 != memcmp((char *)stream->expected.bytes + stream->received,
+                  fragment.bytes, fragment.len)) {
+    die("unexpected body fragment");
+  }
+  stream->received += fragment.len;
+  stream->fragments++;
+
+  for (retired = stream->conn->retired_inbound_buffers; retired != NULL;
+       retired = retired->next) {
+    count++;
+  }
+  if (count > stream->max_retired) {
+    stream->max_retired = count;
+  }
+  if (0 != stream->fail_at && stream->received >= stream->fail_at) {
+    return AMQP_STATUS_UNEXPECTED_STATE;
+  }
+  return AMQP_STATUS_OK;
+}
+
+/* Streams the message of the next delivery, expecting it to succeed unless
+ * fail_at is set. */
+static void read_stream(amqp_connection_state_t conn, struct stream_t *stream,
+                        amqp_bytes_t expected, size_t fail_at) {
+  amqp_rpc_reply_t reply;
+  amqp_frame_t frame;
+
+  memset(stream, 0, sizeof(*stream));
+  stream->conn = conn;
+  stream->expected = expected;
+  stream->fail_at = fail_at;
+  wait_frame(conn, &frame, AMQP_FRAME_METHOD);
+  reply = amqp_read_message_stream(conn, 1, stream_header, stream_fragment,
+                                   stream);
+  if (0 == fail_at) {
+    if (AMQP_RESPONSE_NORMAL != reply.reply_type ||
+        expected.len != stream->received) {
+      die("amqp_read_message_stream failed");
+    }
+  } else if (AMQP_RESPONSE_LIBRARY_EXCEPTION != reply.reply_type ||
+             AMQP_STATUS_UNEXPECTED_STATE != reply.library_error) {
+    die("amqp_read_message_stream should have failed");
+  }
+}
+
+static void test_read_message_stream(void) {
+  amqp_connection_state_t conn;
+  struct test_socket_t *sock = new_test_connection(&conn, 4096);
+  amqp_bytes_t large = make_body(256 * 4096);
+  amqp_bytes_t small = amqp_cstring_bytes("small");
+  amqp_basic_properties_t properties;
+  struct stream_t stream;
+
+  if (AMQP_STATUS_OK != amqp_set_inbound_buffer_limits(conn, 4096, 16384)) {
+    die("amqp_set_inbound_buffer_limits failed");
+  }
+  script_delivery(sock, 1, 1, large, 4096);
+  script_delivery(sock, 1, 2, large, 4096);
+  script_delivery(sock, 1, 3, small, 4096);
+  properties._flags = AMQP_BASIC_CONTENT_ENCODING_FLAG;
+  properties.content_encoding = amqp_cstring_bytes("x-pairs");
+  script_delivery_with(sock, 1, 4, &properties, amqp_cstring_bytes("abc"),
+                       4096);
+
+  /* The body is passed on a frame at a time, in bounded memory */
+  read_stream(conn, &stream, large, 0);
+  if (large.len != stream.body_size || stream.fragments < 256 ||
+      stream.max_retired > 1) {
+    die("the body should have been streamed");
+  }
+
+  /* A failing callback still leaves the channel in step */
+  read_stream(conn, &stream, large, 1);
+  if (1 != stream.fragments) {
+    die("the callback should not have been called again");
+  }
+  read_stream(conn, &stream, small, 0);
+
+  /* Encoded bodies are decoded as they are read */
+  amqp_set_body_codec(conn, &pairs_codec, NULL, 0);
+  read_stream(conn, &stream, amqp_cstring_bytes("aabbcc"), 0);
+  if (3 != stream.body_size) {
+    die("the encoded size should have been passed on");
+  }
+
+  amqp_bytes_free(large);
+  amqp_destroy_connection(conn);
+}
+
+/* A buffer provider handing out slot, or failing with fail_with if set */
+struct slot_provider_t {
+  amqp_bytes_t slot;
+  uint64_t body_size;
+  int calls;
+  int fail_with;
+};
+
+static int AMQP_CALL provide_slot(void *user_data,
+                                  AMQP_UNUSED amqp_channel_t channel,
+                                  const amqp_basic_properties_t *properties,
+                                  uint64_t body_size, amqp_bytes_t *buffer) {
+  struct slot_provider_t *provider = user_data;
+  if (properties->_flags & AMQP_BASIC_CONTENT_ENCODING_FLAG) {
+    die("unexpected message properties");
+  }
+  provider->body_size = body_size;
+  provider->calls++;
+  *buffer = provider->slot;
+  return provider->fail_with;
+}
+
+/* Reads the message of the next delivery into buffer, expecting status */
+static void read_into(amqp_connection_state_t conn,
+                      amqp_basic_properties_t *properties, amqp_bytes_t buffer,
+                      amqp_bytes_t expected, int status) {
+  amqp_rpc_reply_t reply;
+  amqp_frame_t frame;
+  size_t body_len;
+
+  wait_frame(conn, &frame, AMQP_FRAME_METHOD);
+  reply = amqp_read_message_into(conn, 1, properties, buffer, &body_len);
+  if (AMQP_STATUS_OK == status) {
+    if (AMQP_RESPONSE_NORMAL != reply.reply_type ||
+        expected.len != body_len ||
+        0 != memcmp(expected.bytes, buffer.bytes, body_len)) {
+      die("amqp_read_message_into failed");
+    }
+  } else if (AMQP_RESPONSE_LIBRARY_EXCEPTION != reply.reply_type ||
+             status != reply.library_error) {
+    die("amqp_read_message_into should have failed");
+  }
+}
+
+static void test_read_message_into(void) {
+  amqp_connection_state_t conn;
+  struct test_socket_t *sock = new_test_connection(&conn, 4096);
+  amqp_bytes_t body = make_body(10000);
+  amqp_bytes_t large = make_body(256 * 4096);
+  amqp_bytes_t buffer = amqp_bytes_malloc(large.len);
+  amqp_bytes_t small_buffer = {100, buffer.bytes};
+  amqp_basic_properties_t properties;
+  amqp_basic_properties_t read_properties;
+  struct slot_provider_t provider;
+  amqp_message_t message;
+  amqp_frame_t frame;
+  amqp_rpc_reply_t reply;
+  size_t body_len;
+
+  if (NULL == buffer.bytes) {
+    die("out of memory");
+  }
+  if (AMQP_STATUS_OK != amqp_set_inbound_buffer_limits(conn, 4096, 16384)) {
+    die("amqp_set_inbound_buffer_limits failed");
+  }
+  properties._flags = AMQP_BASIC_CONTENT_TYPE_FLAG;
+  properties.content_type = amqp_cstring_bytes("text/plain");
+  script_delivery_with(sock, 1, 0, &properties, large, 4096);
+  script_delivery_with(sock, 1, 1, &properties, body, 4096);
+  script_delivery(sock, 1, 2, body, 4096);
+  script_delivery(sock, 1, 3, body, 4096);
+  properties._flags = AMQP_BASIC_CONTENT_ENCODING_FLAG;
+  properties.content_encoding = amqp_cstring_bytes("x-pairs");
+  script_delivery_with(sock, 1, 4, &properties, amqp_cstring_bytes("abc"),
+                       4096);
+  script_delivery_with(sock, 1, 5, &properties, amqp_cstring_bytes("abc"),
+                       4096);
+  script_delivery(sock, 1, 6, amqp_cstring_bytes("last"), 4096);
+
+  /* The channel's buffers are released as the body is read, the properties
+   * being copied out of them */
+  read_into(conn, &read_properties, buffer, large, AMQP_STATUS_OK);
+  if (NULL != conn->retired_inbound_buffers) {
+    die("the channel's buffers should have been released");
+  }
+  amqp_maybe_release_buffers(conn);
+  if (!amqp_bytes_equal(amqp_cstring_bytes("text/plain"),
+                        read_properties.content_type)) {
+    die("the properties should outlive the channel's buffers");
+  }
+
+  /* The body is read straight into the caller's buffer */
+  read_into(conn, &read_properties, buffer, body, AMQP_STATUS_OK);
+  if (!(read_properties._flags & AMQP_BASIC_CONTENT_TYPE_FLAG) ||
+      !amqp_bytes_equal(amqp_cstring_bytes("text/plain"),
+                        read_properties.content_type)) {
+    die("the properties should have been returned");
+  }
+
+  /* A body that does not fit is left to be read otherwise */
+  read_into(conn, NULL, small_buffer, body, AMQP_STATUS_INVALID_PARAMETER);
+  reply = amqp_read_message(conn, 1, &message, 0);
+  if (AMQP_RESPONSE_NORMAL != reply.reply_type ||
+      !amqp_bytes_equal(body, message.body)) {
+    die("the message should have been left unread");
+  }
+  amqp_destroy_message(&message);
+
+  /* The provider is asked for a buffer once the size is known, and its error
+   * also leaves the message unread */
+  memset(&provider, 0, sizeof(provider));
+  provider.slot = buffer;
+  provider.fail_with = AMQP_STATUS_UNEXPECTED_STATE;
+  wait_frame(conn, &frame, AMQP_FRAME_METHOD);
+  reply = amqp_read_message_provided(conn, 1, provide_slot, &provider,
+                                     &body_len);
+  if (AMQP_RESPONSE_LIBRARY_EXCEPTION != reply.reply_type ||
+      AMQP_STATUS_UNEXPECTED_STATE != reply.library_error ||
+      body.len != provider.body_size) {
+    die("the provider's error should have been returned");
+  }
+  provider.fail_with = AMQP_STATUS_OK;
+  reply = amqp_read_message_provided(conn, 1, provide_slot, &provider,
+                                     &body_len);
+  if (AMQP_RESPONSE_NORMAL != reply.reply_type || 2 != provider.calls ||
+      body.len != body_len || 0 != memcmp(body.bytes, buffer.bytes, body_len)) {
+    die("amqp_read_message_provided failed");
+  }
+
+  /* Encoded bodies are decoded into the buffer, which must fit the decoded
+   * body */
+  amqp_set_body_codec(conn, &pairs_codec, NULL, 0);
+  read_into(conn, NULL, buffer, amqp_cstring_bytes("aabbcc"), AMQP_STATUS_OK);
+  small_buffer.len = 5;
+  read_into(conn, NULL, small_buffer, amqp_empty_bytes,
+            AMQP_STATUS_INVALID_PARAMETER);
+  read_into(conn, NULL, buffer, amqp_cstring_bytes("last"), AMQP_STATUS_OK);
+
+  amqp_bytes_free(buffer);
+  amqp_bytes_free(large);
+  amqp_bytes_free(body);
+  amqp_destroy_connection(conn);
+}
+
+int main(void) {
+  test_decode_in_place();
+  test_decode_split_frames();
+  test_channel_pool_size();
+  test_message_view();
+  test_consume_batch();
+  test_inbound_ring();
+  test_frame_queues();
+  test_channel_lifetime();
+  test_lazy_properties();
+  test_process_input();
+  test_consumer_dispatch();
+  test_read_message_stream();
+  test_read_message_into();
+
+  return 0;
+}
@@ -0,0 +1,155 @@
+// Copyright 2007 - 2021, Alan Antonuk and the rabbitmq-c contributors.
+// SPDX-License-Identifier: mit
+
+#include "amqp_private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* The size of the array a pool first lists its pages, or its large blocks,
+ * in */
+#define LIST (8 * sizeof(void *))
+
+static void die(const char *msg) {
+  fprintf(stderr, "%s\n", msg);
+  abort();
+}
+
+static void expect_cached(size_t expected) {
+  if (expected != amqp_page_cache_bytes()) {
+    fprintf(stderr, "expected %d bytes cached, got %d\n", (int)expected,
+            (int)amqp_page_cache_bytes());
+    abort();
+  }
+}
+
+static void *pool_alloc(amqp_pool_t *pool, size_t amount) {
+  void *p = amqp_pool_alloc(pool, amount);
+  if (NULL == p) {
+    die("amqp_pool_alloc failed");
+  }
+  return p;
+}
+
+static void test_page_reuse(void) {
+  amqp_pool_t pool;
+  void *page;
+  void *large;
+
+  amqp_set_page_cache(1024 * 1024);
+
+  /* Freed pages and large blocks are kept */
+  init_amqp_pool(&pool, 4096);
+  page = pool_alloc(&pool, 100);
+  large = pool_alloc(&pool, 10000);
+  empty_amqp_pool(&pool);
+  expect_cached(4096 + 16384 + 2 * LIST);
+
+  /* And reused by any pool needing a block of the same size class */
+  init_amqp_pool(&pool, 4096);
+  if (page != pool_alloc(&pool, 4096) || large != pool_alloc(&pool, 9000)) {
+    die("expected the cached blocks to be reused");
+  }
+  expect_cached(0);
+
+  /* Recycling a pool keeps its pages but frees its large blocks */
+  recycle_amqp_pool(&pool);
+  expect_cached(16384 + LIST);
+  empty_amqp_pool(&pool);
+  expect_cached(4096 + 16384 + 2 * LIST);
+
+  /* Page sizes are rounded up to a size class */
+  init_amqp_pool(&pool, 10000);
+  if (large != pool_alloc(&pool, 100)) {
+    die("expected a 10000 byte page to come from the 16 KiB class");
+  }
+  /* Too big to cache */
+  pool_alloc(&pool, 2 * 1024 * 1024);
+  empty_amqp_pool(&pool);
+  expect_cached(4096 + 16384 + 2 * LIST);
+
+  amqp_set_page_cache(0);
+  expect_cached(0);
+}
+
+static void test_cache_limit(void) {
+  amqp_pool_t pool;
+  int i;
+
+  /* Blocks are only kept while they fit */
+  amqp_set_page_cache(3 * 4096);
+  init_amqp_pool(&pool, 4096);
+  for (i = 0; i < 4; ++i) {
+    pool_alloc(&pool, 4096);
+  }
+  empty_amqp_pool(&pool);
+  expect_cached(3 * 4096);
+
+  /* Lowering the limit frees what is over it */
+  amqp_set_page_cache(4096);
+  expect_cached(4096);
+
+  /* Blocks allocated with the cache disabled are freed then */
+  amqp_set_page_cache(0);
+  init_amqp_pool(&pool, 4096);
+  pool_alloc(&pool, 4096);
+  pool_alloc(&pool, 5000);
+  empty_amqp_pool(&pool);
+  expect_cached(0);
+
+  /* Even if the cache has been enabled since, unless they happen to be the
+   * size of a class, as block lists are */
+  init_amqp_pool(&pool, 4000);
+  pool_alloc(&pool, 100);
+  pool_alloc(&pool, 8192);
+  amqp_set_page_cache(1024 * 1024);
+  empty_amqp_pool(&pool);
+  expect_cached(8192 + 2 * LIST);
+
+  amqp_set_page_cache(0);
+}
+
+static void test_channel_pools(void) {
+  amqp_connection_state_t conn = amqp_new_connection();
+  amqp_channel_t channels[] = {0, 1, 255, 256, 1000, 65535};
+  amqp_pool_t *pools[sizeof(channels) / sizeof(channels[0])];
+  size_t i;
+
+  if (NULL == conn) {
+    die("amqp_new_connection failed");
+  }
+
+  for (i = 0; i < sizeof(channels) / sizeof(channels[0]); ++i) {
+    if (NULL != amqp_get_channel_pool(conn, channels[i])) {
+      die("expected no pool before one is created");
+    }
+    pools[i] = amqp_get_or_create_channel_pool(conn, channels[i]);
+    if (NULL == pools[i]) {
+      die("amqp_get_or_create_channel_pool failed");
+    }
+  }
+
+  /* Each channel has a pool of its own, found again however it was made */
+  for (i = 0; i < sizeof(channels) / sizeof(channels[0]); ++i) {
+    if (pools[i] != amqp_get_channel_pool(conn, channels[i]) ||
+        pools[i] != amqp_get_or_create_channel_pool(conn, channels[i]) ||
+        (i > 0 && pools[i] == pools[i - 1])) {
+      die("unexpected channel pool");
+    }
+  }
+  if (NULL != amqp_get_channel_pool(conn, 2) ||
+      NULL != amqp_get_channel_pool(conn, 257) ||
+      NULL != amqp_get_channel_pool(conn, 512)) {
+    die("expected no pool for channels never used");
+  }
+
+  amqp_destroy_connection(conn);
+}
+
+int main(void) {
+  test_page_reuse();
+  test_cache_limit();
+  test_channel_pools();
+
+  return 0;
+}
@@ -0,0 +1,1491 @@
+// Copyright 2007 - 2021, Alan Antonuk and the rabbitmq-c contributors.
+// SPDX-License-Identifier: mit
+
+#include "rabbitmq-c/tcp_socket.h"
+#include "test_socket.h"
+#ifdef AMQP_TEST_ZLIB
+#include "rabbitmq-c/zlib_codec.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+static void script_confirm(struct test_socket_t *sock, amqp_channel_t channel,
+                           uint64_t delivery_tag, amqp_boolean_t multiple,
+                           amqp_boolean_t nack) {
+  if (nack) {
+    amqp_basic_nack_t m;
+    m.delivery_tag = delivery_tag;
+    m.multiple = multiple;
+    m.requeue = 0;
+    script_method(sock, channel, AMQP_BASIC_NACK_METHOD, &m);
+  } else {
+    amqp_basic_ack_t m;
+    m.delivery_tag = delivery_tag;
+    m.multiple = multiple;
+    script_method(sock, channel, AMQP_BASIC_ACK_METHOD, &m);
+  }
+}
+
+/* Decodes the frames written to sock, checking they make up a basic.publish
+ * on channel of each of the count bodies, in order. */
+static void check_published(struct test_socket_t *sock, amqp_channel_t channel,
+                            const amqp_bytes_t *bodies, size_t count) {
+  amqp_connection_state_t decoder = amqp_new_connection();
+  amqp_bytes_t input;
+  amqp_frame_t frame;
+  size_t message = 0;
+  int frames = 0;
+  size_t body_read = 0;
+
+  input.bytes = sock->data;
+  input.len = sock->len;
+
+  while (input.len > 0) {
+    int res = amqp_handle_input(decoder, input, &frame);
+    if (res <= 0) {
+      die("amqp_handle_input failed");
+    }
+    input.bytes = (char *)input.bytes + res;
+    input.len -= res;
+    if (0 == frame.frame_type) {
+      continue;
+    }
+    if (frame.channel != channel) {
+      die("frame on wrong channel");
+    }
+    if (message == count) {
+      die("unexpected frame after last message");
+    }
+
+    switch (frames++) {
+      case 0:
+        if (AMQP_FRAME_METHOD != frame.frame_type ||
+            AMQP_BASIC_PUBLISH_METHOD != frame.payload.method.id) {
+          die("expected basic.publish");
+        }
+        break;
+      case 1:
+        if (AMQP_FRAME_HEADER != frame.frame_type ||
+            frame.payload.properties.body_size != bodies[message].len) {
+          die("expected content header");
+        }
+        break;
+      default:
+        if (AMQP_FRAME_BODY != frame.frame_type ||
+            body_read + frame.payload.body_fragment.len >
+                bodies[message].len ||
+            0 != memcmp((char *)bodies[message].bytes + body_read,
+                        frame.payload.body_fragment.bytes,
+                        frame.payload.body_fragment.len)) {
+          die("body frame mismatch");
+        }
+        body_read += frame.payload.body_fragment.len;
+        break;
+    }
+
+    if (frames >= 2 && body_read == bodies[message].len) {
+      message++;
+      frames = 0;
+      body_read = 0;
+    }
+  }
+
+  if (message != count || frames != 0) {
+    die("incomplete message");
+  }
+  amqp_destroy_connection(decoder);
+}
+
+static void test_publish(size_t body_len, size_t max_write,
+                         int expected_writev_calls) {
+  amqp_connection_state_t conn;
+  struct test_socket_t *sock = new_test_connection(&conn, 4096);
+  amqp_bytes_t body = make_body(body_len);
+  int res;
+
+  sock->max_write = max_write;
+  res = amqp_basic_publish(conn, 7, amqp_cstring_bytes("exchange"),
+                           amqp_cstring_bytes("routing.key"), 0, 0, NULL, body);
+  if (AMQP_STATUS_OK != res) {
+    die("amqp_basic_publish failed");
+  }
+  if (0 != sock->send_calls) {
+    die("publish should not use send()");
+  }
+  if (expected_writev_calls != 0 &&
+      expected_writev_calls != sock->writev_calls) {
+    fprintf(stderr, "body of %d bytes: expected %d writev calls, got %d\n",
+            (int)body_len, expected_writev_calls, sock->writev_calls);
+    abort();
+  }
+
+  check_published(sock, 7, &body, 1);
+
+  amqp_bytes_free(body);
+  amqp_destroy_connection(conn);
+}
+
+static void test_publish_batch(const size_t *body_lens, size_t count,
+                               size_t max_write, int max_writev_calls) {
+  amqp_connection_state_t conn;
+  struct test_socket_t *sock = new_test_connection(&conn, 4096);
+  amqp_publish_item_t *items = calloc(count, sizeof(*items));
+  amqp_bytes_t *bodies = calloc(count, sizeof(*bodies));
+  int *statuses = calloc(count, sizeof(*statuses));
+  size_t i;
+  int res;
+
+  if (NULL == items || NULL == bodies || NULL == statuses) {
+    die("out of memory");
+  }
+  for (i = 0; i < count; ++i) {
+    bodies[i] = make_body(body_lens[i]);
+    items[i].exchange = amqp_cstring_bytes("exchange");
+    items[i].routing_key = amqp_cstring_bytes("routing.key");
+    items[i].body = bodies[i];
+  }
+
+  sock->max_write = max_write;
+  res = amqp_basic_publish_batch(conn, 3, items, count, statuses);
+  if (AMQP_STATUS_OK != res) {
+    die("amqp_basic_publish_batch failed");
+  }
+  for (i = 0; i < count; ++i) {
+    if (AMQP_STATUS_OK != statuses[i]) {
+      die("unexpected message status");
+    }
+  }
+  if (0 != sock->send_calls) {
+    die("batch publish should not use send()");
+  }
+  if (max_writev_calls != 0 && sock->writev_calls > max_writev_calls) {
+    fprintf(stderr, "%d messages: expected at most %d writev calls, got %d\n",
+            (int)count, max_writev_calls, sock->writev_calls);
+    abort();
+  }
+
+  check_published(sock, 3, bodies, count);
+
+  for (i = 0; i < count; ++i) {
+    amqp_bytes_free(bodies[i]);
+  }
+  free(statuses);
+  free(bodies);
+  free(items);
+  amqp_destroy_connection(conn);
+}
+
+static void test_publish_batch_bad_item(void) {
+  amqp_connection_state_t conn;
+  struct test_socket_t *sock = new_test_connection(&conn, 4096);
+  amqp_publish_item_t items[3];
+  amqp_bytes_t bodies[2];
+  char long_name[300];
+  int statuses[3];
+  int res;
+
+  memset(long_name, 'x', sizeof(long_name));
+  memset(items, 0, sizeof(items));
+  bodies[0] = make_body(100);
+  bodies[1] = make_body(5000);
+  items[0].exchange = amqp_cstring_bytes("exchange");
+  items[0].body = bodies[0];
+  /* A shortstr cannot hold the exchange name */
+  items[1].exchange.bytes = long_name;
+  items[1].exchange.len = sizeof(long_name);
+  items[1].body = bodies[0];
+  items[2].exchange = amqp_cstring_bytes("exchange");
+  items[2].body = bodies[1];
+
+  res = amqp_basic_publish_batch(conn, 3, items, 3, statuses);
+  if (AMQP_STATUS_OK == res || res != statuses[1] ||
+      AMQP_STATUS_OK != statuses[0] || AMQP_STATUS_OK != statuses[2]) {
+    die("expected only the second message to fail");
+  }
+
+  check_published(sock, 3, bodies, 2);
+
+  amqp_bytes_free(bodies[0]);
+  amqp_bytes_free(bodies[1]);
+  amqp_destroy_connection(conn);
+}
+
+/* Publishing with a template must produce exactly the bytes
+ * amqp_basic_publish() does for the merged properties. */
+static void check_template_publish(amqp_publish_template_t *tmpl,
+                                   amqp_basic_properties_t const *overrides,
+                                   amqp_basic_properties_t const *expected,
+                                   size_t body_len) {
+  amqp_connection_state_t conn;
+  amqp_connection_state_t reference_conn;
+  struct test_socket_t *sock = new_test_connection(&conn, 4096);
+  struct test_socket_t *reference =
+      new_test_connection(&reference_conn, 4096);
+  amqp_bytes_t body = make_body(body_len);
+
+  if (AMQP_STATUS_OK !=
+          amqp_basic_publish_template(conn, 5, tmpl, overrides, body) ||
+      AMQP_STATUS_OK != amqp_basic_publish(reference_conn, 5,
+                                           amqp_cstring_bytes("exchange"),
+                                           amqp_cstring_bytes("routing.key"),
+                                           1, 0, expected, body)) {
+    die("publish failed");
+  }
+  if (sock->len != reference->len ||
+      0 != memcmp(sock->data, reference->data, sock->len)) {
+    die("template publish differs from amqp_basic_publish");
+  }
+  check_published(sock, 5, &body, 1);
+
+  amqp_bytes_free(body);
+  amqp_destroy_connection(conn);
+  amqp_destroy_connection(reference_conn);
+}
+
+static void test_publish_template(void) {
+  amqp_table_entry_t entry;
+  amqp_basic_properties_t props;
+  amqp_basic_properties_t overrides;
+  amqp_basic_properties_t expected;
+  amqp_publish_template_t *tmpl;
+
+  entry.key = amqp_cstring_bytes("key");
+  entry.value.kind = AMQP_FIELD_KIND_UTF8;
+  entry.value.value.bytes = amqp_cstring_bytes("value");
+
+  memset(&props, 0, sizeof(props));
+  props._flags = AMQP_BASIC_CONTENT_TYPE_FLAG | AMQP_BASIC_HEADERS_FLAG |
+                 AMQP_BASIC_DELIVERY_MODE_FLAG | AMQP_BASIC_MESSAGE_ID_FLAG |
+                 AMQP_BASIC_APP_ID_FLAG;
+  props.content_type = amqp_cstring_bytes("text/plain");
+  props.headers.num_entries = 1;
+  props.headers.entries = &entry;
+  props.delivery_mode = 2;
+  props.message_id = amqp_cstring_bytes("default");
+  props.app_id = amqp_cstring_bytes("app");
+
+  /* Override the last properties */
+  if (AMQP_STATUS_OK !=
+      amqp_publish_template_new(
+          amqp_cstring_bytes("exchange"), amqp_cstring_bytes("routing.key"), 1,
+          0, &props, AMQP_BASIC_MESSAGE_ID_FLAG | AMQP_BASIC_TIMESTAMP_FLAG,
+          &tmpl)) {
+    die("amqp_publish_template_new failed");
+  }
+
+  expected = props;
+  expected._flags |= AMQP_BASIC_TIMESTAMP_FLAG;
+  expected.timestamp = 0;
+  check_template_publish(tmpl, NULL, &expected, 0);
+
+  memset(&overrides, 0, sizeof(overrides));
+  overrides._flags = AMQP_BASIC_MESSAGE_ID_FLAG | AMQP_BASIC_TIMESTAMP_FLAG |
+                     AMQP_BASIC_PRIORITY_FLAG;
+  overrides.message_id = amqp_cstring_bytes("message-1");
+  overrides.timestamp = 1234567890;
+  overrides.priority = 9;
+  expected.message_id = overrides.message_id;
+  expected.timestamp = overrides.timestamp;
+  check_template_publish(tmpl, &overrides, &expected, 5000);
+
+  overrides._flags = AMQP_BASIC_TIMESTAMP_FLAG;
+  overrides.timestamp = 42;
+  expected.message_id = props.message_id;
+  expected.timestamp = 42;
+  check_template_publish(tmpl, &overrides, &expected, 10);
+  amqp_publish_template_free(tmpl);
+
+  /* Override a property preceding ones that are not overridable */
+  if (AMQP_STATUS_OK !=
+      amqp_publish_template_new(amqp_cstring_bytes("exchange"),
+                                amqp_cstring_bytes("routing.key"), 1, 0,
+                                &props, AMQP_BASIC_DELIVERY_MODE_FLAG, &tmpl)) {
+    die("amqp_publish_template_new failed");
+  }
+  overrides._flags = AMQP_BASIC_DELIVERY_MODE_FLAG;
+  overrides.delivery_mode = 1;
+  expected = props;
+  expected.delivery_mode = 1;
+  check_template_publish(tmpl, &overrides, &expected, 100);
+  amqp_publish_template_free(tmpl);
+
+  /* No overrides at all */
+  if (AMQP_STATUS_OK !=
+      amqp_publish_template_new(amqp_cstring_bytes("exchange"),
+                                amqp_cstring_bytes("routing.key"), 1, 0,
+                                &props, 0, &tmpl)) {
+    die("amqp_publish_template_new failed");
+  }
+  check_template_publish(tmpl, &overrides, &props, 100);
+  amqp_publish_template_free(tmpl);
+
+  /* The headers table cannot be overridden */
+  if (AMQP_STATUS_INVALID_PARAMETER !=
+          amqp_publish_template_new(amqp_cstring_bytes("exchange"),
+                                    amqp_cstring_bytes("routing.key"), 1, 0,
+                                    &props, AMQP_BASIC_HEADERS_FLAG, &tmpl) ||
+      NULL != tmpl) {
+    die("expected AMQP_STATUS_INVALID_PARAMETER");
+  }
+}
+
+static void publish_one(amqp_connection_state_t conn,
+                        amqp_channel_t channel) {
+  if (AMQP_STATUS_OK != amqp_basic_publish(conn, channel,
+                                           amqp_cstring_bytes("exchange"),
+                                           amqp_cstring_bytes("routing.key"), 0,
+                                           0, NULL, amqp_cstring_bytes("x"))) {
+    die("amqp_basic_publish failed");
+  }
+}
+
+static void expect_confirm(amqp_connection_state_t conn,
+                           amqp_channel_t channel, uint64_t delivery_tag,
+                           amqp_boolean_t multiple, amqp_boolean_t nack) {
+  struct timeval zero = {0, 0};
+  amqp_confirm_t confirm;
+
+  if (AMQP_STATUS_OK != amqp_confirm_poll(conn, channel, &confirm, &zero) ||
+      confirm.channel != channel || confirm.delivery_tag != delivery_tag ||
+      confirm.multiple != multiple || confirm.nack != nack) {
+    fprintf(stderr, "expected confirm of %d\n", (int)delivery_tag);
+    abort();
+  }
+}
+
+static void enable_confirms(amqp_connection_state_t conn,
+                            struct test_socket_t *sock, amqp_channel_t channel,
+                            size_t max_in_flight) {
+  amqp_confirm_select_ok_t select_ok;
+  amqp_rpc_reply_t reply;
+
+  select_ok.dummy = 0;
+  script_method(sock, channel, AMQP_CONFIRM_SELECT_OK_METHOD, &select_ok);
+  reply = amqp_confirm_enable(conn, channel, max_in_flight);
+  if (AMQP_RESPONSE_NORMAL != reply.reply_type) {
+    die("amqp_confirm_enable failed");
+  }
+  if (1 != amqp_confirm_next_seqno(conn, channel)) {
+    die("sequence numbers should start at 1");
+  }
+}
+
+static void test_confirm_window(void) {
+  amqp_connection_state_t conn;
+  struct test_socket_t *sock = new_test_connection(&conn, 4096);
+  struct timeval zero = {0, 0};
+  amqp_basic_ack_t other;
+  amqp_confirm_t confirm;
+  amqp_frame_t frame;
+  int i;
+
+  enable_confirms(conn, sock, 1, 4);
+
+  for (i = 0; i < 4; ++i) {
+    publish_one(conn, 1);
+  }
+  if (5 != amqp_confirm_next_seqno(conn, 1)) {
+    die("expected 4 messages in flight");
+  }
+
+  /* The window is full: the next publish must read confirms first. A frame
+   * for another channel read meanwhile is kept for the application. */
+  script_confirm(sock, 1, 2, 0, 0);
+  other.delivery_tag = 42;
+  other.multiple = 0;
+  script_method(sock, 2, AMQP_BASIC_ACK_METHOD, &other);
+  script_confirm(sock, 1, 3, 1, 1);
+  script_confirm(sock, 1, 4, 0, 0);
+  publish_one(conn, 1);
+  if (6 != amqp_confirm_next_seqno(conn, 1)) {
+    die("expected 5 messages published");
+  }
+
+  expect_confirm(conn, 1, 2, 0, 0);
+  expect_confirm(conn, 1, 3, 1, 1);
+  expect_confirm(conn, 1, 4, 0, 0);
+
+  if (AMQP_STATUS_OK != amqp_simple_wait_frame(conn, &frame) ||
+      2 != frame.channel || AMQP_BASIC_ACK_METHOD != frame.payload.method.id) {
+    die("expected the channel 2 frame to be queued");
+  }
+
+  /* Duplicate and unknown tags are ignored */
+  script_confirm(sock, 1, 2, 0, 0);
+  script_confirm(sock, 1, 100, 0, 0);
+  script_confirm(sock, 1, 5, 0, 1);
+  expect_confirm(conn, 1, 5, 0, 1);
+  if (AMQP_STATUS_TIMEOUT != amqp_confirm_poll(conn, 1, &confirm, &zero)) {
+    die("nothing should be awaiting a confirm");
+  }
+
+  amqp_destroy_connection(conn);
+}
+
+static void test_confirm_out_of_order(void) {
+  amqp_connection_state_t conn;
+  struct test_socket_t *sock = new_test_connection(&conn, 4096);
+  struct timeval zero = {0, 0};
+  amqp_confirm_t confirm;
+  uint64_t first = 1;
+  int round;
+
+  enable_confirms(conn, sock, 1, 100);
+
+  /* Confirm each round of publishes in a scrambled order, mixing single and
+   * multiple confirms, so the bitmap wraps around many times */
+  for (round = 0; round < 50; ++round) {
+    int count = 1 + (round * 37) % 100;
+    uint64_t confirmed = 0;
+    int i;
+
+    for (i = 0; i < count; ++i) {
+      publish_one(conn, 1);
+    }
+    for (i = count - 1; i >= 0; i -= 2) {
+      script_confirm(sock, 1, first + i, 0, 0);
+    }
+    script_confirm(sock, 1, first + count - 1, 1, 0);
+
+    while (AMQP_STATUS_OK == amqp_confirm_poll(conn, 1, &confirm, &zero)) {
+      confirmed++;
+    }
+    /* The multiple confirm is ignored only if everything was already
+     * confirmed */
+    if (confirmed != (uint64_t)(count + 1) / 2 + (count > 1 ? 1 : 0)) {
+      fprintf(stderr, "round %d: got %d confirms\n", round, (int)confirmed);
+      abort();
+    }
+    first += count;
+    if (first != amqp_confirm_next_seqno(conn, 1)) {
+      die("wrong sequence number");
+    }
+  }
+
+  amqp_destroy_connection(conn);
+}
+
+static int confirm_callback_calls;
+
+static void AMQP_CALL count_confirm(AMQP_UNUSED amqp_connection_state_t state,
+                                    const amqp_confirm_t *confirm,
+                                    void *user_data) {
+  if (confirm->delivery_tag != 1 || user_data != &confirm_callback_calls) {
+    die("unexpected confirm");
+  }
+  confirm_callback_calls++;
+}
+
+static void test_confirm_callback(void) {
+  amqp_connection_state_t conn;
+  struct test_socket_t *sock = new_test_connection(&conn, 4096);
+  amqp_frame_t frame;
+
+  enable_confirms(conn, sock, 1, 16);
+  amqp_confirm_set_callback(conn, 1, count_confirm, &confirm_callback_calls);
+
+  publish_one(conn, 1);
+  script_confirm(sock, 1, 1, 0, 0);
+
+  /* The confirm is consumed, not returned */
+  if (AMQP_STATUS_CONNECTION_CLOSED != amqp_simple_wait_frame(conn, &frame) ||
+      1 != confirm_callback_calls) {
+    die("expected the callback to be called");
+  }
+
+  amqp_destroy_connection(conn);
+}
+
+static void test_confirm_after_broker_close(void) {
+  amqp_connection_state_t conn;
+  struct test_socket_t *sock = new_test_connection(&conn, 4096);
+  amqp_channel_close_t close;
+  amqp_channel_close_ok_t close_ok;
+  amqp_channel_open_ok_t open_ok;
+  amqp_channel_flow_t flow;
+  amqp_rpc_reply_t reply;
+  amqp_frame_t frame;
+
+  enable_confirms(conn, sock, 1, 4);
+  publish_one(conn, 1);
+  flow.active = 0;
+  script_method(sock, 1, AMQP_CHANNEL_FLOW_METHOD, &flow);
+
+  /* A channel the broker closes drops its confirm and flow state once the
+   * application acknowledges the close */
+  memset(&close, 0, sizeof(close));
+  close.reply_code = 406;
+  close.reply_text = amqp_cstring_bytes("PRECONDITION_FAILED");
+  script_method(sock, 1, AMQP_CHANNEL_CLOSE_METHOD, &close);
+  if (AMQP_STATUS_OK != amqp_simple_wait_frame(conn, &frame) ||
+      AMQP_CHANNEL_CLOSE_METHOD != frame.payload.method.id) {
+    die("expected channel.close");
+  }
+  close_ok.dummy = 0;
+  if (AMQP_STATUS_OK !=
+      amqp_send_method(conn, 1, AMQP_CHANNEL_CLOSE_OK_METHOD, &close_ok)) {
+    die("amqp_send_method failed");
+  }
+
+  /* So the reopened channel can be put in confirm mode again */
+  open_ok.channel_id = amqp_empty_bytes;
+  script_method(sock, 1, AMQP_CHANNEL_OPEN_OK_METHOD, &open_ok);
+  amqp_channel_open(conn, 1);
+  reply = amqp_get_rpc_reply(conn);
+  if (AMQP_RESPONSE_NORMAL != reply.reply_type ||
+      !amqp_channel_flow_active(conn, 1)) {
+    die("the channel should have been reopened afresh");
+  }
+  enable_confirms(conn, sock, 1, 4);
+
+  amqp_destroy_connection(conn);
+}
+
+/* Decodes the frames written to sock, returning how many there are and the
+ * method id of the first frame after skip frames. */
+static int count_frames(struct test_socket_t *sock, int skip,
+                        amqp_method_number_t *method) {
+  amqp_connection_state_t decoder = amqp_new_connection();
+  amqp_bytes_t input;
+  amqp_frame_t frame;
+  int frames = 0;
+
+  input.bytes = sock->data;
+  input.len = sock->len;
+  while (input.len > 0) {
+    int res = amqp_handle_input(decoder, input, &frame);
+    if (res <= 0) {
+      die("amqp_handle_input failed");
+    }
+    input.bytes = (char *)input.bytes + res;
+    input.len -= res;
+    if (0 == frame.frame_type) {
+      continue;
+    }
+    if (frames++ == skip) {
+      *method = AMQP_FRAME_METHOD == frame.frame_type
+                    ? frame.payload.method.id
+                    : 0;
+    }
+  }
+  amqp_destroy_connection(decoder);
+  return frames;
+}
+
+static void test_write_coalescing(void) {
+  amqp_connection_state_t conn;
+  struct test_socket_t *sock = new_test_connection(&conn, 4096);
+  struct timeval zero = {0, 0};
+  amqp_method_number_t method;
+  amqp_bytes_t body;
+  amqp_frame_t frame;
+  amqp_basic_ack_t other;
+  int i;
+
+  if (AMQP_STATUS_OK != amqp_set_write_coalescing(conn, 1024, NULL)) {
+    die("amqp_set_write_coalescing failed");
+  }
+
+  /* Small frames are held back until amqp_flush() */
+  for (i = 0; i < 10; ++i) {
+    if (AMQP_STATUS_OK != amqp_basic_ack(conn, 1, i + 1, 0)) {
+      die("amqp_basic_ack failed");
+    }
+  }
+  if (0 != sock->len) {
+    die("acks should be buffered");
+  }
+  if (AMQP_STATUS_OK != amqp_flush(conn) || 1 != sock->writev_calls ||
+      10 != count_frames(sock, 9, &method) ||
+      AMQP_BASIC_ACK_METHOD != method) {
+    die("amqp_flush should write all acks at once");
+  }
+  if (AMQP_STATUS_OK != amqp_flush(conn) || 1 != sock->writev_calls) {
+    die("nothing left to flush");
+  }
+
+  /* Reaching the threshold writes the buffer: 49 acks of 21 bytes */
+  for (i = 0; i < 49; ++i) {
+    amqp_basic_ack(conn, 1, i + 1, 0);
+  }
+  if (2 != sock->writev_calls || 59 != count_frames(sock, 0, &method)) {
+    die("expected the threshold to flush");
+  }
+
+  /* A publish too big to buffer goes out with the buffered ack, in order */
+  amqp_basic_ack(conn, 1, 1, 0);
+  body = make_body(5000);
+  amqp_basic_publish(conn, 1, amqp_cstring_bytes("exchange"),
+                     amqp_cstring_bytes("routing.key"), 0, 0, NULL, body);
+  amqp_bytes_free(body);
+  if (3 != sock->writev_calls || 64 != count_frames(sock, 59, &method) ||
+      AMQP_BASIC_ACK_METHOD != method) {
+    die("expected the ack to be written before the publish");
+  }
+
+  /* Waiting for a frame writes out buffered ones first */
+  amqp_basic_ack(conn, 1, 1, 0);
+  other.delivery_tag = 1;
+  other.multiple = 0;
+  script_method(sock, 1, AMQP_BASIC_ACK_METHOD, &other);
+  if (AMQP_STATUS_OK != amqp_simple_wait_frame(conn, &frame) ||
+      4 != sock->writev_calls || 65 != count_frames(sock, 0, &method)) {
+    die("expected a flush before reading");
+  }
+
+  /* A max_delay of 0 flushes on every send */
+  if (AMQP_STATUS_OK != amqp_set_write_coalescing(conn, 1024, &zero)) {
+    die("amqp_set_write_coalescing failed");
+  }
+  amqp_basic_ack(conn, 1, 1, 0);
+  amqp_basic_ack(conn, 1, 2, 0);
+  if (6 != sock->writev_calls) {
+    die("expected max_delay to flush");
+  }
+
+  /* Disabling flushes what is buffered */
+  amqp_set_write_coalescing(conn, 1024, NULL);
+  amqp_basic_ack(conn, 1, 3, 0);
+  if (AMQP_STATUS_OK != amqp_set_write_coalescing(conn, 0, NULL) ||
+      7 != sock->writev_calls || 68 != count_frames(sock, 0, &method)) {
+    die("expected disabling to flush");
+  }
+  amqp_basic_ack(conn, 1, 4, 0);
+  if (8 != sock->writev_calls) {
+    die("expected an immediate write");
+  }
+
+  amqp_destroy_connection(conn);
+}
+
+static void test_nonblocking_send(void) {
+  amqp_connection_state_t conn;
+  amqp_connection_state_t expected_conn;
+  struct test_socket_t *sock = new_test_connection(&conn, 4096);
+  struct test_socket_t *expected = new_test_connection(&expected_conn, 4096);
+  amqp_bytes_t body = make_body(10000);
+  int i;
+
+  /* The same frames sent blocking */
+  for (i = 0; i < 2; ++i) {
+    amqp_basic_publish(expected_conn, 1, amqp_cstring_bytes("exchange"),
+                       amqp_cstring_bytes("routing.key"), 0, 0, NULL, body);
+    amqp_basic_ack(expected_conn, 1, i + 1, 0);
+  }
+
+  amqp_set_send_nonblocking(conn, 1);
+  sock->write_limited = 1;
+  sock->write_budget = 100;
+
+  /* What the socket does not take is queued */
+  if (AMQP_STATUS_WOULD_BLOCK !=
+          amqp_basic_publish(conn, 1, amqp_cstring_bytes("exchange"),
+                             amqp_cstring_bytes("routing.key"), 0, 0, NULL,
+                             body) ||
+      100 != sock->len) {
+    die("expected the publish to be partially written");
+  }
+  /* And later frames are queued behind it */
+  if (AMQP_STATUS_WOULD_BLOCK != amqp_basic_ack(conn, 1, 1, 0) ||
+      AMQP_STATUS_WOULD_BLOCK != amqp_send_pending(conn) || 100 != sock->len) {
+    die("expected the ack to be queued");
+  }
+
+  sock->write_budget = 5000;
+  if (AMQP_STATUS_WOULD_BLOCK != amqp_send_pending(conn) ||
+      5100 != sock->len) {
+    die("expected amqp_send_pending to write what it can");
+  }
+
+  /* Also through the write coalescing buffer */
+  amqp_set_write_coalescing(conn, 1024, NULL);
+  if (AMQP_STATUS_WOULD_BLOCK !=
+      amqp_basic_publish(conn, 1, amqp_cstring_bytes("exchange"),
+                         amqp_cstring_bytes("routing.key"), 0, 0, NULL,
+                         body)) {
+    die("expected the second publish to be queued");
+  }
+  if (AMQP_STATUS_OK != amqp_basic_ack(conn, 1, 2, 0)) {
+    die("expected the ack to be coalesced");
+  }
+
+  sock->write_limited = 0;
+  if (AMQP_STATUS_OK != amqp_send_pending(conn) ||
+      sock->len != expected->len ||
+      0 != memcmp(sock->data, expected->data, sock->len)) {
+    die("expected the queued frames to be written in order");
+  }
+  i = sock->writev_calls;
+  if (AMQP_STATUS_OK != amqp_send_pending(conn) || i != sock->writev_calls) {
+    die("expected nothing left to send");
+  }
+
+  amqp_bytes_free(body);
+  amqp_destroy_connection(conn);
+  amqp_destroy_connection(expected_conn);
+}
+
+#ifndef _WIN32
+/* Returns a temporary file holding body after skip bytes of padding. */
+static int make_body_file(amqp_bytes_t body, size_t skip) {
+  FILE *file = tmpfile();
+  size_t i;
+
+  if (NULL == file) {
+    die("tmpfile failed");
+  }
+  for (i = 0; i < skip; ++i) {
+    fputc('x', file);
+  }
+  if (body.len != fwrite(body.bytes, 1, body.len, file) || 0 != fflush(file)) {
+    die("writing body file failed");
+  }
+  /* The FILE is never closed, the test process is short lived */
+  return fileno(file);
+}
+
+static void publish_fd(amqp_connection_state_t conn, int fd, uint64_t offset,
+                       uint64_t len, int expected) {
+  int res = amqp_basic_publish_fd(conn, 7, amqp_cstring_bytes("exchange"),
+                                  amqp_cstring_bytes("routing.key"), 0, 0,
+                                  NULL, fd, offset, len);
+  if (expected != res) {
+    fprintf(stderr, "amqp_basic_publish_fd: expected %s, got %s\n",
+            amqp_error_string2(expected), amqp_error_string2(res));
+    abort();
+  }
+}
+
+static void test_publish_fd(void) {
+  amqp_connection_state_t conn;
+  struct test_socket_t *sock = new_test_connection(&conn, 4096);
+  amqp_bytes_t body = make_body(20000);
+  amqp_bytes_t empty = {0, NULL};
+  int fd = make_body_file(body, 100);
+
+  /* Sockets without sendfile get the file read a frame at a time */
+  publish_fd(conn, fd, 100, body.len, AMQP_STATUS_OK);
+  check_published(sock, 7, &body, 1);
+
+  sock->len = 0;
+  publish_fd(conn, fd, 100, 0, AMQP_STATUS_OK);
+  check_published(sock, 7, &empty, 1);
+
+  /* Asking for more than the file holds fails without sending anything */
+  sock->len = 0;
+  publish_fd(conn, fd, 101, body.len, AMQP_STATUS_INVALID_PARAMETER);
+  publish_fd(conn, -1, 0, 1, AMQP_STATUS_INVALID_PARAMETER);
+  if (0 != sock->len) {
+    die("nothing should have been sent");
+  }
+
+  amqp_destroy_connection(conn);
+  amqp_bytes_free(body);
+}
+
+static void test_publish_fd_sendfile(void) {
+  amqp_connection_state_t conn;
+  amqp_connection_state_t expected_conn;
+  struct test_socket_t *expected = new_test_connection(&expected_conn, 4096);
+  amqp_socket_t *tcp;
+  amqp_bytes_t body = make_body(20000);
+  int fd = make_body_file(body, 100);
+  int fds[2];
+  char *received;
+  size_t received_len = 0;
+
+  /* A TCP socket object over a socketpair, small enough a message fits in
+   * its buffer */
+  if (0 != socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+    die("socketpair failed");
+  }
+  conn = amqp_new_connection();
+  tcp = amqp_tcp_socket_new(conn);
+  if (NULL == tcp) {
+    die("amqp_tcp_socket_new failed");
+  }
+  amqp_tcp_socket_set_sockfd(tcp, fds[0]);
+  conn->state = CONNECTION_STATE_IDLE;
+  if (AMQP_STATUS_OK != amqp_tune_connection(conn, 0, 4096, 0)) {
+    die("amqp_tune_connection failed");
+  }
+
+  publish_fd(conn, fd, 100, body.len, AMQP_STATUS_OK);
+  amqp_basic_publish(expected_conn, 7, amqp_cstring_bytes("exchange"),
+                     amqp_cstring_bytes("routing.key"), 0, 0, NULL, body);
+
+  received = malloc(expected->len + 1);
+  if (NULL == received) {
+    die("out of memory");
+  }
+  while (received_len < expected->len) {
+    ssize_t res = recv(fds[1], received + received_len,
+                       expected->len + 1 - received_len, 0);
+    if (res <= 0) {
+      die("recv failed");
+    }
+    received_len += res;
+  }
+  if (received_len != expected->len ||
+      0 != memcmp(received, expected->data, received_len)) {
+    die("sendfile publish differs from amqp_basic_publish");
+  }
+
+  free(received);
+  close(fds[1]);
+  amqp_destroy_connection(conn);
+  amqp_destroy_connection(expected_conn);
+  amqp_bytes_free(body);
+}
+#endif
+
+static int publish_begin(amqp_connection_state_t conn, uint64_t body_size) {
+  return amqp_basic_publish_begin(conn, 7, amqp_cstring_bytes("exchange"),
+                                  amqp_cstring_bytes("routing.key"), 0, 0,
+                                  NULL, body_size);
+}
+
+/* Writes body in chunks cycling through the count sizes in chunk_lens,
+ * starting at chunk_lens[first]. */
+static int publish_write_chunks(amqp_connection_state_t conn,
+                                amqp_bytes_t body, const size_t *chunk_lens,
+                                size_t count, size_t first) {
+  size_t offset = 0;
+  size_t i = first;
+  int would_block = 0;
+
+  while (offset < body.len) {
+    amqp_bytes_t chunk;
+    int res;
+
+    chunk.bytes = (char *)body.bytes + offset;
+    chunk.len = chunk_lens[i++ % count];
+    if (chunk.len > body.len - offset) {
+      chunk.len = body.len - offset;
+    }
+    res = amqp_basic_publish_write(conn, chunk);
+    if (AMQP_STATUS_WOULD_BLOCK == res) {
+      would_block = 1;
+    } else if (AMQP_STATUS_OK != res) {
+      die("amqp_basic_publish_write failed");
+    }
+    offset += chunk.len;
+  }
+  return would_block ? AMQP_STATUS_WOULD_BLOCK : AMQP_STATUS_OK;
+}
+
+static void test_publish_stream(void) {
+  static const size_t chunk_lens[] = {1, 100, 5000, 4088, 3, 2 * 4096, 777};
+  const size_t count = sizeof(chunk_lens) / sizeof(chunk_lens[0]);
+  amqp_connection_state_t conn;
+  amqp_connection_state_t expected_conn;
+  struct test_socket_t *sock = new_test_connection(&conn, 4096);
+  struct test_socket_t *expected = new_test_connection(&expected_conn, 4096);
+  amqp_bytes_t body = make_body(50000);
+  amqp_bytes_t empty = {0, NULL};
+  amqp_bytes_t one = {1, "x"};
+  size_t i;
+
+  amqp_basic_publish(expected_conn, 7, amqp_cstring_bytes("exchange"),
+                     amqp_cstring_bytes("routing.key"), 0, 0, NULL, body);
+
+  /* However the body is split up, the frames are those amqp_basic_publish()
+   * sends */
+  for (i = 0; i < count; ++i) {
+    sock->len = 0;
+    if (AMQP_STATUS_OK != publish_begin(conn, body.len) ||
+        AMQP_STATUS_OK !=
+            publish_write_chunks(conn, body, chunk_lens, count, i) ||
+        AMQP_STATUS_OK != amqp_basic_publish_end(conn)) {
+      die("streamed publish failed");
+    }
+    if (sock->len != expected->len ||
+        0 != memcmp(sock->data, expected->data, sock->len)) {
+      die("streamed publish differs from amqp_basic_publish");
+    }
+  }
+
+  sock->len = 0;
+  if (AMQP_STATUS_OK != publish_begin(conn, 0) ||
+      AMQP_STATUS_OK != amqp_basic_publish_end(conn)) {
+    die("streamed publish of an empty body failed");
+  }
+  check_published(sock, 7, &empty, 1);
+
+  /* Writing more than the body size, or outside a message, sends nothing */
+  sock->len = 0;
+  if (AMQP_STATUS_INVALID_PARAMETER != amqp_basic_publish_write(conn, one) ||
+      AMQP_STATUS_INVALID_PARAMETER != amqp_basic_publish_end(conn)) {
+    die("expected writing without a message to fail");
+  }
+  if (AMQP_STATUS_OK != publish_begin(conn, 0) ||
+      AMQP_STATUS_INVALID_PARAMETER != publish_begin(conn, 0) ||
+      AMQP_STATUS_INVALID_PARAMETER != amqp_basic_publish_write(conn, one) ||
+      AMQP_STATUS_OK != amqp_basic_publish_end(conn)) {
+    die("expected writing past the body size to fail");
+  }
+  check_published(sock, 7, &empty, 1);
+
+  /* What the socket does not take is queued */
+  amqp_set_send_nonblocking(conn, 1);
+  sock->len = 0;
+  sock->write_limited = 1;
+  sock->write_budget = 100;
+  if (AMQP_STATUS_OK != publish_begin(conn, body.len) ||
+      AMQP_STATUS_WOULD_BLOCK !=
+          publish_write_chunks(conn, body, chunk_lens, 1, 0) ||
+      AMQP_STATUS_OK != amqp_basic_publish_end(conn) || 100 != sock->len) {
+    die("expected the streamed publish to be queued");
+  }
+  sock->write_limited = 0;
+  if (AMQP_STATUS_OK != amqp_send_pending(conn) ||
+      sock->len != expected->len ||
+      0 != memcmp(sock->data, expected->data, sock->len)) {
+    die("expected the queued body frames to be written in order");
+  }
+  amqp_set_send_nonblocking(conn, 0);
+
+  /* Finishing a message short of its body size closes the connection */
+  if (AMQP_STATUS_OK != publish_begin(conn, body.len) ||
+      AMQP_STATUS_OK != amqp_basic_publish_write(conn, one) ||
+      AMQP_STATUS_CONNECTION_CLOSED != amqp_basic_publish_end(conn)) {
+    die("expected a short body to close the connection");
+  }
+
+  amqp_bytes_free(body);
+  amqp_destroy_connection(conn);
+  amqp_destroy_connection(expected_conn);
+}
+
+/* A run-length codec: the body is encoded as (count, byte) pairs. */
+struct rle_decoder_t {
+  int have_count;
+  uint8_t count;
+};
+
+static int AMQP_CALL rle_encode(AMQP_UNUSED void *user_data, amqp_bytes_t body,
+                                amqp_bytes_t *encoded) {
+  const uint8_t *in = body.bytes;
+  uint8_t *out;
+  size_t i = 0;
+
+  *encoded = amqp_bytes_malloc(2 * body.len);
+  if (NULL == encoded->bytes) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  out = encoded->bytes;
+  encoded->len = 0;
+  while (i < body.len) {
+    size_t run = 1;
+    while (i + run < body.len && run < 255 && in[i + run] == in[i]) {
+      ++run;
+    }
+    out[encoded->len++] = (uint8_t)run;
+    out[encoded->len++] = in[i];
+    i += run;
+  }
+  return AMQP_STATUS_OK;
+}
+
+static int AMQP_CALL rle_decoder_new(AMQP_UNUSED void *user_data,
+                                     AMQP_UNUSED uint64_t encoded_size,
+                                     AMQP_UNUSED uint64_t max_size,
+                                     void **decoder) {
+  *decoder = calloc(1, sizeof(struct rle_decoder_t));
+  return NULL == *decoder ? AMQP_STATUS_NO_MEMORY : AMQP_STATUS_OK;
+}
+
+static int AMQP_CALL rle_decode(void *decoder, amqp_bytes_t fragment,
+                                amqp_bytes_t *body, size_t *capacity) {
+  struct rle_decoder_t *self = decoder;
+  const uint8_t *in = fragment.bytes;
+  size_t i;
+
+  for (i = 0; i < fragment.len; ++i) {
+    if (!self->have_count) {
+      if (0 == in[i]) {
+        return AMQP_STATUS_CODEC_ERROR;
+      }
+      self->count = in[i];
+      self->have_count = 1;
+      continue;
+    }
+    if (body->len + self->count > *capacity) {
+      size_t new_capacity = 2 * *capacity + 256;
+      void *bytes = realloc(body->bytes, new_capacity);
+      if (NULL == bytes) {
+        return AMQP_STATUS_NO_MEMORY;
+      }
+      body->bytes = bytes;
+      *capacity = new_capacity;
+    }
+    memset((uint8_t *)body->bytes + body->len, in[i], self->count);
+    body->len += self->count;
+    self->have_count = 0;
+  }
+  return AMQP_STATUS_OK;
+}
+
+static int AMQP_CALL rle_decoder_finish(void *decoder) {
+  struct rle_decoder_t *self = decoder;
+  return self->have_count ? AMQP_STATUS_CODEC_ERROR : AMQP_STATUS_OK;
+}
+
+static void AMQP_CALL rle_decoder_free(void *decoder) { free(decoder); }
+
+static const amqp_body_codec_t rle_codec = {
+    "x-rle",            /* content_encoding */
+    rle_encode,         /* encode */
+    rle_decoder_new,    /* decoder_new */
+    rle_decode,         /* decode */
+    rle_decoder_finish, /* decoder_finish */
+    rle_decoder_free    /* decoder_free */
+};
+
+/* A body that run-length encodes well. */
+static amqp_bytes_t make_runs_body(size_t len) {
+  amqp_bytes_t body = make_body(len);
+  size_t i;
+  for (i = 0; i < len; ++i) {
+    ((uint8_t *)body.bytes)[i] = (uint8_t)(i / 300);
+  }
+  return body;
+}
+
+/* Hands everything written to from over to be read from to. */
+static void transfer(struct test_socket_t *from, struct test_socket_t *to) {
+  free(to->recv_data);
+  to->recv_data = from->data;
+  to->recv_len = from->len;
+  to->recv_offset = 0;
+  from->data = NULL;
+  from->len = 0;
+  from->cap = 0;
+}
+
+/* Reads the next message on channel 7 of conn, which must be body. */
+static void expect_message(amqp_connection_state_t conn, amqp_bytes_t body,
+                           const char *content_encoding) {
+  amqp_frame_t frame;
+  amqp_message_t message;
+  amqp_rpc_reply_t reply;
+  int has_encoding;
+
+  if (AMQP_STATUS_OK != amqp_simple_wait_frame(conn, &frame) ||
+      AMQP_FRAME_METHOD != frame.frame_type ||
+      AMQP_BASIC_PUBLISH_METHOD != frame.payload.method.id) {
+    die("expected a basic.publish frame");
+  }
+  reply = amqp_read_message(conn, 7, &message, 0);
+  if (AMQP_RESPONSE_NORMAL != reply.reply_type) {
+    die("amqp_read_message failed");
+  }
+  if (body.len != message.body.len ||
+      (0 != body.len &&
+       0 != memcmp(body.bytes, message.body.bytes, body.len))) {
+    die("message body differs from the one published");
+  }
+  if (!(message.properties._flags & AMQP_BASIC_CONTENT_TYPE_FLAG) ||
+      0 != strncmp("text/plain", message.properties.content_type.bytes,
+                   message.properties.content_type.len)) {
+    die("content_type was not preserved");
+  }
+  has_encoding =
+      0 != (message.properties._flags & AMQP_BASIC_CONTENT_ENCODING_FLAG);
+  if ((NULL != content_encoding) != has_encoding ||
+      (has_encoding &&
+       (strlen(content_encoding) != message.properties.content_encoding.len ||
+        0 != memcmp(content_encoding,
+                    message.properties.content_encoding.bytes,
+                    message.properties.content_encoding.len)))) {
+    die("unexpected content_encoding");
+  }
+  amqp_destroy_message(&message);
+}
+
+static void publish_text(amqp_connection_state_t conn, amqp_bytes_t body) {
+  amqp_basic_properties_t props;
+  props._flags = AMQP_BASIC_CONTENT_TYPE_FLAG;
+  props.content_type = amqp_cstring_bytes("text/plain");
+  if (AMQP_STATUS_OK != amqp_basic_publish(conn, 7,
+                                           amqp_cstring_bytes("exchange"),
+                                           amqp_cstring_bytes("routing.key"),
+                                           0, 0, &props, body)) {
+    die("amqp_basic_publish failed");
+  }
+}
+
+static void test_body_codec(void) {
+  amqp_connection_state_t conn;
+  amqp_connection_state_t reader;
+  struct test_socket_t *sock = new_test_connection(&conn, 4096);
+  struct test_socket_t *reader_sock = new_test_connection(&reader, 4096);
+  amqp_bytes_t runs = make_runs_body(10 * 4096 + 11);
+  amqp_bytes_t noise = make_body(5000);
+  amqp_bytes_t small = make_runs_body(100);
+  amqp_bytes_t bad;
+  amqp_basic_properties_t props;
+  amqp_frame_t frame;
+  amqp_message_t message;
+  amqp_rpc_reply_t reply;
+
+  amqp_set_body_codec(conn, &rle_codec, NULL, 1000);
+
+  /* Encoded over several body frames and decoded back on receipt */
+  publish_text(conn, runs);
+  if (sock->len >= runs.len) {
+    die("the body should have been encoded");
+  }
+  /* Bodies that would not shrink, or are too small, are sent as they are */
+  publish_text(conn, noise);
+  publish_text(conn, small);
+
+  transfer(sock, reader_sock);
+  amqp_set_body_codec(reader, &rle_codec, NULL, 0);
+  expect_message(reader, runs, NULL);
+  expect_message(reader, noise, NULL);
+  expect_message(reader, small, NULL);
+
+  /* Batches are encoded too, encoded bodies large enough to be written from
+   * their own buffers included */
+  {
+    amqp_publish_item_t items[40];
+    amqp_bytes_t large = make_runs_body(400 * 1024);
+    size_t i;
+
+    props._flags = AMQP_BASIC_CONTENT_TYPE_FLAG;
+    props.content_type = amqp_cstring_bytes("text/plain");
+    for (i = 0; i < 40; ++i) {
+      memset(&items[i], 0, sizeof(items[i]));
+      items[i].exchange = amqp_cstring_bytes("exchange");
+      items[i].routing_key = amqp_cstring_bytes("routing.key");
+      items[i].properties = &props;
+      items[i].body = i % 4 == 0 ? large : i % 4 == 1 ? noise : runs;
+    }
+    if (AMQP_STATUS_OK != amqp_basic_publish_batch(conn, 7, items, 40, NULL)) {
+      die("amqp_basic_publish_batch failed");
+    }
+    if (sock->len >= 10 * (large.len + runs.len)) {
+      die("the batch should have been encoded");
+    }
+    transfer(sock, reader_sock);
+    for (i = 0; i < 40; ++i) {
+      expect_message(reader, items[i].body, NULL);
+    }
+    amqp_bytes_free(large);
+  }
+
+  /* Without the codec the reader sees the encoded body */
+  publish_text(conn, runs);
+  transfer(sock, reader_sock);
+  amqp_set_body_codec(reader, NULL, NULL, 0);
+  {
+    amqp_bytes_t encoded;
+    if (AMQP_STATUS_OK != rle_encode(NULL, runs, &encoded)) {
+      die("rle_encode failed");
+    }
+    expect_message(reader, encoded, "x-rle");
+    amqp_bytes_free(encoded);
+  }
+
+  /* A body that does not decode fails the read but leaves the channel in
+   * step for the next message */
+  amqp_set_body_codec(conn, NULL, NULL, 0);
+  bad = make_runs_body(3 * 4096 + 1);
+  props._flags = AMQP_BASIC_CONTENT_ENCODING_FLAG;
+  props.content_encoding = amqp_cstring_bytes("x-rle");
+  if (AMQP_STATUS_OK != amqp_basic_publish(conn, 7,
+                                           amqp_cstring_bytes("exchange"),
+                                           amqp_cstring_bytes("routing.key"),
+                                           0, 0, &props, bad)) {
+    die("amqp_basic_publish failed");
+  }
+  publish_text(conn, small);
+  transfer(sock, reader_sock);
+  amqp_set_body_codec(reader, &rle_codec, NULL, 0);
+  if (AMQP_STATUS_OK != amqp_simple_wait_frame(reader, &frame)) {
+    die("expected a basic.publish frame");
+  }
+  reply = amqp_read_message(reader, 7, &message, 0);
+  if (AMQP_RESPONSE_LIBRARY_EXCEPTION != reply.reply_type ||
+      AMQP_STATUS_CODEC_ERROR != reply.library_error) {
+    die("expected AMQP_STATUS_CODEC_ERROR");
+  }
+  expect_message(reader, small, NULL);
+
+  amqp_bytes_free(bad);
+  amqp_bytes_free(small);
+  amqp_bytes_free(noise);
+  amqp_bytes_free(runs);
+  amqp_destroy_connection(reader);
+  amqp_destroy_connection(conn);
+}
+
+#ifdef AMQP_TEST_ZLIB
+static void test_deflate_codec(void) {
+  amqp_connection_state_t conn;
+  amqp_connection_state_t reader;
+  struct test_socket_t *sock = new_test_connection(&conn, 4096);
+  struct test_socket_t *reader_sock = new_test_connection(&reader, 4096);
+  amqp_bytes_t runs = make_runs_body(200 * 4096 + 3);
+  amqp_bytes_t noise = make_body(3 * 4096);
+  amqp_bytes_t empty = {0, NULL};
+  amqp_frame_t frame;
+  amqp_message_t message;
+  amqp_rpc_reply_t reply;
+
+  if (AMQP_STATUS_INVALID_PARAMETER == amqp_set_deflate_codec(conn, 6, 1) ||
+      AMQP_STATUS_INVALID_PARAMETER != amqp_set_deflate_codec(conn, 10, 1) ||
+      AMQP_STATUS_OK != amqp_set_deflate_codec(conn, 6, 1) ||
+      AMQP_STATUS_OK != amqp_set_deflate_codec(reader, 6, 1)) {
+    die("amqp_set_deflate_codec failed");
+  }
+
+  publish_text(conn, runs);
+  publish_text(conn, noise);
+  publish_text(conn, empty);
+  if (sock->len >= runs.len) {
+    die("the body should have been compressed");
+  }
+  transfer(sock, reader_sock);
+  expect_message(reader, runs, NULL);
+  expect_message(reader, noise, NULL);
+  expect_message(reader, empty, NULL);
+
+  /* A body that decodes to more than the limit fails, one that decodes to
+   * exactly the limit does not */
+  publish_text(conn, runs);
+  publish_text(conn, runs);
+  transfer(sock, reader_sock);
+  amqp_set_max_decoded_body_size(reader, runs.len - 1);
+  if (AMQP_STATUS_OK != amqp_simple_wait_frame(reader, &frame)) {
+    die("expected a basic.publish frame");
+  }
+  reply = amqp_read_message(reader, 7, &message, 0);
+  if (AMQP_RESPONSE_LIBRARY_EXCEPTION != reply.reply_type ||
+      AMQP_STATUS_CODEC_ERROR != reply.library_error) {
+    die("expected AMQP_STATUS_CODEC_ERROR");
+  }
+  amqp_set_max_decoded_body_size(reader, runs.len);
+  expect_message(reader, runs, NULL);
+
+  amqp_bytes_free(noise);
+  amqp_bytes_free(runs);
+  amqp_destroy_connection(reader);
+  amqp_destroy_connection(conn);
+}
+#endif
+
+/* Publishes on channel until the flow control poll reads what the broker
+ * sent, returning the status of the publish that did. */
+static int publish_until_polled(amqp_connection_state_t conn,
+                                struct test_socket_t *sock,
+                                amqp_channel_t channel) {
+  int i;
+  for (i = 0; i < AMQP_FLOW_POLL_INTERVAL; ++i) {
+    int res = amqp_basic_publish(conn, channel, amqp_cstring_bytes("exchange"),
+                                 amqp_cstring_bytes("routing.key"), 0, 0, NULL,
+                                 amqp_cstring_bytes("x"));
+    if (sock->recv_offset == sock->recv_len) {
+      return res;
+    }
+    if (AMQP_STATUS_OK != res) {
+      die("amqp_basic_publish failed before polling");
+    }
+  }
+  die("publishing never read from the socket");
+  return 0;
+}
+
+static void test_flow_control(void) {
+  amqp_connection_state_t conn;
+  struct test_socket_t *sock = new_test_connection(&conn, 4096);
+  struct timeval zero = {0, 0};
+  amqp_connection_blocked_t blocked;
+  amqp_connection_unblocked_t unblocked;
+  amqp_channel_flow_t flow;
+  amqp_basic_recover_ok_t recover_ok;
+  amqp_method_number_t method;
+  amqp_frame_t frame;
+  int frames;
+
+  /* A connection that only publishes notices it has been blocked, and with
+   * a zero timeout fails at once without writing anything */
+  amqp_set_publish_blocked_timeout(conn, &zero);
+  blocked.reason = amqp_cstring_bytes("low on memory");
+  script_method(sock, 0, AMQP_CONNECTION_BLOCKED_METHOD, &blocked);
+  frames = count_frames(sock, 0, &method);
+  if (AMQP_STATUS_CONNECTION_BLOCKED != publish_until_polled(conn, sock, 7) ||
+      !amqp_connection_is_blocked(conn)) {
+    die("publishing should have been blocked");
+  }
+  if (frames + 3 * (AMQP_FLOW_POLL_INTERVAL - 1) != count_frames(sock, 0,
+                                                                   &method)) {
+    die("a blocked publish should not write anything");
+  }
+  if (AMQP_STATUS_CONNECTION_BLOCKED !=
+      amqp_basic_publish(conn, 8, amqp_cstring_bytes("exchange"),
+                         amqp_cstring_bytes("routing.key"), 0, 0, NULL,
+                         amqp_cstring_bytes("x"))) {
+    die("every channel should be blocked");
+  }
+
+  /* Without a timeout a publish waits for connection.unblocked */
+  amqp_set_publish_blocked_timeout(conn, NULL);
+  unblocked.dummy = 0;
+  script_method(sock, 0, AMQP_CONNECTION_UNBLOCKED_METHOD, &unblocked);
+  publish_one(conn, 7);
+  if (amqp_connection_is_blocked(conn)) {
+    die("the connection should have been unblocked");
+  }
+
+  /* channel.flow pauses one channel, and is acknowledged */
+  sock->len = 0;
+  amqp_set_publish_blocked_timeout(conn, &zero);
+  flow.active = 0;
+  script_method(sock, 7, AMQP_CHANNEL_FLOW_METHOD, &flow);
+  if (AMQP_STATUS_CONNECTION_BLOCKED != publish_until_polled(conn, sock, 7) ||
+      amqp_channel_flow_active(conn, 7) || !amqp_channel_flow_active(conn, 8)) {
+    die("channel 7 should have been paused");
+  }
+  frames = count_frames(sock, 0, &method);
+  count_frames(sock, frames - 1, &method);
+  if (AMQP_CHANNEL_FLOW_OK_METHOD != method) {
+    die("expected channel.flow-ok");
+  }
+  publish_one(conn, 8);
+
+  /* Frames read while waiting are kept for the application */
+  amqp_set_publish_blocked_timeout(conn, NULL);
+  recover_ok.dummy = 0;
+  script_method(sock, 7, AMQP_BASIC_RECOVER_OK_METHOD, &recover_ok);
+  flow.active = 1;
+  script_method(sock, 7, AMQP_CHANNEL_FLOW_METHOD, &flow);
+  publish_one(conn, 7);
+  if (!amqp_channel_flow_active(conn, 7)) {
+    die("channel 7 should have been resumed");
+  }
+  if (AMQP_STATUS_OK != amqp_simple_wait_frame(conn, &frame) ||
+      AMQP_FRAME_METHOD != frame.frame_type ||
+      AMQP_BASIC_RECOVER_OK_METHOD != frame.payload.method.id) {
+    die("expected the frame read while waiting");
+  }
+
+  amqp_destroy_connection(conn);
+}
+
+static void test_flow_during_send(void) {
+  amqp_connection_state_t conn;
+  struct test_socket_t *sock = new_test_connection(&conn, 65536);
+  amqp_bytes_t body = make_body(60000);
+  amqp_channel_flow_t flow;
+  amqp_basic_recover_ok_t recover_ok;
+  amqp_method_number_t method;
+  amqp_frame_t frame;
+
+  /* channel.flow is in the socket buffer, and read while the body frame is
+   * partly written */
+  flow.active = 0;
+  script_method(sock, 7, AMQP_CHANNEL_FLOW_METHOD, &flow);
+  if (AMQP_STATUS_OK != amqp_try_recv(conn)) {
+    die("amqp_try_recv failed");
+  }
+  recover_ok.dummy = 0;
+  script_method(sock, 7, AMQP_BASIC_RECOVER_OK_METHOD, &recover_ok);
+  sock->write_limited = 1;
+  sock->write_budget = 4096;
+  sock->recv_write_budget = 1 << 20;
+  conn->next_recv_heartbeat = amqp_time_immediate();
+
+  frame.frame_type = AMQP_FRAME_BODY;
+  frame.channel = 7;
+  frame.payload.body_fragment = body;
+  if (AMQP_STATUS_OK != amqp_send_frame(conn, &frame)) {
+    die("amqp_send_frame failed");
+  }
+  if (amqp_channel_flow_active(conn, 7)) {
+    die("channel 7 should have been paused");
+  }
+  if (1 != count_frames(sock, 0, &method) || 0 != method) {
+    die("channel.flow-ok should not be written inside the body frame");
+  }
+
+  /* The reply goes out before the next method */
+  publish_one(conn, 8);
+  count_frames(sock, 1, &method);
+  if (AMQP_CHANNEL_FLOW_OK_METHOD != method) {
+    die("expected channel.flow-ok after the body frame");
+  }
+
+  amqp_bytes_free(body);
+  amqp_destroy_connection(conn);
+}
+
+int main(void) {
+  /* Empty body: method and header frame only */
+  test_publish(0, 0, 1);
+  /* Single body frame */
+  test_publish(300, 0, 1);
+  /* Several body frames, still a single writev */
+  test_publish(4 * 4096 + 5, 0, 1);
+  /* More body frames than fit in one writev */
+  test_publish(50 * 4096, 0, 3);
+  /* Short writes must resume mid-iovec */
+  test_publish(3 * 4096 + 17, 5, 0);
+  test_publish(3 * 4096 + 17, 4093, 0);
+
+  {
+    size_t lens[1000];
+    size_t i;
+
+    /* A burst of small messages goes out in a few writes */
+    for (i = 0; i < 1000; ++i) {
+      lens[i] = 200 + i % 300;
+    }
+    test_publish_batch(lens, 1000, 0, 16);
+
+    /* Empty, copied and referenced bodies, some spanning several frames */
+    for (i = 0; i < 100; ++i) {
+      lens[i] = (i * 7919) % (5 * 4096);
+      if (i % 10 == 0) {
+        lens[i] = 0;
+      }
+    }
+    test_publish_batch(lens, 100, 0, 0);
+    test_publish_batch(lens, 100, 7, 0);
+  }
+  test_publish_batch_bad_item();
+  test_publish_template();
+
+  test_confirm_window();
+  test_confirm_out_of_order();
+  test_confirm_callback();
+  test_confirm_after_broker_close();
+
+  test_write_coalescing();
+
+  test_nonblocking_send();
+
+#ifndef _WIN32
+  test_publish_fd();
+  test_publish_fd_sendfile();
+#endif
+
+  test_publish_stream();
+
+  test_body_codec();
+#ifdef AMQP_TEST_ZLIB
+  test_deflate_codec();
+#endif
+
+  test_flow_control();
+  test_flow_during_send();
+
+  return 0;
+}
@@ -0,0 +1,230 @@
+// Copyright 2007 - 2021, Alan Antonuk and the rabbitmq-c contributors.
+// SPDX-License-Identifier: mit
+
+#include "test_socket.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void die(const char *msg) {
+  fprintf(stderr, "%s\n", msg);
+  abort();
+}
+
+static size_t test_socket_append(struct test_socket_t *self, const void *buf,
+                                 size_t len) {
+  if (self->max_write != 0 && len > self->max_write) {
+    len = self->max_write;
+  }
+  if (self->len + len > self->cap) {
+    self->cap = (self->len + len) * 2;
+    self->data = realloc(self->data, self->cap);
+    if (NULL == self->data) {
+      die("out of memory");
+    }
+  }
+  memcpy(self->data + self->len, buf, len);
+  self->len += len;
+  return len;
+}
+
+static ssize_t test_socket_send(void *base, const void *buf, size_t len,
+                                AMQP_UNUSED int flags) {
+  struct test_socket_t *self = base;
+  self->send_calls++;
+  return (ssize_t)test_socket_append(self, buf, len);
+}
+
+static ssize_t test_socket_writev(void *base, const struct iovec *iov,
+                                  int iovcnt, AMQP_UNUSED int flags) {
+  struct test_socket_t *self = base;
+  size_t saved_max_write = self->max_write;
+  size_t max_write = self->max_write;
+  size_t sent = 0;
+  int i;
+
+  self->writev_calls++;
+  if (self->write_limited) {
+    if (0 == self->write_budget) {
+      return AMQP_PRIVATE_STATUS_SOCKET_NEEDWRITE;
+    }
+    if (0 == max_write || max_write > self->write_budget) {
+      max_write = self->write_budget;
+    }
+  }
+  for (i = 0; i < iovcnt; ++i) {
+    size_t n;
+    if (max_write != 0 && sent == max_write) {
+      break;
+    }
+    self->max_write = max_write == 0 ? 0 : max_write - sent;
+    n = test_socket_append(self, iov[i].iov_base, iov[i].iov_len);
+    sent += n;
+    if (n != iov[i].iov_len) {
+      break;
+    }
+  }
+  self->max_write = saved_max_write;
+  if (self->write_limited) {
+    self->write_budget -= sent;
+  }
+  return (ssize_t)sent;
+}
+
+/* Copies up to len bytes of the scripted data into buf. */
+static ssize_t test_socket_read(struct test_socket_t *self, void *buf,
+                                size_t len) {
+  if (self->recv_offset == self->recv_len) {
+    return AMQP_PRIVATE_STATUS_SOCKET_NEEDREAD;
+  }
+  if (len > self->recv_len - self->recv_offset) {
+    len = self->recv_len - self->recv_offset;
+  }
+  memcpy(buf, self->recv_data + self->recv_offset, len);
+  self->recv_offset += len;
+  return (ssize_t)len;
+}
+
+static ssize_t test_socket_recv(void *base, void *buf, size_t len,
+                                AMQP_UNUSED int flags) {
+  struct test_socket_t *self = base;
+  ssize_t res;
+
+  if (self->max_read != 0 && len > self->max_read) {
+    len = self->max_read;
+  }
+  res = test_socket_read(self, buf, len);
+  if (res > 0) {
+    self->write_budget += self->recv_write_budget;
+  }
+  return res;
+}
+
+static ssize_t test_socket_readv(void *base, const struct iovec *iov,
+                                 int iovcnt, AMQP_UNUSED int flags) {
+  struct test_socket_t *self = base;
+  size_t max_read = self->max_read;
+  ssize_t len = 0;
+  int i;
+
+  if (2 == iovcnt) {
+    self->split_reads++;
+  }
+  for (i = 0; i < iovcnt; ++i) {
+    size_t want = iov[i].iov_len;
+    ssize_t res;
+    if (max_read != 0 && want > max_read - (size_t)len) {
+      want = max_read - (size_t)len;
+    }
+    if (0 == want) {
+      break;
+    }
+    res = test_socket_read(self, iov[i].iov_base, want);
+    if (res < 0) {
+      if (0 == len) {
+        return res;
+      }
+      break;
+    }
+    len += res;
+  }
+  self->write_budget += self->recv_write_budget;
+  return len;
+}
+
+static int test_socket_open(AMQP_UNUSED void *base,
+                            AMQP_UNUSED const char *host, AMQP_UNUSED int port,
+                            AMQP_UNUSED const struct timeval *timeout) {
+  return AMQP_STATUS_OK;
+}
+
+static int test_socket_close(AMQP_UNUSED void *base,
+                             AMQP_UNUSED amqp_socket_close_enum force) {
+  return AMQP_STATUS_OK;
+}
+
+static int test_socket_get_sockfd(AMQP_UNUSED void *base) { return -1; }
+
+static void test_socket_delete(void *base) {
+  struct test_socket_t *self = base;
+  free(self->data);
+  free(self->recv_data);
+  free(self);
+}
+
+static const struct amqp_socket_class_t test_socket_class = {
+    test_socket_send,       /* send */
+    test_socket_writev,     /* writev */
+    test_socket_recv,       /* recv */
+    test_socket_open,       /* open */
+    test_socket_close,      /* close */
+    test_socket_get_sockfd, /* get_sockfd */
+    test_socket_delete,     /* delete */
+    NULL,                   /* sendfile */
+    test_socket_readv       /* readv */
+};
+
+struct test_socket_t *new_test_connection(amqp_connection_state_t *conn,
+                                          int frame_max) {
+  struct test_socket_t *sock = calloc(1, sizeof(*sock));
+  if (NULL == sock) {
+    die("out of memory");
+  }
+  sock->klass = &test_socket_class;
+
+  *conn = amqp_new_connection();
+  if (NULL == *conn) {
+    die("amqp_new_connection failed");
+  }
+  amqp_set_socket(*conn, (amqp_socket_t *)sock);
+
+  /* As after the handshake, ready for a frame header */
+  (*conn)->state = CONNECTION_STATE_IDLE;
+  (*conn)->target_size = HEADER_SIZE;
+  if (AMQP_STATUS_OK != amqp_tune_connection(*conn, 0, frame_max, 0)) {
+    die("amqp_tune_connection failed");
+  }
+  return sock;
+}
+
+void script_frame(struct test_socket_t *sock, const amqp_frame_t *frame) {
+  char buffer[131072];
+  amqp_bytes_t encoded;
+
+  encoded.bytes = buffer;
+  encoded.len = sizeof(buffer);
+  if (AMQP_STATUS_OK != amqp_frame_to_bytes(frame, encoded, &encoded)) {
+    die("amqp_frame_to_bytes failed");
+  }
+
+  sock->recv_data = realloc(sock->recv_data, sock->recv_len + encoded.len);
+  if (NULL == sock->recv_data) {
+    die("out of memory");
+  }
+  memcpy(sock->recv_data + sock->recv_len, encoded.bytes, encoded.len);
+  sock->recv_len += encoded.len;
+}
+
+void script_method(struct test_socket_t *sock, amqp_channel_t channel,
+                   amqp_method_number_t id, void *decoded) {
+  amqp_frame_t frame;
+
+  frame.frame_type = AMQP_FRAME_METHOD;
+  frame.channel = channel;
+  frame.payload.method.id = id;
+  frame.payload.method.decoded = decoded;
+  script_frame(sock, &frame);
+}
+
+amqp_bytes_t make_body(size_t len) {
+  amqp_bytes_t body = amqp_bytes_malloc(len);
+  size_t i;
+  if (len != 0 && NULL == body.bytes) {
+    die("out of memory");
+  }
+  for (i = 0; i < len; ++i) {
+    ((uint8_t *)body.bytes)[i] = (uint8_t)(i * 7);
+  }
+  return body;
+}
@@ -0,0 +1,60 @@
+// Copyright 2007 - 2021, Alan Antonuk and the rabbitmq-c contributors.
+// SPDX-License-Identifier: mit
+
+#ifndef AMQP_TEST_SOCKET_H
+#define AMQP_TEST_SOCKET_H
+
+#include "amqp_private.h"
+#include "amqp_socket.h"
+
+/* A socket that records everything written to it, and returns scripted data
+ * from recv() and readv(). */
+struct test_socket_t {
+  const struct amqp_socket_class_t *klass;
+  char *data;
+  size_t len;
+  size_t cap;
+  /* Maximum number of bytes accepted per call, 0 for no limit */
+  size_t max_write;
+  /* When limited, the number of bytes accepted before the socket reports it
+   * would block */
+  int write_limited;
+  size_t write_budget;
+  /* Added to write_budget whenever data is read, as a peer that drains the
+   * socket once it has sent something */
+  size_t recv_write_budget;
+  int send_calls;
+  int writev_calls;
+  /* Data returned by recv(). Once it runs out recv() reports it would block,
+   * and as there is no descriptor to wait on the connection is closed. */
+  char *recv_data;
+  size_t recv_len;
+  size_t recv_offset;
+  /* Maximum number of bytes returned per recv() or readv() call, 0 for no
+   * limit */
+  size_t max_read;
+  /* Number of readv() calls into two buffers */
+  int split_reads;
+};
+
+/* Prints msg and aborts. */
+void die(const char *msg);
+
+/* Creates a connection over a new test socket, as after the handshake, with
+ * a frame_max of frame_max. The socket is owned by the connection. */
+struct test_socket_t *new_test_connection(amqp_connection_state_t *conn,
+                                          int frame_max);
+
+/* Queues a frame to be read from sock. */
+void script_frame(struct test_socket_t *sock, const amqp_frame_t *frame);
+
+/* Queues a method frame to be read from sock. decoded may be NULL for
+ * methods without fields. */
+void script_method(struct test_socket_t *sock, amqp_channel_t channel,
+                   amqp_method_number_t id, void *decoded);
+
+/* Returns len bytes of a repeating pattern, to be freed with
+ * amqp_bytes_free(). */
+amqp_bytes_t make_body(size_t len);
+
+#endif /* AMQP_TEST_SOCKET_H */